@@ -0,0 +1,112 @@
+#----------------------------------------------------------------
+#-------------------------Cuda setup-----------------------------
+#----------------------------------------------------------------
+
+# We need at least CUDA 11.0 for the cub and Thrust that ship with it and for nvtx3. Our CUDA graph mode needs
+# CUDA 11.4, before that we always use plain stream launches. Our non synchronising thrust calls need Thrust 1.16
+# (CUDA 11.6), before that thrust synchronises after each call. CUDA stopped supporting macOS at 10.2 so our
+# macOS paths are only kept for reference.
+
+#Enter your gencodes here! Maxwell through Ampere, with PTX for anything newer.
+GENCODE = -gencode arch=compute_52,code=sm_52 \
+          -gencode arch=compute_61,code=sm_61 \
+          -gencode arch=compute_75,code=sm_75 \
+          -gencode arch=compute_86,code=sm_86 \
+          -gencode arch=compute_86,code=compute_86
+
+#We must define this as we get some confilcs in minwindef.h and helper_math.h
+DEFINES += NOMINMAX
+
+#set out cuda sources
+CUDA_SOURCES = "$$PWD"/cudaSrc/*.cu
+
+#This is to add our .cu files to our file browser in Qt
+SOURCES+=cudaSrc/*cu
+SOURCES-=cudaSrc/*cu
+
+# Path to cuda SDK install
+macx:CUDA_DIR = /Developer/NVIDIA/CUDA-10.2
+linux:CUDA_DIR = /usr/local/cuda
+win32:CUDA_DIR = "C:\Program Files\NVIDIA GPU Computing Toolkit\CUDA\v11.8"
+# Path to cuda toolkit install. From CUDA 11.6 the samples are a separate download, point this at your
+# checkout of github.com/NVIDIA/cuda-samples instead.
+macx:CUDA_SDK = /Developer/NVIDIA/CUDA-10.2/samples
+linux:CUDA_SDK = /usr/local/cuda/samples
+win32:CUDA_SDK = "C:\ProgramData\NVIDIA Corporation\CUDA Samples\v11.8"
+
+#Cuda include paths
+INCLUDEPATH += $$CUDA_DIR/include
+#INCLUDEPATH += $$CUDA_DIR/common/inc/
+#INCLUDEPATH += $$CUDA_DIR/../shared/inc/
+#To get some prewritten helper functions from NVIDIA
+win32:INCLUDEPATH += $$CUDA_SDK\common\inc
+# Newer samples keep them in Common
+win32:INCLUDEPATH += $$CUDA_SDK\Common
+linux|macx:INCLUDEPATH += $$CUDA_SDK/common/inc $$CUDA_SDK/Common
+
+
+#cuda libs
+macx:QMAKE_LIBDIR += $$CUDA_DIR/lib
+linux:QMAKE_LIBDIR += $$CUDA_DIR/lib64
+win32:QMAKE_LIBDIR += $$CUDA_DIR\lib\x64
+linux|macx:QMAKE_LIBDIR += $$CUDA_SDK/common/lib
+win32:QMAKE_LIBDIR +=$$CUDA_SDK\common\lib\x64
+LIBS += -lcudart -lcudadevrt
+
+# join the includes in a line
+CUDA_INC = $$join(INCLUDEPATH,'" -I"','-I"','"')
+
+# nvcc flags (ptxas option verbose is always useful)
+NVCCFLAGS = --compiler-options  -fno-strict-aliasing --ptxas-options=-v -maxrregcount 20 --use_fast_math
+# Our NVTX ranges are in our launchers as well, see SPHNvtx.h
+contains(DEFINES, SPH_USE_NVTX):NVCCFLAGS += -DSPH_USE_NVTX
+# Our kernals only report errors into SolverErrors in debug builds or when asked to
+contains(DEFINES, SPH_DEVICE_ERRORS):NVCCFLAGS += -DSPH_DEVICE_ERRORS
+
+#On windows we must define if we are in debug mode or not
+CONFIG(debug, debug|release) {
+#DEBUG
+    # MSVCRT link option (static or dynamic, it must be the same with your Qt SDK link option)
+    win32:MSVCRT_LINK_FLAG_DEBUG = "/MDd"
+    win32:NVCCFLAGS += -D_DEBUG -Xcompiler $$MSVCRT_LINK_FLAG_DEBUG
+    NVCCFLAGS += -DSPH_DEVICE_ERRORS
+}
+else{
+#Release UNTESTED!!!
+    win32:MSVCRT_LINK_FLAG_RELEASE = "/MD"
+    win32:NVCCFLAGS += -Xcompiler $$MSVCRT_LINK_FLAG_RELEASE
+}
+
+#prepare intermediat cuda compiler
+cudaIntr.input = CUDA_SOURCES
+cudaIntr.output = ${OBJECTS_DIR}${QMAKE_FILE_BASE}.o
+#So in windows object files have to be named with the .obj suffix instead of just .o
+#God I hate you windows!!
+win32:cudaIntr.output = $$OBJECTS_DIR/${QMAKE_FILE_BASE}.obj
+
+## Tweak arch according to your hw's compute capability
+cudaIntr.commands = $$CUDA_DIR/bin/nvcc -m64 -g $$GENCODE -dc $$NVCCFLAGS $$CUDA_INC $$LIBS ${QMAKE_FILE_NAME} -o ${QMAKE_FILE_OUT}
+
+#Set our variable out. These obj files need to be used to create the link obj file
+#and used in our final gcc compilation
+cudaIntr.variable_out = CUDA_OBJ
+cudaIntr.variable_out += OBJECTS
+cudaIntr.clean = cudaIntrObj/*.o
+win32:cudaIntr.clean = cudaIntrObj/*.obj
+
+QMAKE_EXTRA_UNIX_COMPILERS += cudaIntr
+
+
+# Prepare the linking compiler step
+cuda.input = CUDA_OBJ
+cuda.output = ${QMAKE_FILE_BASE}_link.o
+win32:cuda.output = ${QMAKE_FILE_BASE}_link.obj
+
+# Tweak arch according to your hw's compute capability
+cuda.commands = $$CUDA_DIR/bin/nvcc -m64 -g $$GENCODE  -dlink    ${QMAKE_FILE_NAME} -o ${QMAKE_FILE_OUT}
+cuda.dependency_type = TYPE_C
+cuda.depend_command = $$CUDA_DIR/bin/nvcc -g -M $$CUDA_INC $$NVCCFLAGS   ${QMAKE_FILE_NAME}
+# Tell Qt that we want add more stuff to the Makefile
+QMAKE_EXTRA_UNIX_COMPILERS += cuda
+
+
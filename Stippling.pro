@@ -26,10 +26,15 @@ SOURCES+= src/main.cpp \
     src/ShaderUtils.cpp \
     src/Camera.cpp \
     src/Text.cpp \
-    src/SPHSolverCUDA.cpp
+    src/SPHSolverCUDA.cpp \
+    src/SPHSolverThread.cpp \
+    src/StippleExport.cpp \
+    src/StippleSnapshotWriter.cpp \
+    src/StippleRaster.cpp
 
 # same for the .h files
 HEADERS+=include/MainWindow.h \
+    include/SPHNvtx.h \
     include/NGLScene.h \
     include/Particle.h \
     include/ParticleDrawer.h \
@@ -39,7 +44,12 @@ HEADERS+=include/MainWindow.h \
     include/Camera.h \
     include/Text.h \
     include/SPHSolverCUDAKernals.h \
-    include/SPHSolverCUDA.h
+    include/SPHSolverCUDA.h \
+    include/SPHSolverThread.h \
+    include/StippleExport.h \
+    include/StippleSnapshotWriter.h \
+    include/StippleRaster.h \
+    include/StippleRasterKernals.h
 
 # and add the include dir into the search path for Qt and make
 # Make sure you are not shadow building ot this will not work!
@@ -70,94 +80,5 @@ unix*:QMAKE_CXXFLAGS_WARN_ON += "-Wno-unused-parameter"
 #----------------------------------------------------------------
 #-------------------------Cuda setup-----------------------------
 #----------------------------------------------------------------
-
-#Enter your gencode here!
-GENCODE = arch=compute_52,code=sm_52
-
-#We must define this as we get some confilcs in minwindef.h and helper_math.h
-DEFINES += NOMINMAX
-
-#set out cuda sources
-CUDA_SOURCES = "$$PWD"/cudaSrc/*.cu
-
-#This is to add our .cu files to our file browser in Qt
-SOURCES+=cudaSrc/*cu
-SOURCES-=cudaSrc/*cu
-
-# Path to cuda SDK install
-macx:CUDA_DIR = /Developer/NVIDIA/CUDA-6.5
-linux:CUDA_DIR = /usr/local/cuda-6.5
-win32:CUDA_DIR = "C:\Program Files\NVIDIA GPU Computing Toolkit\CUDA\v7.5"
-# Path to cuda toolkit install
-macx:CUDA_SDK = /Developer/NVIDIA/CUDA-6.5/samples
-linux:CUDA_SDK = /usr/local/cuda-6.5/samples
-win32:CUDA_SDK = "C:\ProgramData\NVIDIA Corporation\CUDA Samples\v7.5"
-
-#Cuda include paths
-INCLUDEPATH += $$CUDA_DIR/include
-#INCLUDEPATH += $$CUDA_DIR/common/inc/
-#INCLUDEPATH += $$CUDA_DIR/../shared/inc/
-#To get some prewritten helper functions from NVIDIA
-win32:INCLUDEPATH += $$CUDA_SDK\common\inc
-
-
-#cuda libs
-macx:QMAKE_LIBDIR += $$CUDA_DIR/lib
-linux:QMAKE_LIBDIR += $$CUDA_DIR/lib64
-win32:QMAKE_LIBDIR += $$CUDA_DIR\lib\x64
-linux|macx:QMAKE_LIBDIR += $$CUDA_SDK/common/lib
-win32:QMAKE_LIBDIR +=$$CUDA_SDK\common\lib\x64
-LIBS += -lcudart -lcudadevrt
-
-# join the includes in a line
-CUDA_INC = $$join(INCLUDEPATH,'" -I"','-I"','"')
-
-# nvcc flags (ptxas option verbose is always useful)
-NVCCFLAGS = --compiler-options  -fno-strict-aliasing --ptxas-options=-v -maxrregcount 20 --use_fast_math
-
-#On windows we must define if we are in debug mode or not
-CONFIG(debug, debug|release) {
-#DEBUG
-    # MSVCRT link option (static or dynamic, it must be the same with your Qt SDK link option)
-    win32:MSVCRT_LINK_FLAG_DEBUG = "/MDd"
-    win32:NVCCFLAGS += -D_DEBUG -Xcompiler $$MSVCRT_LINK_FLAG_DEBUG
-}
-else{
-#Release UNTESTED!!!
-    win32:MSVCRT_LINK_FLAG_RELEASE = "/MD"
-    win32:NVCCFLAGS += -Xcompiler $$MSVCRT_LINK_FLAG_RELEASE
-}
-
-#prepare intermediat cuda compiler
-cudaIntr.input = CUDA_SOURCES
-cudaIntr.output = ${OBJECTS_DIR}${QMAKE_FILE_BASE}.o
-#So in windows object files have to be named with the .obj suffix instead of just .o
-#God I hate you windows!!
-win32:cudaIntr.output = $$OBJECTS_DIR/${QMAKE_FILE_BASE}.obj
-
-## Tweak arch according to your hw's compute capability
-cudaIntr.commands = $$CUDA_DIR/bin/nvcc -m64 -g -gencode $$GENCODE -dc $$NVCCFLAGS $$CUDA_INC $$LIBS ${QMAKE_FILE_NAME} -o ${QMAKE_FILE_OUT}
-
-#Set our variable out. These obj files need to be used to create the link obj file
-#and used in our final gcc compilation
-cudaIntr.variable_out = CUDA_OBJ
-cudaIntr.variable_out += OBJECTS
-cudaIntr.clean = cudaIntrObj/*.o
-win32:cudaIntr.clean = cudaIntrObj/*.obj
-
-QMAKE_EXTRA_UNIX_COMPILERS += cudaIntr
-
-
-# Prepare the linking compiler step
-cuda.input = CUDA_OBJ
-cuda.output = ${QMAKE_FILE_BASE}_link.o
-win32:cuda.output = ${QMAKE_FILE_BASE}_link.obj
-
-# Tweak arch according to your hw's compute capability
-cuda.commands = $$CUDA_DIR/bin/nvcc -m64 -g -gencode $$GENCODE  -dlink    ${QMAKE_FILE_NAME} -o ${QMAKE_FILE_OUT}
-cuda.dependency_type = TYPE_C
-cuda.depend_command = $$CUDA_DIR/bin/nvcc -g -M $$CUDA_INC $$NVCCFLAGS   ${QMAKE_FILE_NAME}
-# Tell Qt that we want add more stuff to the Makefile
-QMAKE_EXTRA_UNIX_COMPILERS += cuda
-
-
+# The cuda build steps are shared with our headless batch target
+include(Cuda.pri)
@@ -0,0 +1,57 @@
+# This specifies the exe name
+# Headless batch version of our stippler. No window or OpenGL context is created
+# so this can be run on GPU nodes without a display.
+TARGET=StipplingBatch
+# where to put the .o files, keep these away from our GUI build
+OBJECTS_DIR=obj/batch
+# QImage lives in gui, we never create a window though
+QT+=gui core
+isEqual(QT_MAJOR_VERSION, 5) {
+	cache()
+	DEFINES +=QT5BUILD
+}
+# where to put moc auto generated files
+MOC_DIR=moc/batch
+CONFIG-=app_bundle
+VPATH += ./src
+SOURCES+= src/batchMain.cpp \
+    src/SPHSolverCUDA.cpp \
+    src/SPHSolverMultiGPU.cpp \
+    src/StippleJobScheduler.cpp \
+    src/StippleExport.cpp \
+    src/StippleSnapshotWriter.cpp \
+    src/StippleRaster.cpp
+
+HEADERS+=include/SPHSolverCUDAKernals.h \
+    include/SPHNvtx.h \
+    include/SPHSolverCUDA.h \
+    include/SPHSolverMultiGPU.h \
+    include/StippleJobScheduler.h \
+    include/StippleExport.h \
+    include/StippleSnapshotWriter.h \
+    include/StippleRaster.h \
+    include/StippleRasterKernals.h
+
+INCLUDEPATH +=./include
+# where our exe is going to live (root of project)
+DESTDIR=./
+CONFIG += console
+DEFINES += _USE_MATH_DEFINES
+macx:DEFINES+=DARWIN
+# We still need to link against GL for the interop code in our solver even though
+# it is never called in headless mode
+win32:{
+    DEFINES+=WIN32
+    DEFINES+=_WIN32
+    DEFINES += GLEW_STATIC
+    INCLUDEPATH+=C:/boost
+    LIBS+= -lopengl32 -lglew32s
+}
+unix:!macx:LIBS+= -lGLEW -lGL
+QMAKE_CXXFLAGS+= -msse -msse2 -msse3
+unix*:QMAKE_CXXFLAGS_WARN_ON += "-Wno-unused-parameter"
+
+#----------------------------------------------------------------
+#-------------------------Cuda setup-----------------------------
+#----------------------------------------------------------------
+include(Cuda.pri)
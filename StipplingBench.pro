@@ -0,0 +1,50 @@
+# This specifies the exe name
+# Headless benchmark of our solver. Kept separate from our GUI and batch builds so timing
+# changes never touch them. No window or OpenGL context is created.
+TARGET=StipplingBench
+# where to put the .o files, keep these away from our other builds
+OBJECTS_DIR=obj/bench
+# QImage lives in gui, we never create a window though
+QT+=gui core
+isEqual(QT_MAJOR_VERSION, 5) {
+	cache()
+	DEFINES +=QT5BUILD
+}
+# where to put moc auto generated files
+MOC_DIR=moc/bench
+CONFIG-=app_bundle
+VPATH += ./src
+SOURCES+= src/benchMain.cpp \
+    src/SPHSolverCUDA.cpp \
+    src/StippleExport.cpp \
+    src/StippleSnapshotWriter.cpp
+
+HEADERS+=include/SPHSolverCUDAKernals.h \
+    include/SPHNvtx.h \
+    include/SPHSolverCUDA.h \
+    include/StippleExport.h \
+    include/StippleSnapshotWriter.h
+
+INCLUDEPATH +=./include
+# where our exe is going to live (root of project)
+DESTDIR=./
+CONFIG += console
+DEFINES += _USE_MATH_DEFINES
+macx:DEFINES+=DARWIN
+# We still need to link against GL for the interop code in our solver even though
+# it is never called in headless mode
+win32:{
+    DEFINES+=WIN32
+    DEFINES+=_WIN32
+    DEFINES += GLEW_STATIC
+    INCLUDEPATH+=C:/boost
+    LIBS+= -lopengl32 -lglew32s
+}
+unix:!macx:LIBS+= -lGLEW -lGL
+QMAKE_CXXFLAGS+= -msse -msse2 -msse3
+unix*:QMAKE_CXXFLAGS_WARN_ON += "-Wno-unused-parameter"
+
+#----------------------------------------------------------------
+#-------------------------Cuda setup-----------------------------
+#----------------------------------------------------------------
+include(Cuda.pri)
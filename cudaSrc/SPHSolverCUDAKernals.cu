@@ -5,6 +5,7 @@
 /// @version 1.0
 //----------------------------------------------------------------------------------------------------------------------
 #include "SPHSolverCUDAKernals.h"
+#include "SPHNvtx.h"
 #include <helper_math.h>  //< some math operations with cuda types
 #include <iostream>
 #include <thrust/sort.h>
@@ -12,19 +13,176 @@
 #include <thrust/device_ptr.h>
 #include <thrust/scan.h>
 #include <thrust/reduce.h>
-#define NULLHASH 4294967295
+#include <thrust/transform_reduce.h>
+#include <thrust/execution_policy.h>
+#include <thrust/merge.h>
+#include <thrust/tuple.h>
+#include <thrust/iterator/zip_iterator.h>
+#include <thrust/iterator/transform_output_iterator.h>
+#include <thrust/iterator/counting_iterator.h>
+#include <cub/device/device_radix_sort.cuh>
+#include <cub/device/device_partition.cuh>
+#include <cub/device/device_select.cuh>
+#include <curand_kernel.h>
+#include <cooperative_groups.h>
+#include <map>
 #define F_INVTWOPI  ( 0.15915494309f )
 #define M_E ( 2.71828182845904523536f )
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief the most our adaptive timestep can grow by in one step, so we dont overshoot as our particles settle
+//----------------------------------------------------------------------------------------------------------------------
+#define SPH_DT_GROWTH 1.1f
 
-// Our simulation properties. These wont change much so lets load them into constant memory
-__constant__ SimProps props;
-
+namespace cg = cooperative_groups;
 
 //----------------------------------------------------------------------------------------------------------------------
-__global__ void testKernal()
+/// @brief CUDA 11.4 onwards has a stream ordered allocator that can also be captured in our graphs. Before that we
+/// @brief fall back to our own cache.
+//----------------------------------------------------------------------------------------------------------------------
+#if CUDART_VERSION >= 11040
+    #define SPH_STREAM_ORDERED_ALLOC
+#endif
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Allocator for thrusts temporary storage. Thrust hands our storage back as soon as it has queued its work,
+/// @brief while its kernals may still be running, so everything we give back is only reused in the order of our
+/// @brief stream. Each solver has its own on its own stream so nothing here is shared between threads or streams.
+/// @brief With SPH_STREAM_ORDERED_ALLOC we use cudaMallocAsync and cudaFreeAsync on our stream. Our device pool
+/// @brief keeps its memory between steps so this doesnt go back to the driver, and any thrust calls captured in
+/// @brief a CUDA graph become allocation nodes that the graph owns for as long as it exists.
+/// @brief Otherwise we keep our blocks and hand them back out on the next request that fits. Every request is on
+/// @brief our stream so it is ordered after everything that used that block before, and blocks are only freed
+/// @brief once our graphs are destroyed so any captured storage stays valid.
+//----------------------------------------------------------------------------------------------------------------------
+class CachedAllocator
+{
+public:
+    typedef char value_type;
+    //----------------------------------------------------------------------------------------------------------------------
+    CachedAllocator(cudaStream_t _stream) : m_stream(_stream) {}
+    //----------------------------------------------------------------------------------------------------------------------
+    ~CachedAllocator()
+    {
+        std::multimap<std::ptrdiff_t,char*>::iterator it;
+        for(it=m_freeBlocks.begin();it!=m_freeBlocks.end();it++) cudaFree(it->second);
+        std::map<char*,std::ptrdiff_t>::iterator ait;
+        for(ait=m_allocatedBlocks.begin();ait!=m_allocatedBlocks.end();ait++) cudaFree(ait->first);
+    }
+    //----------------------------------------------------------------------------------------------------------------------
+    char *allocate(std::ptrdiff_t _numBytes)
+    {
+        char *result = 0;
+#ifdef SPH_STREAM_ORDERED_ALLOC
+        cudaError_t error = cudaMallocAsync((void**)&result,_numBytes,m_stream);
+        if(error != cudaSuccess)
+        {
+          printf("Thrust temporary allocation error: %s\n", cudaGetErrorString(error));
+          exit(-1);
+        }
+#else
+        // Find the smallest cached block that is big enough
+        std::multimap<std::ptrdiff_t,char*>::iterator freeBlock = m_freeBlocks.lower_bound(_numBytes);
+        if(freeBlock != m_freeBlocks.end())
+        {
+            result = freeBlock->second;
+            _numBytes = freeBlock->first;
+            m_freeBlocks.erase(freeBlock);
+        }
+        else
+        {
+            cudaError_t error = cudaMalloc(&result,_numBytes);
+            if(error != cudaSuccess)
+            {
+              printf("Thrust temporary allocation error: %s\n", cudaGetErrorString(error));
+              exit(-1);
+            }
+        }
+        m_allocatedBlocks.insert(std::make_pair(result,_numBytes));
+#endif
+        return result;
+    }
+    //----------------------------------------------------------------------------------------------------------------------
+    void deallocate(char *_ptr, size_t)
+    {
+#ifdef SPH_STREAM_ORDERED_ALLOC
+        // Freed once everything queued on our stream so far is done with it
+        cudaFreeAsync(_ptr,m_stream);
+#else
+        // Put our block back into our cache
+        std::map<char*,std::ptrdiff_t>::iterator it = m_allocatedBlocks.find(_ptr);
+        m_freeBlocks.insert(std::make_pair(it->second,it->first));
+        m_allocatedBlocks.erase(it);
+#endif
+    }
+    //----------------------------------------------------------------------------------------------------------------------
+private:
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the stream all of our thrust calls run on
+    //----------------------------------------------------------------------------------------------------------------------
+    cudaStream_t m_stream;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief blocks ready to be handed out, sorted by size
+    //----------------------------------------------------------------------------------------------------------------------
+    std::multimap<std::ptrdiff_t,char*> m_freeBlocks;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief blocks that thrust is currently using
+    //----------------------------------------------------------------------------------------------------------------------
+    std::map<char*,std::ptrdiff_t> m_allocatedBlocks;
+    //----------------------------------------------------------------------------------------------------------------------
+};
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Thrust 1.16 onwards lets us run algorithms on a stream without the implicit synchronise at the end of each
+/// @brief call. Older versions fall back to the regular stream policy. The _nosync version is needed for graph capture.
+//----------------------------------------------------------------------------------------------------------------------
+#if THRUST_VERSION >= 101600
+    #define SPH_THRUST_ASYNC(_alloc,_stream) thrust::cuda::par_nosync(*(_alloc)).on(_stream)
+#else
+    #define SPH_THRUST_ASYNC(_alloc,_stream) thrust::cuda::par(*(_alloc)).on(_stream)
+#endif
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Our launches are asynchronous so errors are normally picked up once per step by checkSolverErrors.
+/// @brief Define SPH_DEBUG_SYNC to synchronise and check after every launch so errors are reported by the kernal
+/// @brief that caused them.
+//----------------------------------------------------------------------------------------------------------------------
+#ifdef SPH_DEBUG_SYNC
+    #define SPH_CHECK_LAUNCH(_stream,_name) checkLaunch(_stream,_name)
+#else
+    #define SPH_CHECK_LAUNCH(_stream,_name)
+#endif
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Our kernals report problems through reportError rather than printf, which is called in our innermost
+/// @brief neighbour loops and crawls when a run goes unstable. Unless SPH_DEVICE_ERRORS is defined this is false
+/// @brief and our checks compile away, leaving our hot loops as they were.
+//----------------------------------------------------------------------------------------------------------------------
+#ifdef SPH_DEVICE_ERRORS
+    static const bool c_deviceErrors = true;
+#else
+    static const bool c_deviceErrors = false;
+#endif
+//----------------------------------------------------------------------------------------------------------------------
+__device__ inline void reportError(SolverErrors *_errors, int _code, float4 _info)
+{
+    if(!c_deviceErrors || !_errors) return;
+    // Only whoever counts first records what they saw
+    if(atomicAdd(&(_errors->count[_code]),1)==0)
+    {
+        _errors->firstThread[_code] = threadIdx.x + blockIdx.x * blockDim.x;
+        _errors->firstInfo[_code] = _info;
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+void checkLaunch(cudaStream_t _stream, const char *_name)
 {
-    printf("thread number %d\n",threadIdx.x);
+    cudaStreamSynchronize(_stream);
+    cudaError_t error = cudaGetLastError();
+    if(error != cudaSuccess)
+    {
+      // print the CUDA error message and exit
+      printf("%s error: %s\n", _name, cudaGetErrorString(error));
+      exit(-1);
+    }
 }
+
+
 //----------------------------------------------------------------------------------------------------------------------
 __global__ void fillIntZeroKernal(int *_bufferPtr,int size)
 {
@@ -35,58 +193,126 @@ __global__ void fillIntZeroKernal(int *_bufferPtr,int size)
     }
 }
 //----------------------------------------------------------------------------------------------------------------------
-__global__ void createHashMapKernal(int _hashTableSize, fluidBuffers _buff)
+__global__ void sumDensityKernal(int _numParticles, fluidBuffers _buff)
 {
+    // First pass of our density sum. Each block writes its partial sum so the result is deterministic.
+    __shared__ float sdata[SPH_REDUCE_THREADS];
     int idx = threadIdx.x + blockIdx.x * blockDim.x;
-    if(idx<_hashTableSize)
-    {
-        int count=0;
-        int key;
-        cellInfo cell;
-        int y = floor((float)idx/(float)props.gridRes.x);
-        int x = idx - (y*props.gridRes.x);
-        int xi,yj;
-        for(int i=-1;i<2;i++)
-        {
-            for(int j=-1;j<2;j++)
-            {
-                xi = x+i;
-                yj = y+j;
-                if ((xi>=0) && (xi<props.gridRes.x) && (yj>=0) && (yj<props.gridRes.y))
-                {
-                    key = idx + i + (j*props.gridRes.x);
-                    if(key>=0 && key<_hashTableSize && count < _hashTableSize)
-                    {
-                        cell.cIdx[count] = key;
-                        count++;
-                    }
-                }
-            }
-        }
-        cell.cNum = count;
-        _buff.hashMap[idx] = cell;
+    sdata[threadIdx.x] = (idx<_numParticles) ? _buff.posPtr[idx].z : 0.f;
+    __syncthreads();
+    for(unsigned int s=blockDim.x/2; s>0; s>>=1)
+    {
+        if(threadIdx.x<s) sdata[threadIdx.x]+=sdata[threadIdx.x+s];
+        __syncthreads();
     }
+    if(threadIdx.x==0) _buff.denPartials[blockIdx.x] = sdata[0];
+}
+//----------------------------------------------------------------------------------------------------------------------
+__global__ void restDensityKernal(int _numPartials, int _numParticles, float _densityDiff, fluidBuffers _buff)
+{
+    // Second pass of our density sum. Run with a single block.
+    __shared__ float sdata[SPH_REDUCE_THREADS];
+    float sum = 0.f;
+    for(int i=threadIdx.x; i<_numPartials; i+=blockDim.x) sum+=_buff.denPartials[i];
+    sdata[threadIdx.x] = sum;
+    __syncthreads();
+    for(unsigned int s=blockDim.x/2; s>0; s>>=1)
+    {
+        if(threadIdx.x<s) sdata[threadIdx.x]+=sdata[threadIdx.x+s];
+        __syncthreads();
+    }
+    if(threadIdx.x==0) *_buff.restDenPtr = (sdata[0]/(float)_numParticles) - _densityDiff;
+}
+//----------------------------------------------------------------------------------------------------------------------
+__global__ void combineRestDensityKernal(int _numParts, const float *_means, const int *_counts, float _densityDiff, fluidBuffers _buff)
+{
+    // Only a handful of parts so one thread does it all
+    double sum = 0.0;
+    int total = 0;
+    for(int i=0;i<_numParts;i++)
+    {
+        sum+=(double)_means[i]*_counts[i];
+        total+=_counts[i];
+    }
+    *_buff.restDenPtr = (total) ? (float)(sum/total) - _densityDiff : 0.f;
+}
+//----------------------------------------------------------------------------------------------------------------------
+__global__ void countConvergedKernal(int _numParticles, fluidBuffers _buff)
+{
+    __shared__ int sdata[SPH_REDUCE_THREADS];
+    int idx = threadIdx.x + blockIdx.x * blockDim.x;
+    sdata[threadIdx.x] = (idx<_numParticles) ? _buff.convergedPtr[idx] : 0;
+    __syncthreads();
+    for(unsigned int s=blockDim.x/2; s>0; s>>=1)
+    {
+        if(threadIdx.x<s) sdata[threadIdx.x]+=sdata[threadIdx.x+s];
+        __syncthreads();
+    }
+    // Integer atomics are exact so one pass is fine here
+    if(threadIdx.x==0) atomicAdd(_buff.convergedCount,sdata[0]);
+}
+//----------------------------------------------------------------------------------------------------------------------
+__device__ inline float2 posXY(float4 _p)
+{
+    // Our particles are stored as x, y, density, class
+    return make_float2(_p.x,_p.y);
+}
+//----------------------------------------------------------------------------------------------------------------------
+__device__ inline SimProps loadSimProps(const SimProps *__restrict__ _props)
+{
+    // Our properties are the same for every thread and never written by our kernals so read them through our
+    // read only cache into a local copy. Our kernals then dont reload them after every store to our buffers,
+    // and anything we dont use is never loaded. They stay on the device so our graphs see every update.
+    SimProps props;
+    const int *src = reinterpret_cast<const int*>(_props);
+    int *dst = reinterpret_cast<int*>(&props);
+    #pragma unroll
+    for(int i=0;i<(int)(sizeof(SimProps)/sizeof(int));i++) dst[i] = __ldg(&src[i]);
+    return props;
+}
+//----------------------------------------------------------------------------------------------------------------------
+__device__ inline int activeParticle(int _i, int _numParticles, const fluidBuffers &_buff)
+{
+    // Returns the particle thread _i of our forces kernals should update, or -1 if it has nothing to do.
+    // Without an active set everyone is updated.
+    if(!_buff.activeIdx) return (_i<_numParticles) ? _i : -1;
+    return (_i<*_buff.activeCount) ? _buff.activeIdx[_i] : -1;
+}
+//----------------------------------------------------------------------------------------------------------------------
+__device__ int hashPos(const SimProps &_props, float2 _p)
+{
+    return floor((_p.x/_props.gridDim.x)*_props.gridRes.x) + (floor((_p.y/_props.gridDim.y)*_props.gridRes.y)*_props.gridRes.x);
 }
-
 //----------------------------------------------------------------------------------------------------------------------
-__device__ int hashPos(float3 &_p)
+__device__ inline int2 cellRowRange(const SimProps &_props, int _cell, int _row, const int *__restrict__ _cellOcc, const int *__restrict__ _cellIdx)
 {
-    return floor((_p.x/props.gridDim.x)*props.gridRes.x) + (floor((_p.y/props.gridDim.y)*props.gridRes.y)*props.gridRes.x);
+    // Our particles are sorted by cell key so the 3 cells in a row of our neighbourhood
+    // are one contiguous range of particles. Returns the [start,end) of that range.
+    int y = _cell / _props.gridRes.x;
+    int x = _cell - (y*_props.gridRes.x);
+    int yj = y + _row;
+    if(yj<0 || yj>=_props.gridRes.y) return make_int2(0,0);
+    int rowKey = yj*_props.gridRes.x;
+    int first = rowKey + max(x-1,0);
+    int last = rowKey + min(x+1,_props.gridRes.x-1);
+    return make_int2(__ldg(&_cellIdx[first]),__ldg(&_cellIdx[last])+__ldg(&_cellOcc[last]));
 }
 //----------------------------------------------------------------------------------------------------------------------
-__global__ void hashParticles(int _numParticles,float3 *_posPtr, int *_hashKeys, int*_cellOccBuffer)
+template<class T>
+__global__ void hashParticles(const SimProps *_props, int _numParticles, const T *__restrict__ _posPtr, int *__restrict__ _hashKeys, int *__restrict__ _cellOccBuffer, int *__restrict__ _particleIdx, int *_nullHashCount, SolverErrors *_errors)
 {
+    const SimProps props = loadSimProps(_props);
     int idx = threadIdx.x + blockIdx.x * blockDim.x;
     if(idx<_numParticles)
     {
-        float3 pos = _posPtr[idx];
-        pos.x -= props.gridMin.x;
-        pos.y -= props.gridMin.y;
+        // Reset our index ready for our sort
+        if(_particleIdx) _particleIdx[idx] = idx;
+        float2 pos = make_float2(_posPtr[idx].x - props.gridMin.x,_posPtr[idx].y - props.gridMin.y);
         // Make sure the point is within our hash table
         if(pos.x>=0.f && pos.x<props.gridDim.x && pos.y>=0.f && pos.y<props.gridDim.y)
         {
             //Compute our hash key
-            int key = hashPos(pos);
+            int key = hashPos(props,pos);
             _hashKeys[idx] = key;
 
             //Increment our occumpancy of this hash cell
@@ -95,30 +321,104 @@ __global__ void hashParticles(int _numParticles,float3 *_posPtr, int *_hashKeys,
         }
         else
         {
-            _hashKeys[idx] = NULLHASH;
-            printf("NULL HASH idx %d pos %f,%f,%f\n",idx,pos.x,pos.y,pos.z);
+            // One past our last cell so these sort to the end and need no extra key bits
+            _hashKeys[idx] = props.gridRes.x*props.gridRes.y;
+            if(_nullHashCount) atomicAdd(_nullHashCount,1);
+            reportError(_errors,SPH_ERROR_NULL_HASH,make_float4(pos.x,pos.y,0.f,0.f));
+        }
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+__device__ int particleKey(const SimProps &_props, float2 _p)
+{
+    // Same as our hashParticles kernal but out of grid particles quietly get the key one past our last cell
+    float2 pos = _p - _props.gridMin;
+    if(pos.x>=0.f && pos.x<_props.gridDim.x && pos.y>=0.f && pos.y<_props.gridDim.y)
+    {
+        return hashPos(_props,pos);
+    }
+    return _props.gridRes.x*_props.gridRes.y;
+}
+//----------------------------------------------------------------------------------------------------------------------
+__global__ void rehashParticlesKernal(int _numParticles, fluidBuffers _buff)
+{
+    const SimProps props = loadSimProps(_buff.props);
+    int idx = threadIdx.x + blockIdx.x * blockDim.x;
+    if(idx<_numParticles)
+    {
+        int tableSize = props.gridRes.x*props.gridRes.y;
+        int key = particleKey(props,posXY(_buff.posPtr[idx]));
+        // Our particles are in the order of last steps sort so this is the key we were sorted by
+        int oldKey = _buff.sortedHashKeys[idx];
+        _buff.hashKeys[idx] = key;
+        _buff.particleIdx[idx] = idx;
+        // Pack our key above our index so comparing these orders by cell
+        _buff.packedKeys[idx] = ((unsigned long long)key<<32) | (unsigned int)idx;
+
+        if(key==tableSize)
+        {
+            if(_buff.nullHashCount) atomicAdd(_buff.nullHashCount,1);
+            float2 pos = posXY(_buff.posPtr[idx]) - props.gridMin;
+            reportError(_buff.errors,SPH_ERROR_NULL_HASH,make_float4(pos.x,pos.y,0.f,0.f));
+        }
+
+        int moved = (key!=oldKey);
+        _buff.stayFlags[idx] = !moved;
+        if(moved)
+        {
+            // Our occupancy is kept from last step so just move our particle between cells
+            if(oldKey<tableSize) atomicSub(&(_buff.cellOccBuffer[oldKey]),1);
+            if(key<tableSize) atomicAdd(&(_buff.cellOccBuffer[key]),1);
+            atomicAdd(&(_buff.sortStats[0]),1);
+        }
+        // If we are bigger than the next particle our order is no longer valid
+        if(idx<_numParticles-1 && key>particleKey(props,posXY(_buff.posPtr[idx+1])))
+        {
+            atomicAdd(&(_buff.sortStats[1]),1);
         }
     }
 }
 //----------------------------------------------------------------------------------------------------------------------
-__device__ float gausian(float3 _q, float3 _d, float _SDSqrd)
+/// @brief unpacks a packed key and index back into their own buffers as our merge writes them out
+//----------------------------------------------------------------------------------------------------------------------
+struct unpackKey
+{
+    __host__ __device__ thrust::tuple<int,int> operator()(unsigned long long _packed) const
+    {
+        return thrust::make_tuple((int)(_packed>>32),(int)(_packed & 0xffffffffull));
+    }
+};
+//----------------------------------------------------------------------------------------------------------------------
+__global__ void gatherParticlesKernal(int _numParticles, fluidBuffers _buff)
+{
+    int idx = threadIdx.x + blockIdx.x * blockDim.x;
+    if(idx<_numParticles)
+    {
+        // Our writes are coalesced, only our reads are scattered
+        int src = _buff.sortedIdx[idx];
+        _buff.posSwap[idx] = _buff.posPtr[src];
+        _buff.velSwap[idx] = _buff.velPtr[src];
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+__device__ float gausian(float2 _q, float2 _d, float _SDSqrd)
 {
-    float3 sq = (_q-_d);
+    float2 sq = (_q-_d);
     sq*=sq;
     float w = pow(M_E,-((sq.x+sq.y)/(2.f*_SDSqrd)));
     return w;
 }
 //----------------------------------------------------------------------------------------------------------------------
-__device__ float calculatePressure(float &_pi,float &_restDensity)
+__device__ float calculatePressure(const SimProps &_props, float &_pi,float &_restDensity)
 {
-    return props.k*(_pi-_restDensity);
+    return _props.k*(_pi-_restDensity);
 }
 //----------------------------------------------------------------------------------------------------------------------
-__device__ float calcDensityWeighting(float _rLength)
+__device__ float calcDensityWeighting(const SimProps &_props, float _rLength)
 {
-    if(_rLength>0.f && _rLength<props.h)
+    if(_rLength>0.f && _rLength<_props.h)
     {
-        return props.dWConst * (props.hSqrd - _rLength*_rLength) * (props.hSqrd - _rLength*_rLength) * (props.hSqrd - _rLength*_rLength);
+        return _props.dWConst * (_props.hSqrd - _rLength*_rLength) * (_props.hSqrd - _rLength*_rLength) * (_props.hSqrd - _rLength*_rLength);
     }
     else
     {
@@ -126,76 +426,74 @@ __device__ float calcDensityWeighting(float _rLength)
     }
 }
 //----------------------------------------------------------------------------------------------------------------------
-__device__ float3 calcPressureWeighting(float3 &_r, float _rLength)
+__device__ float2 calcPressureWeighting(const SimProps &_props, float2 &_r, float _rLength)
 {
-    if(_rLength>0.f && _rLength<props.h)
+    if(_rLength>0.f && _rLength<_props.h)
     {
-        return props.pWConst * (_r) * (props.h - _rLength) * (props.h - _rLength);
+        return _props.pWConst * (_r) * (_props.h - _rLength) * (_props.h - _rLength);
     }
     else
     {
-        return make_float3(0.f,0.f,0.f);
+        return make_float2(0.f,0.f);
     }
 }
 //----------------------------------------------------------------------------------------------------------------------
-__device__ float3 calcViscosityWeighting(float3 &_r, float &_rLength)
+__device__ float2 calcViscosityWeighting(const SimProps &_props, float2 &_r, float &_rLength)
 {
-    if(_rLength>0.f && _rLength<=props.h)
+    if(_rLength>0.f && _rLength<=_props.h)
     {
-        return props.vWConst * _r * (props.h - _rLength);
+        return _props.vWConst * _r * (_props.h - _rLength);
     }
     else
     {
-        return make_float3(0.f,0.f,0.f);
+        return make_float2(0.f,0.f);
     }
 }
 //----------------------------------------------------------------------------------------------------------------------
-__device__ float calcCoheWeighting(float _rLength)
+__device__ float calcCoheWeighting(const SimProps &_props, float _rLength)
 {
     float w = 0.f;
-    if(((2.f*_rLength)>props.h)&&(_rLength<=props.h))
+    if(((2.f*_rLength)>_props.h)&&(_rLength<=_props.h))
     {
-        w = props.cWConst1*((props.h-_rLength)*(props.h-_rLength)*(props.h-_rLength)*_rLength*_rLength*_rLength);
+        w = _props.cWConst1*((_props.h-_rLength)*(_props.h-_rLength)*(_props.h-_rLength)*_rLength*_rLength*_rLength);
     }
-    else if((_rLength>0.f)&&(2.f*_rLength<=props.h))
+    else if((_rLength>0.f)&&(2.f*_rLength<=_props.h))
     {
-        w = props.cWConst1*(2.f*((props.h-_rLength)*(props.h-_rLength)*(props.h-_rLength)*_rLength*_rLength*_rLength) - props.cWConst2);
+        w = _props.cWConst1*(2.f*((_props.h-_rLength)*(_props.h-_rLength)*(_props.h-_rLength)*_rLength*_rLength*_rLength) - _props.cWConst2);
     }
     return w;
 }
 //----------------------------------------------------------------------------------------------------------------------
-__device__ float getPixelIntensity(float3 _p, float* _buff)
+__device__ float getPixelIntensity(const SimProps &_props, float2 _p, cudaTextureObject_t _tex, SolverErrors *_errors)
 {
-    float3 np = _p;
-    np/=15.f;
+    // Map our position in our domain to normalised texture coordinates
+    float2 np = _p/_props.simBounds;
     if(np.x<0.f || np.x>1.f || np.y<0.f || np.y>1.f)
     {
-        printf("out of bounds\n");
+        reportError(_errors,SPH_ERROR_OUT_OF_BOUNDS,make_float4(_p.x,_p.y,0.f,0.f));
         return 1.f;
     }
-    np*=make_float3(199.f,199.f,0);
-    np = floorf(np);
-    return _buff[(int)np.x + (int)(np.y*200.f)];
+    return tex2D<float>(_tex,np.x,np.y);
 
 }
 //----------------------------------------------------------------------------------------------------------------------
-__device__ float getPixelCMYK(float3 _p,float pClass, float4* _buff)
+__device__ float getPixelCMYK(const SimProps &_props, float2 _p,float pClass, cudaTextureObject_t _tex, SolverErrors *_errors)
 {
-    float3 np = _p;
-    np/=15.f;
+    // Map our position in our domain to normalised texture coordinates
+    float2 np = _p/_props.simBounds;
     if(np.x<0.f || np.x>1.f || np.y<0.f || np.y>1.f)
     {
-        printf("out of bounds\n");
+        reportError(_errors,SPH_ERROR_OUT_OF_BOUNDS,make_float4(_p.x,_p.y,pClass,0.f));
         return 1.f;
     }
-    np*=make_float3(199.f,199.f,0);
-    np = floorf(np);
-    float4 cmyk = _buff[(int)np.x + (int)(np.y*200.f)];
-//    if(pClass==0.f) return cmyk.x;
-//    if(pClass==1.f) return cmyk.y;
-//    if(pClass==2.f) return cmyk.z;
-//    if(pClass==3.f) return cmyk.w;
-    return cmyk.x;
+    float4 cmyk = tex2D<float4>(_tex,np.x,np.y);
+    // Each class is stippled from its own ink. We want how light we are, same as getPixelIntensity, so our
+    // particles bunch up where there is the most ink.
+    float ink = cmyk.w;
+    if(pClass<0.5f) ink = cmyk.x;
+    else if(pClass<1.5f) ink = cmyk.y;
+    else if(pClass<2.5f) ink = cmyk.z;
+    return 1.f-ink;
 
 }
 //----------------------------------------------------------------------------------------------------------------------
@@ -204,506 +502,828 @@ __device__ float invScale(float _var)
     return ((sqrt(_var))*0.999f)+0.001f;
 }
 //----------------------------------------------------------------------------------------------------------------------
-__device__ float sizeFunction(float _rLength, float _vari, float _varj)
+__device__ float sizeFunction(float _rLength, float _scalei, float _scalej, SolverErrors *_errors)
 {
-    float s = (2.f*_rLength)/(invScale(_vari)+invScale(_varj));
+    // Our scales are invScale() of our image samples, worked out once per particle by computeParticleScales
+    float s = (2.f*_rLength)/(_scalei+_scalej);
     if(s!=s)
     {
-        printf("Nan isi %f isn %f, _rLength %f\n",_vari,_varj,_rLength);
+        reportError(_errors,SPH_ERROR_NAN_SIZE,make_float4(_scalei,_scalej,_rLength,0.f));
         s = _rLength;
     }
-//    printf("yi %f si %f yj %f sj %f s %f rLength %f\n",_pi.y,sizeFunc(_pi),_pn.y,sizeFunc(_pn),s,_rLength);
 
     return s;
 }
 //----------------------------------------------------------------------------------------------------------------------
-__global__ void solveDensityMultiClassKernal(int _numParticles, fluidBuffers _buff)
+__device__ void recordMotion(float2 _vel, float2 _acc, fluidBuffers &_buff)
 {
-    int idx = threadIdx.x + blockIdx.x * blockDim.x;
-    if(idx<_numParticles)
+    // Reduce across whichever threads of our warp got here first so we only need one atomic per warp.
+    // Our lengths are never negative so their float bits order the same as their values.
+    cg::coalesced_group g = cg::coalesced_threads();
+    float v = length(_vel);
+    float a = length(_acc);
+    for(int o=1;o<(int)g.size();o<<=1)
     {
-        // Get our particle position
-        float3 pi = _buff.posPtr[idx];
-        int key = hashPos(pi-make_float3(props.gridMin.x,props.gridMin.y,0));
-        // Get our neighbouring cell locations for this particle
-        cellInfo nCells = _buff.hashMap[key];
-
-        // Compute our density for all our particles
-        int cellOcc;
-        int cellIdx;
-        int nIdx;
-        float di = 0.f;
-        float3 pj;
-        float rLength,varj;
-        float classI = _buff.classBuff[idx];
-        float classJ,sf;
-        float vari = getPixelCMYK(pi,classI,_buff.pixelCMYK);
-        for(int c=0; c<nCells.cNum; c++)
+        float vo = g.shfl_down(v,o);
+        float ao = g.shfl_down(a,o);
+        if(g.thread_rank()+o<g.size())
         {
-            // Get our cell occupancy total and start index
-            cellOcc = _buff.cellOccBuffer[nCells.cIdx[c]];
-            cellIdx = _buff.cellIndexBuffer[nCells.cIdx[c]];
-            for(int i=0; i<cellOcc; i++)
-            {
-                //Get our neighbour particle index
-                nIdx = cellIdx+i;
-                //Dont want to compare against same particle
-                if(nIdx==idx) continue;
-                // Get our neighbour position
-                pj = _buff.posPtr[nIdx];
-                //Calculate our length
-                rLength = length(pi-pj);
-                classJ = _buff.classBuff[nIdx];
-                varj = getPixelCMYK(pj,classJ,_buff.pixelCMYK);
-                //Increment our density
-                //di+=props.mass*calcDensityWeighting(rLength);
-                sf = sizeFunction(rLength,vari,varj);
-                //if(classI!=classJ) sf*=3.f;
-                di+=props.mass*calcDensityWeighting(sf);
-            }
-            // Do the same thing but for our boundary ghost particles
-            // Get our cell occupancy total and start index
-            cellOcc = _buff.bndCellOccBuff[nCells.cIdx[c]];
-            cellIdx = _buff.bndCellIdxBuff[nCells.cIdx[c]];
-            for(int i=0; i<cellOcc; i++)
-            {
-                //Get our neighbour particle index
-                nIdx = cellIdx+i;
-                // Get our neighbour position
-                pj = _buff.bndPos[nIdx];
-                //Calculate our length
-                rLength = length(pi-pj);
-                //Increment our density
-                //di+=props.mass*calcDensityWeighting(rLength);
-                di+=props.mass*calcDensityWeighting(sizeFunction(rLength,vari,1.f));
-            }
+            v = fmaxf(v,vo);
+            a = fmaxf(a,ao);
         }
-        _buff.denPtr[idx] = di;
     }
+    if(g.thread_rank()==0)
+    {
+        atomicMax(&_buff.motionMax[0],__float_as_uint(v));
+        atomicMax(&_buff.motionMax[1],__float_as_uint(a));
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+__device__ void integrateParticle(int _idx, float4 _pi4, float2 _acc, float _avgLen, fluidBuffers &_buff)
+{
+    const SimProps props = loadSimProps(_buff.props);
+    float dt = (props.adaptiveTimeStep) ? *_buff.dtPtr : props.timeStep;
+    // Acceleration limit
+//        if(dot(_acc,_acc)>props.accLimit2)
+//        {
+//            _acc *= props.accLimit/length(_acc);
+//        }
+
+    // Now lets integerate our acceleration using leapfrog to get our new position
+    float2 halfBwd = _buff.velPtr[_idx] - 0.5f*dt*_acc;
+    float2 halfFwd = halfBwd + dt*_acc;
+    // Apply velocity dampaning
+    halfFwd *= 0.9f;
+
+    //printf("vel %f,%f,%f\n",halfFwd.x,halfFwd.y,halfFwd.z);
+
+    //Velocity Limit
+//        if(dot(halfFwd,halfFwd)>props.velLimit2)
+//        {
+//            halfFwd *= props.velLimit/length(halfFwd);
+//        }
+
+    // Update our velocity
+    _buff.velPtr[_idx] = halfFwd;
+    if(props.adaptiveTimeStep) recordMotion(halfFwd,_acc,_buff);
+
+
+    // Update our position
+    float2 pi = posXY(_pi4);
+    float2 oldPos = pi;
+    pi+= dt * halfFwd;
+
+
+    //Place our particles back in our bounds
+    //this could potentially have problems with velocity and such not being
+    //adjusted but we will leave that for future work (Hes says...)
+    if(pi.x<0.f){
+        pi.x = 0.f;
+    }
+    if(pi.y<0.f){
+        pi.y = 0.f;
+    }
+    if(pi.x>props.simBounds.x){
+        pi.x = props.simBounds.x;
+    }
+    if(pi.y>props.simBounds.y){
+        pi.y = props.simBounds.y;
+    }
+
+    _buff.posPtr[_idx] = make_float4(pi.x,pi.y,_pi4.z,_pi4.w);
+    // Check to see if we have met our converged state
+    if(length(oldPos-pi)<props.convergeValue*_avgLen)
+    {
+        _buff.convergedPtr[_idx] = 1;
+    }
+    else
+    {
+        _buff.convergedPtr[_idx] = 0;
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief How much further apart particles of different classes look to each other in STIPPLE_MODE_MULTICLASS, so
+/// @brief other classes only push us around up close
+//----------------------------------------------------------------------------------------------------------------------
+#define SPH_CROSS_CLASS_SCALE 3.f
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Our pair rules for each StippleMode. Our kernals take their mode as a template parameter so these fold
+/// @brief away at compile time and our pair loops never branch on our mode. STIPPLE_MODE_MONO never reads our classes.
+//----------------------------------------------------------------------------------------------------------------------
+template<int MODE>
+__device__ inline bool pairInteracts(float _classI, float _classJ)
+{
+    // Each of our CMYK channels is stippled on its own
+    return (MODE!=STIPPLE_MODE_CMYK_CHANNEL) || (_classI==_classJ);
+}
+//----------------------------------------------------------------------------------------------------------------------
+template<int MODE>
+__device__ inline float pairSize(float _sf, float _classI, float _classJ)
+{
+    if(MODE==STIPPLE_MODE_MULTICLASS && _classI!=_classJ) return _sf*SPH_CROSS_CLASS_SCALE;
+    return _sf;
+}
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief What one of our walls adds to a particle _d away from it. x is our density term, y our force term.
+//----------------------------------------------------------------------------------------------------------------------
+__device__ inline float2 wallLookup(const SimProps &_props, cudaTextureObject_t _wallTable, float _d, float _scalei)
+{
+    // Most of our particles are nowhere near a wall so dont bother fetching
+    if(_d>=_props.h) return make_float2(0.f,0.f);
+    return tex2D<float2>(_wallTable,_d/_props.h,_scalei);
+}
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief The density our boundary adds to a particle, every class feels our walls. Corners get both of their walls.
+//----------------------------------------------------------------------------------------------------------------------
+__device__ inline float wallDensity(const SimProps &_props, cudaTextureObject_t _wallTable, float2 _pi, float _scalei)
+{
+    float w = wallLookup(_props,_wallTable,_pi.x,_scalei).x + wallLookup(_props,_wallTable,_props.simBounds.x-_pi.x,_scalei).x
+            + wallLookup(_props,_wallTable,_pi.y,_scalei).x + wallLookup(_props,_wallTable,_props.simBounds.y-_pi.y,_scalei).x;
+    return _props.dWConst*w;
+}
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief The sum of pressure weights our boundary adds to a particle, which pushes it off each of our walls
+//----------------------------------------------------------------------------------------------------------------------
+__device__ inline float2 wallForce(const SimProps &_props, cudaTextureObject_t _wallTable, float2 _pi, float _scalei)
+{
+    float2 w;
+    w.x = wallLookup(_props,_wallTable,_pi.x,_scalei).y - wallLookup(_props,_wallTable,_props.simBounds.x-_pi.x,_scalei).y;
+    w.y = wallLookup(_props,_wallTable,_pi.y,_scalei).y - wallLookup(_props,_wallTable,_props.simBounds.y-_pi.y,_scalei).y;
+    return _props.pWConst*w;
 }
 //----------------------------------------------------------------------------------------------------------------------
+template<int MODE, bool BND>
 __global__ void solveDensityKernal(int _numParticles, fluidBuffers _buff)
 {
+    const SimProps props = loadSimProps(_buff.props);
     int idx = threadIdx.x + blockIdx.x * blockDim.x;
     if(idx<_numParticles)
     {
         // Get our particle position
-        float3 pi = _buff.posPtr[idx];
-        int key = hashPos(pi-make_float3(props.gridMin.x,props.gridMin.y,0));
-        // Get our neighbouring cell locations for this particle
-        cellInfo nCells = _buff.hashMap[key];
-
-        // Compute our density for all our particles
-        int cellOcc;
-        int cellIdx;
+        float4 pi4 = _buff.posPtr[idx];
+        float2 pi = posXY(pi4);
+        int key = hashPos(props,pi-props.gridMin);
+
+        // Compute our density for all our particles. Everyone has the same mass so it is left out of our sum.
+        int2 range;
         int nIdx;
         float di = 0.f;
-        float3 pj;
-        float vari = getPixelIntensity(pi,_buff.pixelI);
-        float rLength,varj;
-        for(int c=0; c<nCells.cNum; c++)
+        float4 pj4;
+        float sf;
+        float scalei = _buff.scalePtr[idx];
+        for(int row=-1; row<2; row++)
         {
-            // Get our cell occupancy total and start index
-            cellOcc = _buff.cellOccBuffer[nCells.cIdx[c]];
-            cellIdx = _buff.cellIndexBuffer[nCells.cIdx[c]];
-            for(int i=0; i<cellOcc; i++)
+            // Get the contiguous range of particles in this row of our neighbourhood
+            range = cellRowRange(props,key,row,_buff.cellOccBuffer,_buff.cellIndexBuffer);
+            for(nIdx=range.x; nIdx<range.y; nIdx++)
             {
-                //Get our neighbour particle index
-                nIdx = cellIdx+i;
                 //Dont want to compare against same particle
                 if(nIdx==idx) continue;
-                // Get our neighbour position
-                pj = _buff.posPtr[nIdx];
-                //Calculate our length
-                rLength = length(pi-pj);
-                varj = getPixelIntensity(pj,_buff.pixelI);
-                //Increment our density
-                //di+=props.mass*calcDensityWeighting(rLength);
-                di+=props.mass*calcDensityWeighting(sizeFunction(rLength,vari,varj));
-            }
-            // Do the same thing but for our boundary ghost particles
-            // Get our cell occupancy total and start index
-            cellOcc = _buff.bndCellOccBuff[nCells.cIdx[c]];
-            cellIdx = _buff.bndCellIdxBuff[nCells.cIdx[c]];
-            for(int i=0; i<cellOcc; i++)
-            {
-                //Get our neighbour particle index
-                nIdx = cellIdx+i;
-                // Get our neighbour position
-                pj = _buff.bndPos[nIdx];
-                //Calculate our length
-                rLength = length(pi-pj);
+                // Get our neighbour position and class in one load
+                pj4 = _buff.posPtr[nIdx];
+                if(!pairInteracts<MODE>(pi4.w,pj4.w)) continue;
                 //Increment our density
-                //di+=props.mass*calcDensityWeighting(rLength);
-                di+=props.mass*calcDensityWeighting(sizeFunction(rLength,vari,1.f));
+                sf = sizeFunction(length(pi-posXY(pj4)),scalei,__ldg(&_buff.scalePtr[nIdx]),_buff.errors);
+                di+=calcDensityWeighting(props,pairSize<MODE>(sf,pi4.w,pj4.w));
             }
         }
-        _buff.denPtr[idx] = di;
+        if(BND) di+=wallDensity(props,_buff.wallTable,pi,scalei);
+        _buff.posPtr[idx].z = props.mass*di;
     }
 }
 //----------------------------------------------------------------------------------------------------------------------
-__global__ void solveForcesMultiClassKernal(int _numParticles, float _restDensity, fluidBuffers _buff)
+template<int MODE, bool BND>
+__global__ void solveForcesKernal(int _numParticles, fluidBuffers _buff)
 {
-    int idx = threadIdx.x + blockIdx.x * blockDim.x;
-    if(idx<_numParticles)
+    const SimProps props = loadSimProps(_buff.props);
+    int idx = activeParticle(threadIdx.x + blockIdx.x * blockDim.x,_numParticles,_buff);
+    if(idx>=0)
     {
+        // Our rest density is computed on the device so our host never has to wait for it
+        float _restDensity = *_buff.restDenPtr;
         // Get our particle position
-        float3 pi = _buff.posPtr[idx];
-        float di = _buff.denPtr[idx];
-        float3 acc = make_float3(0.f,0.f,0.f);
+        float4 pi4 = _buff.posPtr[idx];
+        float2 pi = posXY(pi4);
+        float di = pi4.z;
+        float2 acc = make_float2(0.f,0.f);
         float avgLen = 0.f;
         // Put this in its own scope means we get some registers back at the end of it (I think)
         if(di>0.f)
         {
             // Get our neighbouring cell locations for this particle
-            cellInfo nCells = _buff.hashMap[hashPos(pi-make_float3(props.gridMin.x,props.gridMin.y,0))];
+            int key = hashPos(props,pi-props.gridMin);
 
             // Compute our fources for all our particles
-            int cellOcc,cellIdx,nIdx;
-            float classI = _buff.classBuff[idx];
-            float classJ,sf;
-            float vari = getPixelCMYK(pi,classI,_buff.pixelCMYK);
-            float dj,presi,presj,rLength,varj;
-            presi = calculatePressure(di,_restDensity);
+            int2 range;
+            int nIdx;
+            float scalei = _buff.scalePtr[idx];
+            // Our half of every pairs pressure term only depends on us so only work it out once
+            float presTermi = calculatePressure(props,di,_restDensity)/(di*di);
+            float dj,rLength,sf;
             int numN = 0;
-            float3 pj,r,w;
-            float3 presForce = make_float3(0.f,0.f,0.f);
-            float3 coheForce = make_float3(0.f,0.f,0.f);
-            for(int c=0; c<nCells.cNum; c++)
+            float2 r;
+            float4 pj4;
+            float2 presForce = make_float2(0.f,0.f);
+            for(int row=-1; row<2; row++)
             {
-                // Get our cell occupancy total and start index
-                cellOcc = _buff.cellOccBuffer[nCells.cIdx[c]];
-                cellIdx = _buff.cellIndexBuffer[nCells.cIdx[c]];
-                for(int i=0; i<cellOcc; i++)
+                // Get the contiguous range of particles in this row of our neighbourhood
+                range = cellRowRange(props,key,row,_buff.cellOccBuffer,_buff.cellIndexBuffer);
+                for(nIdx=range.x; nIdx<range.y; nIdx++)
                 {
-                    //Get our neighbour particle index
-                    nIdx = cellIdx+i;
                     //Dont want to compare against same particle
                     if(nIdx==idx) continue;
-                    // Get our neighbour density
-                    dj = _buff.denPtr[nIdx];
-                    if(dj>0.f)
+                    // Get our neighbour position, density and class in one load
+                    pj4 = _buff.posPtr[nIdx];
+                    dj = pj4.z;
+                    if(dj>0.f && pairInteracts<MODE>(pi4.w,pj4.w))
                     {
-                        // Get our neighbour position
-                        pj = _buff.posPtr[nIdx];
                         //Get our vector beteen points
-                        r = pi - pj;
+                        r = pi - posXY(pj4);
                         //Calculate our length
                         rLength=length(r);
                         // Normalise our differential
                         r/=rLength;
-
-                        //Compute our particles pressure
-                        presj = calculatePressure(dj,_restDensity);
-                        classJ = _buff.classBuff[nIdx];
-                        varj = getPixelCMYK(pj,classJ,_buff.pixelCMYK);
-                        //Weighting
-                        //w = calcPressureWeighting(r,rLength);
-                        sf = sizeFunction(rLength,vari,varj);
-                        //if(classI!=classJ) sf*=3.f;
-                        w = calcPressureWeighting(r,sf);
+                        sf = pairSize<MODE>(sizeFunction(rLength,scalei,__ldg(&_buff.scalePtr[nIdx]),_buff.errors),pi4.w,pj4.w);
                         // Accumilate our pressure force
-                        presForce+= ((presi/(di*di)) + (presj/(dj*dj))) * props.mass * w;
-                        // Accumilate our cohesion force
-//                        cw = calcCoheWeighting(sizeFunction(rLength,vari,varj));
-//                        if(cw!=cw) printf("cw %f\n",cw);
-//                        coheForce+=-props.tension*props.mass*props.mass*((2.f*_restDensity)/(di+dj))*r*cw;
-
+                        presForce+= (presTermi + calculatePressure(props,dj,_restDensity)/(dj*dj)) * calcPressureWeighting(props,r,sf);
                         avgLen+=rLength;
                         numN++;
                     }
-
-                }
-                // Do the same for our boundary ghost particles
-                // Get our cell occupancy total and start index
-                cellOcc = _buff.bndCellOccBuff[nCells.cIdx[c]];
-                cellIdx = _buff.bndCellIdxBuff[nCells.cIdx[c]];
-                for(int i=0; i<cellOcc; i++)
-                {
-                    //Get our neighbour particle index
-                    nIdx = cellIdx+i;
-                    // Get our neighbour position
-                    pj = _buff.bndPos[nIdx];
-                    //Get our vector beteen points
-                    r = pi - pj;
-                    //Calculate our length
-                    rLength=length(r);
-                    // Normalise our differential
-                    r/=rLength;
-
-                    //Weighting
-                    w = calcPressureWeighting(r,sizeFunction(rLength,vari,1.f));
-
-                    // Accumilate our pressure force
-                    presForce+= (presi/(di*di)) * props.mass * w;
-
-                    // Accumilate our cohesion force
-//                    cw = calcCoheWeighting(rLength);
-//                    if(cw!=cw) printf("cw %f\n",cw);
-//                    coheForce+=-props.tension*props.mass*props.mass*((2.f*_restDensity)/(di+_restDensity))*r*cw;
                 }
             }
+            if(BND) presForce+= presTermi * wallForce(props,_buff.wallTable,pi,scalei);
 
             // Compute our average distance between neighbours
             avgLen/=numN;
-            // Complete our pressure force term
-            presForce*=-1.f*props.mass;
-            acc = (presForce+coheForce)/props.mass;
-        }
-
-        // Acceleration limit
-//        if(dot(acc,acc)>props.accLimit2)
-//        {
-//            acc *= props.accLimit/length(acc);
-//        }
-
-        // Now lets integerate our acceleration using leapfrog to get our new position
-        float3 halfBwd = _buff.velPtr[idx] - 0.5f*props.timeStep*acc;
-        float3 halfFwd = halfBwd + props.timeStep*acc;
-        // Apply velocity dampaning
-        halfFwd *= 0.9f;
-
-        //printf("vel %f,%f,%f\n",halfFwd.x,halfFwd.y,halfFwd.z);
-
-        //Velocity Limit
-//        if(dot(halfFwd,halfFwd)>props.velLimit2)
-//        {
-//            halfFwd *= props.velLimit/length(halfFwd);
-//        }
-
-        // Update our velocity
-        _buff.velPtr[idx] = halfFwd;
-
-
-        // Update our position
-        float3 oldPos = pi;
-        pi+= props.timeStep * halfFwd;
-
-
-        //Place our particles back in our bounds
-        //this could potentially have problems with velocity and such not being
-        //adjusted but we will leave that for future work (Hes says...)
-        if(pi.x<0.f){
-            pi.x = 0.f;
-        }
-        if(pi.y<0.f){
-            pi.y = 0.f;
-        }
-        if(pi.x>15.f){
-            pi.x = 15.f;
-        }
-        if(pi.y>15.f){
-            pi.y = 15.f;
+            // Our force is -mass^2 times our sum, divide by our mass for our acceleration
+            acc = -props.mass*presForce;
         }
 
-        _buff.posPtr[idx] = pi;
-        // Check to see if we have met our converged state
-        if(length(oldPos-pi)<props.convergeValue*avgLen)
+        // Integrate our new position and velocity
+        integrateParticle(idx,pi4,acc,avgLen,_buff);
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+__device__ inline float sampleVariance(float4 _p, bool _multiClass, fluidBuffers &_buff)
+{
+    const SimProps props = loadSimProps(_buff.props);
+    if(_multiClass) return getPixelCMYK(props,posXY(_p),_p.w,_buff.pixelCMYK,_buff.errors);
+    return getPixelIntensity(props,posXY(_p),_buff.pixelI,_buff.errors);
+}
+//----------------------------------------------------------------------------------------------------------------------
+template<int MODE, bool BND>
+__global__ void solveDensityCellKernal(fluidBuffers _buff)
+{
+    const SimProps props = loadSimProps(_buff.props);
+    // One block per cell. Each chunk of neighbours is loaded once per block rather than once per particle.
+    __shared__ float4 sPos[SPH_CELL_THREADS];
+    __shared__ float sScale[SPH_CELL_THREADS];
+
+    int cell = blockIdx.x;
+    int cellOcc = _buff.cellOccBuffer[cell];
+    // Everything below depends only on our cell so all threads take the same path through our syncs
+    if(cellOcc==0) return;
+    int cellStart = _buff.cellIndexBuffer[cell];
+
+    for(int base=0; base<cellOcc; base+=blockDim.x)
+    {
+        int idx = cellStart + base + threadIdx.x;
+        bool active = (base+threadIdx.x)<cellOcc;
+        float4 pi4 = make_float4(0.f,0.f,0.f,0.f);
+        float scalei = 1.f;
+        float di = 0.f;
+        if(active)
         {
-            _buff.convergedPtr[idx] = 1;
+            pi4 = _buff.posPtr[idx];
+            scalei = _buff.scalePtr[idx];
         }
-        else
+        float2 pi = posXY(pi4);
+
+        for(int row=-1; row<2; row++)
         {
-            _buff.convergedPtr[idx] = 0;
+            // Stage our neighbouring particles a chunk at a time
+            int2 range = cellRowRange(props,cell,row,_buff.cellOccBuffer,_buff.cellIndexBuffer);
+            for(int t=range.x; t<range.y; t+=blockDim.x)
+            {
+                int load = t + threadIdx.x;
+                // Make sure everyone has finished with our last chunk
+                __syncthreads();
+                if(load<range.y)
+                {
+                    sPos[threadIdx.x] = _buff.posPtr[load];
+                    sScale[threadIdx.x] = __ldg(&_buff.scalePtr[load]);
+                }
+                __syncthreads();
+                if(active)
+                {
+                    int count = min((int)blockDim.x,range.y-t);
+                    for(int j=0; j<count; j++)
+                    {
+                        //Dont want to compare against same particle
+                        if(t+j==idx || !pairInteracts<MODE>(pi4.w,sPos[j].w)) continue;
+                        float sf = sizeFunction(length(pi-posXY(sPos[j])),scalei,sScale[j],_buff.errors);
+                        di+=calcDensityWeighting(props,pairSize<MODE>(sf,pi4.w,sPos[j].w));
+                    }
+                }
+            }
         }
+        if(active && BND) di+=wallDensity(props,_buff.wallTable,pi,scalei);
+        if(active) _buff.posPtr[idx].z = props.mass*di;
     }
 }
 //----------------------------------------------------------------------------------------------------------------------
-__global__ void solveForcesKernal(int _numParticles, float _restDensity, fluidBuffers _buff)
+template<int MODE, bool BND>
+__global__ void solveForcesCellKernal(fluidBuffers _buff)
 {
-    int idx = threadIdx.x + blockIdx.x * blockDim.x;
-    if(idx<_numParticles)
+    const SimProps props = loadSimProps(_buff.props);
+    // One block per cell. Each chunk of neighbours is loaded once per block rather than once per particle.
+    __shared__ float4 sPos[SPH_CELL_THREADS];
+    __shared__ float sScale[SPH_CELL_THREADS];
+
+    int cell = blockIdx.x;
+    int cellOcc = _buff.cellOccBuffer[cell];
+    // Everything below depends only on our cell so all threads take the same path through our syncs
+    if(cellOcc==0) return;
+    int cellStart = _buff.cellIndexBuffer[cell];
+    // Our rest density is computed on the device so our host never has to wait for it
+    float _restDensity = *_buff.restDenPtr;
+
+    for(int base=0; base<cellOcc; base+=blockDim.x)
     {
-        // Get our particle position
-        float3 pi = _buff.posPtr[idx];
-        float di = _buff.denPtr[idx];
-        float3 acc = make_float3(0.f,0.f,0.f);
+        int idx = cellStart + base + threadIdx.x;
+        bool active = (base+threadIdx.x)<cellOcc;
+        float4 pi4 = make_float4(0.f,0.f,0.f,0.f);
+        if(active) pi4 = _buff.posPtr[idx];
+        float2 pi = posXY(pi4);
+        float di = pi4.z;
+        // Particles without a density dont feel any force but still have to help stage our neighbours
+        bool solving = active && di>0.f;
+        float scalei = solving ? _buff.scalePtr[idx] : 1.f;
+        // Our half of every pairs pressure term only depends on us so only work it out once
+        float presTermi = solving ? calculatePressure(props,di,_restDensity)/(di*di) : 0.f;
         float avgLen = 0.f;
-        // Put this in its own scope means we get some registers back at the end of it (I think)
-        if(di>0.f)
-        {
-            // Get our neighbouring cell locations for this particle
-            cellInfo nCells = _buff.hashMap[hashPos(pi-make_float3(props.gridMin.x,props.gridMin.y,0))];
+        int numN = 0;
+        float2 presForce = make_float2(0.f,0.f);
 
-            // Compute our fources for all our particles
-            int cellOcc,cellIdx,nIdx;
-            float vari = getPixelIntensity(pi,_buff.pixelI);
-            float dj,presi,presj,rLength,varj;
-            presi = calculatePressure(di,_restDensity);
-            int numN = 0;
-            float3 pj,r,w;
-            float3 presForce = make_float3(0.f,0.f,0.f);
-            float3 coheForce = make_float3(0.f,0.f,0.f);
-            for(int c=0; c<nCells.cNum; c++)
+        for(int row=-1; row<2; row++)
+        {
+            // Stage our neighbouring particles a chunk at a time
+            int2 range = cellRowRange(props,cell,row,_buff.cellOccBuffer,_buff.cellIndexBuffer);
+            for(int t=range.x; t<range.y; t+=blockDim.x)
             {
-                // Get our cell occupancy total and start index
-                cellOcc = _buff.cellOccBuffer[nCells.cIdx[c]];
-                cellIdx = _buff.cellIndexBuffer[nCells.cIdx[c]];
-                for(int i=0; i<cellOcc; i++)
+                int load = t + threadIdx.x;
+                // Make sure everyone has finished with our last chunk
+                __syncthreads();
+                if(load<range.y)
                 {
-                    //Get our neighbour particle index
-                    nIdx = cellIdx+i;
-                    //Dont want to compare against same particle
-                    if(nIdx==idx) continue;
-                    // Get our neighbour density
-                    dj = _buff.denPtr[nIdx];
-                    if(dj>0.f)
+                    sPos[threadIdx.x] = _buff.posPtr[load];
+                    sScale[threadIdx.x] = __ldg(&_buff.scalePtr[load]);
+                }
+                __syncthreads();
+                if(solving)
+                {
+                    int count = min((int)blockDim.x,range.y-t);
+                    for(int j=0; j<count; j++)
                     {
-                        // Get our neighbour position
-                        pj = _buff.posPtr[nIdx];
-                        //Get our vector beteen points
-                        r = pi - pj;
-                        //Calculate our length
-                        rLength=length(r);
-                        // Normalise our differential
-                        r/=rLength;
-
-                        //Compute our particles pressure
-                        presj = calculatePressure(dj,_restDensity);
-
-                        varj = getPixelIntensity(pj,_buff.pixelI);
-                        //Weighting
-                        //w = calcPressureWeighting(r,rLength);
-                        w = calcPressureWeighting(r,sizeFunction(rLength,vari,varj));
-                        // Accumilate our pressure force
-                        presForce+= ((presi/(di*di)) + (presj/(dj*dj))) * props.mass * w;
-                        // Accumilate our cohesion force
-//                        cw = calcCoheWeighting(sizeFunction(rLength,vari,varj));
-//                        if(cw!=cw) printf("cw %f\n",cw);
-//                        coheForce+=-props.tension*props.mass*props.mass*((2.f*_restDensity)/(di+dj))*r*cw;
-
-                        avgLen+=rLength;
-                        numN++;
+                        //Dont want to compare against same particle
+                        if(t+j==idx) continue;
+                        float dj = sPos[j].z;
+                        if(dj>0.f && pairInteracts<MODE>(pi4.w,sPos[j].w))
+                        {
+                            //Get our vector beteen points
+                            float2 r = pi - posXY(sPos[j]);
+                            float rLength = length(r);
+                            // Normalise our differential
+                            r/=rLength;
+                            float sf = pairSize<MODE>(sizeFunction(rLength,scalei,sScale[j],_buff.errors),pi4.w,sPos[j].w);
+                            // Accumilate our pressure force
+                            presForce+= (presTermi + calculatePressure(props,dj,_restDensity)/(dj*dj)) * calcPressureWeighting(props,r,sf);
+                            avgLen+=rLength;
+                            numN++;
+                        }
                     }
-
-                }
-                // Do the same for our boundary ghost particles
-                // Get our cell occupancy total and start index
-                cellOcc = _buff.bndCellOccBuff[nCells.cIdx[c]];
-                cellIdx = _buff.bndCellIdxBuff[nCells.cIdx[c]];
-                for(int i=0; i<cellOcc; i++)
-                {
-                    //Get our neighbour particle index
-                    nIdx = cellIdx+i;
-                    // Get our neighbour position
-                    pj = _buff.bndPos[nIdx];
-                    //Get our vector beteen points
-                    r = pi - pj;
-                    //Calculate our length
-                    rLength=length(r);
-                    // Normalise our differential
-                    r/=rLength;
-
-                    //Weighting
-                    w = calcPressureWeighting(r,sizeFunction(rLength,vari,1.f));
-
-                    // Accumilate our pressure force
-                    presForce+= (presi/(di*di)) * props.mass * w;
-
-                    // Accumilate our cohesion force
-//                    cw = calcCoheWeighting(rLength);
-//                    if(cw!=cw) printf("cw %f\n",cw);
-//                    coheForce+=-props.tension*props.mass*props.mass*((2.f*_restDensity)/(di+_restDensity))*r*cw;
                 }
             }
-
-            // Compute our average distance between neighbours
-            avgLen/=numN;
-            // Complete our pressure force term
-            presForce*=-1.f*props.mass;
-            acc = (presForce+coheForce)/props.mass;
         }
+        if(solving && BND) presForce+= presTermi * wallForce(props,_buff.wallTable,pi,scalei);
 
-        // Acceleration limit
-//        if(dot(acc,acc)>props.accLimit2)
-//        {
-//            acc *= props.accLimit/length(acc);
-//        }
-
-        // Now lets integerate our acceleration using leapfrog to get our new position
-        float3 halfBwd = _buff.velPtr[idx] - 0.5f*props.timeStep*acc;
-        float3 halfFwd = halfBwd + props.timeStep*acc;
-        // Apply velocity dampaning
-        halfFwd *= 0.9f;
-
-        //printf("vel %f,%f,%f\n",halfFwd.x,halfFwd.y,halfFwd.z);
-
-        //Velocity Limit
-//        if(dot(halfFwd,halfFwd)>props.velLimit2)
-//        {
-//            halfFwd *= props.velLimit/length(halfFwd);
-//        }
-
-        // Update our velocity
-        _buff.velPtr[idx] = halfFwd;
-
+        // Every thread has to get here before anyone writes a new position over our staged neighbours
+        __syncthreads();
+        if(active)
+        {
+            float2 acc = make_float2(0.f,0.f);
+            if(solving)
+            {
+                // Compute our average distance between neighbours
+                avgLen/=numN;
+                // Our force is -mass^2 times our sum, divide by our mass for our acceleration
+                acc = -props.mass*presForce;
+            }
+            // Integrate our new position and velocity
+            integrateParticle(idx,pi4,acc,avgLen,_buff);
+        }
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+__global__ void computeScaleKernal(int _numParticles, fluidBuffers _buff, bool _multiClass)
+{
+    int idx = threadIdx.x + blockIdx.x * blockDim.x;
+    if(idx<_numParticles)
+    {
+        // Sample our image once per particle so our neighbour loops dont have to for every pair
+        _buff.scalePtr[idx] = invScale(sampleVariance(_buff.posPtr[idx],_multiClass,_buff));
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+__global__ void packExportKernal(int _numParticles, fluidBuffers _buff, bool _multiClass, float2 *__restrict__ _xy, unsigned char *__restrict__ _class, float *__restrict__ _radius)
+{
+    int idx = threadIdx.x + blockIdx.x * blockDim.x;
+    if(idx<_numParticles)
+    {
+        const SimProps props = loadSimProps(_buff.props);
+        float4 p = _buff.posPtr[idx];
+        _xy[idx] = make_float2(p.x,p.y);
+        if(_class) _class[idx] = (unsigned char)p.w;
+        // Our scales are from the start of our last step so sample again where our particles ended up
+        if(_radius) _radius[idx] = 0.5f*props.h*invScale(sampleVariance(p,_multiClass,_buff));
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+__global__ void sampleWeightKernal(int _numPixels, const float *__restrict__ _intensity, double *__restrict__ _weights)
+{
+    int idx = threadIdx.x + blockIdx.x * blockDim.x;
+    if(idx<_numPixels)
+    {
+        // Our particles settle with a spacing of invScale() so aim for a density of 1/invScale()^2.
+        // These range over a few orders of magnitude so we keep them in double for our scan.
+        float s = invScale(_intensity[idx]);
+        _weights[idx] = 1.0/(double)(s*s);
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+__device__ inline float openUniform(curandStatePhilox4_32_10_t *_state)
+{
+    // curand_uniform gives us (0,1] but we want to keep our samples off the edge of our domain
+    float u = curand_uniform(_state);
+    while(u>=1.f) u = curand_uniform(_state);
+    return u;
+}
+//----------------------------------------------------------------------------------------------------------------------
+__global__ void randomSamplesKernal(int _numParticles, float4 *__restrict__ _posPtr, float2 _bounds, unsigned long long _seed, const double *__restrict__ _cdf, int _cdfWidth, int _cdfHeight)
+{
+    int idx = threadIdx.x + blockIdx.x * blockDim.x;
+    if(idx<_numParticles)
+    {
+        // One Philox subsequence per particle so our samples only depend on our seed
+        curandStatePhilox4_32_10_t state;
+        curand_init(_seed,idx,0,&state);
 
-        // Update our position
-        float3 oldPos = pi;
-        pi+= props.timeStep * halfFwd;
+        float2 p;
+        if(!_cdf)
+        {
+            p = make_float2(openUniform(&state),openUniform(&state));
+        }
+        else
+        {
+            // Pick a pixel in proportion to its weight by searching our CDF
+            int numPixels = _cdfWidth*_cdfHeight;
+            double target = (double)openUniform(&state)*_cdf[numPixels-1];
+            int lo = 0;
+            int hi = numPixels-1;
+            while(lo<hi)
+            {
+                int mid = (lo+hi)>>1;
+                if(_cdf[mid]<target) lo = mid+1;
+                else hi = mid;
+            }
+            // then jitter our sample inside it. Our CDF is bottom row first like our textures.
+            p.x = ((float)(lo%_cdfWidth)+openUniform(&state))/(float)_cdfWidth;
+            p.y = ((float)(lo/_cdfWidth)+openUniform(&state))/(float)_cdfHeight;
+        }
+        // Our classes cycle the same way as setParticles assigns them
+        _posPtr[idx] = make_float4(p.x*_bounds.x,p.y*_bounds.y,0.f,(float)(idx%4));
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+__global__ void splitParticlesKernal(int _numOld, int _numNew, float4 *_posPtr, float2 _bounds, float _radius, unsigned long long _seed)
+{
+    int idx = threadIdx.x + blockIdx.x * blockDim.x + _numOld;
+    if(idx<_numNew)
+    {
+        curandStatePhilox4_32_10_t state;
+        curand_init(_seed,idx,0,&state);
+
+        // Drop our new particle somewhere in a disc around its parent. Our parents are all before _numOld
+        // so nothing we read is being written.
+        float4 parent = _posPtr[(idx-_numOld)%_numOld];
+        float r = _radius*sqrtf(openUniform(&state));
+        float a = 6.283185307f*openUniform(&state);
+        float2 p = make_float2(parent.x+r*cosf(a),parent.y+r*sinf(a));
+        p = clamp(p,_bounds*0.0001f,_bounds*0.9999f);
+        _posPtr[idx] = make_float4(p.x,p.y,0.f,(float)(idx%4));
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+__global__ void updateTimeStepKernal(fluidBuffers _buff)
+{
+    const SimProps props = loadSimProps(_buff.props);
+    float vMax = __uint_as_float(_buff.motionMax[0]);
+    float aMax = __uint_as_float(_buff.motionMax[1]);
 
+    // Our fastest particle may only move a fraction of our smoothing length, both from its speed and its acceleration
+    float dt = props.maxTimeStep;
+    if(!isfinite(vMax) || !isfinite(aMax))
+    {
+        // Someone has blown up. Our comparisons and fminf would quietly skip over them so take our smallest step.
+        reportError(_buff.errors,SPH_ERROR_NAN_MOTION,make_float4(vMax,aMax,0.f,0.f));
+        dt = props.minTimeStep;
+    }
+    else
+    {
+        if(vMax>0.f) dt = fminf(dt,props.cflFactor*props.h/vMax);
+        if(aMax>0.f) dt = fminf(dt,props.cflFactor*sqrtf(props.h/aMax));
+        dt = fminf(dt,*_buff.dtPtr*SPH_DT_GROWTH);
+    }
+    // Our last timestep could still be a NaN from before our particles were set
+    if(!(dt>=props.minTimeStep)) dt = props.minTimeStep;
 
-        //Place our particles back in our bounds
-        //this could potentially have problems with velocity and such not being
-        //adjusted but we will leave that for future work (Hes says...)
-        if(pi.x<0.f){
-            pi.x = 0.f;
+    *_buff.dtPtr = dt;
+    _buff.motionMax[0] = 0u;
+    _buff.motionMax[1] = 0u;
+}
+//----------------------------------------------------------------------------------------------------------------------
+__device__ inline int clampedCell(const SimProps &_props, float2 _p)
+{
+    int key = hashPos(_props,_p-_props.gridMin);
+    return min(max(key,0),_props.gridRes.x*_props.gridRes.y-1);
+}
+//----------------------------------------------------------------------------------------------------------------------
+__global__ void activeFlagsKernal(int _numParticles, fluidBuffers _buff)
+{
+    const SimProps props = loadSimProps(_buff.props);
+    int idx = threadIdx.x + blockIdx.x * blockDim.x;
+    if(idx<_numParticles)
+    {
+        // We are active if anyone in our neighbourhood was still moving at the end of our last step
+        int key = clampedCell(props,posXY(_buff.posPtr[idx]));
+        int y = key / props.gridRes.x;
+        int x = key - (y*props.gridRes.x);
+        int active = 0;
+        for(int yj=max(y-1,0); yj<=min(y+1,props.gridRes.y-1) && !active; yj++)
+        for(int xj=max(x-1,0); xj<=min(x+1,props.gridRes.x-1); xj++)
+        {
+            if(_buff.cellHot[xj+yj*props.gridRes.x])
+            {
+                active = 1;
+                break;
+            }
         }
-        if(pi.y<0.f){
-            pi.y = 0.f;
+        _buff.activeFlags[idx] = active;
+        // Our frozen particles were converged last step and stay where they are. Our forces kernal
+        // overwrites this for everyone else.
+        if(!active)
+        {
+            _buff.convergedPtr[idx] = 1;
+            _buff.velPtr[idx] = make_float2(0.f,0.f);
         }
-        if(pi.x>15.f){
-            pi.x = 15.f;
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+__global__ void markActiveCellsKernal(int _numParticles, fluidBuffers _buff)
+{
+    const SimProps props = loadSimProps(_buff.props);
+    int idx = threadIdx.x + blockIdx.x * blockDim.x;
+    if(idx<_numParticles && !_buff.convergedPtr[idx])
+    {
+        // Everyone writes the same value so we dont need atomics
+        _buff.cellHot[clampedCell(props,posXY(_buff.posPtr[idx]))] = 1;
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+__device__ inline float neighbourRadius2(const SimProps &_props)
+{
+    // Our lists hold everything inside our smoothing length plus our Verlet skin
+    float r = _props.h + _props.skin;
+    return r*r;
+}
+//----------------------------------------------------------------------------------------------------------------------
+__global__ void countNeighboursKernal(int _numParticles, int _maxNeighbours, fluidBuffers _buff)
+{
+    const SimProps props = loadSimProps(_buff.props);
+    int idx = threadIdx.x + blockIdx.x * blockDim.x;
+    if(idx<_numParticles)
+    {
+        float2 pi = posXY(_buff.posPtr[idx]);
+        int key = hashPos(props,pi-props.gridMin);
+        float r2 = neighbourRadius2(props);
+        int2 range;
+        int count = 0;
+        float2 d;
+        for(int row=-1; row<2; row++)
+        {
+            range = cellRowRange(props,key,row,_buff.cellOccBuffer,_buff.cellIndexBuffer);
+            for(int nIdx=range.x; nIdx<range.y; nIdx++)
+            {
+                if(nIdx==idx) continue;
+                d = pi - posXY(_buff.posPtr[nIdx]);
+                if(dot(d,d)<r2) count++;
+            }
         }
-        if(pi.y>15.f){
-            pi.y = 15.f;
+        // Let our host know we had to drop some neighbours
+        if(count>_maxNeighbours)
+        {
+            atomicOr(_buff.nbrStale,SPH_NEIGHBOUR_OVERFLOW);
+            count = _maxNeighbours;
         }
-
-        _buff.posPtr[idx] = pi;
-        // Check to see if we have met our converged state
-        if(length(oldPos-pi)<props.convergeValue*avgLen)
+        _buff.nbrCount[idx] = count;
+        // Remember where we were so we know when our list has gone stale
+        _buff.nbrRefPos[idx] = pi;
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+__global__ void fillNeighboursKernal(int _numParticles, fluidBuffers _buff)
+{
+    const SimProps props = loadSimProps(_buff.props);
+    int idx = threadIdx.x + blockIdx.x * blockDim.x;
+    if(idx<_numParticles)
+    {
+        float2 pi = posXY(_buff.posPtr[idx]);
+        int key = hashPos(props,pi-props.gridMin);
+        float r2 = neighbourRadius2(props);
+        int offset = _buff.nbrOffsets[idx];
+        int limit = _buff.nbrCount[idx];
+        int count = 0;
+        int2 range;
+        float2 d;
+        for(int row=-1; row<2 && count<limit; row++)
         {
-            _buff.convergedPtr[idx] = 1;
+            range = cellRowRange(props,key,row,_buff.cellOccBuffer,_buff.cellIndexBuffer);
+            for(int nIdx=range.x; nIdx<range.y && count<limit; nIdx++)
+            {
+                if(nIdx==idx) continue;
+                d = pi - posXY(_buff.posPtr[nIdx]);
+                if(dot(d,d)<r2) _buff.nbrList[offset+count++] = nIdx;
+            }
         }
-        else
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+template<int MODE, bool BND>
+__global__ void solveDensityListKernal(int _numParticles, fluidBuffers _buff)
+{
+    const SimProps props = loadSimProps(_buff.props);
+    int idx = threadIdx.x + blockIdx.x * blockDim.x;
+    if(idx<_numParticles)
+    {
+        float4 pi4 = _buff.posPtr[idx];
+        float2 pi = posXY(pi4);
+        float scalei = _buff.scalePtr[idx];
+        int start = _buff.nbrOffsets[idx];
+        int end = start + _buff.nbrCount[idx];
+        float di = 0.f;
+        float4 pj4;
+        float sf;
+        int nIdx;
+        for(int n=start; n<end; n++)
         {
-            _buff.convergedPtr[idx] = 0;
+            nIdx = __ldg(&_buff.nbrList[n]);
+            pj4 = _buff.posPtr[nIdx];
+            if(!pairInteracts<MODE>(pi4.w,pj4.w)) continue;
+            sf = sizeFunction(length(pi-posXY(pj4)),scalei,__ldg(&_buff.scalePtr[nIdx]),_buff.errors);
+            di+=calcDensityWeighting(props,pairSize<MODE>(sf,pi4.w,pj4.w));
         }
+        if(BND) di+=wallDensity(props,_buff.wallTable,pi,scalei);
+        _buff.posPtr[idx].z = props.mass*di;
     }
 }
 //----------------------------------------------------------------------------------------------------------------------
-void test(){
-    printf("calling\n");
-    testKernal<<<1,1000>>>();
-    //make sure all our threads are done
-    cudaThreadSynchronize();
-    printf("called\n");
+template<int MODE, bool BND>
+__global__ void solveForcesListKernal(int _numParticles, fluidBuffers _buff)
+{
+    const SimProps props = loadSimProps(_buff.props);
+    int idx = activeParticle(threadIdx.x + blockIdx.x * blockDim.x,_numParticles,_buff);
+    if(idx>=0)
+    {
+        // Our rest density is computed on the device so our host never has to wait for it
+        float _restDensity = *_buff.restDenPtr;
+        float4 pi4 = _buff.posPtr[idx];
+        float2 pi = posXY(pi4);
+        float di = pi4.z;
+        float2 acc = make_float2(0.f,0.f);
+        float avgLen = 0.f;
+        if(di>0.f)
+        {
+            float scalei = _buff.scalePtr[idx];
+            // Our half of every pairs pressure term only depends on us so only work it out once
+            float presTermi = calculatePressure(props,di,_restDensity)/(di*di);
+            int start = _buff.nbrOffsets[idx];
+            int end = start + _buff.nbrCount[idx];
+            int numN = 0;
+            int nIdx;
+            float dj,rLength,sf;
+            float2 r;
+            float4 pj4;
+            float2 presForce = make_float2(0.f,0.f);
+            for(int n=start; n<end; n++)
+            {
+                nIdx = __ldg(&_buff.nbrList[n]);
+                pj4 = _buff.posPtr[nIdx];
+                dj = pj4.z;
+                if(dj>0.f && pairInteracts<MODE>(pi4.w,pj4.w))
+                {
+                    r = pi - posXY(pj4);
+                    rLength = length(r);
+                    r/=rLength;
+                    sf = pairSize<MODE>(sizeFunction(rLength,scalei,__ldg(&_buff.scalePtr[nIdx]),_buff.errors),pi4.w,pj4.w);
+                    // Accumilate our pressure force
+                    presForce+= (presTermi + calculatePressure(props,dj,_restDensity)/(dj*dj)) * calcPressureWeighting(props,r,sf);
+                    avgLen+=rLength;
+                    numN++;
+                }
+            }
+            if(BND) presForce+= presTermi * wallForce(props,_buff.wallTable,pi,scalei);
+
+            // Compute our average distance between neighbours
+            avgLen/=numN;
+            // Our force is -mass^2 times our sum, divide by our mass for our acceleration
+            acc = -props.mass*presForce;
+        }
+
+        // Integrate our new position and velocity
+        integrateParticle(idx,pi4,acc,avgLen,_buff);
+
+        // Once anyone has moved more than half our skin a new neighbour could have come into range
+        float2 d = posXY(_buff.posPtr[idx]) - _buff.nbrRefPos[idx];
+        if(dot(d,d)>0.25f*props.skin*props.skin) atomicOr(_buff.nbrStale,SPH_NEIGHBOUR_STALE);
+    }
 }
 //----------------------------------------------------------------------------------------------------------------------
-float computeAverageDensity(int _numParticles, fluidBuffers _buff)
+/// @brief returns the density we store in the z of our particles
+//----------------------------------------------------------------------------------------------------------------------
+struct getDensity
+{
+    __host__ __device__ float operator()(const float4 &_p) const
+    {
+        return _p.z;
+    }
+};
+//----------------------------------------------------------------------------------------------------------------------
+CachedAllocator *createThrustAllocator(cudaStream_t _stream)
 {
-    // Turn our density buffer pointer into a thrust iterater
-    thrust::device_ptr<float> t_denPtr = thrust::device_pointer_cast(_buff.denPtr);
+#ifdef SPH_STREAM_ORDERED_ALLOC
+    // By default our pool gives its memory back every time we synchronise. Keep it so our steps reuse it.
+    int device = 0;
+    cudaGetDevice(&device);
+    cudaMemPool_t pool;
+    cudaDeviceGetDefaultMemPool(&pool,device);
+    cuuint64_t threshold = ~0ull;
+    cudaMemPoolSetAttribute(pool,cudaMemPoolAttrReleaseThreshold,&threshold);
+#endif
+    return new CachedAllocator(_stream);
+}
+//----------------------------------------------------------------------------------------------------------------------
+void destroyThrustAllocator(CachedAllocator *_alloc)
+{
+    delete _alloc;
+}
+//----------------------------------------------------------------------------------------------------------------------
+float computeAverageDensity(cudaStream_t _stream, int _numParticles, fluidBuffers _buff)
+{
+    SPH_NVTX_RANGE("computeAverageDensity");
+    // Turn our position buffer pointer into a thrust iterater. Our density lives in z.
+    thrust::device_ptr<float4> t_posPtr = thrust::device_pointer_cast(_buff.posPtr);
 
-    // Use reduce to sum all our densities
-    float sum = thrust::reduce(t_denPtr, t_denPtr+_numParticles, 0.f, thrust::plus<float>());
+    // Use reduce to sum all our densities. We need the result on the host so this waits on our stream.
+    float sum = thrust::transform_reduce(thrust::cuda::par.on(_stream), t_posPtr, t_posPtr+_numParticles, getDensity(), 0.f, thrust::plus<float>());
 
     // Return our average density
     return sum/(float)_numParticles;
 }
 //----------------------------------------------------------------------------------------------------------------------
-void updateSimProps(SimProps *_props)
+void updateSimProps(SimProps *_props, fluidBuffers _buff, cudaStream_t _stream)
 {
-    #ifdef CUDA_42
-        // Unlikely we will ever use CUDA 4.2 but nice to have it in anyway I guess?
-        cudaMemcpyToSymbol ( "props", _props, sizeof(SimProps) );
-    #else
-        cudaMemcpyToSymbol ( props, _props, sizeof(SimProps) );
-    #endif
+    SPH_NVTX_RANGE("updateSimProps");
+    // Copy on our stream rather than the default stream, which would otherwise serialise with all our work.
+    // Our kernals read our properties from here so our graphs pick up the change on their next launch.
+    cudaMemcpyAsync(_buff.props, _props, sizeof(SimProps), cudaMemcpyHostToDevice, _stream);
+}
+//----------------------------------------------------------------------------------------------------------------------
+void checkSolverErrors(const char *_where)
+{
+    // This doesnt synchronise so it picks up launch errors straight away and
+    // any errors from earlier asynchronous work that has already completed
+    cudaError_t error = cudaGetLastError();
+    if(error != cudaSuccess)
+    {
+      // print the CUDA error message and exit
+      printf("%s error: %s\n", _where, cudaGetErrorString(error));
+      exit(-1);
+    }
 }
 //----------------------------------------------------------------------------------------------------------------------
 void fillIntZero(cudaStream_t _stream, int _threadsPerBlock, int *_bufferPtr,int size)
 {
+    SPH_NVTX_RANGE("fillIntZero");
     if(size>_threadsPerBlock)
     {
         //calculate how many blocks we want
@@ -713,47 +1333,80 @@ void fillIntZero(cudaStream_t _stream, int _threadsPerBlock, int *_bufferPtr,int
     else{
         fillIntZeroKernal<<<1,size,0,_stream>>>(_bufferPtr,size);
     }
-    //make sure all our threads are done
-    cudaThreadSynchronize();
-    // check for error
-    cudaError_t error = cudaGetLastError();
-    if(error != cudaSuccess)
-    {
-      // print the CUDA error message and exit
-      printf("Fill int zero: %s\n", cudaGetErrorString(error));
-      exit(-1);
-    }
+    SPH_CHECK_LAUNCH(_stream,"Fill int zero");
 }
 //----------------------------------------------------------------------------------------------------------------------
-void createHashMap(cudaStream_t _stream, int _threadsPerBlock, int _hashTableSize, fluidBuffers _buff)
+void hashParticles(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, fluidBuffers _buff)
 {
+    SPH_NVTX_RANGE("hashParticles");
     int blocks = 1;
-    int threads = _hashTableSize;
-    if(_hashTableSize>_threadsPerBlock)
+    int threads = _numParticles;
+    if(_numParticles>_threadsPerBlock)
     {
         //calculate how many blocks we want
-        blocks = ceil(_hashTableSize/_threadsPerBlock)+1;
+        blocks = ceil(_numParticles/_threadsPerBlock)+1;
         threads = _threadsPerBlock;
     }
 
-    // Create ou hash map
-    createHashMapKernal<<<blocks,threads,0,_stream>>>(_hashTableSize,_buff);
-
-    // check for error
-    cudaError_t error = cudaGetLastError();
+    //Hash our partilces
+    if(_buff.nullHashCount) cudaMemsetAsync(_buff.nullHashCount,0,sizeof(int),_stream);
+    hashParticles<<<blocks,threads,0,_stream>>>(_buff.props,_numParticles,_buff.posPtr,_buff.hashKeys,_buff.cellOccBuffer,_buff.particleIdx,_buff.nullHashCount,_buff.errors);
+    SPH_CHECK_LAUNCH(_stream,"Hash Particles");
+}
+//----------------------------------------------------------------------------------------------------------------------
+size_t sortTempStorageBytes(int _numParticles)
+{
+    // Passing no storage just asks cub how much it needs. Our incremental sort shares this storage too.
+    size_t bytes = 0;
+    size_t partitionBytes = 0;
+    size_t sortKeysBytes = 0;
+    int *nullPtr = 0;
+    unsigned long long *nullPacked = 0;
+    cudaError_t error = cub::DeviceRadixSort::SortPairs(0,bytes,nullPtr,nullPtr,nullPtr,nullPtr,_numParticles);
+    if(error == cudaSuccess) error = cub::DevicePartition::Flagged(0,partitionBytes,nullPacked,nullPtr,nullPacked,nullPtr,_numParticles);
+    if(error == cudaSuccess) error = cub::DeviceRadixSort::SortKeys(0,sortKeysBytes,nullPacked,nullPacked,_numParticles);
+    // Our active set compaction shares this storage too
+    size_t selectBytes = 0;
+    if(error == cudaSuccess) error = cub::DeviceSelect::Flagged(0,selectBytes,thrust::counting_iterator<int>(0),nullPtr,nullPtr,nullPtr,_numParticles);
     if(error != cudaSuccess)
     {
-      // print the CUDA error message and exit
-      printf("Create hash map error: %s\n", cudaGetErrorString(error));
+      printf("Sort temporary storage error: %s\n", cudaGetErrorString(error));
       exit(-1);
     }
+    if(partitionBytes>bytes) bytes = partitionBytes;
+    if(sortKeysBytes>bytes) bytes = sortKeysBytes;
+    if(selectBytes>bytes) bytes = selectBytes;
+    return bytes;
+}
+//----------------------------------------------------------------------------------------------------------------------
+static int keyBits(int _hashTableSize)
+{
+    // Our keys are at most _hashTableSize so we only need to sort this many bits
+    int bits = 1;
+    while(bits<31 && (1<<bits)<=_hashTableSize) bits++;
+    return bits;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void sortParticleKeys(cudaStream_t _stream, int _numParticles, int _hashTableSize, fluidBuffers _buff)
+{
+    SPH_NVTX_RANGE("sortParticleKeys");
+    int endBit = keyBits(_hashTableSize);
 
-    //make sure all our threads are done
-    cudaThreadSynchronize();
+    cudaError_t error = cub::DeviceRadixSort::SortPairs(_buff.sortTempStorage,_buff.sortTempBytes,
+                                                        _buff.hashKeys,_buff.sortedHashKeys,
+                                                        _buff.particleIdx,_buff.sortedIdx,
+                                                        _numParticles,0,endBit,_stream);
+    if(error != cudaSuccess)
+    {
+      printf("Sort particle keys error: %s\n", cudaGetErrorString(error));
+      exit(-1);
+    }
+    SPH_CHECK_LAUNCH(_stream,"Sort particle keys");
 }
 //----------------------------------------------------------------------------------------------------------------------
-void hashAndSortBnd(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, int _hashTableSize, float3 *posPtr, int *_occPtr, int *_idxPtr)
+void rehashParticles(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, fluidBuffers _buff)
 {
+    SPH_NVTX_RANGE("rehashParticles");
     int blocks = 1;
     int threads = _numParticles;
     if(_numParticles>_threadsPerBlock)
@@ -763,54 +1416,91 @@ void hashAndSortBnd(cudaStream_t _stream, int _threadsPerBlock, int _numParticle
         threads = _threadsPerBlock;
     }
 
-    int *hashKeys = 0;
-    cudaMalloc(&hashKeys,_numParticles*sizeof(int));
-    fillIntZero(_stream,_threadsPerBlock,hashKeys,_numParticles);
-
-    //Hash our partilces
-    hashParticles<<<blocks,threads,0,_stream>>>(_numParticles,posPtr,hashKeys,_occPtr);
-
-    // check for error
-    cudaError_t error = cudaGetLastError();
+    cudaMemsetAsync(_buff.sortStats,0,3*sizeof(int),_stream);
+    if(_buff.nullHashCount) cudaMemsetAsync(_buff.nullHashCount,0,sizeof(int),_stream);
+    rehashParticlesKernal<<<blocks,threads,0,_stream>>>(_numParticles,_buff);
+    SPH_CHECK_LAUNCH(_stream,"Rehash particles");
+}
+//----------------------------------------------------------------------------------------------------------------------
+void partitionStayingKeys(cudaStream_t _stream, int _numParticles, fluidBuffers _buff)
+{
+    SPH_NVTX_RANGE("partitionStayingKeys");
+    // Particles that stayed in their cell are still in sorted order so keep them in order at the front.
+    // Our movers end up at the back in reverse order but we sort those in repairSortedKeys anyway.
+    cudaError_t error = cub::DevicePartition::Flagged(_buff.sortTempStorage,_buff.sortTempBytes,
+                                                      _buff.packedKeys,_buff.stayFlags,_buff.repairKeys,
+                                                      &(_buff.sortStats[2]),_numParticles,_stream);
     if(error != cudaSuccess)
     {
-      // print the CUDA error message and exit
-      printf("Hash Particles error: %s\n", cudaGetErrorString(error));
+      printf("Partition sorted keys error: %s\n", cudaGetErrorString(error));
       exit(-1);
     }
+}
+//----------------------------------------------------------------------------------------------------------------------
+void repairSortedKeys(cudaStream_t _stream, int _numParticles, int _numMoved, int _hashTableSize, fluidBuffers _buff)
+{
+    SPH_NVTX_RANGE("repairSortedKeys");
+    int numStay = _numParticles - _numMoved;
 
-    //make sure all our threads are done
-    cudaThreadSynchronize();
-
-//    //Turn our raw pointers into thrust pointers so we can use
-//    //thrusts sort algorithm
-    thrust::device_ptr<int> t_hashPtr = thrust::device_pointer_cast(hashKeys);
-    thrust::device_ptr<float3> t_posPtr = thrust::device_pointer_cast(posPtr);
-    thrust::device_ptr<int> t_cellOccPtr = thrust::device_pointer_cast(_occPtr);
-    thrust::device_ptr<int> t_cellIdxPtr = thrust::device_pointer_cast(_idxPtr);
+    // Sort just our movers. Our merge compares whole keys so our index bits have to be sorted as well, our
+    // partition left them reversed within each cell.
+    cudaError_t error = cudaSuccess;
+    if(_numMoved>0)
+    {
+        error = cub::DeviceRadixSort::SortKeys(_buff.sortTempStorage,_buff.sortTempBytes,
+                                               _buff.repairKeys+numStay,_buff.packedKeys,
+                                               _numMoved,0,32+keyBits(_hashTableSize),_stream);
+    }
+    if(error != cudaSuccess)
+    {
+      printf("Repair sorted keys error: %s\n", cudaGetErrorString(error));
+      exit(-1);
+    }
 
-    //sort our buffers
-    thrust::sort_by_key(t_hashPtr,t_hashPtr+_numParticles, t_posPtr);
-    //make sure all our threads are done
-    cudaThreadSynchronize();
+    // Merge our two sorted lists and unpack them straight into our sorted keys and indices
+    thrust::device_ptr<unsigned long long> t_stayPtr = thrust::device_pointer_cast(_buff.repairKeys);
+    thrust::device_ptr<unsigned long long> t_movePtr = thrust::device_pointer_cast(_buff.packedKeys);
+    thrust::device_ptr<int> t_sortedKeyPtr = thrust::device_pointer_cast(_buff.sortedHashKeys);
+    thrust::device_ptr<int> t_sortedIdxPtr = thrust::device_pointer_cast(_buff.sortedIdx);
+    thrust::merge(SPH_THRUST_ASYNC(_buff.thrustAlloc,_stream),t_stayPtr,t_stayPtr+numStay,t_movePtr,t_movePtr+_numMoved,
+                  thrust::make_transform_output_iterator(thrust::make_zip_iterator(thrust::make_tuple(t_sortedKeyPtr,t_sortedIdxPtr)),unpackKey()));
+    SPH_CHECK_LAUNCH(_stream,"Merge sorted keys");
+}
+//----------------------------------------------------------------------------------------------------------------------
+void gatherParticles(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, fluidBuffers _buff)
+{
+    SPH_NVTX_RANGE("gatherParticles");
+    int blocks = 1;
+    int threads = _numParticles;
+    if(_numParticles>_threadsPerBlock)
+    {
+        //calculate how many blocks we want
+        blocks = ceil(_numParticles/_threadsPerBlock)+1;
+        threads = _threadsPerBlock;
+    }
 
+    gatherParticlesKernal<<<blocks,threads,0,_stream>>>(_numParticles,_buff);
+    SPH_CHECK_LAUNCH(_stream,"Gather particles");
+}
+//----------------------------------------------------------------------------------------------------------------------
+void computeCellIndices(cudaStream_t _stream, int _hashTableSize, fluidBuffers _buff)
+{
+    SPH_NVTX_RANGE("computeCellIndices");
+    thrust::device_ptr<int> t_cellOccPtr = thrust::device_pointer_cast(_buff.cellOccBuffer);
+    thrust::device_ptr<int> t_cellIdxPtr = thrust::device_pointer_cast(_buff.cellIndexBuffer);
 
     //Create our cell indexs
     //run an excludive scan on our arrays to do this
-    thrust::exclusive_scan(t_cellOccPtr,t_cellOccPtr+_hashTableSize,t_cellIdxPtr);
-
-    //make sure all our threads are done
-    cudaThreadSynchronize();
-
-    cudaFree(hashKeys);
+    thrust::exclusive_scan(SPH_THRUST_ASYNC(_buff.thrustAlloc,_stream),t_cellOccPtr,t_cellOccPtr+_hashTableSize,t_cellIdxPtr);
 
     //DEBUG: uncomment to print out counted cell occupancy
     //thrust::copy(t_cellOccPtr, t_cellOccPtr+_hashTableSize, std::ostream_iterator<unsigned int>(std::cout, " "));
     //std::cout<<"\n"<<std::endl;
 }
 //----------------------------------------------------------------------------------------------------------------------
-void hashAndSort(cudaStream_t _stream,int _threadsPerBlock, int _numParticles, int _hashTableSize, fluidBuffers _buff)
+void computeParticleScales(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, fluidBuffers _buff, bool _multiClass)
 {
+    SPH_NVTX_RANGE("computeParticleScales");
     int blocks = 1;
     int threads = _numParticles;
     if(_numParticles>_threadsPerBlock)
@@ -820,53 +1510,33 @@ void hashAndSort(cudaStream_t _stream,int _threadsPerBlock, int _numParticles, i
         threads = _threadsPerBlock;
     }
 
-    //Hash our partilces
-    hashParticles<<<blocks,threads,0,_stream>>>(_numParticles,_buff.posPtr,_buff.hashKeys,_buff.cellOccBuffer);
-
-    // check for error
-    cudaError_t error = cudaGetLastError();
-    if(error != cudaSuccess)
+    computeScaleKernal<<<blocks,threads,0,_stream>>>(_numParticles,_buff,_multiClass);
+    SPH_CHECK_LAUNCH(_stream,"Compute particle scales");
+}
+//----------------------------------------------------------------------------------------------------------------------
+void buildSampleCDF(cudaStream_t _stream, int _threadsPerBlock, int _numPixels, const float *_intensity, double *_cdf, CachedAllocator *_thrustAlloc)
+{
+    SPH_NVTX_RANGE("buildSampleCDF");
+    int blocks = 1;
+    int threads = _numPixels;
+    if(_numPixels>_threadsPerBlock)
     {
-      // print the CUDA error message and exit
-      printf("Hash Particles error: %s\n", cudaGetErrorString(error));
-      exit(-1);
+        //calculate how many blocks we want
+        blocks = ceil(_numPixels/_threadsPerBlock)+1;
+        threads = _threadsPerBlock;
     }
 
-    //make sure all our threads are done
-    cudaThreadSynchronize();
+    sampleWeightKernal<<<blocks,threads,0,_stream>>>(_numPixels,_intensity,_cdf);
+    SPH_CHECK_LAUNCH(_stream,"Sample weights");
 
-//    //Turn our raw pointers into thrust pointers so we can use
-//    //thrusts sort algorithm
-    thrust::device_ptr<int> t_hashPtr = thrust::device_pointer_cast(_buff.hashKeys);
-    thrust::device_ptr<float3> t_posPtr = thrust::device_pointer_cast(_buff.posPtr);
-    thrust::device_ptr<float3> t_velPtr = thrust::device_pointer_cast(_buff.velPtr);
-    thrust::device_ptr<float3> t_accPtr = thrust::device_pointer_cast(_buff.accPtr);
-    thrust::device_ptr<float> t_classPtr = thrust::device_pointer_cast(_buff.classBuff);
-    thrust::device_ptr<int> t_cellOccPtr = thrust::device_pointer_cast(_buff.cellOccBuffer);
-    thrust::device_ptr<int> t_cellIdxPtr = thrust::device_pointer_cast(_buff.cellIndexBuffer);
-
-    //sort our buffers
-    thrust::sort_by_key(t_hashPtr,t_hashPtr+_numParticles, thrust::make_zip_iterator(thrust::make_tuple(t_posPtr,t_velPtr,t_accPtr,t_classPtr)));
-    //make sure all our threads are done
-    cudaThreadSynchronize();
-
-
-    //Create our cell indexs
-    //run an excludive scan on our arrays to do this
-    thrust::exclusive_scan(t_cellOccPtr,t_cellOccPtr+_hashTableSize,t_cellIdxPtr);
-
-    //make sure all our threads are done
-    cudaThreadSynchronize();
-
-    //DEBUG: uncomment to print out counted cell occupancy
-    //thrust::copy(t_cellOccPtr, t_cellOccPtr+_hashTableSize, std::ostream_iterator<unsigned int>(std::cout, " "));
-    //std::cout<<"\n"<<std::endl;
-    //thrust::copy(t_classPtr, t_classPtr+_numParticles, std::ostream_iterator<int>(std::cout, " "));
-    //std::cout<<"\n"<<std::endl;
+    // Scan our weights in place to get our CDF
+    thrust::device_ptr<double> t_cdfPtr = thrust::device_pointer_cast(_cdf);
+    thrust::inclusive_scan(SPH_THRUST_ASYNC(_thrustAlloc,_stream),t_cdfPtr,t_cdfPtr+_numPixels,t_cdfPtr);
 }
 //----------------------------------------------------------------------------------------------------------------------
-void initDensity(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, fluidBuffers _buff, bool _multiClass)
+void generateRandomSamples(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, float4 *_posPtr, float2 _bounds, unsigned long long _seed, const double *_cdf, int _cdfWidth, int _cdfHeight)
 {
+    SPH_NVTX_RANGE("generateRandomSamples");
     int blocks = 1;
     int threads = _numParticles;
     if(_numParticles>_threadsPerBlock)
@@ -876,35 +1546,88 @@ void initDensity(cudaStream_t _stream, int _threadsPerBlock, int _numParticles,
         threads = _threadsPerBlock;
     }
 
-    //Solve our particles density
-    if(_multiClass)
+    randomSamplesKernal<<<blocks,threads,0,_stream>>>(_numParticles,_posPtr,_bounds,_seed,_cdf,_cdfWidth,_cdfHeight);
+    SPH_CHECK_LAUNCH(_stream,"Generate random samples");
+}
+//----------------------------------------------------------------------------------------------------------------------
+void splitParticles(cudaStream_t _stream, int _threadsPerBlock, int _numOld, int _numNew, float4 *_posPtr, float2 _bounds, float _radius, unsigned long long _seed)
+{
+    SPH_NVTX_RANGE("splitParticles");
+    int numChildren = _numNew-_numOld;
+    if(numChildren<=0 || _numOld<=0) return;
+    int blocks = 1;
+    int threads = numChildren;
+    if(numChildren>_threadsPerBlock)
+    {
+        //calculate how many blocks we want
+        blocks = ceil(numChildren/_threadsPerBlock)+1;
+        threads = _threadsPerBlock;
+    }
+
+    splitParticlesKernal<<<blocks,threads,0,_stream>>>(_numOld,_numNew,_posPtr,_bounds,_radius,_seed);
+    SPH_CHECK_LAUNCH(_stream,"Split particles");
+}
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Launches the density kernal of our neighbour search for one of our compile time modes
+//----------------------------------------------------------------------------------------------------------------------
+template<int MODE, bool BND>
+void launchDensity(cudaStream_t _stream, int _blocks, int _threads, int _numParticles, int _hashTableSize, fluidBuffers &_buff, NeighbourSearchMode _search)
+{
+    if(_search==NEIGHBOUR_SEARCH_CELL_SHARED)
+    {
+        // One block for each cell of our hash table
+        solveDensityCellKernal<MODE,BND><<<_hashTableSize,SPH_CELL_THREADS,0,_stream>>>(_buff);
+    }
+    else if(_search==NEIGHBOUR_SEARCH_LIST)
     {
-        solveDensityMultiClassKernal<<<blocks,threads,0,_stream>>>(_numParticles,_buff);
+        solveDensityListKernal<MODE,BND><<<_blocks,_threads,0,_stream>>>(_numParticles,_buff);
     }
     else
     {
-        solveDensityKernal<<<blocks,threads,0,_stream>>>(_numParticles,_buff);
+        solveDensityKernal<MODE,BND><<<_blocks,_threads,0,_stream>>>(_numParticles,_buff);
     }
-    cudaError_t error = cudaGetLastError();
-    if(error != cudaSuccess)
+}
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Launches the force kernal of our neighbour search for one of our compile time modes
+//----------------------------------------------------------------------------------------------------------------------
+template<int MODE, bool BND>
+void launchForces(cudaStream_t _stream, int _blocks, int _threads, int _numParticles, int _hashTableSize, fluidBuffers &_buff, NeighbourSearchMode _search)
+{
+    if(_search==NEIGHBOUR_SEARCH_CELL_SHARED)
     {
-      // print the CUDA error message and exit
-      printf("Solve Density Kernel error: %s\n", cudaGetErrorString(error));
-      exit(-1);
+        // One block for each cell of our hash table
+        solveForcesCellKernal<MODE,BND><<<_hashTableSize,SPH_CELL_THREADS,0,_stream>>>(_buff);
+    }
+    else if(_search==NEIGHBOUR_SEARCH_LIST)
+    {
+        solveForcesListKernal<MODE,BND><<<_blocks,_threads,0,_stream>>>(_numParticles,_buff);
+    }
+    else
+    {
+        solveForcesKernal<MODE,BND><<<_blocks,_threads,0,_stream>>>(_numParticles,_buff);
     }
-
-    //make sure all our threads are done
-    cudaThreadSynchronize();
-
-    //DEBUG: uncomment to print out counted density
-    // Turn our density buffer pointer into a thrust iterater
-    //thrust::device_ptr<float> t_denPtr = thrust::device_pointer_cast(_buff.denPtr);
-    //thrust::copy(t_denPtr, t_denPtr+_numParticles, std::ostream_iterator<unsigned int>(std::cout, " "));
-    //std::cout<<"\n"<<std::endl;
 }
 //----------------------------------------------------------------------------------------------------------------------
-void solve(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, float _restDensity, fluidBuffers _buff, bool _multiClass)
+/// @brief Calls the instantiation of _launch for our stipple mode and if we have a wall table. This is
+/// @brief the only place our mode is looked at, our kernals are compiled for each one.
+//----------------------------------------------------------------------------------------------------------------------
+#define SPH_DISPATCH_SOLVER(_launch,_stippleMode,_bnd,_args) \
+    switch(_stippleMode) \
+    { \
+    case STIPPLE_MODE_CMYK_CHANNEL: \
+        if(_bnd) _launch<STIPPLE_MODE_CMYK_CHANNEL,true>_args; else _launch<STIPPLE_MODE_CMYK_CHANNEL,false>_args; \
+    break; \
+    case STIPPLE_MODE_MULTICLASS: \
+        if(_bnd) _launch<STIPPLE_MODE_MULTICLASS,true>_args; else _launch<STIPPLE_MODE_MULTICLASS,false>_args; \
+    break; \
+    default: \
+        if(_bnd) _launch<STIPPLE_MODE_MONO,true>_args; else _launch<STIPPLE_MODE_MONO,false>_args; \
+    break; \
+    }
+//----------------------------------------------------------------------------------------------------------------------
+void initDensity(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, int _hashTableSize, fluidBuffers _buff, StippleMode _stippleMode, NeighbourSearchMode _mode)
 {
+    SPH_NVTX_RANGE("initDensity");
     int blocks = 1;
     int threads = _numParticles;
     if(_numParticles>_threadsPerBlock)
@@ -914,38 +1637,155 @@ void solve(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, float
         threads = _threadsPerBlock;
     }
 
+    //Solve our particles density
+    bool bnd = (_buff.wallTable!=0);
+    SPH_DISPATCH_SOLVER(launchDensity,_stippleMode,bnd,(_stream,blocks,threads,_numParticles,_hashTableSize,_buff,_mode));
+    SPH_CHECK_LAUNCH(_stream,"Solve Density Kernel");
+}
+//----------------------------------------------------------------------------------------------------------------------
+void solve(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, int _hashTableSize, fluidBuffers _buff, StippleMode _stippleMode, NeighbourSearchMode _mode)
+{
+    SPH_NVTX_RANGE("solve");
+    int blocks = 1;
+    int threads = _numParticles;
+    if(_numParticles>_threadsPerBlock)
+    {
+        //calculate how many blocks we want
+        blocks = ceil(_numParticles/_threadsPerBlock)+1;
+        threads = _threadsPerBlock;
+    }
 
     //Solve for our new positions
-    if(_multiClass)
+    bool bnd = (_buff.wallTable!=0);
+    SPH_DISPATCH_SOLVER(launchForces,_stippleMode,bnd,(_stream,blocks,threads,_numParticles,_hashTableSize,_buff,_mode));
+    SPH_CHECK_LAUNCH(_stream,"Solve");
+}
+//----------------------------------------------------------------------------------------------------------------------
+void buildNeighbourList(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, int _maxNeighbours, fluidBuffers _buff)
+{
+    SPH_NVTX_RANGE("buildNeighbourList");
+    int blocks = 1;
+    int threads = _numParticles;
+    if(_numParticles>_threadsPerBlock)
     {
-        solveForcesKernal<<<blocks,threads,0,_stream>>>(_numParticles, _restDensity, _buff);
+        //calculate how many blocks we want
+        blocks = ceil(_numParticles/_threadsPerBlock)+1;
+        threads = _threadsPerBlock;
     }
-    else
+
+    // Our new list is fresh
+    cudaMemsetAsync(_buff.nbrStale,0,sizeof(int),_stream);
+
+    // Count our neighbours, scan our counts into our CSR offsets then fill in our list
+    countNeighboursKernal<<<blocks,threads,0,_stream>>>(_numParticles,_maxNeighbours,_buff);
+    SPH_CHECK_LAUNCH(_stream,"Count neighbours");
+
+    thrust::device_ptr<int> t_countPtr = thrust::device_pointer_cast(_buff.nbrCount);
+    thrust::device_ptr<int> t_offsetPtr = thrust::device_pointer_cast(_buff.nbrOffsets);
+    thrust::exclusive_scan(SPH_THRUST_ASYNC(_buff.thrustAlloc,_stream),t_countPtr,t_countPtr+_numParticles,t_offsetPtr);
+
+    fillNeighboursKernal<<<blocks,threads,0,_stream>>>(_numParticles,_buff);
+    SPH_CHECK_LAUNCH(_stream,"Fill neighbours");
+}
+//----------------------------------------------------------------------------------------------------------------------
+void computeRestDensity(cudaStream_t _stream, int _numParticles, float _densityDiff, fluidBuffers _buff)
+{
+    SPH_NVTX_RANGE("computeRestDensity");
+    int blocks = (_numParticles+SPH_REDUCE_THREADS-1)/SPH_REDUCE_THREADS;
+    sumDensityKernal<<<blocks,SPH_REDUCE_THREADS,0,_stream>>>(_numParticles,_buff);
+    SPH_CHECK_LAUNCH(_stream,"Sum density");
+    restDensityKernal<<<1,SPH_REDUCE_THREADS,0,_stream>>>(blocks,_numParticles,_densityDiff,_buff);
+    SPH_CHECK_LAUNCH(_stream,"Rest density");
+}
+//----------------------------------------------------------------------------------------------------------------------
+void combineRestDensity(cudaStream_t _stream, int _numParts, const float *_means, const int *_counts, float _densityDiff, fluidBuffers _buff)
+{
+    SPH_NVTX_RANGE("combineRestDensity");
+    combineRestDensityKernal<<<1,1,0,_stream>>>(_numParts,_means,_counts,_densityDiff,_buff);
+    SPH_CHECK_LAUNCH(_stream,"Combine rest density");
+}
+//----------------------------------------------------------------------------------------------------------------------
+void buildActiveSet(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, int _hashTableSize, fluidBuffers _buff)
+{
+    SPH_NVTX_RANGE("buildActiveSet");
+    int blocks = 1;
+    int threads = _numParticles;
+    if(_numParticles>_threadsPerBlock)
     {
-        solveForcesKernal<<<blocks,threads,0,_stream>>>(_numParticles, _restDensity, _buff);
+        //calculate how many blocks we want
+        blocks = ceil(_numParticles/_threadsPerBlock)+1;
+        threads = _threadsPerBlock;
     }
 
-    //make sure all our threads are done
-    cudaThreadSynchronize();
+    activeFlagsKernal<<<blocks,threads,0,_stream>>>(_numParticles,_buff);
+    SPH_CHECK_LAUNCH(_stream,"Active flags");
 
-    cudaError_t error = cudaGetLastError();
+    // Compact the indices of our active particles. Our count stays on the device for our forces kernal.
+    size_t bytes = _buff.sortTempBytes;
+    cudaError_t error = cub::DeviceSelect::Flagged(_buff.sortTempStorage,bytes,thrust::counting_iterator<int>(0),_buff.activeFlags,_buff.activeIdx,_buff.activeCount,_numParticles,_stream);
     if(error != cudaSuccess)
     {
-      // print the CUDA error message and exit
-      printf("Solve error: %s\n", cudaGetErrorString(error));
-      exit(-1);
+        printf("Active set error: %s\n", cudaGetErrorString(error));
+        exit(-1);
     }
 
+    // Ready for markActiveCells to fill in again after our forces kernal
+    cudaMemsetAsync(_buff.cellHot,0,_hashTableSize*sizeof(int),_stream);
 }
 //----------------------------------------------------------------------------------------------------------------------
-bool isConverged(int _numParticles, fluidBuffers _buff)
+void markActiveCells(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, fluidBuffers _buff)
 {
-    // Turn our density buffer pointer into a thrust iterater
-    thrust::device_ptr<int> t_conPtr = thrust::device_pointer_cast(_buff.convergedPtr);
+    SPH_NVTX_RANGE("markActiveCells");
+    int blocks = 1;
+    int threads = _numParticles;
+    if(_numParticles>_threadsPerBlock)
+    {
+        //calculate how many blocks we want
+        blocks = ceil(_numParticles/_threadsPerBlock)+1;
+        threads = _threadsPerBlock;
+    }
 
-    // Use reduce to sum all our densities
-    int sum = thrust::reduce(t_conPtr, t_conPtr+_numParticles, 0, thrust::plus<int>());
+    markActiveCellsKernal<<<blocks,threads,0,_stream>>>(_numParticles,_buff);
+    SPH_CHECK_LAUNCH(_stream,"Mark active cells");
+}
+//----------------------------------------------------------------------------------------------------------------------
+void updateTimeStep(cudaStream_t _stream, fluidBuffers _buff)
+{
+    SPH_NVTX_RANGE("updateTimeStep");
+    updateTimeStepKernal<<<1,1,0,_stream>>>(_buff);
+    SPH_CHECK_LAUNCH(_stream,"Update time step");
+}
+//----------------------------------------------------------------------------------------------------------------------
+void resetTimeStep(cudaStream_t _stream, fluidBuffers _buff, float _dt)
+{
+    SPH_NVTX_RANGE("resetTimeStep");
+    // Copying from the stack is fine here, pageable copies are staged before this returns
+    cudaMemcpyAsync(_buff.dtPtr,&_dt,sizeof(float),cudaMemcpyHostToDevice,_stream);
+    cudaMemsetAsync(_buff.motionMax,0,2*sizeof(unsigned int),_stream);
+}
+//----------------------------------------------------------------------------------------------------------------------
+void countConverged(cudaStream_t _stream, int _numParticles, fluidBuffers _buff)
+{
+    SPH_NVTX_RANGE("countConverged");
+    cudaMemsetAsync(_buff.convergedCount,0,sizeof(int),_stream);
+    int blocks = (_numParticles+SPH_REDUCE_THREADS-1)/SPH_REDUCE_THREADS;
+    countConvergedKernal<<<blocks,SPH_REDUCE_THREADS,0,_stream>>>(_numParticles,_buff);
+    SPH_CHECK_LAUNCH(_stream,"Count converged");
+}
+//----------------------------------------------------------------------------------------------------------------------
+void packParticleExport(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, fluidBuffers _buff, bool _multiClass, float2 *_xy, unsigned char *_class, float *_radius)
+{
+    SPH_NVTX_RANGE("packParticleExport");
+    int blocks = 1;
+    int threads = _numParticles;
+    if(_numParticles>_threadsPerBlock)
+    {
+        //calculate how many blocks we want
+        blocks = ceil(_numParticles/_threadsPerBlock)+1;
+        threads = _threadsPerBlock;
+    }
 
-    return (sum==_numParticles);
+    packExportKernal<<<blocks,threads,0,_stream>>>(_numParticles,_buff,_multiClass,_xy,_class,_radius);
+    SPH_CHECK_LAUNCH(_stream,"Pack particle export");
 }
 //----------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,260 @@
+//----------------------------------------------------------------------------------------------------------------------
+/// @file StippleRasterKernals.cu
+/// @brief Kernals to draw our stipples as antialiased discs into tiles of our output image
+//----------------------------------------------------------------------------------------------------------------------
+#include "StippleRasterKernals.h"
+#include "SPHNvtx.h"
+#include <helper_math.h>  //< some math operations with cuda types
+#include <cub/device/device_radix_sort.cuh>
+#include <cub/device/device_scan.cuh>
+#include <cstdio>
+#include <cstdlib>
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Same as our solver, define SPH_DEBUG_SYNC to check every launch as it happens
+//----------------------------------------------------------------------------------------------------------------------
+#ifdef SPH_DEBUG_SYNC
+    #define STP_CHECK_LAUNCH(_stream,_name) checkRasterLaunch(_stream,_name)
+#else
+    #define STP_CHECK_LAUNCH(_stream,_name)
+#endif
+//----------------------------------------------------------------------------------------------------------------------
+void checkRasterLaunch(cudaStream_t _stream, const char *_name)
+{
+    cudaStreamSynchronize(_stream);
+    cudaError_t error = cudaGetLastError();
+    if(error != cudaSuccess)
+    {
+      // print the CUDA error message and exit
+      printf("%s error: %s\n", _name, cudaGetErrorString(error));
+      exit(-1);
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief returns the first and last tile across and down that our stipples dot touches, the same pixels our splat
+/// @brief draws. Our range is empty for dots with no radius or that are off our image.
+//----------------------------------------------------------------------------------------------------------------------
+__device__ inline int4 stippleTileRange(int _idx, const float2 *_xy, const float *_radius, float _dotScale, float _dotRadius, const RasterTile &_image)
+{
+    float2 p = _xy[_idx];
+    float cx = p.x*_image.pixelsPerUnit;
+    float cy = (_image.simHeight-p.y)*_image.pixelsPerUnit;
+    float r = ((_radius) ? _radius[_idx] : _dotRadius)*_dotScale*_image.pixelsPerUnit;
+    if(r<=0.f) return make_int4(0,0,-1,-1);
+
+    int x0 = max((int)floorf(cx-r-0.5f),0);
+    int y0 = max((int)floorf(cy-r-0.5f),0);
+    int x1 = min((int)ceilf(cx+r+0.5f),_image.size.x-1);
+    int y1 = min((int)ceilf(cy+r+0.5f),_image.size.y-1);
+    if(x0>x1 || y0>y1) return make_int4(0,0,-1,-1);
+    return make_int4(x0/STP_RASTER_TILE,y0/STP_RASTER_TILE,x1/STP_RASTER_TILE,y1/STP_RASTER_TILE);
+}
+//----------------------------------------------------------------------------------------------------------------------
+__global__ void countStippleTilesKernal(int _numStipples, const float2 *_xy, const float *_radius, float _dotScale, float _dotRadius, RasterTile _image, int2 _tiles, RasterBins _bins)
+{
+    int idx = threadIdx.x + blockIdx.x * blockDim.x;
+    if(idx>=_numStipples) return;
+
+    int4 range = stippleTileRange(idx,_xy,_radius,_dotScale,_dotRadius,_image);
+    int count = 0;
+    for(int ty=range.y;ty<=range.w;ty++)
+    {
+        for(int tx=range.x;tx<=range.z;tx++)
+        {
+            atomicAdd(&(_bins.tileOcc[ty*_tiles.x+tx]),1);
+            count++;
+        }
+    }
+    _bins.stippleTiles[idx] = count;
+}
+//----------------------------------------------------------------------------------------------------------------------
+__global__ void fillStippleTilesKernal(int _numStipples, const float2 *_xy, const float *_radius, float _dotScale, float _dotRadius, RasterTile _image, int2 _tiles, RasterBins _bins)
+{
+    int idx = threadIdx.x + blockIdx.x * blockDim.x;
+    if(idx>=_numStipples) return;
+
+    int4 range = stippleTileRange(idx,_xy,_radius,_dotScale,_dotRadius,_image);
+    int entry = _bins.entryOffset[idx];
+    for(int ty=range.y;ty<=range.w;ty++)
+    {
+        for(int tx=range.x;tx<=range.z;tx++)
+        {
+            _bins.tileKeys[entry] = ty*_tiles.x+tx;
+            _bins.stippleIdx[entry] = idx;
+            entry++;
+        }
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+__global__ void splatStipplesKernal(int _numStipples, const int *_idx, const float2 *_xy, const float *_radius, const unsigned char *_class, float _dotScale, float _dotRadius, RasterTile _tile, float *_ink)
+{
+    int i = threadIdx.x + blockIdx.x * blockDim.x;
+    if(i>=_numStipples) return;
+    int idx = (_idx) ? _idx[i] : i;
+
+    // Our stipple in the pixels of our tile, images are top row first
+    float2 p = _xy[idx];
+    float cx = p.x*_tile.pixelsPerUnit - _tile.origin.x;
+    float cy = (_tile.simHeight-p.y)*_tile.pixelsPerUnit - _tile.origin.y;
+    float r = ((_radius) ? _radius[idx] : _dotRadius)*_dotScale*_tile.pixelsPerUnit;
+    if(r<=0.f) return;
+
+    // Our stipples can hang off the edges of our tile so only draw the pixels we have
+    int x0 = max((int)floorf(cx-r-0.5f),0);
+    int y0 = max((int)floorf(cy-r-0.5f),0);
+    int x1 = min((int)ceilf(cx+r+0.5f),_tile.size.x-1);
+    int y1 = min((int)ceilf(cy+r+0.5f),_tile.size.y-1);
+    if(x0>x1 || y0>y1) return;
+
+    int channels = (_class) ? 4 : 1;
+    int channel = (_class) ? min((int)_class[idx],3) : 0;
+    for(int y=y0;y<=y1;y++)
+    {
+        float dy = (y+0.5f)-cy;
+        for(int x=x0;x<=x1;x++)
+        {
+            float dx = (x+0.5f)-cx;
+            // Our coverage falls off over one pixel across our edge
+            float cover = clamp(r-sqrtf(dx*dx+dy*dy)+0.5f,0.f,1.f);
+            if(cover>0.f) atomicAdd(&_ink[(y*_tile.size.x+x)*channels+channel],cover);
+        }
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+__global__ void resolveInkKernal(RasterTile _tile, const float *_ink, bool _color, unsigned char *_pixels)
+{
+    int idx = threadIdx.x + blockIdx.x * blockDim.x;
+    if(idx>=_tile.size.x*_tile.size.y) return;
+
+    if(!_color)
+    {
+        float k = fminf(_ink[idx],1.f);
+        _pixels[idx] = (unsigned char)(255.f*(1.f-k)+0.5f);
+        return;
+    }
+
+    // Our inks mix subtractively on white paper
+    float c = fminf(_ink[idx*4+0],1.f);
+    float m = fminf(_ink[idx*4+1],1.f);
+    float y = fminf(_ink[idx*4+2],1.f);
+    float k = fminf(_ink[idx*4+3],1.f);
+    _pixels[idx*3+0] = (unsigned char)(255.f*(1.f-c)*(1.f-k)+0.5f);
+    _pixels[idx*3+1] = (unsigned char)(255.f*(1.f-m)*(1.f-k)+0.5f);
+    _pixels[idx*3+2] = (unsigned char)(255.f*(1.f-y)*(1.f-k)+0.5f);
+}
+//----------------------------------------------------------------------------------------------------------------------
+size_t binTempStorageBytes(int _numStipples, int _numTiles, int _numEntries)
+{
+    // Passing no storage just asks cub how much it needs, our scans and sort share it
+    size_t bytes = 0;
+    size_t scanBytes = 0;
+    size_t tileScanBytes = 0;
+    int *nullPtr = 0;
+    cudaError_t error = cub::DeviceRadixSort::SortPairs(0,bytes,nullPtr,nullPtr,nullPtr,nullPtr,_numEntries);
+    if(error == cudaSuccess) error = cub::DeviceScan::ExclusiveSum(0,scanBytes,nullPtr,nullPtr,_numStipples);
+    if(error == cudaSuccess) error = cub::DeviceScan::ExclusiveSum(0,tileScanBytes,nullPtr,nullPtr,_numTiles+1);
+    if(error != cudaSuccess)
+    {
+      printf("Bin temporary storage error: %s\n", cudaGetErrorString(error));
+      exit(-1);
+    }
+    if(scanBytes>bytes) bytes = scanBytes;
+    if(tileScanBytes>bytes) bytes = tileScanBytes;
+    return bytes;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void countStippleTiles(cudaStream_t _stream, int _threadsPerBlock, int _numStipples, const float2 *_xy, const float *_radius, float _dotScale, float _dotRadius, RasterTile _image, int2 _tiles, RasterBins _bins)
+{
+    SPH_NVTX_RANGE("countStippleTiles");
+    if(!_numStipples) return;
+    int blocks = 1;
+    int threads = _numStipples;
+    if(_numStipples>_threadsPerBlock)
+    {
+        //calculate how many blocks we want
+        blocks = ceil(_numStipples/_threadsPerBlock)+1;
+        threads = _threadsPerBlock;
+    }
+
+    int numTiles = _tiles.x*_tiles.y;
+    cudaMemsetAsync(_bins.tileOcc,0,(numTiles+1)*sizeof(int),_stream);
+    countStippleTilesKernal<<<blocks,threads,0,_stream>>>(_numStipples,_xy,_radius,_dotScale,_dotRadius,_image,_tiles,_bins);
+    STP_CHECK_LAUNCH(_stream,"Count stipple tiles");
+
+    // Where each stipple writes its keys and where each tile starts, our extra empty tile gives us our total
+    cudaError_t error = cub::DeviceScan::ExclusiveSum(_bins.tempStorage,_bins.tempBytes,_bins.stippleTiles,_bins.entryOffset,_numStipples,_stream);
+    if(error == cudaSuccess) error = cub::DeviceScan::ExclusiveSum(_bins.tempStorage,_bins.tempBytes,_bins.tileOcc,_bins.tileStart,numTiles+1,_stream);
+    if(error != cudaSuccess)
+    {
+      printf("Scan stipple tiles error: %s\n", cudaGetErrorString(error));
+      exit(-1);
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+void sortStippleTiles(cudaStream_t _stream, int _threadsPerBlock, int _numStipples, int _numEntries, const float2 *_xy, const float *_radius, float _dotScale, float _dotRadius, RasterTile _image, int2 _tiles, RasterBins _bins)
+{
+    SPH_NVTX_RANGE("sortStippleTiles");
+    if(!_numStipples || !_numEntries) return;
+    int blocks = 1;
+    int threads = _numStipples;
+    if(_numStipples>_threadsPerBlock)
+    {
+        //calculate how many blocks we want
+        blocks = ceil(_numStipples/_threadsPerBlock)+1;
+        threads = _threadsPerBlock;
+    }
+
+    fillStippleTilesKernal<<<blocks,threads,0,_stream>>>(_numStipples,_xy,_radius,_dotScale,_dotRadius,_image,_tiles,_bins);
+    STP_CHECK_LAUNCH(_stream,"Fill stipple tiles");
+
+    // Our keys are at most our number of tiles so we only need to sort this many bits
+    int numTiles = _tiles.x*_tiles.y;
+    int endBit = 1;
+    while(endBit<31 && (1<<endBit)<=numTiles) endBit++;
+    cudaError_t error = cub::DeviceRadixSort::SortPairs(_bins.tempStorage,_bins.tempBytes,
+                                                        _bins.tileKeys,_bins.sortedKeys,
+                                                        _bins.stippleIdx,_bins.sortedIdx,
+                                                        _numEntries,0,endBit,_stream);
+    if(error != cudaSuccess)
+    {
+      printf("Sort stipple tiles error: %s\n", cudaGetErrorString(error));
+      exit(-1);
+    }
+    STP_CHECK_LAUNCH(_stream,"Sort stipple tiles");
+}
+//----------------------------------------------------------------------------------------------------------------------
+void splatStipples(cudaStream_t _stream, int _threadsPerBlock, int _numStipples, const int *_idx, const float2 *_xy, const float *_radius, const unsigned char *_class, float _dotScale, float _dotRadius, RasterTile _tile, float *_ink)
+{
+    SPH_NVTX_RANGE("splatStipples");
+    if(!_numStipples) return;
+    int blocks = 1;
+    int threads = _numStipples;
+    if(_numStipples>_threadsPerBlock)
+    {
+        //calculate how many blocks we want
+        blocks = ceil(_numStipples/_threadsPerBlock)+1;
+        threads = _threadsPerBlock;
+    }
+
+    splatStipplesKernal<<<blocks,threads,0,_stream>>>(_numStipples,_idx,_xy,_radius,_class,_dotScale,_dotRadius,_tile,_ink);
+    STP_CHECK_LAUNCH(_stream,"Splat stipples");
+}
+//----------------------------------------------------------------------------------------------------------------------
+void resolveInk(cudaStream_t _stream, int _threadsPerBlock, RasterTile _tile, const float *_ink, bool _color, unsigned char *_pixels)
+{
+    SPH_NVTX_RANGE("resolveInk");
+    int numPixels = _tile.size.x*_tile.size.y;
+    if(!numPixels) return;
+    int blocks = 1;
+    int threads = numPixels;
+    if(numPixels>_threadsPerBlock)
+    {
+        //calculate how many blocks we want
+        blocks = ceil(numPixels/_threadsPerBlock)+1;
+        threads = _threadsPerBlock;
+    }
+
+    resolveInkKernal<<<blocks,threads,0,_stream>>>(_tile,_ink,_color,_pixels);
+    STP_CHECK_LAUNCH(_stream,"Resolve ink");
+}
+//----------------------------------------------------------------------------------------------------------------------
@@ -21,6 +21,9 @@
 #include "Camera.h"
 #include "ShaderProgram.h"
 #include "SPHSolverCUDA.h"
+#include "SPHSolverThread.h"
+#include "StippleExport.h"
+#include "StippleRaster.h"
 
 //----------------------------------------------------------------------------------------------------------------------
 /// @file NGLScene.h
@@ -80,23 +83,54 @@ class NGLScene : public QGLWidget
     //----------------------------------------------------------------------------------------------------------------------
     SPHSolverCUDA *m_SPHSolverCUDA;
     //----------------------------------------------------------------------------------------------------------------------
+    /// @brief steps our solver on its own thread, hold its lock to use our solver from anywhere else
+    //----------------------------------------------------------------------------------------------------------------------
+    SPHSolverThread *m_solverThread;
+    //----------------------------------------------------------------------------------------------------------------------
 
 
     public slots:
     //----------------------------------------------------------------------------------------------------------------------
     /// @brief slot to toggle our automatic update
     //----------------------------------------------------------------------------------------------------------------------
-    inline void tglUpdate(){m_update = !m_update; if(m_update) {m_startTime = m_startTime.currentTime();}}
+    inline void tglUpdate(){m_update = !m_update; if(m_update) {m_startTime = m_startTime.currentTime();} m_solverThread->setStepping(m_update);}
     //----------------------------------------------------------------------------------------------------------------------
     /// @brief slot to reset our simulation back to white noise
     //----------------------------------------------------------------------------------------------------------------------
     void resetSim();
     //----------------------------------------------------------------------------------------------------------------------
-    /// @brief exports our sample positions to a file
+    /// @brief exports our sample positions to a file. Files ending in .stp are written in our binary format along
+    /// @brief with our stipple radii, and our classes if we are color stippling. Files ending in .png, .svg or .pdf
+    /// @brief are drawn by StippleRaster at our export width.
     //----------------------------------------------------------------------------------------------------------------------
     void exportSamplesToFile(QString _dir);
     //----------------------------------------------------------------------------------------------------------------------
+    /// @brief mutator to the width in pixels we draw our .png, .svg and .pdf exports at
+    //----------------------------------------------------------------------------------------------------------------------
+    inline void setExportWidth(int _width){if(_width>0) m_exportWidth = _width;}
+    //----------------------------------------------------------------------------------------------------------------------
 private:
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our export buffers, kept so exporting again doesnt have to allocate
+    //----------------------------------------------------------------------------------------------------------------------
+    StippleExport m_export;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the width in pixels we draw our .png, .svg and .pdf exports at
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_exportWidth;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief if we only draw the particles in cells our camera can see, falling back to density splats when they
+    /// @brief are too small to make out
+    //----------------------------------------------------------------------------------------------------------------------
+    bool m_cullParticles;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief if we draw the outline of our walls
+    //----------------------------------------------------------------------------------------------------------------------
+    bool m_drawBoundary;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief if we draw our solver stats overlay
+    //----------------------------------------------------------------------------------------------------------------------
+    bool m_showStats;
     //----------------------------------------------------------------------------------------------------------------------
     /// @brief start time of sim
     //----------------------------------------------------------------------------------------------------------------------
@@ -22,6 +22,7 @@
 #endif
 
 #include <vector>
+#include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
 #include <glm/matrix.hpp>
 #include "ShaderProgram.h"
@@ -87,6 +88,37 @@ public:
     //----------------------------------------------------------------------------------------------------------------------
     void drawCMYKFromVAO(GLuint _VAO, int _n, glm::mat4 _M, glm::mat4 _V, glm::mat4 _P);
     //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Draws a VAO of particles sorted by grid cell, only drawing the cells that are on screen. Each visible
+    /// @brief run of cells is one range of our buffer so the whole draw is a single glMultiDrawArrays. Once our
+    /// @brief particles are smaller than our level of detail size on screen each cell is drawn as one density splat
+    /// @brief instead, shaded by how much of the cell its particles cover.
+    /// @param _VAO - VAO to draw
+    /// @param _n - number of points in our VAO
+    /// @param _cmyk - draw with our CMYK shader
+    /// @param _cellIdx - where the particles of each cell begin in our VAO
+    /// @param _cellOcc - the number of particles in each cell
+    /// @param _gridRes - the number of cells in x and y, cells are stored x fastest
+    /// @param _cellSize - the size of one of our cells
+    /// @param _gridMin - where our first cell starts, our walls put this below our origin
+    /// @param _tableVersion - changes whenever our cell table does, our density splats are only rebuilt when it changes
+    /// @param _M - model matrix of scene
+    /// @param _V - view matrix of scene
+    /// @param _P - projection matrix of scene
+    //----------------------------------------------------------------------------------------------------------------------
+    void drawCulledFromVAO(GLuint _VAO, int _n, bool _cmyk, const int *_cellIdx, const int *_cellOcc, glm::ivec2 _gridRes, glm::vec2 _cellSize, glm::vec2 _gridMin, unsigned int _tableVersion, glm::mat4 _M, glm::mat4 _V, glm::mat4 _P);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief mutator to the size in pixels below which we draw density splats rather than our particles
+    //----------------------------------------------------------------------------------------------------------------------
+    inline void setLODPixelSize(float _size){m_lodPixelSize = _size;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to the number of points our last culled draw actually drew
+    //----------------------------------------------------------------------------------------------------------------------
+    inline int getNumDrawn(){return m_numDrawn;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to if our last culled draw used our density splats
+    //----------------------------------------------------------------------------------------------------------------------
+    inline bool isDrawingSplats(){return m_drawingSplats;}
+    //----------------------------------------------------------------------------------------------------------------------
     /// @brief accessor to our VAO
     /// @return handle to our VAO
     //----------------------------------------------------------------------------------------------------------------------
@@ -182,6 +214,58 @@ private:
     //----------------------------------------------------------------------------------------------------------------------
     GLuint m_CMYKscreenWidthHndl;
     //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our density splat shader and its uniforms
+    //----------------------------------------------------------------------------------------------------------------------
+    ShaderProgram *m_splatShader;
+    GLuint m_splatMVPHndl;
+    GLuint m_splatSizeHndl;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief one density splat per occupied cell, (x, y, coverage)
+    //----------------------------------------------------------------------------------------------------------------------
+    GLuint m_splatVAO;
+    GLuint m_splatVBO;
+    int m_numSplats;
+    unsigned int m_splatVersion;
+    float m_splatParticleSize;
+    bool m_splatsValid;
+    float m_lastSplatSize;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the size in pixels below which we draw density splats
+    //----------------------------------------------------------------------------------------------------------------------
+    float m_lodPixelSize;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our screen width, needed to work out our sizes on screen
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_screenWidth;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the ranges of our buffer our culled draw draws, kept so we dont allocate every frame
+    //----------------------------------------------------------------------------------------------------------------------
+    std::vector<GLint> m_drawFirsts;
+    std::vector<GLsizei> m_drawCounts;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief stats from our last culled draw
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_numDrawn;
+    bool m_drawingSplats;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the last matrices and colour we gave each of our shaders. Uniforms stay with their program so we only
+    /// @brief push them again when they change. [0] is our particle shader, [1] our CMYK shader, [2] our splat shader.
+    //----------------------------------------------------------------------------------------------------------------------
+    glm::mat4 m_lastMVP[3];
+    glm::mat4 m_lastMV[2];
+    glm::mat4 m_lastP[2];
+    bool m_matricesValid[3];
+    glm::vec3 m_lastColour;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief pushes our matrices to our particle or CMYK shader if they have changed. Our shader must be in use.
+    /// @param _cmyk - which of our shaders
+    //----------------------------------------------------------------------------------------------------------------------
+    void setMatrices(bool _cmyk, const glm::mat4 &_MV, const glm::mat4 &_P, const glm::mat4 &_MVP);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief rebuilds our density splats from our cell table
+    //----------------------------------------------------------------------------------------------------------------------
+    void buildSplats(const int *_cellOcc, glm::ivec2 _gridRes, glm::vec2 _cellSize, glm::vec2 _gridMin);
+    //----------------------------------------------------------------------------------------------------------------------
 
 };
 
@@ -0,0 +1,30 @@
+#ifndef SPHNVTX_H
+#define SPHNVTX_H
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @file SPHNvtx.h
+/// @brief NVTX ranges around each stage of our solver and each of our launchers so Nsight Systems shows where our
+/// @brief time goes. Define SPH_USE_NVTX to turn them on, e.g. qmake "DEFINES+=SPH_USE_NVTX". NVTX3 is header only
+/// @brief so nothing extra needs linking. Without it all of these compile away to nothing.
+//----------------------------------------------------------------------------------------------------------------------
+
+#ifdef SPH_USE_NVTX
+    #include <nvtx3/nvToolsExt.h>
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief pushes a range when created and pops it when it goes out of scope
+    //----------------------------------------------------------------------------------------------------------------------
+    struct SPHNvtxScope
+    {
+        SPHNvtxScope(const char *_name){nvtxRangePushA(_name);}
+        ~SPHNvtxScope(){nvtxRangePop();}
+    };
+    #define SPH_NVTX_RANGE(_name) SPHNvtxScope sphNvtxScope(_name)
+    #define SPH_NVTX_PUSH(_name) nvtxRangePushA(_name)
+    #define SPH_NVTX_POP() nvtxRangePop()
+#else
+    #define SPH_NVTX_RANGE(_name)
+    #define SPH_NVTX_PUSH(_name)
+    #define SPH_NVTX_POP()
+#endif
+
+#endif // SPHNVTX_H
@@ -31,10 +31,93 @@
 #include <QString>
 #include <QColor>
 #include <QImage>
+#include <QMutex>
+#include <QTime>
 
 #include "SPHSolverCUDAKernals.h"
 #include <vector>
 
+class StippleSnapshotWriter;
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Our CUDA graph mode needs cudaGraphInstantiateWithFlags and allocations in captured streams from CUDA 11.4.
+/// @brief Before that setUseCudaGraph() is ignored and we always use plain stream launches.
+//----------------------------------------------------------------------------------------------------------------------
+#if CUDART_VERSION >= 11040
+    #define SPH_CUDA_GRAPHS 1
+#else
+    #define SPH_CUDA_GRAPHS 0
+#endif
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief A copy of our cell table on the host, used to cull and level of detail our drawing. Our OpenGL particles are
+/// @brief in our sorted cell order so the particles of cell c are [cellIdx[c], cellIdx[c]+cellOcc[c]).
+//----------------------------------------------------------------------------------------------------------------------
+struct HostCellTable
+{
+    const int *cellIdx;
+    const int *cellOcc;
+    int2 gridRes;
+    float2 cellSize;
+    float2 gridMin;
+    int numParticles;
+    unsigned int version;
+};
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief The stages of our step we can time with SPHSolverCUDA::setStageTiming()
+//----------------------------------------------------------------------------------------------------------------------
+enum SolverStage
+{
+    SOLVER_STAGE_HASH,
+    SOLVER_STAGE_SORT,
+    SOLVER_STAGE_SCAN,
+    SOLVER_STAGE_DENSITY,
+    SOLVER_STAGE_REDUCE,
+    SOLVER_STAGE_FORCES,
+    SOLVER_STAGE_CONVERGE,
+    SOLVER_STAGE_OTHER,
+    SOLVER_NUM_STAGES
+};
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief A cheap snapshot of how our solver is doing, for our on screen overlay
+//----------------------------------------------------------------------------------------------------------------------
+struct SolverStats
+{
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief rolling average of the milliseconds each SolverStage takes per step, 0 unless we have live stats on
+    //----------------------------------------------------------------------------------------------------------------------
+    float stageMs[SOLVER_NUM_STAGES];
+    float stepsPerSecond;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the fraction of our particles that had converged and how many were outside our grid as of our last
+    /// @brief converged count readback
+    //----------------------------------------------------------------------------------------------------------------------
+    float convergedFraction;
+    int nullHashCount;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the number of errors our kernals have reported, always 0 unless built with SPH_DEVICE_ERRORS
+    //----------------------------------------------------------------------------------------------------------------------
+    int errorCount;
+    int stepCount;
+};
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief What our renderer needs to know about a frame our solver published, so it never has to read our solver
+/// @brief while it is being stepped on another thread
+//----------------------------------------------------------------------------------------------------------------------
+struct SolverFrame
+{
+    int numParticles;
+    bool colorStippling;
+    bool converged;
+    float convergeValue;
+    int stepCount;
+    SolverStats stats;
+};
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief How many steps of stage timings we can have in flight before we skip timing a step
+//----------------------------------------------------------------------------------------------------------------------
+#define SPH_STAGE_TIMER_SETS 4
+
 class SPHSolverCUDA
 {
 public:
@@ -42,10 +125,13 @@ public:
     /// @brief Our defualt constructor
     /// @param _x - the x boundary of our simulation
     /// @param _y - the y boundary of our simulation
-    /// @param _t - the thickness of our boundary
-    /// @param _l - the number of layers we want in our boundary
+    /// @param _t - the thickness of our boundary. Our walls push back like _l layers of ghost particles _t/_l apart.
+    /// @param _l - the number of layers we want in our boundary. No boundary if either of these are 0.
+    /// @param _headless - if true no OpenGL buffers are created and all our particle buffers are plain CUDA allocations.
+    /// @param _headless - Use this when running without a window or OpenGL context e.g. batch jobs.
+    /// @param _device - the CUDA device to run our simulation on. -1 uses the current device.
     //----------------------------------------------------------------------------------------------------------------------
-    SPHSolverCUDA(float _x = 15.f, float _y = 15.f, float _t = 0.05, float _l = 3);
+    SPHSolverCUDA(float _x = 15.f, float _y = 15.f, float _t = 0.05, float _l = 3, bool _headless = false, int _device = -1);
     //----------------------------------------------------------------------------------------------------------------------
     /// @brief destructor
     //----------------------------------------------------------------------------------------------------------------------
@@ -60,14 +146,35 @@ public:
     //----------------------------------------------------------------------------------------------------------------------
     std::vector<float3> getParticlePositions();
     //----------------------------------------------------------------------------------------------------------------------
-    /// @brief Generates a defined number of random positions for our simulation.
+    /// @brief Generates a defined number of random positions for our simulation on the GPU.
     /// @brief Note that these samples will replace the original samples in the simulation.
+    /// @brief The same seed and sequence of calls always gives the same samples.
     /// @param _n - number of samples to generate.
     //----------------------------------------------------------------------------------------------------------------------
     void genRandomSamples(float _n);
     //----------------------------------------------------------------------------------------------------------------------
-    /// @brief Retrieves our particles from the GPU and returns them in a vector in float2 form
-    /// @return array of particle positions (vector<float3>)
+    /// @brief mutator to the seed of our random samples. Defaults to the time we were created.
+    /// @param _seed - desired seed
+    //----------------------------------------------------------------------------------------------------------------------
+    inline void setSampleSeed(unsigned long long _seed){m_sampleSeed = _seed; m_sampleGeneration = 0;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to the seed of our random samples
+    //----------------------------------------------------------------------------------------------------------------------
+    inline unsigned long long getSampleSeed(){return m_sampleSeed;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief sets if our random samples are drawn in proportion to the density our image asks for rather than
+    /// @brief uniformly. Starting close to our target density means far fewer steps to converge.
+    /// @param _importance - importance sample our image
+    //----------------------------------------------------------------------------------------------------------------------
+    inline void setImportanceSampling(bool _importance){m_importanceSampling = _importance;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to if our random samples are importance sampled
+    //----------------------------------------------------------------------------------------------------------------------
+    inline bool isImportanceSampling(){return m_importanceSampling;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Retrieves our particles from the GPU and returns them in a vector in float2 form. Our buffers are
+    /// @brief kept between calls so this only waits for its own copy.
+    /// @return array of particle positions (vector<float2>)
     //----------------------------------------------------------------------------------------------------------------------
     std::vector<float2> getParticlePosF2();
     //----------------------------------------------------------------------------------------------------------------------
@@ -75,24 +182,50 @@ public:
     //----------------------------------------------------------------------------------------------------------------------
     inline int getNumParticles(){return m_simProperties.numParticles;}
     //----------------------------------------------------------------------------------------------------------------------
-    /// @brief accessor to the number of boundary particles in our simulation
+    /// @brief accessor to the number of points we draw the outline of our walls with
     //----------------------------------------------------------------------------------------------------------------------
-    inline int getNumBoundParticles(){return m_numBoundParticles;}
+    inline int getNumWallPoints(){return m_numWallPoints;}
     //----------------------------------------------------------------------------------------------------------------------
-    /// @brief Returns our OpenGL VAO handle to our particle positions
+    /// @brief Returns our OpenGL VAO handle to our particle positions. Always 0 in headless mode.
     /// @return OpenGL VAO handle to our particle positions (GLuint)
     //----------------------------------------------------------------------------------------------------------------------
     inline GLuint getActiveVAO(){return m_activeVAO;}
     //----------------------------------------------------------------------------------------------------------------------
-    /// @brief returns our OpenGL VAO handle to our boundary particle positions
-    /// @return OpenGL VAO handle to our particle positions (GLuint)
+    /// @brief returns our OpenGL VAO handle to the outline of our walls. Always 0 in headless mode.
+    /// @return OpenGL VAO handle to our wall points (GLuint)
+    //----------------------------------------------------------------------------------------------------------------------
+    inline GLuint getWallVAO(){return m_wallVAO;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Gets the latest copy of our cell table that has reached the host. Copied alongside our OpenGL buffers
+    /// @brief without ever waiting on our stream, so it can be a step or so behind what we are drawing.
+    /// @param _table - filled in with our table
+    /// @return false if we have no table yet, always in headless mode (bool)
+    //----------------------------------------------------------------------------------------------------------------------
+    bool getHostCellTable(HostCellTable &_table);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Defers touching OpenGL so we can be stepped on a thread without our OpenGL context. Our update() then
+    /// @brief copies each finished frame into one of two device buffers fenced by events, and acquireFrame() copies
+    /// @brief the latest one into our OpenGL buffer on our OpenGL thread. Our OpenGL buffer is grown there too.
+    /// @param _defer - if we defer publishing our frames
+    //----------------------------------------------------------------------------------------------------------------------
+    void setDeferredPublish(bool _defer);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to if we defer publishing our frames
     //----------------------------------------------------------------------------------------------------------------------
-    inline GLuint getBndPositionsVAO(){return m_bndPosVAO;}
+    inline bool isDeferredPublish(){return m_deferPublish;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Call on our OpenGL thread before drawing. If our solver has published a frame since our last call it
+    /// @brief is copied into our OpenGL buffer on our render stream, it never waits on our solver stream. Without
+    /// @brief deferred publishing this just describes our current state.
+    /// @param _frame - filled in with the frame in our OpenGL buffer
+    /// @return false if we have not published a frame yet (bool)
+    //----------------------------------------------------------------------------------------------------------------------
+    bool acquireFrame(SolverFrame &_frame);
     //----------------------------------------------------------------------------------------------------------------------
     /// @brief set the mass of our particles
     /// @param _m - mass of our particles (float)
     //----------------------------------------------------------------------------------------------------------------------
-    inline void setMass(float _m){m_simProperties.mass = _m; updateGPUSimProps();}
+    inline void setMass(float _m){m_simProperties.mass = _m; markSimPropsDirty();}
     //----------------------------------------------------------------------------------------------------------------------
     /// @brief accessor to the mass of our particles
     //----------------------------------------------------------------------------------------------------------------------
@@ -101,12 +234,29 @@ public:
     /// @brief mutator for the timestep of our simulation
     /// @param _t - desired timestep
     //----------------------------------------------------------------------------------------------------------------------
-    inline void setTimeStep(float _t){m_simProperties.timeStep = _t; updateGPUSimProps();}
+    inline void setTimeStep(float _t){m_simProperties.timeStep = _t; markSimPropsDirty();}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief sets if our timestep is picked on the device each step so our fastest particle moves at most _cfl of our
+    /// @brief smoothing length, rather than staying fixed at our timestep. Our timestep is used as our first step.
+    /// @param _adaptive - use our adaptive timestep
+    /// @param _minStep - smallest timestep we can take
+    /// @param _maxStep - largest timestep we can take
+    /// @param _cfl - fraction of our smoothing length our fastest particle can move each step
+    //----------------------------------------------------------------------------------------------------------------------
+    void setAdaptiveTimeStep(bool _adaptive, float _minStep = 0.0005f, float _maxStep = 0.02f, float _cfl = 0.4f);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to if we are using our adaptive timestep
+    //----------------------------------------------------------------------------------------------------------------------
+    inline bool isAdaptiveTimeStep(){return m_simProperties.adaptiveTimeStep!=0;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to the timestep of our last step. This waits on our stream when using our adaptive timestep.
+    //----------------------------------------------------------------------------------------------------------------------
+    float getCurrentTimeStep();
     //----------------------------------------------------------------------------------------------------------------------
     /// @brief mutator to k our gas/stiffness constant
     /// @param _k - desired gas/stiffness constant
     //----------------------------------------------------------------------------------------------------------------------
-    inline void setKConst(float _k){m_simProperties.k = _k; updateGPUSimProps();}
+    inline void setKConst(float _k){m_simProperties.k = _k; markSimPropsDirty();}
     //----------------------------------------------------------------------------------------------------------------------
     /// @brief accessor to k our gas/stiffness constant
     /// @return k our gas/stiffness constant (float)
@@ -118,23 +268,105 @@ public:
     //----------------------------------------------------------------------------------------------------------------------
     inline void setSmoothingLength(float _h);
     //----------------------------------------------------------------------------------------------------------------------
-    /// @brief mutator to our rest/target density
+    /// @brief mutator to our rest/target density. This is not part of our sim properties so nothing is uploaded.
     /// @param _d - desired rest/target density
     //----------------------------------------------------------------------------------------------------------------------
-    inline void setRestDensity(float _d){m_restDensity = _d; updateGPUSimProps();}
+    inline void setRestDensity(float _d){m_restDensity = _d;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief flags that our sim properties have changed so they are sent to our GPU before our next launch
+    //----------------------------------------------------------------------------------------------------------------------
+    inline void markSimPropsDirty(){m_simPropsDirty = true;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief sends our sim properties to our GPU on our stream if they have changed since our last upload
+    //----------------------------------------------------------------------------------------------------------------------
+    void updateGPUSimProps();
     //----------------------------------------------------------------------------------------------------------------------
-    /// @brief updates the sim properties on our GPU
+    /// @brief accessor to how many times our sim properties have been sent to our GPU
     //----------------------------------------------------------------------------------------------------------------------
-    inline void updateGPUSimProps(){updateSimProps(&m_simProperties);}
+    inline unsigned int getSimPropsVersion(){return m_simPropsVersion;}
     //----------------------------------------------------------------------------------------------------------------------
     /// @brief our update function to increment the step of our simulation
+    /// @param _iterations - number of simulation steps to run in this call. When using our CUDA graph each step is
+    /// @param _iterations - a single cudaGraphLaunch.
+    //----------------------------------------------------------------------------------------------------------------------
+    void update(int _iterations = 1);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief sets if we capture our solver step in a CUDA graph and replay it rather than launching each kernal.
+    /// @brief Does nothing unless SPH_CUDA_GRAPHS is set.
+    /// @param _useGraph - use our CUDA graph execution mode
+    //----------------------------------------------------------------------------------------------------------------------
+    inline void setUseCudaGraph(bool _useGraph){m_useCudaGraph = _useGraph && SPH_CUDA_GRAPHS; if(!m_useCudaGraph) destroyGraph();}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief sets how many threads each of our per particle kernals are launched with. Small simulations fill
+    /// @brief more of the GPU with smaller blocks. Clamped to what our device supports.
+    /// @param _threads - threads per block
+    //----------------------------------------------------------------------------------------------------------------------
+    void setThreadsPerBlock(int _threads);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to how many threads each of our per particle kernals are launched with
+    //----------------------------------------------------------------------------------------------------------------------
+    inline int getThreadsPerBlock(){return m_threadsPerBlock;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to if we are using our CUDA graph execution mode
+    //----------------------------------------------------------------------------------------------------------------------
+    inline bool isUsingCudaGraph(){return m_useCudaGraph;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief sets if we only re-sort the particles that changed cell each step. This is much cheaper once our
+    /// @brief particles have settled but needs to read back a count each step so it is ignored in CUDA graph mode.
+    /// @param _incremental - use our incremental sort
+    //----------------------------------------------------------------------------------------------------------------------
+    inline void setIncrementalSort(bool _incremental){m_incrementalSort = _incremental;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to if we are using our incremental sort
     //----------------------------------------------------------------------------------------------------------------------
-    void update();
+    inline bool isIncrementalSort(){return m_incrementalSort;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief mutator to the fraction of particles that can change cell before our incremental sort falls back to
+    /// @brief a full sort
+    /// @param _t - fraction of our particles (0-1)
+    //----------------------------------------------------------------------------------------------------------------------
+    inline void setIncrementalSortThreshold(float _t){m_incrementalThreshold = _t;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief sets how our density and force kernals search for neighbours
+    /// @param _mode - per particle search or our cell by cell shared memory search
+    //----------------------------------------------------------------------------------------------------------------------
+    void setNeighbourSearchMode(NeighbourSearchMode _mode);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief sets if our forces are only solved for our active set, the particles that have not converged and
+    /// @brief their neighbours. Everyone else is frozen but still counted in our densities. Late steps then only cost
+    /// @brief as much as the part of our image that is still settling. Not used by NEIGHBOUR_SEARCH_CELL_SHARED.
+    /// @param _active - use our active set
+    //----------------------------------------------------------------------------------------------------------------------
+    void setActiveSet(bool _active);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to if we are using our active set
+    //----------------------------------------------------------------------------------------------------------------------
+    inline bool isActiveSet(){return m_activeSet;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to how our density and force kernals search for neighbours
+    //----------------------------------------------------------------------------------------------------------------------
+    inline NeighbourSearchMode getNeighbourSearchMode(){return m_neighbourSearchMode;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief sets how many steps we reuse our neighbour list for before sorting and rebuilding it. We also rebuild
+    /// @brief early once a particle moves more than half our skin. Ignored in CUDA graph mode where we rebuild every step.
+    /// @param _steps - steps between rebuilds
+    //----------------------------------------------------------------------------------------------------------------------
+    inline void setNeighbourListRebuildInterval(int _steps){m_nbrRebuildInterval = (_steps>0) ? _steps : 1;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief sets our Verlet skin, the extra distance past our smoothing length our neighbour lists hold
+    /// @param _skin - skin distance
+    //----------------------------------------------------------------------------------------------------------------------
+    void setNeighbourListSkin(float _skin);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief sets the most neighbours we store for each particle in our neighbour list
+    /// @param _max - max neighbours per particle
+    //----------------------------------------------------------------------------------------------------------------------
+    void setMaxNeighbours(int _max);
     //----------------------------------------------------------------------------------------------------------------------
     /// @brief compute the average density of our simulation
     /// @return average density of simulation (float)
     //----------------------------------------------------------------------------------------------------------------------
-    inline float getAverageDensity(){return computeAverageDensity(m_simProperties.numParticles,m_fluidBuffers);}
+    inline float getAverageDensity(){return computeAverageDensity(m_cudaStream,m_simProperties.numParticles,m_fluidBuffers);}
     //----------------------------------------------------------------------------------------------------------------------
     /// @brief mutator to our density difference
     /// @param _diff - desired density difference
@@ -142,19 +374,100 @@ public:
     inline void setDensityDiff(float _diff){m_densityDiff = _diff;}
     //----------------------------------------------------------------------------------------------------------------------
     /// @brief mutator to our convergence value
-    /// @param _x - desired convergence value (int)
+    /// @param _x - desired convergence value (float)
     //----------------------------------------------------------------------------------------------------------------------
-    inline void setConvergeValue(int _x){m_simProperties.convergeValue = _x; updateGPUSimProps();}
+    inline void setConvergeValue(float _x){m_simProperties.convergeValue = _x; markSimPropsDirty();}
     //----------------------------------------------------------------------------------------------------------------------
     /// @brief accessor to our convergence value
     /// @return convergence value (float)
     //----------------------------------------------------------------------------------------------------------------------
     inline float getConvergeValue(){return m_simProperties.convergeValue;}
     //----------------------------------------------------------------------------------------------------------------------
-    /// @brief checks to see if our simulation has convered
+    /// @brief checks to see if our simulation has convered. This never blocks, our converged count is copied back
+    /// @brief every few steps (see setConvergeCheckInterval) so the result can lag our simulation slightly.
+    /// @brief When running progressively this is only true once our last stage has converged.
     /// @return is our simulation has convereged (bool)
     //----------------------------------------------------------------------------------------------------------------------
-    inline bool convergedState(){return isConverged(m_simProperties.numParticles,m_fluidBuffers);}
+    bool convergedState();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Same as convergedState but waits for our last converged count readback to land first, so the result is
+    /// @brief as of the last check our stream has queued. Only use this when exact iteration counts matter.
+    /// @return is our simulation has convereged (bool)
+    //----------------------------------------------------------------------------------------------------------------------
+    bool waitConvergedState();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief sets how many stages genRandomSamples converges in. Our first stage has 1/4^(_stages-1) of our particles,
+    /// @brief a larger smoothing length and a downsampled image. Each stage after converges, or after
+    /// @brief setProgressiveStageIterations steps, our particles are split 4 ways, our smoothing length halves and our
+    /// @brief image gets sharper until we reach our full count. 1 turns this off.
+    /// @param _stages - number of stages
+    //----------------------------------------------------------------------------------------------------------------------
+    inline void setProgressiveStages(int _stages){m_progressiveStages = (_stages>0) ? _stages : 1;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to how many stages genRandomSamples converges in
+    //----------------------------------------------------------------------------------------------------------------------
+    inline int getProgressiveStages(){return m_progressiveStages;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief mutator to the most steps we spend on a stage before moving on even if it hasnt converged
+    /// @param _steps - steps per stage
+    //----------------------------------------------------------------------------------------------------------------------
+    inline void setProgressiveStageIterations(int _steps){m_stageMaxIterations = (_steps>0) ? _steps : 1;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to the stage we are on, counting from 0
+    //----------------------------------------------------------------------------------------------------------------------
+    inline int getProgressiveStage(){return m_progressiveStage;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief mutator to how many steps we run between reading back our converged count
+    /// @param _k - number of steps between checks
+    //----------------------------------------------------------------------------------------------------------------------
+    inline void setConvergeCheckInterval(int _k){m_convergeCheckInterval = (_k>0) ? _k : 1;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Times each stage of every step with CUDA events. Our timings are read back after every step so this
+    /// @brief waits on our stream each step, and our graphs are not used while timing. Only use this to benchmark.
+    /// @param _timing - if we time our stages
+    //----------------------------------------------------------------------------------------------------------------------
+    void setStageTiming(bool _timing);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to if we are timing our stages
+    //----------------------------------------------------------------------------------------------------------------------
+    inline bool isStageTiming(){return m_stageTiming;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief sets our stage timings and timed step count back to zero
+    //----------------------------------------------------------------------------------------------------------------------
+    void resetStageTimes();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to the total time in milliseconds spent in _stage since our timings were last reset
+    /// @param _stage - a SolverStage
+    //----------------------------------------------------------------------------------------------------------------------
+    inline double getStageTime(int _stage){return m_stageTimes[_stage];}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to the number of steps we have timed since our timings were last reset
+    //----------------------------------------------------------------------------------------------------------------------
+    inline int getNumTimedSteps(){return m_numTimedSteps;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief returns the name of _stage, for reports
+    //----------------------------------------------------------------------------------------------------------------------
+    static const char *getStageName(int _stage);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Keeps a rolling average of our stage timings for our overlay. Unlike setStageTiming we never wait on
+    /// @brief our stream, timings are picked up once the device is done with them and steps are skipped if too many
+    /// @brief are in flight. Our graphs are not used while this is on.
+    /// @param _live - if we keep live stats
+    //----------------------------------------------------------------------------------------------------------------------
+    void setLiveStats(bool _live);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to if we are keeping live stats
+    //----------------------------------------------------------------------------------------------------------------------
+    inline bool isLiveStats(){return m_liveStats;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief fills _stats with how our solver is doing right now, never waits on the device
+    /// @param _stats - the stats to fill
+    //----------------------------------------------------------------------------------------------------------------------
+    void getSolverStats(SolverStats &_stats);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to the errors our kernals reported as of our last converged count readback
+    //----------------------------------------------------------------------------------------------------------------------
+    inline const SolverErrors &getDeviceErrors(){return *m_hostErrors;}
     //----------------------------------------------------------------------------------------------------------------------
     /// @brief toggles if we are using multiclass color stippling
     //----------------------------------------------------------------------------------------------------------------------
@@ -164,33 +477,216 @@ public:
     //----------------------------------------------------------------------------------------------------------------------
     inline bool isColorStippling(){return m_multiclass;}
     //----------------------------------------------------------------------------------------------------------------------
+    /// @brief mutator to how our classes interact when we are color stippling, STIPPLE_MODE_CMYK_CHANNEL or
+    /// @brief STIPPLE_MODE_MULTICLASS (the default)
+    //----------------------------------------------------------------------------------------------------------------------
+    inline void setColorStippleMode(StippleMode _mode){if(_mode!=STIPPLE_MODE_MONO) m_colorStippleMode = _mode;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to how our classes interact when we are color stippling
+    //----------------------------------------------------------------------------------------------------------------------
+    inline StippleMode getColorStippleMode(){return m_colorStippleMode;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to the mode our kernals are run in right now
+    //----------------------------------------------------------------------------------------------------------------------
+    inline StippleMode getStippleMode(){return (m_multiclass) ? m_colorStippleMode : STIPPLE_MODE_MONO;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to if we are running without any OpenGL buffers
+    //----------------------------------------------------------------------------------------------------------------------
+    inline bool isHeadless(){return m_headless;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to the CUDA device our simulation runs on
+    //----------------------------------------------------------------------------------------------------------------------
+    inline int getDevice(){return m_device;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief waits for all the steps we have queued on our stream to finish
+    //----------------------------------------------------------------------------------------------------------------------
+    inline void synchronize(){checkCudaErrors(cudaStreamSynchronize(m_cudaStream));}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to the stream all of our work is queued on
+    //----------------------------------------------------------------------------------------------------------------------
+    inline cudaStream_t getStream(){return m_cudaStream;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to the bounds of our simulation
+    //----------------------------------------------------------------------------------------------------------------------
+    inline float2 getSimBounds(){return make_float2(m_simBounds.x,m_simBounds.y);}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Queues packing our particles into seperate device columns on our stream, used by StippleExport to
+    /// @brief download our stipples without waiting on us. Any column left null is skipped.
+    /// @param _xy - device buffer of getNumParticles() positions
+    /// @param _class - device buffer of getNumParticles() classes
+    /// @param _radius - device buffer of getNumParticles() radii, half our local spacing
+    //----------------------------------------------------------------------------------------------------------------------
+    void packParticles(float2 *_xy, unsigned char *_class, float *_radius);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Saves a snapshot of our particles every _interval steps of update() through _writer. Our snapshots are
+    /// @brief queued on our stream between steps so we never wait on the disk. Pass null to stop.
+    /// @param _writer - where to send our snapshots, must outlive us or be unset first
+    /// @param _interval - steps between snapshots
+    //----------------------------------------------------------------------------------------------------------------------
+    inline void setSnapshotWriter(StippleSnapshotWriter *_writer, int _interval = 1){m_snapshotWriter = _writer; m_snapshotInterval = (_interval>0) ? _interval : 1;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to the number of steps we have run since our particles were last set
+    //----------------------------------------------------------------------------------------------------------------------
+    inline int getStepCount(){return m_stepCount;}
+    //----------------------------------------------------------------------------------------------------------------------
     /// @brief sets the sample image for our adaptive scalling
     /// @param _loc - location of sample image (QString)
     //----------------------------------------------------------------------------------------------------------------------
     void setSampleImage(QString _loc);
     //----------------------------------------------------------------------------------------------------------------------
 private:
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Our multi GPU solver runs one of us on each device and drives our buffers directly
+    //----------------------------------------------------------------------------------------------------------------------
+    friend class SPHSolverMultiGPU;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the CUDA device all of our buffers and our stream live on
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_device;
     //----------------------------------------------------------------------------------------------------------------------
     /// @brief boolean to define if we are using multiclass
     //----------------------------------------------------------------------------------------------------------------------
     bool m_multiclass;
     //----------------------------------------------------------------------------------------------------------------------
+    /// @brief how our classes interact when we are color stippling
+    //----------------------------------------------------------------------------------------------------------------------
+    StippleMode m_colorStippleMode;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief boolean to define if we are running without OpenGL. If so we have no OpenGL buffers to copy our
+    /// @brief particles into for drawing.
+    //----------------------------------------------------------------------------------------------------------------------
+    bool m_headless;
+    //----------------------------------------------------------------------------------------------------------------------
     /// @brief the boundaries of our simulation
     //----------------------------------------------------------------------------------------------------------------------
     float3 m_simBounds;
     //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the CUDA arrays behind our sample image textures
+    //----------------------------------------------------------------------------------------------------------------------
+    cudaArray_t m_pixelIArray;
+    cudaArray_t m_pixelCMYKArray;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief uploads our sample image into CUDA arrays and creates the textures our kernals sample from
+    /// @param _w - width of our image
+    /// @param _h - height of our image
+    /// @param _intensity - intensity of each pixel, bottom row first
+    /// @param _cmyk - CMYK of each pixel, bottom row first
+    //----------------------------------------------------------------------------------------------------------------------
+    void setImageTextures(int _w, int _h, std::vector<float> &_intensity, std::vector<float4> &_cmyk);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief destroys our sample image textures and frees their arrays
+    //----------------------------------------------------------------------------------------------------------------------
+    void destroyImageTextures();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief how thick our walls are and how many layers of ghost particles they stand in for
+    //----------------------------------------------------------------------------------------------------------------------
+    float m_wallThickness;
+    float m_wallLayers;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the CUDA array behind our wall table and the smoothing length it was built for
+    //----------------------------------------------------------------------------------------------------------------------
+    cudaArray_t m_wallArray;
+    float m_wallTableH;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Makes sure our wall table is the one for our current smoothing length. Tables are tabulated on the host
+    /// @brief once per smoothing length, thickness and layers and shared with every other solver in our process.
+    //----------------------------------------------------------------------------------------------------------------------
+    void updateWallTable();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief destroys our wall table texture and frees its array
+    //----------------------------------------------------------------------------------------------------------------------
+    void destroyWallTable();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief CDF of our sample image our importance sampled random samples are drawn from, bottom row first
+    //----------------------------------------------------------------------------------------------------------------------
+    double *m_sampleCDF;
+    int m_sampleCDFWidth;
+    int m_sampleCDFHeight;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the seed of our random samples
+    //----------------------------------------------------------------------------------------------------------------------
+    unsigned long long m_sampleSeed;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief how many times we have generated samples since our seed was set. Each time gets its own samples.
+    //----------------------------------------------------------------------------------------------------------------------
+    unsigned long long m_sampleGeneration;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief if our random samples are importance sampled from our image
+    //----------------------------------------------------------------------------------------------------------------------
+    bool m_importanceSampling;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the image we loaded in setSampleImage, kept so we can downsample it for our progressive stages
+    //----------------------------------------------------------------------------------------------------------------------
+    QImage m_sampleImage;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief uploads an image into our sample textures
+    /// @param _img - the image
+    //----------------------------------------------------------------------------------------------------------------------
+    void uploadSampleImage(const QImage &_img);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief how many stages genRandomSamples converges in and the stage we are on
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_progressiveStages;
+    int m_progressiveStage;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the number of particles our last stage has, 0 when we are not running progressively
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_progressiveTarget;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the smoothing length of our last stage
+    //----------------------------------------------------------------------------------------------------------------------
+    float m_progressiveFinalH;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief steps we have run on our current stage and the most we run before moving on
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_stageIterations;
+    int m_stageMaxIterations;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief returns how many particles a progressive stage has
+    /// @param _stage - the stage
+    //----------------------------------------------------------------------------------------------------------------------
+    int progressiveStageCount(int _stage);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief sets our smoothing length and sample image for a progressive stage
+    /// @param _stage - the stage
+    //----------------------------------------------------------------------------------------------------------------------
+    void applyProgressiveStage(int _stage);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief splits our particles up to the count of our next stage. Our current particles are kept as a warm start.
+    //----------------------------------------------------------------------------------------------------------------------
+    void refineProgressiveStage();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief picks up our converged count if its copy has landed
+    /// @return if our current particles have converged (bool)
+    //----------------------------------------------------------------------------------------------------------------------
+    bool pollConverged();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief gets our buffers ready for _n new particles. Our new positions should then be written into
+    /// @brief m_fluidBuffers.posPtr before calling finishSetParticles().
+    /// @param _n - the number of particles
+    //----------------------------------------------------------------------------------------------------------------------
+    void beginSetParticles(int _n);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief sorts our new particles, works out our mass and hands them to OpenGL
+    //----------------------------------------------------------------------------------------------------------------------
+    void finishSetParticles();
+    //----------------------------------------------------------------------------------------------------------------------
     /// @brief volume of our fluid
     //----------------------------------------------------------------------------------------------------------------------
     float m_volume;
     //----------------------------------------------------------------------------------------------------------------------
-    /// @brief the number of boundary particles we have
+    /// @brief the number of points in the outline of our walls we draw
     //----------------------------------------------------------------------------------------------------------------------
-    int m_numBoundParticles;
+    int m_numWallPoints;
     //----------------------------------------------------------------------------------------------------------------------
     /// @brief Our maximum threads per block.
     //----------------------------------------------------------------------------------------------------------------------
     int m_threadsPerBlock;
     //----------------------------------------------------------------------------------------------------------------------
+    /// @brief The most threads per block our device supports
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_maxThreadsPerBlock;
+    //----------------------------------------------------------------------------------------------------------------------
     /// @brief VAO handle of our positions buffer
     //----------------------------------------------------------------------------------------------------------------------
     GLuint m_activeVAO;
@@ -199,29 +695,21 @@ private:
     //----------------------------------------------------------------------------------------------------------------------
     GLuint m_posVBO;
     //----------------------------------------------------------------------------------------------------------------------
-    /// @brief VBO handle to our class buffer
-    //----------------------------------------------------------------------------------------------------------------------
-    GLuint m_classVBO;
+    /// @brief VAO handle for the outline of our walls
     //----------------------------------------------------------------------------------------------------------------------
-    /// @brief VAO handle for our boundary positions buffer
+    GLuint m_wallVAO;
     //----------------------------------------------------------------------------------------------------------------------
-    GLuint m_bndPosVAO;
+    /// @brief VBO handle to the outline of our walls
     //----------------------------------------------------------------------------------------------------------------------
-    /// @brief VBO handle to our boundary positions buffer
-    //----------------------------------------------------------------------------------------------------------------------
-    GLuint m_bndVBO;
+    GLuint m_wallVBO;
     //----------------------------------------------------------------------------------------------------------------------
     /// @brief our cuda graphics resource for our particle positions OpenGL interop.
     //----------------------------------------------------------------------------------------------------------------------
     cudaGraphicsResource_t m_resourcePos;
     //----------------------------------------------------------------------------------------------------------------------
-    /// @brief our cuda graphics resource for our boundary particles positions OpenGL interop.
-    //----------------------------------------------------------------------------------------------------------------------
-    cudaGraphicsResource_t m_resourceBndPos;
-    //----------------------------------------------------------------------------------------------------------------------
-    /// @brief our cuda graphics resource for our particle class OpenGL interop
+    /// @brief number of particles our OpenGL position buffer has room for. Like our CUDA buffers it only ever grows.
     //----------------------------------------------------------------------------------------------------------------------
-    cudaGraphicsResource_t m_resourceClass;
+    int m_glParticleCapacity;
     //----------------------------------------------------------------------------------------------------------------------
     /// @brief our fluid buffers on our device
     //----------------------------------------------------------------------------------------------------------------------
@@ -231,6 +719,23 @@ private:
     //----------------------------------------------------------------------------------------------------------------------
     SimProps m_simProperties;
     //----------------------------------------------------------------------------------------------------------------------
+    /// @brief pinned host copy of the sim properties we last sent to our GPU. Our uploads copy from here so
+    /// @brief they can run asynchronously while m_simProperties carries on changing.
+    //----------------------------------------------------------------------------------------------------------------------
+    SimProps *m_hostSimProps;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief event recorded after each upload so we never overwrite our pinned copy while it is being read
+    //----------------------------------------------------------------------------------------------------------------------
+    cudaEvent_t m_simPropsEvent;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief true when m_simProperties has changed since our last upload
+    //----------------------------------------------------------------------------------------------------------------------
+    bool m_simPropsDirty;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the number of uploads we have made
+    //----------------------------------------------------------------------------------------------------------------------
+    unsigned int m_simPropsVersion;
+    //----------------------------------------------------------------------------------------------------------------------
     /// @brief Our CUDA stream to help run kernals concurrently
     //----------------------------------------------------------------------------------------------------------------------
     cudaStream_t m_cudaStream;
@@ -243,12 +748,385 @@ private:
     //----------------------------------------------------------------------------------------------------------------------
     float m_densityDiff;
     //----------------------------------------------------------------------------------------------------------------------
+    /// @brief pinned host memory our converged count and the number of particles outside our grid are copied into,
+    /// @brief and the last of each we picked up
+    //----------------------------------------------------------------------------------------------------------------------
+    int *m_hostConvergedCount;
+    int m_lastConvergedCount;
+    int m_lastNullHashCount;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief pinned host memory our kernal errors are copied into and the count of each we have already reported
+    //----------------------------------------------------------------------------------------------------------------------
+    SolverErrors *m_hostErrors;
+    int m_reportedErrors[SPH_NUM_ERRORS];
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief prints any errors our kernals reported since we last looked
+    //----------------------------------------------------------------------------------------------------------------------
+    void reportDeviceErrors();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief event recorded after our converged count copy so we can poll it without blocking
+    //----------------------------------------------------------------------------------------------------------------------
+    cudaEvent_t m_convergeEvent;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief true while a converged count copy is in flight
+    //----------------------------------------------------------------------------------------------------------------------
+    bool m_convergeReadPending;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our last known converged state
+    //----------------------------------------------------------------------------------------------------------------------
+    bool m_converged;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief number of steps between reading back our converged count
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_convergeCheckInterval;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief if we are timing our stages
+    //----------------------------------------------------------------------------------------------------------------------
+    bool m_stageTiming;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief if we are keeping live stats
+    //----------------------------------------------------------------------------------------------------------------------
+    bool m_liveStats;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the events we record between our stages in one step and the stage each one starts, -1 for none
+    //----------------------------------------------------------------------------------------------------------------------
+    struct StageTimerSet
+    {
+        std::vector<cudaEvent_t> events;
+        std::vector<int> marks;
+        int numMarks;
+    };
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief a ring of timer sets so we can time steps still on the device. m_stageSetHead is our oldest set still
+    /// @brief pending and m_stageSet the one this step records into, -1 if we are not timing this step.
+    //----------------------------------------------------------------------------------------------------------------------
+    StageTimerSet m_stageSets[SPH_STAGE_TIMER_SETS];
+    int m_stageSetHead;
+    int m_stageSetsPending;
+    int m_stageSet;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief rolling average of our stage timings and if it has been started yet
+    //----------------------------------------------------------------------------------------------------------------------
+    float m_stageRolling[SOLVER_NUM_STAGES];
+    bool m_stageRollingValid;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the stage we have an NVTX range open for, -1 for none
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_nvtxStage;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief how we work out our steps per second
+    //----------------------------------------------------------------------------------------------------------------------
+    QTime m_statsClock;
+    int m_statsSteps;
+    float m_stepsPerSecond;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our total time in milliseconds spent in each stage and the number of steps we have timed
+    //----------------------------------------------------------------------------------------------------------------------
+    double m_stageTimes[SOLVER_NUM_STAGES];
+    int m_numTimedSteps;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief ends the stage we are in and starts _stage when we are timing, -1 just ends our current stage
+    //----------------------------------------------------------------------------------------------------------------------
+    void markStage(int _stage);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief picks a free timer set for this step if we are timing
+    //----------------------------------------------------------------------------------------------------------------------
+    void beginStageStep();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief adds the timer sets the device has finished with to our timings, when benchmarking waits on them
+    //----------------------------------------------------------------------------------------------------------------------
+    void collectStageTimes();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief steps since we last read back our converged count
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_stepsSinceConvergeCheck;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief steps we have run since our particles were last set
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_stepCount;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief where we send our snapshots and every how many steps
+    //----------------------------------------------------------------------------------------------------------------------
+    StippleSnapshotWriter *m_snapshotWriter;
+    int m_snapshotInterval;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief boolean to define if we replay our solver step from a CUDA graph
+    //----------------------------------------------------------------------------------------------------------------------
+    bool m_useCudaGraph;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our captured solver steps, one for each half of our double buffered particle data
+    //----------------------------------------------------------------------------------------------------------------------
+    cudaGraph_t m_graph[2];
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief instantiated versions of our captured solver steps that we launch
+    //----------------------------------------------------------------------------------------------------------------------
+    cudaGraphExec_t m_graphExec[2];
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the buffers our graphs were captured with. Kernal arguments are baked into the graph so if any of
+    /// @brief these change we must capture it again.
+    //----------------------------------------------------------------------------------------------------------------------
+    fluidBuffers m_graphBuffers[2];
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief number of particles our graph was captured with
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_graphNumParticles;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief hash table size our graph was captured with
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_graphTableSize;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief stipple mode our graph was captured with
+    //----------------------------------------------------------------------------------------------------------------------
+    StippleMode m_graphStippleMode;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief density difference our graph was captured with
+    //----------------------------------------------------------------------------------------------------------------------
+    float m_graphDensityDiff;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief neighbour search mode our graph was captured with
+    //----------------------------------------------------------------------------------------------------------------------
+    NeighbourSearchMode m_graphNeighbourSearchMode;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief enqueues one step of our simulation on our stream. Everything here stays on the device so
+    /// @brief it can be captured into our CUDA graph.
+    //----------------------------------------------------------------------------------------------------------------------
+    void enqueueDeviceStep();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief checks if our captured graph for our current buffers still matches our buffers and settings
+    /// @return true if our graph can be launched (bool)
+    //----------------------------------------------------------------------------------------------------------------------
+    bool graphIsValid();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief captures enqueueDeviceStep() on our stream and instantiates it
+    //----------------------------------------------------------------------------------------------------------------------
+    void buildGraph();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief destroys our graph if we have one
+    //----------------------------------------------------------------------------------------------------------------------
+    void destroyGraph();
+    //----------------------------------------------------------------------------------------------------------------------
     /// @brief function to set our hash grid position and dimensions
     /// @param _gridMin - minimum position of our grid
     /// @param _gridDim - grid dimentions
     //----------------------------------------------------------------------------------------------------------------------
     void setHashPosAndDim(float2 _gridMin, float2 _gridDim);
     //----------------------------------------------------------------------------------------------------------------------
+    /// @brief which half of our double buffered particle data is current
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_bufferParity;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief number of cells our cell buffers have been allocated for
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_cellTableCapacity;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief hashes our particles, sorts them by cell and gathers them into our swap buffers which then become
+    /// @brief our current buffers.
+    //----------------------------------------------------------------------------------------------------------------------
+    void spatialSort();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our incremental version of spatialSort. Only changes the order of particles that changed cell.
+    /// @param _tableSize - size of our hash table
+    //----------------------------------------------------------------------------------------------------------------------
+    void incrementalSort(int _tableSize);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief boolean to define if we are using our incremental sort
+    //----------------------------------------------------------------------------------------------------------------------
+    bool m_incrementalSort;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief fraction of our particles that can change cell before we fall back to a full sort
+    //----------------------------------------------------------------------------------------------------------------------
+    float m_incrementalThreshold;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief how our density and force kernals search for neighbours
+    //----------------------------------------------------------------------------------------------------------------------
+    NeighbourSearchMode m_neighbourSearchMode;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief most neighbours we store for each particle in our neighbour list
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_maxNeighbours;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief steps we reuse our neighbour list for before rebuilding it
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_nbrRebuildInterval;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief steps since we last built our neighbour list
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_stepsSinceNbrBuild;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief true if our neighbour list was built for our current particles and grid
+    //----------------------------------------------------------------------------------------------------------------------
+    bool m_nbrListValid;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief set once our device tells us a particle has moved too far for our neighbour list
+    //----------------------------------------------------------------------------------------------------------------------
+    bool m_nbrRebuildRequested;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief so we only warn about our neighbour list overflowing once
+    //----------------------------------------------------------------------------------------------------------------------
+    bool m_nbrOverflowWarned;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief pinned host memory we read back our neighbour list flags into
+    //----------------------------------------------------------------------------------------------------------------------
+    int *m_hostNbrStale;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief event recorded after our neighbour list flags copy
+    //----------------------------------------------------------------------------------------------------------------------
+    cudaEvent_t m_nbrStaleEvent;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief true if we are waiting on our neighbour list flags copy
+    //----------------------------------------------------------------------------------------------------------------------
+    bool m_nbrStaleReadPending;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief allocates our neighbour list buffers for our current particles
+    //----------------------------------------------------------------------------------------------------------------------
+    void allocNeighbourList();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief frees our neighbour list buffers
+    //----------------------------------------------------------------------------------------------------------------------
+    void freeNeighbourList();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief if we are using our active set
+    //----------------------------------------------------------------------------------------------------------------------
+    bool m_activeSet;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief allocates our active set buffers for our current particles
+    //----------------------------------------------------------------------------------------------------------------------
+    void allocActiveSet();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief frees our active set buffers
+    //----------------------------------------------------------------------------------------------------------------------
+    void freeActiveSet();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief marks all of our cells as hot so everyone is active on our next step. Used whenever our particles or
+    /// @brief our grid change under our hot cells.
+    //----------------------------------------------------------------------------------------------------------------------
+    void resetActiveSet();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief reads back our neighbour list flags without blocking and requests a rebuild if our list is stale
+    //----------------------------------------------------------------------------------------------------------------------
+    void checkNeighbourList();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief true if our sorted keys and cell occupancy are from a sort of our current particles and grid
+    //----------------------------------------------------------------------------------------------------------------------
+    bool m_sortValid;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief pinned host memory we read back our incremental sort stats into
+    //----------------------------------------------------------------------------------------------------------------------
+    int *m_hostSortStats;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief recorded once our incremental sort stats have been copied back, so we only wait on them and not on
+    /// @brief whatever we queue behind them
+    //----------------------------------------------------------------------------------------------------------------------
+    cudaEvent_t m_sortStatsEvent;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the device buffer getParticlePosF2 packs into and the pinned memory it copies back through. These only
+    /// @brief ever grow so repeated exports dont allocate, and m_posF2Event lets us wait on just our copy.
+    //----------------------------------------------------------------------------------------------------------------------
+    float2 *m_devPosF2;
+    float2 *m_hostPosF2;
+    int m_posF2Capacity;
+    cudaEvent_t m_posF2Event;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief swaps our current particle buffers with our swap buffers
+    //----------------------------------------------------------------------------------------------------------------------
+    void swapParticleBuffers();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief frees all of our per particle device buffers
+    //----------------------------------------------------------------------------------------------------------------------
+    void freeParticleBuffers();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief allocates all of our per particle device buffers
+    /// @param _capacity - number of particles to allocate for
+    //----------------------------------------------------------------------------------------------------------------------
+    void allocParticleBuffers(int _capacity);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief zeros the velocities, hash keys and converged flags of our first _n particles on our stream
+    /// @param _n - number of particles to zero
+    //----------------------------------------------------------------------------------------------------------------------
+    void resetParticleBuffers(int _n);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief grows our per particle buffers to hold at least _capacity particles, keeping our current positions
+    /// @brief and velocities. Does nothing if we already have room.
+    /// @param _capacity - number of particles we need room for
+    //----------------------------------------------------------------------------------------------------------------------
+    void reserveParticles(int _capacity);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief number of particles our per particle buffers have been allocated for
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_particleCapacity;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief copies our current packed particles into our OpenGL buffer for drawing. Does nothing in headless mode.
+    //----------------------------------------------------------------------------------------------------------------------
+    void publishGLBuffers();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief if we are being stepped on a thread without our OpenGL context
+    //----------------------------------------------------------------------------------------------------------------------
+    bool m_deferPublish;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our two published frames. Our solver copies into one while our renderer copies out of the other.
+    /// @brief m_frameStaged is recorded on our solver stream once a frame is copied in, m_frameDrawn on our render
+    /// @brief stream once it has been copied out.
+    //----------------------------------------------------------------------------------------------------------------------
+    float4 *m_frameBuffer[2];
+    int m_frameCapacity;
+    cudaEvent_t m_frameStaged[2];
+    cudaEvent_t m_frameDrawn[2];
+    SolverFrame m_frameInfo[2];
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the frame in our OpenGL buffer, and the frame waiting to be copied into it. -1 if none.
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_frameRead;
+    int m_frameWrite;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the stream our renderer copies our frames into OpenGL on
+    //----------------------------------------------------------------------------------------------------------------------
+    cudaStream_t m_renderStream;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief guards our published frames and host cell tables, the only state our renderer and solver share
+    //----------------------------------------------------------------------------------------------------------------------
+    QMutex m_frameMutex;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief copies our current particles into our next published frame
+    //----------------------------------------------------------------------------------------------------------------------
+    void stageFrame();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief grows our OpenGL buffer to hold _n particles. Must be called on our OpenGL thread.
+    //----------------------------------------------------------------------------------------------------------------------
+    void reserveGLBuffers(int _n);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our two pinned copies of our cell table, one we read while the other is being copied into. Each holds our
+    /// @brief cell indices followed by our cell occupancies.
+    //----------------------------------------------------------------------------------------------------------------------
+    int *m_hostCellTable[2];
+    int m_hostCellTableCapacity;
+    HostCellTable m_hostCellTableInfo[2];
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief which of our copies can be read, -1 if neither, and if a copy is on its way into the other
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_hostCellTableRead;
+    bool m_hostCellTablePending;
+    cudaEvent_t m_hostCellTableEvent;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief bumped every time we queue a copy of our cell table
+    //----------------------------------------------------------------------------------------------------------------------
+    unsigned int m_hostCellTableVersion;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the table size our renderer needs to grow our host cell tables to when we are deferring
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_hostCellTableWanted;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief grows our host cell tables to hold _tableSize cells
+    //----------------------------------------------------------------------------------------------------------------------
+    void reserveHostCellTable(int _tableSize);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief queues a copy of our cell table to the host if we arent already waiting on one
+    //----------------------------------------------------------------------------------------------------------------------
+    void publishCellTable();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief picks up our cell table copy once it has landed
+    //----------------------------------------------------------------------------------------------------------------------
+    void pollCellTable();
+    //----------------------------------------------------------------------------------------------------------------------
 
 };
 
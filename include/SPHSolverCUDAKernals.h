@@ -4,6 +4,86 @@
 #include <helper_math.h>
 #include <cuda_runtime.h>
 
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief number of threads per block used by our reduction kernals. Must be a power of 2.
+//----------------------------------------------------------------------------------------------------------------------
+#define SPH_REDUCE_THREADS 256
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief number of threads per block used by our cell by cell neighbour search kernals. This is also how many
+/// @brief neighbour particles we stage in shared memory at a time.
+//----------------------------------------------------------------------------------------------------------------------
+#define SPH_CELL_THREADS 64
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief flags set in fluidBuffers::nbrStale. Stale means someone has moved more than half our skin since our
+/// @brief neighbour list was built, overflow means someone had more neighbours than we had room for.
+//----------------------------------------------------------------------------------------------------------------------
+#define SPH_NEIGHBOUR_STALE 1
+#define SPH_NEIGHBOUR_OVERFLOW 2
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief The resolution of our wall table. Our columns are distances to our wall from 0 to our smoothing length,
+/// @brief our rows are particle scales from 0 to 1.
+//----------------------------------------------------------------------------------------------------------------------
+#define SPH_WALL_TABLE_DISTANCES 64
+#define SPH_WALL_TABLE_SCALES 16
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief The ways our density and force kernals can search for neighbours
+//----------------------------------------------------------------------------------------------------------------------
+enum NeighbourSearchMode
+{
+    // One thread per particle, each thread walks its own 3x3 cell neighbourhood in global memory
+    NEIGHBOUR_SEARCH_PARTICLE = 0,
+    // One block per cell, the block stages the particles of the neighbouring cells in shared memory
+    NEIGHBOUR_SEARCH_CELL_SHARED = 1,
+    // Our neighbours are found once into a CSR list which both our density and force kernals read
+    NEIGHBOUR_SEARCH_LIST = 2
+};
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief How our particles classes interact. Our density and force kernals are compiled for each of these.
+//----------------------------------------------------------------------------------------------------------------------
+enum StippleMode
+{
+    // Greyscale stippling from our image intensity, our classes are ignored
+    STIPPLE_MODE_MONO = 0,
+    // Each class stipples its own CMYK channel and only sees particles of its own class
+    STIPPLE_MODE_CMYK_CHANNEL = 1,
+    // Each class stipples its own CMYK channel but sees every class, other classes only up close
+    STIPPLE_MODE_MULTICLASS = 2
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief The problems our kernals can report. Our kernals only report them when built with SPH_DEVICE_ERRORS,
+/// @brief which our debug builds define, so our release kernals dont pay for the checks.
+//----------------------------------------------------------------------------------------------------------------------
+enum SolverErrorCode
+{
+    // A particle was outside our hash grid, info is its position relative to our grid
+    SPH_ERROR_NULL_HASH = 0,
+    // Our image was sampled outside of our domain, info is the position we sampled
+    SPH_ERROR_OUT_OF_BOUNDS = 1,
+    // Our size function came out as NaN, info is our two scales and our distance
+    SPH_ERROR_NAN_SIZE = 2,
+    // Our fastest speed or acceleration was NaN or infinite when picking our adaptive timestep, info is both of them
+    SPH_ERROR_NAN_MOTION = 3,
+    SPH_NUM_ERRORS = 4
+};
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief How many times each of our errors happened and what the first thread to hit it saw. Lives on our device
+/// @brief and is read back with our converged count.
+//----------------------------------------------------------------------------------------------------------------------
+struct SolverErrors
+{
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the number of times each SolverErrorCode was reported
+    //----------------------------------------------------------------------------------------------------------------------
+    int count[SPH_NUM_ERRORS];
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the thread that first reported each error and what it saw
+    //----------------------------------------------------------------------------------------------------------------------
+    int firstThread[SPH_NUM_ERRORS];
+    float4 firstInfo[SPH_NUM_ERRORS];
+};
+
 //----------------------------------------------------------------------------------------------------------------------
 /// @breif Structure to hold all our simulation properties for easy passing to our kernals
 //----------------------------------------------------------------------------------------------------------------------
@@ -95,46 +175,55 @@ struct SimProps
     //----------------------------------------------------------------------------------------------------------------------
     float velLimit2;
     //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Verlet skin added to our smoothing length when building our neighbour lists. Our grid cells are
+    /// @brief h + skin wide so our 3x3 cell search still finds everything.
+    //----------------------------------------------------------------------------------------------------------------------
+    float skin;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the extents of our simulation domain. Our sample image is stretched over this.
+    //----------------------------------------------------------------------------------------------------------------------
+    float2 simBounds;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief if our timestep is picked each step from our fastest particle rather than fixed at timeStep
+    //----------------------------------------------------------------------------------------------------------------------
+    int adaptiveTimeStep;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the bounds of our adaptive timestep
+    //----------------------------------------------------------------------------------------------------------------------
+    float minTimeStep;
+    float maxTimeStep;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief fraction of our smoothing length our fastest particle may move in an adaptive step
+    //----------------------------------------------------------------------------------------------------------------------
+    float cflFactor;
+    //----------------------------------------------------------------------------------------------------------------------
 };
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Structure to hold our neighbour cell locations
+/// @brief Our pool of thrust temporary storage, see createThrustAllocator
 //----------------------------------------------------------------------------------------------------------------------
-struct cellInfo
-{
-    // Number of neighbouring cells we have
-    int cNum;
-    // Idx's of neighbouring cells
-    int cIdx[9];
-};
+class CachedAllocator;
 //----------------------------------------------------------------------------------------------------------------------
 /// @brief Structure to hold our fluid buffers
 //----------------------------------------------------------------------------------------------------------------------
 struct fluidBuffers
 {
     //----------------------------------------------------------------------------------------------------------------------
-    /// @brief pointer to our position buffer on our device
+    /// @brief pointer to our particle buffer on our device. Our sim is 2D so each particle is packed into one
+    /// @brief float4 of (x position, y position, density, class) which we can read in a single 128-bit load.
     //----------------------------------------------------------------------------------------------------------------------
-    float3 *posPtr;
+    float4 *posPtr;
     //----------------------------------------------------------------------------------------------------------------------
     /// @brief pointer to our velocity buffer on our device
     //----------------------------------------------------------------------------------------------------------------------
-    float3 *velPtr;
-    //----------------------------------------------------------------------------------------------------------------------
-    /// @brief pointer to our acceleration buffer on our device
-    //----------------------------------------------------------------------------------------------------------------------
-    float3 *accPtr;
+    float2 *velPtr;
     //----------------------------------------------------------------------------------------------------------------------
-    /// @brief pointer to our density buffer on our device
+    /// @brief texture of our sample image intensity. Sampled with normalised coordinates and bilinear filtering.
     //----------------------------------------------------------------------------------------------------------------------
-    float *denPtr;
+    cudaTextureObject_t pixelI;
     //----------------------------------------------------------------------------------------------------------------------
-    /// @brief pointer to our pixel intensity buffer
+    /// @brief texture of our sample image CMYK. Sampled with normalised coordinates and bilinear filtering.
     //----------------------------------------------------------------------------------------------------------------------
-    float* pixelI;
-    //----------------------------------------------------------------------------------------------------------------------
-    /// @brief pointer to our pixel CMYK buffer
-    //----------------------------------------------------------------------------------------------------------------------
-    float4 *pixelCMYK;
+    cudaTextureObject_t pixelCMYK;
     //----------------------------------------------------------------------------------------------------------------------
     /// @brief pointer to our cell occupancy buffer on our device
     //----------------------------------------------------------------------------------------------------------------------
@@ -148,47 +237,168 @@ struct fluidBuffers
     //----------------------------------------------------------------------------------------------------------------------
     int *hashKeys;
     //----------------------------------------------------------------------------------------------------------------------
-    /// @brief pointer to our hash map buffer on our device
-    //----------------------------------------------------------------------------------------------------------------------
-    cellInfo *hashMap;
-    //----------------------------------------------------------------------------------------------------------------------
     /// @brief pointer to our buffer that holds if our particles have reached our converged condition
     //----------------------------------------------------------------------------------------------------------------------
     int *convergedPtr;
     //----------------------------------------------------------------------------------------------------------------------
-    /// @brief a buffer that holds the cell occupancy of our boundary particles
+    /// @brief Our boundary as a float2 table of what one wall of ghost particles adds to a particle, looked up by
+    /// @brief distance to the wall over our smoothing length and particle scale. x is the sum of our density weights
+    /// @brief without dWConst, y the sum of our pressure weights along our wall normal without pWConst. 0 if we have
+    /// @brief no boundary.
+    //----------------------------------------------------------------------------------------------------------------------
+    cudaTextureObject_t wallTable;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief per block partial sums of our density. Needs ceil(numParticles/SPH_REDUCE_THREADS) elements.
+    //----------------------------------------------------------------------------------------------------------------------
+    float *denPartials;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief single value holding our rest density on the device
+    //----------------------------------------------------------------------------------------------------------------------
+    float *restDenPtr;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief single value holding the number of particles that have converged on the device
+    //----------------------------------------------------------------------------------------------------------------------
+    int *convergedCount;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our particle indices to be sorted with our hash keys
+    //----------------------------------------------------------------------------------------------------------------------
+    int *particleIdx;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our hash keys once sorted
+    //----------------------------------------------------------------------------------------------------------------------
+    int *sortedHashKeys;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our particle indices once sorted. Tells our gather where each sorted particle came from.
+    //----------------------------------------------------------------------------------------------------------------------
+    int *sortedIdx;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief temporary storage for our radix sort
+    //----------------------------------------------------------------------------------------------------------------------
+    void *sortTempStorage;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief size of our radix sort temporary storage in bytes
+    //----------------------------------------------------------------------------------------------------------------------
+    size_t sortTempBytes;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our solvers own thrust temporary storage, only ever used on our solvers stream
+    //----------------------------------------------------------------------------------------------------------------------
+    CachedAllocator *thrustAlloc;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the particle buffer we gather our sorted particles into. Swapped with posPtr every step.
+    //----------------------------------------------------------------------------------------------------------------------
+    float4 *posSwap;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the velocity buffer we gather our sorted velocities into. Swapped with velPtr every step.
+    //----------------------------------------------------------------------------------------------------------------------
+    float2 *velSwap;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our hash keys packed above our particle indices, used by our incremental sort
+    //----------------------------------------------------------------------------------------------------------------------
+    unsigned long long *packedKeys;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our packed keys partitioned into particles that stayed in their cell followed by those that moved
+    //----------------------------------------------------------------------------------------------------------------------
+    unsigned long long *repairKeys;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief 1 if a particle is in the same cell as last step, 0 otherwise
+    //----------------------------------------------------------------------------------------------------------------------
+    int *stayFlags;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief stats from our incremental sort. [0] number of particles that changed cell, [1] number of particles
+    /// @brief out of order, [2] used by our partition.
+    //----------------------------------------------------------------------------------------------------------------------
+    int *sortStats;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the number of particles our last hash found outside of our grid, given our NULLHASH key
+    //----------------------------------------------------------------------------------------------------------------------
+    int *nullHashCount;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the errors our kernals have reported, see SolverErrors
+    //----------------------------------------------------------------------------------------------------------------------
+    SolverErrors *errors;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief invScale() of the image sampled at each of our particles, in our sorted particle order. Worked out
+    /// @brief once per step so our neighbour loops never have to sample our image.
+    //----------------------------------------------------------------------------------------------------------------------
+    float *scalePtr;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief number of neighbours each particle has in our neighbour list
+    //----------------------------------------------------------------------------------------------------------------------
+    int *nbrCount;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief CSR offsets of where each particles neighbours begin in nbrList
     //----------------------------------------------------------------------------------------------------------------------
-    int *bndCellOccBuff;
+    int *nbrOffsets;
     //----------------------------------------------------------------------------------------------------------------------
-    /// @brief a buffer that holds the index's of where the points in our boundary hash begin
+    /// @brief our neighbour list. Needs numParticles * max neighbours elements.
     //----------------------------------------------------------------------------------------------------------------------
-    int *bndCellIdxBuff;
+    int *nbrList;
     //----------------------------------------------------------------------------------------------------------------------
-    /// @brief our boundary particle positions
+    /// @brief where each particle was when our neighbour list was built
     //----------------------------------------------------------------------------------------------------------------------
-    float3 *bndPos;
+    float2 *nbrRefPos;
     //----------------------------------------------------------------------------------------------------------------------
-    /// @brief array to store our particles classes
+    /// @brief SPH_NEIGHBOUR_STALE and SPH_NEIGHBOUR_OVERFLOW flags for our current neighbour list
     //----------------------------------------------------------------------------------------------------------------------
-    float* classBuff;
+    int *nbrStale;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief this simulations properties on the device. Each solver has its own so several can run at once.
+    //----------------------------------------------------------------------------------------------------------------------
+    SimProps *props;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our current timestep on the device when using our adaptive timestep
+    //----------------------------------------------------------------------------------------------------------------------
+    float *dtPtr;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the largest speed and acceleration of this step as float bits, so they can be atomicMax'd
+    //----------------------------------------------------------------------------------------------------------------------
+    unsigned int *motionMax;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our active set. activeIdx holds the *activeCount particles our forces kernals update this step and is null
+    /// @brief when we update everyone. activeFlags marks them in our sorted order and cellHot marks the cells that
+    /// @brief had an unconverged particle in them at the end of our last step.
+    //----------------------------------------------------------------------------------------------------------------------
+    int *activeIdx;
+    int *activeCount;
+    int *activeFlags;
+    int *cellHot;
     //----------------------------------------------------------------------------------------------------------------------
 };
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief just a test function to see if CUDA is working.
+/// @brief Creates the allocator our thrust calls get their temporary storage from. Each solver needs its own as
+/// @brief our storage is handed back in the order of _stream, so it must only be used on _stream.
+/// @param _stream - the stream all of our thrust calls using this allocator run on
+/// @return our new allocator, delete it with destroyThrustAllocator
+//----------------------------------------------------------------------------------------------------------------------
+CachedAllocator *createThrustAllocator(cudaStream_t _stream);
 //----------------------------------------------------------------------------------------------------------------------
-void test();
+/// @brief Frees an allocator from createThrustAllocator and everything it has cached. Our stream must be finished
+/// @brief and any graphs that captured thrust calls using it destroyed first.
+/// @param _alloc - the allocator to free
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Computes the average density of our particles
+void destroyThrustAllocator(CachedAllocator *_alloc);
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Computes the average density of our particles. This has to wait for our stream to finish.
+/// @param _stream - Cuda stream to run our reduction on.
 /// @param _numParticles - number of particles in our simulation
 /// @param _buff - our simulation device buffers
 /// @return average density of our particles (float)
 //----------------------------------------------------------------------------------------------------------------------
-float computeAverageDensity(int _numParticles, fluidBuffers _buff);
+float computeAverageDensity(cudaStream_t _stream, int _numParticles, fluidBuffers _buff);
 //----------------------------------------------------------------------------------------------------------------------
 /// @brief updates our simulation properties on our GPU
-/// @param _props - pointer to our simlulation properties
+/// @param _props - pointer to our simlulation properties. This is copied asynchronously so should be pinned memory
+/// @param _props - that is not changed until the copy has finished.
+/// @param _buff - our simualtion device buffers, our properties are copied into _buff.props
+/// @param _stream - Cuda stream to copy our properties on.
+//----------------------------------------------------------------------------------------------------------------------
+void updateSimProps(SimProps *_props, fluidBuffers _buff, cudaStream_t _stream = 0);
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Checks for any errors from our asynchronous launches without synchronising. Our launchers only check
+/// @brief for errors themselves when SPH_DEBUG_SYNC is defined so call this once per step.
+/// @param _where - name to print with the error message
 //----------------------------------------------------------------------------------------------------------------------
-void updateSimProps(SimProps *_props);
+void checkSolverErrors(const char *_where);
 //----------------------------------------------------------------------------------------------------------------------
 /// @brief fills a buffer of ints with zeros
 /// @brief _stream - Cuda stream to run our kernal on.
@@ -198,60 +408,229 @@ void updateSimProps(SimProps *_props);
 //----------------------------------------------------------------------------------------------------------------------
 void fillIntZero(cudaStream_t _stream, int _threadsPerBlock, int *_bufferPtr, int size);
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Creates our hash table map so we know all cells neighbours
+/// @brief First stage of our spatial sort. Computes the hash key of our particles, counts our cell occupancy and
+/// @brief resets our particle indices ready to be sorted. Particles outside our grid get the key _hashTableSize.
 /// @param _stream - Cuda stream to run our kernal on.
 /// @param _threadsPerBlock - number of threads we have availible per block.
+/// @param _numParticles - numbder of particles in our sim
+/// @param _buff - our simualtion device buffers
+//----------------------------------------------------------------------------------------------------------------------
+void hashParticles(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, fluidBuffers _buff);
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Returns how much temporary storage our radix sort needs for a number of particles
+/// @param _numParticles - numbder of particles in our sim
+/// @return size of temporary storage in bytes (size_t)
+//----------------------------------------------------------------------------------------------------------------------
+size_t sortTempStorageBytes(int _numParticles);
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Second stage of our spatial sort. Radix sorts our (hash key, particle index) pairs into sortedHashKeys
+/// @brief and sortedIdx. Only the bits needed to represent our hash table size are sorted.
+/// @param _stream - Cuda stream to run our sort on.
+/// @param _numParticles - numbder of particles in our sim
 /// @param _hashTableSize - size of our hash table
 /// @param _buff - our simualtion device buffers
 //----------------------------------------------------------------------------------------------------------------------
-void createHashMap(cudaStream_t _stream, int _threadsPerBlock, int _hashTableSize, fluidBuffers _buff);
+void sortParticleKeys(cudaStream_t _stream, int _numParticles, int _hashTableSize, fluidBuffers _buff);
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Our hash and sort function for particles that only need to be hashed once. E.g. Boundary paricles.
+/// @brief First stage of our incremental spatial sort, replaces hashParticles. Our particles must still be in the
+/// @brief order of our last sort with our cell occupancy from that sort. Computes our new hash keys, moves our
+/// @brief cell occupancy for any particle that changed cell and counts into _buff.sortStats how many particles
+/// @brief changed cell and how many are now out of order.
 /// @param _stream - Cuda stream to run our kernal on.
 /// @param _threadsPerBlock - number of threads we have availible per block.
 /// @param _numParticles - numbder of particles in our sim
+/// @param _buff - our simualtion device buffers
+//----------------------------------------------------------------------------------------------------------------------
+void rehashParticles(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, fluidBuffers _buff);
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Second stage of our incremental spatial sort. Partitions the keys of the particles that stayed in their
+/// @brief cell, still in sorted order, to the front of _buff.repairKeys and our movers to the back. This only needs
+/// @brief our device side counts so it can be queued before our host knows how much has moved.
+/// @param _stream - Cuda stream to run on.
+/// @param _numParticles - numbder of particles in our sim
+/// @param _buff - our simualtion device buffers
+//----------------------------------------------------------------------------------------------------------------------
+void partitionStayingKeys(cudaStream_t _stream, int _numParticles, fluidBuffers _buff);
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Fixes our sort order after partitionStayingKeys when only a few particles changed cell. The particles
+/// @brief that stayed are still sorted so only the movers are sorted and then merged back in. Writes sortedHashKeys
+/// @brief and sortedIdx, ready for gatherParticles.
+/// @param _stream - Cuda stream to run on.
+/// @param _numParticles - numbder of particles in our sim
+/// @param _numMoved - number of particles that changed cell
 /// @param _hashTableSize - size of our hash table
-/// @param _posPtr - pointer to our position buffer
-/// @param _occPtr - pointer to our occupancy buffer
-/// @param _idxPtr - pointer to our index buffer
+/// @param _buff - our simualtion device buffers
 //----------------------------------------------------------------------------------------------------------------------
-void hashAndSortBnd(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, int _hashTableSize, float3 *posPtr, int *_occPtr, int *_idxPtr);
+void repairSortedKeys(cudaStream_t _stream, int _numParticles, int _numMoved, int _hashTableSize, fluidBuffers _buff);
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Our hash and sort function
+/// @brief Third stage of our spatial sort. Gathers our particles and velocities into sorted order in our
+/// @brief swap buffers. Swap our buffers afterwards to use the sorted data.
 /// @param _stream - Cuda stream to run our kernal on.
 /// @param _threadsPerBlock - number of threads we have availible per block.
 /// @param _numParticles - numbder of particles in our sim
+/// @param _buff - our simualtion device buffers
+//----------------------------------------------------------------------------------------------------------------------
+void gatherParticles(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, fluidBuffers _buff);
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Last stage of our spatial sort. Scans our cell occupancy to find where each cell begins.
+/// @param _stream - Cuda stream to run our scan on.
 /// @param _hashTableSize - size of our hash table
 /// @param _buff - our simualtion device buffers
 //----------------------------------------------------------------------------------------------------------------------
-void hashAndSort(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, int _hashTableSize, fluidBuffers _buff);
+void computeCellIndices(cudaStream_t _stream, int _hashTableSize, fluidBuffers _buff);
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Samples our image at each particle and stores its density scale in _buff.scalePtr. Must be called after
+/// @brief our particles are sorted and before our density and force kernals.
+/// @param _stream - Cuda stream to run our kernal on.
+/// @param _threadsPerBlock - number of threads we have availible per block.
+/// @param _numParticles - number of particles in our sim
+/// @param _buff - our simualtion device buffers
+/// @param _multiClass - boolean representing if we are using multiclass, if so we sample our CMYK image
+//----------------------------------------------------------------------------------------------------------------------
+void computeParticleScales(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, fluidBuffers _buff, bool _multiClass);
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Builds the CDF our importance sampled random samples are drawn from. Each pixel is weighted by the density
+/// @brief our particles settle at for its intensity.
+/// @param _stream - Cuda stream to run our kernal on.
+/// @param _threadsPerBlock - number of threads we have availible per block.
+/// @param _numPixels - number of pixels in our image
+/// @param _intensity - device buffer of the intensity of each pixel, bottom row first
+/// @param _cdf - device buffer of _numPixels doubles to write our CDF into
+/// @param _thrustAlloc - allocator for our scans temporary storage, from createThrustAllocator on _stream
+//----------------------------------------------------------------------------------------------------------------------
+void buildSampleCDF(cudaStream_t _stream, int _threadsPerBlock, int _numPixels, const float *_intensity, double *_cdf, CachedAllocator *_thrustAlloc);
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Generates random particle positions on the device with a Philox generator. The same seed always gives
+/// @brief the same samples.
+/// @param _stream - Cuda stream to run our kernal on.
+/// @param _threadsPerBlock - number of threads we have availible per block.
+/// @param _numParticles - number of samples to generate
+/// @param _posPtr - our particle buffer to write our samples into
+/// @param _bounds - the bounds of our simulation
+/// @param _seed - the seed of our generator
+/// @param _cdf - CDF from buildSampleCDF to importance sample our image with. If null our samples are uniform.
+/// @param _cdfWidth - width of the image our CDF was built from
+/// @param _cdfHeight - height of the image our CDF was built from
+//----------------------------------------------------------------------------------------------------------------------
+void generateRandomSamples(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, float4 *_posPtr, float2 _bounds, unsigned long long _seed, const double *_cdf, int _cdfWidth, int _cdfHeight);
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Adds new particles around our current ones. New particle i is dropped at a random point near particle
+/// @brief (i-_numOld)%_numOld so every particle gets roughly the same number of children.
+/// @param _stream - Cuda stream to run our kernal on.
+/// @param _threadsPerBlock - number of threads we have availible per block.
+/// @param _numOld - number of particles we have now
+/// @param _numNew - number of particles we want. _posPtr must have room for this many.
+/// @param _posPtr - our particle buffer
+/// @param _bounds - the bounds of our simulation
+/// @param _radius - the furthest our new particles are placed from their parents
+/// @param _seed - the seed of our generator
+//----------------------------------------------------------------------------------------------------------------------
+void splitParticles(cudaStream_t _stream, int _threadsPerBlock, int _numOld, int _numNew, float4 *_posPtr, float2 _bounds, float _radius, unsigned long long _seed);
 //----------------------------------------------------------------------------------------------------------------------
 /// @brief Our fluid solver function. Solves for our particles new positions through our navier stokes technique.
 /// @param _stream - Cuda stream to run our kernal on.
 /// @param _threadsPerBlock - number of threads we have availible per block.
 /// @param _numParticles - number of particles in our sim
+/// @param _hashTableSize - size of our hash table
 /// @param _buff - our simualtion device buffers
-/// @param _multiClass - boolean representing if we are using multiclass
+/// @param _stippleMode - how our particles classes interact
+/// @param _mode - how our kernal should search for neighbours
 //----------------------------------------------------------------------------------------------------------------------
-void initDensity(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, fluidBuffers _buff, bool _multiClass);
+void initDensity(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, int _hashTableSize, fluidBuffers _buff, StippleMode _stippleMode, NeighbourSearchMode _mode);
 //----------------------------------------------------------------------------------------------------------------------
 /// @brief Our fluid solver function. Solves for our particles new positions through our navier stokes technique.
+/// @brief Our rest density is read from _buff.restDenPtr on the device.
 /// @param _stream - Cuda stream to run our kernal on.
 /// @param _threadsPerBlock - number of threads we have availible per block.
 /// @param _numParticles - numbder of particles in our sim
-/// @param _restDensity - the rest density of our particles
+/// @param _hashTableSize - size of our hash table
+/// @param _buff - our simualtion device buffers
+/// @param _stippleMode - how our particles classes interact
+/// @param _mode - how our kernal should search for neighbours
+//----------------------------------------------------------------------------------------------------------------------
+void solve(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, int _hashTableSize, fluidBuffers _buff, StippleMode _stippleMode, NeighbourSearchMode _mode);
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Builds our CSR neighbour list of everything within h + skin of each particle. Our particles must be
+/// @brief sorted with our cell indices up to date. Clears our stale flags.
+/// @param _stream - Cuda stream to run our kernals on.
+/// @param _threadsPerBlock - number of threads we have availible per block.
+/// @param _numParticles - number of particles in our sim
+/// @param _maxNeighbours - most neighbours we can store for each particle
+/// @param _buff - our simualtion device buffers
+//----------------------------------------------------------------------------------------------------------------------
+void buildNeighbourList(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, int _maxNeighbours, fluidBuffers _buff);
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Computes our rest density (average density - density difference) entirely on the device and stores it
+/// @brief in _buff.restDenPtr. Nothing is copied back to the host.
+/// @param _stream - Cuda stream to run our kernals on.
+/// @param _numParticles - number of particles in our sim
+/// @param _densityDiff - the density difference of our simulation
+/// @param _buff - our simualtion device buffers
+//----------------------------------------------------------------------------------------------------------------------
+void computeRestDensity(cudaStream_t _stream, int _numParticles, float _densityDiff, fluidBuffers _buff);
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Combines the mean densities of several parts of our simulation into one rest density on the device
+/// @brief and stores it in _buff.restDenPtr. Used by our multi GPU solver so no device has to wait on our host.
+/// @param _stream - Cuda stream to run our kernal on.
+/// @param _numParts - the number of parts
+/// @param _means - the mean density of each part, device accessible (e.g. mapped pinned memory)
+/// @param _counts - how many particles each part has, device accessible
+/// @param _densityDiff - the density difference of our simulation
+/// @param _buff - our simualtion device buffers
+//----------------------------------------------------------------------------------------------------------------------
+void combineRestDensity(cudaStream_t _stream, int _numParts, const float *_means, const int *_counts, float _densityDiff, fluidBuffers _buff);
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Counts how many of our particles have converged into _buff.convergedCount on the device.
+/// @param _stream - Cuda stream to run our kernals on.
+/// @param _numParticles - number of particles in our sim
+/// @param _buff - our simualtion device buffers
+//----------------------------------------------------------------------------------------------------------------------
+void countConverged(cudaStream_t _stream, int _numParticles, fluidBuffers _buff);
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Picks our next adaptive timestep on the device from the largest speed and acceleration our forces kernal
+/// @brief found this step, then clears them for our next step. Only does anything when props.adaptiveTimeStep is set.
+/// @param _stream - Cuda stream to run our kernal on.
+/// @param _buff - our simualtion device buffers
+//----------------------------------------------------------------------------------------------------------------------
+void updateTimeStep(cudaStream_t _stream, fluidBuffers _buff);
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Sets our adaptive timestep on the device and clears our largest speed and acceleration
+/// @param _stream - Cuda stream to copy on.
+/// @param _buff - our simualtion device buffers
+/// @param _dt - our timestep
+//----------------------------------------------------------------------------------------------------------------------
+void resetTimeStep(cudaStream_t _stream, fluidBuffers _buff, float _dt);
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Builds our active set from _buff.cellHot. Any particle with a hot cell in its neighbourhood is active,
+/// @brief everyone else keeps their position, has their velocity zeroed and counts as converged. Our particles must
+/// @brief be sorted first. Our hot cells are cleared ready for markActiveCells.
+/// @param _stream - Cuda stream to run our kernals on.
+/// @param _threadsPerBlock - number of threads we have availible per block.
+/// @param _numParticles - number of particles in our sim
+/// @param _hashTableSize - size of our hash table
 /// @param _buff - our simualtion device buffers
-/// @param _multiClass - boolean representing if we are using multiclass
 //----------------------------------------------------------------------------------------------------------------------
-void solve(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, float _restDensity, fluidBuffers _buff, bool _multiClass);
+void buildActiveSet(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, int _hashTableSize, fluidBuffers _buff);
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Function to check to see if our simulation has converged
+/// @brief Marks the cell of every particle that has not converged in _buff.cellHot. Call after our forces kernal.
 /// @param _stream - Cuda stream to run our kernal on.
 /// @param _threadsPerBlock - number of threads we have availible per block.
-/// @param _restDensity - the rest density of our particles
+/// @param _numParticles - number of particles in our sim
+/// @param _buff - our simualtion device buffers
+//----------------------------------------------------------------------------------------------------------------------
+void markActiveCells(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, fluidBuffers _buff);
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Packs our particles into seperate columns ready to be downloaded for export. Any column left null is skipped.
+/// @param _stream - Cuda stream to run our kernal on.
+/// @param _threadsPerBlock - number of threads we have availible per block.
+/// @param _numParticles - number of particles in our sim
 /// @param _buff - our simualtion device buffers
+/// @param _multiClass - if we are color stippling, changes how our radius samples our image
+/// @param _xy - where to write our positions
+/// @param _class - where to write our particle classes
+/// @param _radius - where to write half our local particle spacing, props.h*0.5*invScale() of our image
 //----------------------------------------------------------------------------------------------------------------------
-bool isConverged(int _numParticles, fluidBuffers _buff);
+void packParticleExport(cudaStream_t _stream, int _threadsPerBlock, int _numParticles, fluidBuffers _buff, bool _multiClass, float2 *_xy, unsigned char *_class, float *_radius);
 //----------------------------------------------------------------------------------------------------------------------
 
 
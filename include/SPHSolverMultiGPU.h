@@ -0,0 +1,263 @@
+#ifndef SPHSOLVERMULTIGPU_H
+#define SPHSOLVERMULTIGPU_H
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @file SPHSolverMultiGPU.h
+/// @brief Splits our simulation across all of our CUDA devices for very large stipple counts.
+/// @brief Our hash grid is cut into strips of rows and each device owns the particles in its strip. Every step each
+/// @brief device also gets a halo of the particles in the SPH_HALO_ROWS rows either side of its strip from every
+/// @brief device. Our forces need our neighbours densities so our halos are two cells wide, that way the
+/// @brief densities of every halo particle our owned particles touch are correct and we only swap once per step.
+/// @brief Rest density and convergence are reduced over the owned particles of all of our devices.
+/// @brief This is headless only, there are no OpenGL buffers.
+/// @class SPHSolverMultiGPU
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "SPHSolverCUDA.h"
+#include <vector>
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief the number of cell rows each side of a strip that its device needs from its neighbours
+//----------------------------------------------------------------------------------------------------------------------
+#define SPH_HALO_ROWS 2
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief the number of row starts we read back from each device for each strip edge when swapping halos,
+/// @brief the halo row below the edge, the edge and the halo row above it
+//----------------------------------------------------------------------------------------------------------------------
+#define SPH_EDGE_STARTS 3
+
+class SPHSolverMultiGPU
+{
+public:
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Our defualt constructor
+    /// @param _x - the x boundary of our simulation
+    /// @param _y - the y boundary of our simulation
+    /// @param _t - the thickness of our boundary
+    /// @param _l - the number of layers we want in our boundary
+    /// @param _numDevices - the most devices to split our simulation across. -1 uses all our devices.
+    //----------------------------------------------------------------------------------------------------------------------
+    SPHSolverMultiGPU(float _x = 15.f, float _y = 15.f, float _t = 0.05, float _l = 3, int _numDevices = -1);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief destructor
+    //----------------------------------------------------------------------------------------------------------------------
+    ~SPHSolverMultiGPU();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Sets the particles init positions in our simulation and splits them between our devices. Our strips
+    /// @brief are picked so each device gets roughly the same number of particles.
+    //----------------------------------------------------------------------------------------------------------------------
+    void setParticles(std::vector<float3> &_particles);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Generates a defined number of random positions for our simulation. They are drawn on our first device
+    /// @brief the same way SPHSolverCUDA::genRandomSamples does, so the same seed gives the same samples.
+    /// @param _n - number of samples to generate.
+    //----------------------------------------------------------------------------------------------------------------------
+    void genRandomSamples(float _n);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief mutator to the seed of our random samples
+    /// @param _seed - desired seed
+    //----------------------------------------------------------------------------------------------------------------------
+    void setSampleSeed(unsigned long long _seed);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to the seed of our random samples
+    //----------------------------------------------------------------------------------------------------------------------
+    inline unsigned long long getSampleSeed(){return m_domains[0]->getSampleSeed();}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief sets if our random samples are drawn in proportion to the density our image asks for
+    /// @param _importance - use importance sampling
+    //----------------------------------------------------------------------------------------------------------------------
+    void setImportanceSampling(bool _importance);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Retrieves the particles owned by each of our devices and returns them in a vector
+    /// @return array of particle positions (vector<float3>)
+    //----------------------------------------------------------------------------------------------------------------------
+    std::vector<float3> getParticlePositions();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to the number of particles in our simulation
+    //----------------------------------------------------------------------------------------------------------------------
+    inline int getNumParticles(){return m_numParticles;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to the number of devices our simulation is split across
+    //----------------------------------------------------------------------------------------------------------------------
+    inline int getNumDevices(){return (int)m_domains.size();}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to the bounds of our simulation, all of our domains share them
+    //----------------------------------------------------------------------------------------------------------------------
+    inline float2 getSimBounds(){return m_domains[0]->getSimBounds();}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our update function to increment the step of our simulation
+    /// @param _iterations - number of simulation steps to run in this call
+    //----------------------------------------------------------------------------------------------------------------------
+    void update(int _iterations = 1);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief checks to see if our simulation has converged. Our converged count is gathered every step.
+    /// @return is our simulation has convereged (bool)
+    //----------------------------------------------------------------------------------------------------------------------
+    inline bool convergedState(){return m_converged;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief mutator to our convergence value
+    /// @param _x - desired convergence value (float)
+    //----------------------------------------------------------------------------------------------------------------------
+    void setConvergeValue(float _x);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief set the mass of our particles
+    /// @param _m - mass of our particles (float)
+    //----------------------------------------------------------------------------------------------------------------------
+    void setMass(float _m);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief mutator for the timestep of our simulation
+    /// @param _t - desired timestep
+    //----------------------------------------------------------------------------------------------------------------------
+    void setTimeStep(float _t);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief mutator to k our gas/stiffness constant
+    /// @param _k - desired gas/stiffness constant
+    //----------------------------------------------------------------------------------------------------------------------
+    void setKConst(float _k);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief mutator to our density difference
+    /// @param _diff - desired density difference
+    //----------------------------------------------------------------------------------------------------------------------
+    inline void setDensityDiff(float _diff){m_densityDiff = _diff;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief toggles if we are using multiclass color stippling
+    //----------------------------------------------------------------------------------------------------------------------
+    inline void toggleColorStippling(){m_multiclass = !m_multiclass;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to the mode of stippling we are using
+    //----------------------------------------------------------------------------------------------------------------------
+    inline bool isColorStippling(){return m_multiclass;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to the mode our kernals are run in, our classes always see each other when color stippling
+    //----------------------------------------------------------------------------------------------------------------------
+    inline StippleMode getStippleMode(){return (m_multiclass) ? STIPPLE_MODE_MULTICLASS : STIPPLE_MODE_MONO;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief sets how our density and force kernals search for neighbours. Our neighbour lists are not
+    /// @brief supported across devices so NEIGHBOUR_SEARCH_LIST is ignored.
+    /// @param _mode - neighbour search mode
+    //----------------------------------------------------------------------------------------------------------------------
+    void setNeighbourSearchMode(NeighbourSearchMode _mode);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief sets the sample image for our adaptive scalling on all of our devices
+    /// @param _loc - location of sample image (QString)
+    //----------------------------------------------------------------------------------------------------------------------
+    void setSampleImage(QString _loc);
+private:
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief one headless solver on each of our devices. We drive their buffers directly.
+    //----------------------------------------------------------------------------------------------------------------------
+    std::vector<SPHSolverCUDA*> m_domains;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the first cell row of each of our strips, with our grid height on the end
+    //----------------------------------------------------------------------------------------------------------------------
+    std::vector<int> m_stripRows;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief where each devices owned particles start and end in its current buffers
+    //----------------------------------------------------------------------------------------------------------------------
+    std::vector<int> m_ownedBegin;
+    std::vector<int> m_ownedEnd;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief pinned host memory for the row starts we read back from each device, rowStartStride() each
+    //----------------------------------------------------------------------------------------------------------------------
+    int *m_hostRowStarts;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief mapped pinned memory for the mean density of each devices owned particles
+    //----------------------------------------------------------------------------------------------------------------------
+    float *m_hostMeanDensity;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief mapped pinned memory for how many particles each device owns, our means are weighted by these
+    //----------------------------------------------------------------------------------------------------------------------
+    int *m_hostOwnedCount;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief recorded on each device once its mean density has been copied out
+    //----------------------------------------------------------------------------------------------------------------------
+    std::vector<cudaEvent_t> m_meanEvents;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief recorded on each device once it has copied in all of its new particles from everyone else
+    //----------------------------------------------------------------------------------------------------------------------
+    std::vector<cudaEvent_t> m_copyEvents;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief pinned host memory for the converged count of each devices owned particles
+    //----------------------------------------------------------------------------------------------------------------------
+    int *m_hostConvergedCount;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief total number of particles across all our devices
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_numParticles;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief volume of our fluid. Our mass is worked out from this for our total particle count.
+    //----------------------------------------------------------------------------------------------------------------------
+    float m_volume;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the mass of our particles, the same on all our devices
+    //----------------------------------------------------------------------------------------------------------------------
+    float m_mass;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the density difference of our simulation
+    //----------------------------------------------------------------------------------------------------------------------
+    float m_densityDiff;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief boolean to define if we are using multiclass
+    //----------------------------------------------------------------------------------------------------------------------
+    bool m_multiclass;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our last known converged state
+    //----------------------------------------------------------------------------------------------------------------------
+    bool m_converged;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief how our density and force kernals search for neighbours
+    //----------------------------------------------------------------------------------------------------------------------
+    NeighbourSearchMode m_neighbourSearchMode;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief picks our strip rows so each device owns roughly the same number of particles
+    /// @param _rows - the cell row of each of our particles
+    //----------------------------------------------------------------------------------------------------------------------
+    void balanceStrips(std::vector<int> &_rows);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief runs the density and force passes of one step on all of our devices. Our rest density and converged
+    /// @brief count are reduced over our owned particles in between.
+    //----------------------------------------------------------------------------------------------------------------------
+    void solveDomains();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief sorts each devices owned particles by cell and rebuilds every device's particles from the owned
+    /// @brief particles of every device. Particles go to the strip their row is in however far they moved, so
+    /// @brief none are ever lost. Afterwards each device's owned particles come first.
+    //----------------------------------------------------------------------------------------------------------------------
+    void exchangeHalos();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief queues copies of the start of the given cell rows in a devices sorted particles into pinned memory
+    /// @param _d - the device to read from
+    /// @param _rows - the cell rows we want the starts of
+    /// @param _numRows - the number of rows
+    /// @param _numSorted - the number of sorted particles. Rows past our grid start here.
+    /// @param _out - pinned memory to copy our starts into
+    //----------------------------------------------------------------------------------------------------------------------
+    void queueRowStarts(int _d, const int *_rows, int _numRows, int _numSorted, int *_out);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the number of row starts each device has in m_hostRowStarts, SPH_EDGE_STARTS for every strip edge
+    //----------------------------------------------------------------------------------------------------------------------
+    inline int rowStartStride(){return SPH_EDGE_STARTS*(int)m_stripRows.size();}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief copies a range of one devices sorted owned particles into another devices swap buffers
+    /// @param _dst - device we are copying to
+    /// @param _src - device we are copying from
+    /// @param _begin - first particle to copy, relative to our sources owned particles
+    /// @param _end - one past the last particle to copy
+    /// @param _offset - where to copy to in our destination, moved on past our copy
+    //----------------------------------------------------------------------------------------------------------------------
+    void copyParticles(int _dst, int _src, int _begin, int _end, int &_offset);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief returns a devices buffers with our per particle pointers moved on so our kernals only see
+    /// @brief the particles from _offset onwards
+    /// @param _d - the device
+    /// @param _offset - the first particle
+    //----------------------------------------------------------------------------------------------------------------------
+    fluidBuffers offsetBuffers(int _d, int _offset);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief waits for all the work on all of our devices
+    //----------------------------------------------------------------------------------------------------------------------
+    void synchronize();
+    //----------------------------------------------------------------------------------------------------------------------
+};
+
+#endif // SPHSOLVERMULTIGPU_H
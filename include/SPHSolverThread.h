@@ -0,0 +1,90 @@
+#ifndef SPHSOLVERTHREAD_H
+#define SPHSOLVERTHREAD_H
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @file SPHSolverThread.h
+/// @brief Steps our solver on its own thread as fast as it can, so our solver is never held back by our window
+/// @brief redrawing. Our solver publishes each finished batch of steps with deferred publishing and our renderer
+/// @brief picks up the newest with SPHSolverCUDA::acquireFrame(). Anything else that touches our solver has to hold
+/// @brief our lock with lockSolver() and unlockSolver(), which pauses our stepping until it is done.
+/// @class SPHSolverThread
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+
+class SPHSolverCUDA;
+
+class SPHSolverThread : public QThread
+{
+public:
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Our defualt constructor, turns on deferred publishing in our solver and starts our thread paused
+    /// @param _solver - the solver to step. It must outlive us.
+    /// @param _stepsPerBatch - the number of steps we run each time we take our lock
+    //----------------------------------------------------------------------------------------------------------------------
+    SPHSolverThread(SPHSolverCUDA *_solver, int _stepsPerBatch = 1);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief destructor, finishes our current batch then stops our thread
+    //----------------------------------------------------------------------------------------------------------------------
+    ~SPHSolverThread();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief starts or pauses our stepping
+    //----------------------------------------------------------------------------------------------------------------------
+    void setStepping(bool _stepping);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to if we are stepping
+    //----------------------------------------------------------------------------------------------------------------------
+    bool isStepping();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief mutator to the number of steps we run each time we take our lock. Bigger batches publish fewer frames.
+    //----------------------------------------------------------------------------------------------------------------------
+    void setStepsPerBatch(int _steps);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Waits for our current batch to finish then holds our solver so it can be used from another thread.
+    /// @brief Our stepping waits until unlockSolver().
+    //----------------------------------------------------------------------------------------------------------------------
+    void lockSolver();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief lets our stepping carry on
+    //----------------------------------------------------------------------------------------------------------------------
+    void unlockSolver();
+    //----------------------------------------------------------------------------------------------------------------------
+protected:
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our stepping thread
+    //----------------------------------------------------------------------------------------------------------------------
+    void run();
+    //----------------------------------------------------------------------------------------------------------------------
+private:
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the solver we step
+    //----------------------------------------------------------------------------------------------------------------------
+    SPHSolverCUDA *m_solver;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief held while our solver is being stepped or used from another thread
+    //----------------------------------------------------------------------------------------------------------------------
+    QMutex m_solverMutex;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief guards our flags below
+    //----------------------------------------------------------------------------------------------------------------------
+    QMutex m_stateMutex;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief woken whenever our flags change
+    //----------------------------------------------------------------------------------------------------------------------
+    QWaitCondition m_stateChanged;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief if we are stepping, how many steps per batch and if we should stop
+    //----------------------------------------------------------------------------------------------------------------------
+    bool m_stepping;
+    int m_stepsPerBatch;
+    bool m_stop;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the number of threads waiting on our solver, we hold off stepping until they have had it
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_numWaiting;
+    //----------------------------------------------------------------------------------------------------------------------
+};
+
+#endif // SPHSOLVERTHREAD_H
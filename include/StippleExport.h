@@ -0,0 +1,178 @@
+#ifndef STIPPLEEXPORT_H
+#define STIPPLEEXPORT_H
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @file StippleExport.h
+/// @brief Downloads our stipples from the GPU into reusable pinned buffers and writes them out. Downloads are queued
+/// @brief on our solvers stream so they can overlap with whatever we run next, we only wait on them when we write.
+/// @brief Files ending in .stp are written in our binary format, .stpz in our binary format run through qCompress,
+/// @brief anything else in our text format of one "x y" per line.
+/// @class StippleExport
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <cuda_runtime.h>
+#include <vector>
+#include <string>
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Optional columns in our binary format
+//----------------------------------------------------------------------------------------------------------------------
+#define STP_HAS_CLASS 1
+#define STP_HAS_RADIUS 2
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief The header at the start of every .stp file. It is followed by count packed float2 positions, then count
+/// @brief unsigned char classes if STP_HAS_CLASS is set, then count float radii if STP_HAS_RADIUS is set. Everything
+/// @brief is little endian.
+//----------------------------------------------------------------------------------------------------------------------
+struct StippleFileHeader
+{
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief always "STP1"
+    //----------------------------------------------------------------------------------------------------------------------
+    char magic[4];
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the version of our format
+    //----------------------------------------------------------------------------------------------------------------------
+    unsigned int version;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the number of stipples in our file
+    //----------------------------------------------------------------------------------------------------------------------
+    unsigned int count;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief which of our optional columns follow our positions
+    //----------------------------------------------------------------------------------------------------------------------
+    unsigned int flags;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the bounds of the simulation our stipples came from
+    //----------------------------------------------------------------------------------------------------------------------
+    float width;
+    float height;
+    //----------------------------------------------------------------------------------------------------------------------
+};
+
+class SPHSolverCUDA;
+
+class StippleExport
+{
+public:
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Our defualt constructor
+    //----------------------------------------------------------------------------------------------------------------------
+    StippleExport();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief destructor, waits on any download we still have running
+    //----------------------------------------------------------------------------------------------------------------------
+    ~StippleExport();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Queues a download of our solvers particles on its stream and returns straight away. Our buffers only
+    /// @brief grow so exporting the same size of simulation again never allocates.
+    /// @param _solver - the solver to download from. It must stay alive until our download has finished.
+    /// @param _columns - which of our optional columns to download, STP_HAS_CLASS and/or STP_HAS_RADIUS
+    //----------------------------------------------------------------------------------------------------------------------
+    void download(SPHSolverCUDA &_solver, unsigned int _columns = 0);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Sets our stipples from positions already on the host, for solvers we cannot download from directly.
+    /// @brief Our positions are copied to our device buffers as well so they can be drawn by StippleRaster.
+    /// @param _positions - our stipple positions
+    /// @param _width - the x bound of our simulation
+    /// @param _height - the y bound of our simulation
+    //----------------------------------------------------------------------------------------------------------------------
+    void setPositions(const std::vector<float3> &_positions, float _width, float _height);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief returns true once our last download has finished without waiting on it
+    //----------------------------------------------------------------------------------------------------------------------
+    bool ready();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Waits for our last download then writes it out. Files ending in .stp or .stpz are written in our binary format.
+    /// @param _file - the file to write
+    /// @return true if our file was written (bool)
+    //----------------------------------------------------------------------------------------------------------------------
+    bool write(const std::string &_file);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief returns true if _file should be written in our binary format
+    //----------------------------------------------------------------------------------------------------------------------
+    static bool isBinaryFile(const std::string &_file);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief returns true if _file should be written in our compressed binary format
+    //----------------------------------------------------------------------------------------------------------------------
+    static bool isCompressedFile(const std::string &_file);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to the number of stipples we last downloaded
+    //----------------------------------------------------------------------------------------------------------------------
+    inline int getCount(){return m_count;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to which of our optional columns we last downloaded
+    //----------------------------------------------------------------------------------------------------------------------
+    inline unsigned int getColumns(){return m_columns;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to the bounds of the simulation we last downloaded
+    //----------------------------------------------------------------------------------------------------------------------
+    inline float2 getBounds(){return make_float2(m_width,m_height);}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to the device our buffers are on, -1 if we have none
+    //----------------------------------------------------------------------------------------------------------------------
+    inline int getDevice(){return m_device;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to the event recorded after our last download, null if we have never downloaded
+    //----------------------------------------------------------------------------------------------------------------------
+    inline cudaEvent_t getEvent(){return m_downloadEvent;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessors to our columns on the device. Null if we did not download that column.
+    //----------------------------------------------------------------------------------------------------------------------
+    inline const float2 *getDeviceXY(){return m_devXY;}
+    inline const unsigned char *getDeviceClass(){return (m_columns&STP_HAS_CLASS) ? m_devClass : 0;}
+    inline const float *getDeviceRadius(){return (m_columns&STP_HAS_RADIUS) ? m_devRadius : 0;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessors to our columns on the host. Only valid once our last download has finished.
+    //----------------------------------------------------------------------------------------------------------------------
+    inline const float2 *getHostXY(){return m_hostXY;}
+    inline const unsigned char *getHostClass(){return (m_columns&STP_HAS_CLASS) ? m_hostClass : 0;}
+    inline const float *getHostRadius(){return (m_columns&STP_HAS_RADIUS) ? m_hostRadius : 0;}
+    //----------------------------------------------------------------------------------------------------------------------
+private:
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our download buffers. Our device buffers are packed into by our solver then copied into our pinned
+    /// @brief host buffers in one go per column.
+    //----------------------------------------------------------------------------------------------------------------------
+    float2 *m_devXY;
+    unsigned char *m_devClass;
+    float *m_devRadius;
+    float2 *m_hostXY;
+    unsigned char *m_hostClass;
+    float *m_hostRadius;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief how many stipples our buffers have room for
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_capacity;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the device our buffers were allocated on
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_device;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief recorded on our solvers stream after our last download
+    //----------------------------------------------------------------------------------------------------------------------
+    cudaEvent_t m_downloadEvent;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our file header for our last download
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_count;
+    unsigned int m_columns;
+    float m_width;
+    float m_height;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief makes sure our buffers have room for _n stipples on _device
+    //----------------------------------------------------------------------------------------------------------------------
+    void reserve(int _n, int _device);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief frees all of our buffers
+    //----------------------------------------------------------------------------------------------------------------------
+    void freeBuffers();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief writes our stipples to _file in our binary or text format
+    //----------------------------------------------------------------------------------------------------------------------
+    bool writeBinary(const std::string &_file);
+    bool writeText(const std::string &_file);
+    //----------------------------------------------------------------------------------------------------------------------
+};
+
+#endif // STIPPLEEXPORT_H
@@ -0,0 +1,188 @@
+#ifndef STIPPLEJOBSCHEDULER_H
+#define STIPPLEJOBSCHEDULER_H
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @file StippleJobScheduler.h
+/// @brief Runs lots of small stipple jobs on one GPU at the same time. Each running job has its own headless
+/// @brief SPHSolverCUDA with its own stream, image, bounds and simulation properties, so the GPU can overlap the work
+/// @brief of every job we have running. Jobs retire as soon as they converge and the next queued job takes their place.
+/// @brief Finished jobs are downloaded on their own stream and written out while the next round of steps runs.
+/// @class StippleJobScheduler
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "SPHSolverCUDA.h"
+#include "StippleExport.h"
+#include <QString>
+#include <string>
+#include <vector>
+#include <deque>
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Everything we need to know to run one stipple job
+//----------------------------------------------------------------------------------------------------------------------
+struct StippleJob
+{
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the image we are stippling
+    //----------------------------------------------------------------------------------------------------------------------
+    QString image;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief where to write our stipples, files ending in .stp are written in our binary format
+    //----------------------------------------------------------------------------------------------------------------------
+    std::string output;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the number of stipples we want
+    //----------------------------------------------------------------------------------------------------------------------
+    int numParticles;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our convergence value
+    //----------------------------------------------------------------------------------------------------------------------
+    float epsilon;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the most steps we run before giving up and writing what we have
+    //----------------------------------------------------------------------------------------------------------------------
+    int maxIterations;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the bounds of our simulation
+    //----------------------------------------------------------------------------------------------------------------------
+    float width;
+    float height;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the thickness of our walls and how many layers of ghost particles they stand in for
+    //----------------------------------------------------------------------------------------------------------------------
+    float wallThickness;
+    float wallLayers;
+    //----------------------------------------------------------------------------------------------------------------------
+    StippleJob() : numParticles(0), epsilon(0.f), maxIterations(100000), width(15.f), height(15.f), wallThickness(0.05f), wallLayers(3.f){}
+    //----------------------------------------------------------------------------------------------------------------------
+};
+
+class StippleJobScheduler
+{
+public:
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Our defualt constructor
+    /// @param _maxConcurrent - the most jobs we run on the GPU at the same time
+    /// @param _threadsPerBlock - threads per block for each of our jobs. Our jobs are small so smaller blocks means
+    /// @param _threadsPerBlock - more of them to spread across the GPU.
+    //----------------------------------------------------------------------------------------------------------------------
+    StippleJobScheduler(int _maxConcurrent = 8, int _threadsPerBlock = 256);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief destructor
+    //----------------------------------------------------------------------------------------------------------------------
+    ~StippleJobScheduler();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief adds a job to the back of our queue
+    /// @param _job - the job to add
+    //----------------------------------------------------------------------------------------------------------------------
+    void addJob(const StippleJob &_job);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief adds every job in a jobs file to our queue. Each line is
+    /// @brief <image> <numParticles> <epsilon> <outputFile> [maxIterations] [width height] [wallThickness wallLayers].
+    /// @brief Any optional columns left off keep the defaults of StippleJob. Lines starting with # are ignored.
+    /// @param _file - location of our jobs file
+    /// @return the number of jobs we added, -1 if the file cannot be opened (int)
+    //----------------------------------------------------------------------------------------------------------------------
+    int loadJobFile(const std::string &_file);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief runs every job in our queue and returns once they have all been written out
+    //----------------------------------------------------------------------------------------------------------------------
+    void run();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief mutator to how many steps we queue for each job before checking which have finished
+    /// @param _steps - steps per round
+    //----------------------------------------------------------------------------------------------------------------------
+    inline void setStepsPerRound(int _steps){m_stepsPerRound = (_steps>0) ? _steps : 1;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief sets if our jobs replay their steps from CUDA graphs. Small jobs are mostly launch overhead so this is on by default.
+    /// @param _useGraph - use CUDA graphs
+    //----------------------------------------------------------------------------------------------------------------------
+    inline void setUseCudaGraph(bool _useGraph){m_useCudaGraph = _useGraph;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to the number of jobs we have written out
+    //----------------------------------------------------------------------------------------------------------------------
+    inline int getNumCompleted(){return m_numCompleted;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to the number of our completed jobs that converged
+    //----------------------------------------------------------------------------------------------------------------------
+    inline int getNumConverged(){return m_numConverged;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to the number of jobs that could not be written out
+    //----------------------------------------------------------------------------------------------------------------------
+    inline int getNumFailed(){return m_numFailed;}
+    //----------------------------------------------------------------------------------------------------------------------
+private:
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief a job that is running on the GPU
+    //----------------------------------------------------------------------------------------------------------------------
+    struct ActiveJob
+    {
+        StippleJob job;
+        SPHSolverCUDA *solver;
+        int iterations;
+    };
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief a finished job whose stipples are still downloading. Its solver is kept until then.
+    //----------------------------------------------------------------------------------------------------------------------
+    struct PendingExport
+    {
+        ActiveJob active;
+        StippleExport *exporter;
+        bool converged;
+    };
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief jobs waiting to run
+    //----------------------------------------------------------------------------------------------------------------------
+    std::deque<StippleJob> m_queue;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief jobs running on the GPU
+    //----------------------------------------------------------------------------------------------------------------------
+    std::vector<ActiveJob> m_active;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief finished jobs waiting to be written out
+    //----------------------------------------------------------------------------------------------------------------------
+    std::vector<PendingExport> m_exporting;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief export buffers not in use, kept so we dont allocate pinned memory for every job
+    //----------------------------------------------------------------------------------------------------------------------
+    std::vector<StippleExport*> m_exportPool;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the most jobs we run at the same time
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_maxConcurrent;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief threads per block for each of our jobs
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_threadsPerBlock;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief steps we queue for each job before checking which have finished
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_stepsPerRound;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief if our jobs replay their steps from CUDA graphs
+    //----------------------------------------------------------------------------------------------------------------------
+    bool m_useCudaGraph;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our job counts
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_numCompleted;
+    int m_numConverged;
+    int m_numFailed;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief creates a solver for the job at the front of our queue and starts it running
+    //----------------------------------------------------------------------------------------------------------------------
+    void startNextJob();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief queues a download of a finished jobs stipples, they are written out by writeExports
+    /// @param _job - the job that has finished
+    //----------------------------------------------------------------------------------------------------------------------
+    void finishJob(ActiveJob &_job);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief writes out any finished jobs whose download has finished and deletes their solvers
+    /// @param _wait - wait for every download rather than only writing those that are ready
+    //----------------------------------------------------------------------------------------------------------------------
+    void writeExports(bool _wait);
+    //----------------------------------------------------------------------------------------------------------------------
+};
+
+#endif // STIPPLEJOBSCHEDULER_H
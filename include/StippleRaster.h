@@ -0,0 +1,139 @@
+#ifndef STIPPLERASTER_H
+#define STIPPLERASTER_H
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @file StippleRaster.h
+/// @brief Draws our final stipples as print ready images at any resolution, independent of our window. PNGs are
+/// @brief splatted on the GPU as antialiased discs one STP_RASTER_TILE tile at a time, each tile only drawing the
+/// @brief stipples we binned into it. Our device memory is bounded by our tile but we still build our whole PNG in
+/// @brief one full resolution host image before we save it. SVGs and PDFs are streamed straight out of our pinned
+/// @brief stipple buffers. Color stipples are drawn in their CMYK inks.
+/// @class StippleRaster
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "StippleExport.h"
+#include "StippleRasterKernals.h"
+#include <string>
+#include <vector>
+
+class StippleRaster
+{
+public:
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Our defualt constructor
+    //----------------------------------------------------------------------------------------------------------------------
+    StippleRaster();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief destructor
+    //----------------------------------------------------------------------------------------------------------------------
+    ~StippleRaster();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Queues a download of our solvers stipples with their radii, and their classes if we are color
+    /// @brief stippling. Returns straight away, we wait on it when we write.
+    /// @param _solver - the solver to draw
+    //----------------------------------------------------------------------------------------------------------------------
+    void setStipples(SPHSolverCUDA &_solver);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Sets our stipples from positions on the host, such as the text dumps of our old exports. Everyone is
+    /// @brief drawn with our dot radius.
+    /// @param _positions - our stipple positions
+    /// @param _width - the x bound of our simulation
+    /// @param _height - the y bound of our simulation
+    //----------------------------------------------------------------------------------------------------------------------
+    void setStipples(const std::vector<float3> &_positions, float _width, float _height);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief mutator to what each of our stipple radii is multiplied by
+    //----------------------------------------------------------------------------------------------------------------------
+    inline void setDotScale(float _scale){m_dotScale = _scale;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief mutator to the radius in simulation units we draw everyone with. 0 uses our stipple radii, or for
+    /// @brief stipples without radii a radius worked out from how many stipples we have.
+    //----------------------------------------------------------------------------------------------------------------------
+    inline void setDotRadius(float _radius){m_dotRadius = _radius;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief mutator to our print resolution, used to size our PDF pages
+    //----------------------------------------------------------------------------------------------------------------------
+    inline void setDPI(float _dpi){if(_dpi>0.f) m_dpi = _dpi;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Writes our stipples out depending on the extension of _file, .png, .svg or .pdf
+    /// @param _file - the file to write
+    /// @param _width - the width of our output in pixels, PDFs are this many pixels wide at our print resolution
+    /// @return true if our file was written (bool)
+    //----------------------------------------------------------------------------------------------------------------------
+    bool write(const std::string &_file, int _width);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief returns true if _file is a format we can write
+    //----------------------------------------------------------------------------------------------------------------------
+    static bool isRasterFile(const std::string &_file);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief writes each of our formats. Our PNG is built in a full resolution host image, width*height bytes for
+    /// @brief black stippling and three times that for color, so very large PNGs are limited by our host memory.
+    //----------------------------------------------------------------------------------------------------------------------
+    bool writePNG(const std::string &_file, int _width);
+    bool writeSVG(const std::string &_file, int _width);
+    bool writePDF(const std::string &_file, int _width);
+    //----------------------------------------------------------------------------------------------------------------------
+private:
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our stipples on the device and host
+    //----------------------------------------------------------------------------------------------------------------------
+    StippleExport m_stipples;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the stream we draw on, created on the device of our stipples
+    //----------------------------------------------------------------------------------------------------------------------
+    cudaStream_t m_stream;
+    int m_streamDevice;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our tile of ink, our resolved tile of pixels and two pinned tiles so we can copy one tile into our
+    /// @brief image while we draw the next
+    //----------------------------------------------------------------------------------------------------------------------
+    float *m_ink;
+    unsigned char *m_pixels;
+    unsigned char *m_hostPixels[2];
+    cudaEvent_t m_tileEvent[2];
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our stipples binned by tile, how many stipples, tiles and entries our bins have room for and our tile
+    /// @brief starts read back to our host. Our bins only ever grow.
+    //----------------------------------------------------------------------------------------------------------------------
+    RasterBins m_bins;
+    int m_binStipples;
+    int m_binTiles;
+    int m_binEntries;
+    std::vector<int> m_tileStart;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief how we size our dots
+    //----------------------------------------------------------------------------------------------------------------------
+    float m_dotScale;
+    float m_dotRadius;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our print resolution
+    //----------------------------------------------------------------------------------------------------------------------
+    float m_dpi;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the radius we draw everyone with when we dont use our stipple radii
+    //----------------------------------------------------------------------------------------------------------------------
+    float dotRadius();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief creates our stream and tile buffers on our stipples device if we dont have them already
+    //----------------------------------------------------------------------------------------------------------------------
+    void allocTiles();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief frees our stream and tile buffers
+    //----------------------------------------------------------------------------------------------------------------------
+    void freeTiles();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief bins our stipples by the tiles of our image on our stream and reads our tile starts back to our host
+    /// @param _image - our whole image as one tile
+    /// @param _tiles - how many tiles we have across and down our image
+    /// @param _radius - our stipple radii on the device, null to use _dotRadius
+    /// @param _dotRadius - the radius of everyone when _radius is null
+    //----------------------------------------------------------------------------------------------------------------------
+    void binStipples(const RasterTile &_image, int2 _tiles, const float *_radius, float _dotRadius);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief frees our bins
+    //----------------------------------------------------------------------------------------------------------------------
+    void freeBins();
+    //----------------------------------------------------------------------------------------------------------------------
+};
+
+#endif // STIPPLERASTER_H
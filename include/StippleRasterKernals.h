@@ -0,0 +1,136 @@
+#ifndef STIPPLERASTERKERNALS_H
+#define STIPPLERASTERKERNALS_H
+
+#include <cuda_runtime.h>
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief the width and height in pixels of the tiles we rasterize our stipples in. Bigger images are drawn one tile
+/// @brief at a time so our device memory never depends on our output resolution.
+//----------------------------------------------------------------------------------------------------------------------
+#define STP_RASTER_TILE 2048
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Structure to hold how our stipples map onto one tile of our output image
+//----------------------------------------------------------------------------------------------------------------------
+struct RasterTile
+{
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the pixel of our output image at the top left of our tile
+    //----------------------------------------------------------------------------------------------------------------------
+    int2 origin;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the size of our tile in pixels
+    //----------------------------------------------------------------------------------------------------------------------
+    int2 size;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief output pixels per unit of our simulation
+    //----------------------------------------------------------------------------------------------------------------------
+    float pixelsPerUnit;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the y bound of our simulation, our images are top row first and our simulation is bottom row first
+    //----------------------------------------------------------------------------------------------------------------------
+    float simHeight;
+    //----------------------------------------------------------------------------------------------------------------------
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Structure to hold our stipples binned by the tiles they touch. Like our solvers hash grid we give every
+/// @brief stipple a key per tile its dot covers, sort our keys and scan our tile occupancy into where each tiles
+/// @brief list of stipples starts.
+//----------------------------------------------------------------------------------------------------------------------
+struct RasterBins
+{
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief how many tiles each of our stipples covers and where each stipple writes its keys, one per stipple
+    //----------------------------------------------------------------------------------------------------------------------
+    int *stippleTiles;
+    int *entryOffset;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief how many stipples touch each tile and where each tiles list starts, one more than our number of tiles
+    /// @brief so our last start is our total number of entries
+    //----------------------------------------------------------------------------------------------------------------------
+    int *tileOcc;
+    int *tileStart;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our tile keys and stipple indices before and after our sort, one per entry
+    //----------------------------------------------------------------------------------------------------------------------
+    int *tileKeys;
+    int *stippleIdx;
+    int *sortedKeys;
+    int *sortedIdx;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief temporary storage for our scans and sort
+    //----------------------------------------------------------------------------------------------------------------------
+    void *tempStorage;
+    size_t tempBytes;
+    //----------------------------------------------------------------------------------------------------------------------
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief returns how much temporary storage our scans and sort need
+/// @param _numStipples - number of stipples we are binning
+/// @param _numTiles - number of tiles in our image
+/// @param _numEntries - number of stipple tile pairs we sort
+//----------------------------------------------------------------------------------------------------------------------
+size_t binTempStorageBytes(int _numStipples, int _numTiles, int _numEntries);
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Counts the tiles each of our stipples covers and the stipples in each tile, then scans them into where each
+/// @brief stipple writes its keys and where each tiles list starts. Our host needs _bins.tileStart to size our sort.
+/// @param _stream - Cuda stream to run our kernal on.
+/// @param _threadsPerBlock - number of threads we have availible per block.
+/// @param _numStipples - number of stipples to bin
+/// @param _xy - our stipple positions in simulation units
+/// @param _radius - our stipple radii in simulation units. Null uses _dotRadius for everyone.
+/// @param _dotScale - multiplies each of our radii
+/// @param _dotRadius - the radius of everyone when _radius is null
+/// @param _image - our whole image as one tile
+/// @param _tiles - how many tiles we have across and down our image
+/// @param _bins - our bins, _bins.tileOcc is cleared here
+//----------------------------------------------------------------------------------------------------------------------
+void countStippleTiles(cudaStream_t _stream, int _threadsPerBlock, int _numStipples, const float2 *_xy, const float *_radius, float _dotScale, float _dotRadius, RasterTile _image, int2 _tiles, RasterBins _bins);
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Writes a tile key for each tile each of our stipples covers and sorts our stipples by them, so
+/// @brief _bins.sortedIdx holds each tiles stipples from _bins.tileStart of that tile.
+/// @param _stream - Cuda stream to run our kernal on.
+/// @param _threadsPerBlock - number of threads we have availible per block.
+/// @param _numStipples - number of stipples to bin
+/// @param _numEntries - our total number of entries, the last of our tile starts
+/// @param _xy - our stipple positions in simulation units
+/// @param _radius - our stipple radii in simulation units. Null uses _dotRadius for everyone.
+/// @param _dotScale - multiplies each of our radii
+/// @param _dotRadius - the radius of everyone when _radius is null
+/// @param _image - our whole image as one tile
+/// @param _tiles - how many tiles we have across and down our image
+/// @param _bins - our bins counted by countStippleTiles
+//----------------------------------------------------------------------------------------------------------------------
+void sortStippleTiles(cudaStream_t _stream, int _threadsPerBlock, int _numStipples, int _numEntries, const float2 *_xy, const float *_radius, float _dotScale, float _dotRadius, RasterTile _image, int2 _tiles, RasterBins _bins);
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Splats our stipples into a tile of ink as antialiased discs. Our ink buffer has one channel per pixel for
+/// @brief black stippling or four (C,M,Y,K) picked by our stipple classes when _class is set.
+/// @param _stream - Cuda stream to run our kernal on.
+/// @param _threadsPerBlock - number of threads we have availible per block.
+/// @param _numStipples - number of stipples to draw
+/// @param _idx - the indices of the stipples to draw, our tiles list from our bins. Null draws our first _numStipples.
+/// @param _xy - our stipple positions in simulation units
+/// @param _radius - our stipple radii in simulation units. Null uses _dotRadius for everyone.
+/// @param _class - our stipple classes. Null draws everyone in black.
+/// @param _dotScale - multiplies each of our radii
+/// @param _dotRadius - the radius of everyone when _radius is null
+/// @param _tile - where our tile lies in our output image
+/// @param _ink - our tile of ink, cleared before we are called
+//----------------------------------------------------------------------------------------------------------------------
+void splatStipples(cudaStream_t _stream, int _threadsPerBlock, int _numStipples, const int *_idx, const float2 *_xy, const float *_radius, const unsigned char *_class, float _dotScale, float _dotRadius, RasterTile _tile, float *_ink);
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Turns our tile of ink into 8 bit pixels on white paper. Black stippling gives us one grey byte per pixel,
+/// @brief color stippling three RGB bytes per pixel with our inks mixed subtractively.
+/// @param _stream - Cuda stream to run our kernal on.
+/// @param _threadsPerBlock - number of threads we have availible per block.
+/// @param _tile - the tile we are resolving
+/// @param _ink - our tile of ink
+/// @param _color - if our ink has four channels
+/// @param _pixels - where to write our pixels, _tile.size.x*_tile.size.y pixels packed row by row
+//----------------------------------------------------------------------------------------------------------------------
+void resolveInk(cudaStream_t _stream, int _threadsPerBlock, RasterTile _tile, const float *_ink, bool _color, unsigned char *_pixels);
+//----------------------------------------------------------------------------------------------------------------------
+
+#endif // STIPPLERASTERKERNALS_H
@@ -0,0 +1,118 @@
+#ifndef STIPPLESNAPSHOTWRITER_H
+#define STIPPLESNAPSHOTWRITER_H
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @file StippleSnapshotWriter.h
+/// @brief Saves our stipples every few steps while our solver runs. Each snapshot is downloaded on our solvers stream
+/// @brief into one of a ring of pinned StippleExport buffers and written out by our own thread, so our solver stream
+/// @brief never waits on the disk. If the disk falls behind and every buffer is in use we either wait for one to
+/// @brief be written or drop the snapshot.
+/// @class StippleSnapshotWriter
+//----------------------------------------------------------------------------------------------------------------------
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <string>
+#include <vector>
+#include <deque>
+#include "StippleExport.h"
+
+class SPHSolverCUDA;
+
+class StippleSnapshotWriter : public QThread
+{
+public:
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Our defualt constructor, starts our writer thread
+    /// @param _prefix - our snapshots are written to <_prefix>_<step>.stp
+    /// @param _ringSize - the number of snapshots we can have downloading or waiting to be written at once
+    /// @param _compress - compress our snapshots with qCompress, these are written to <_prefix>_<step>.stpz
+    /// @param _dropWhenFull - drop snapshots when our ring is full rather than waiting for the disk
+    //----------------------------------------------------------------------------------------------------------------------
+    StippleSnapshotWriter(const std::string &_prefix, int _ringSize = 4, bool _compress = false, bool _dropWhenFull = false);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief destructor, writes out any snapshots we still have then stops our thread
+    //----------------------------------------------------------------------------------------------------------------------
+    ~StippleSnapshotWriter();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief Queues a snapshot of our solvers current particles on its stream and hands it to our writer thread.
+    /// @brief Only waits if every buffer in our ring is still in use and we are not dropping snapshots.
+    /// @param _solver - the solver to snapshot
+    /// @param _step - the step number to name our snapshot with
+    /// @return false if our snapshot was dropped (bool)
+    //----------------------------------------------------------------------------------------------------------------------
+    bool capture(SPHSolverCUDA &_solver, int _step);
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief sets which of our optional columns we save, STP_HAS_CLASS and/or STP_HAS_RADIUS
+    //----------------------------------------------------------------------------------------------------------------------
+    inline void setColumns(unsigned int _columns){m_columns = _columns;}
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief waits until every snapshot we have captured so far has been written
+    //----------------------------------------------------------------------------------------------------------------------
+    void flush();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to the number of snapshots we have written
+    //----------------------------------------------------------------------------------------------------------------------
+    int getNumWritten();
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief accessor to the number of snapshots we have dropped because our ring was full
+    //----------------------------------------------------------------------------------------------------------------------
+    int getNumDropped();
+    //----------------------------------------------------------------------------------------------------------------------
+protected:
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our writer thread
+    //----------------------------------------------------------------------------------------------------------------------
+    void run();
+    //----------------------------------------------------------------------------------------------------------------------
+private:
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief one buffer in our ring
+    //----------------------------------------------------------------------------------------------------------------------
+    struct Slot
+    {
+        StippleExport exporter;
+        std::string file;
+    };
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief all of our slots, the ones free to capture into and the ones waiting to be written
+    //----------------------------------------------------------------------------------------------------------------------
+    std::vector<Slot*> m_slots;
+    std::vector<Slot*> m_free;
+    std::deque<Slot*> m_pending;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief guards our slot lists, counts and stop flag
+    //----------------------------------------------------------------------------------------------------------------------
+    QMutex m_mutex;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief woken when a snapshot is waiting to be written and when a slot is freed
+    //----------------------------------------------------------------------------------------------------------------------
+    QWaitCondition m_hasWork;
+    QWaitCondition m_slotFree;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our snapshot file names
+    //----------------------------------------------------------------------------------------------------------------------
+    std::string m_prefix;
+    bool m_compress;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief drop snapshots when our ring is full rather than waiting
+    //----------------------------------------------------------------------------------------------------------------------
+    bool m_dropWhenFull;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief the optional columns we save
+    //----------------------------------------------------------------------------------------------------------------------
+    unsigned int m_columns;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief our snapshot counts
+    //----------------------------------------------------------------------------------------------------------------------
+    int m_numWritten;
+    int m_numDropped;
+    //----------------------------------------------------------------------------------------------------------------------
+    /// @brief tells our writer thread to finish once it has written everything
+    //----------------------------------------------------------------------------------------------------------------------
+    bool m_stop;
+    //----------------------------------------------------------------------------------------------------------------------
+};
+
+#endif // STIPPLESNAPSHOTWRITER_H
@@ -14,7 +14,7 @@
 //----------------------------------------------------------------------------------------------------------------------
 /// @brief position of particles buffer
 //----------------------------------------------------------------------------------------------------------------------
-layout (location = 0) in vec3 vertexPosition;
+layout (location = 0) in vec4 vertexPosition;
 //----------------------------------------------------------------------------------------------------------------------
 /// @brief class of particles buffer
 //----------------------------------------------------------------------------------------------------------------------
@@ -64,11 +64,11 @@ void main(){
     if(vertexClass==2){ colour = vec3(1,1,0);}
     if(vertexClass>2){ colour = vec3(vertexClass);}
 
-    ogPos = vertexPosition;
-    vec4 eyePos = MV * vec4(vertexPosition,1.0);
+    ogPos = vertexPosition.xyz;
+    vec4 eyePos = MV * vec4(vertexPosition.xyz,1.0);
     position = vec3(eyePos);
     vec4 projCorner = P * vec4(0.5*pointSize, 0.5*pointSize, eyePos.z, eyePos.w);
     gl_PointSize = screenWidth * projCorner.x / projCorner.w;
     //gl_Position = vec4(MVP * vec4(pos, 1.0));
-    gl_Position = vec4(MVP * vec4(vertexPosition, 1.0));
+    gl_Position = vec4(MVP * vec4(vertexPosition.xyz, 1.0));
 }
@@ -0,0 +1,25 @@
+//----------------------------------------------------------------------------------------------------------------------
+/// @file DensitySplatFrag.glsl
+/// @version 1.0
+/// @namepsace GLSL
+/// @class DensitySplatFrag
+/// @brief Fragment shader for our density splats. Shades our cell by how much of it our particles cover.
+//----------------------------------------------------------------------------------------------------------------------
+
+#version 400
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief how much of our cell is covered from our vertex shader
+//----------------------------------------------------------------------------------------------------------------------
+in float coverage;
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief output fragment
+//----------------------------------------------------------------------------------------------------------------------
+out vec4 fragout;
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief fragment main. Our particles are black on white so the more they cover the darker our cell.
+//----------------------------------------------------------------------------------------------------------------------
+void main(){
+    fragout = vec4(vec3(1.0-coverage),1.0);
+}
@@ -0,0 +1,38 @@
+//----------------------------------------------------------------------------------------------------------------------
+/// @file DensitySplatVert.glsl
+/// @version 1.0
+/// @namepsace GLSL
+/// @class DensitySplatVert
+/// @brief Vertex shader for our density splats. Each point is one grid cell of our simulation drawn as a square
+/// @brief point sprite the size of the cell on screen.
+//----------------------------------------------------------------------------------------------------------------------
+
+#version 400
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief the centre of our cell and how much of it our particles cover
+//----------------------------------------------------------------------------------------------------------------------
+layout (location = 0) in vec3 cellSplat;
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief our model view projection matrix
+//----------------------------------------------------------------------------------------------------------------------
+uniform mat4 MVP;
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief the size of one of our cells on screen in pixels
+//----------------------------------------------------------------------------------------------------------------------
+uniform float splatSize;
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief how much of our cell is covered, passed through to our fragment shader
+//----------------------------------------------------------------------------------------------------------------------
+out float coverage;
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief vertex main. Passes through our coverage and sizes our splat.
+//----------------------------------------------------------------------------------------------------------------------
+void main(){
+    coverage = cellSplat.z;
+    gl_PointSize = splatSize;
+    gl_Position = MVP * vec4(cellSplat.xy, 0.0, 1.0);
+}
@@ -14,7 +14,7 @@
 //----------------------------------------------------------------------------------------------------------------------
 /// @brief position of particles buffer
 //----------------------------------------------------------------------------------------------------------------------
-layout (location = 0) in vec3 vertexPosition;
+layout (location = 0) in vec4 vertexPosition;
 
 //----------------------------------------------------------------------------------------------------------------------
 /// @brief eye space position to be sent to fragment shader
@@ -55,11 +55,11 @@ void main(){
     //vec3 pos = vertexPosition * sizeFunc(vertexPosition);
     //scale the point sprite based on our projection matrix
     //vec4 eyePos = MV * vec4(pos,1.0);
-    ogPos = vertexPosition;
-    vec4 eyePos = MV * vec4(vertexPosition,1.0);
+    ogPos = vertexPosition.xyz;
+    vec4 eyePos = MV * vec4(vertexPosition.xyz,1.0);
     position = vec3(eyePos);
     vec4 projCorner = P * vec4(0.5*pointSize, 0.5*pointSize, eyePos.z, eyePos.w);
     gl_PointSize = screenWidth * projCorner.x / projCorner.w;
     //gl_Position = vec4(MVP * vec4(pos, 1.0));
-    gl_Position = vec4(MVP * vec4(vertexPosition, 1.0));
+    gl_Position = vec4(MVP * vec4(vertexPosition.xyz, 1.0));
 }
@@ -35,11 +35,19 @@ NGLScene::NGLScene(const QGLFormat _format, QWidget *_parent) : QGLWidget(_forma
   // mouse rotation values set to 0
   m_spinXFace=0.0f;
   m_spinYFace=0.0f;
+  // A4 at 300dpi
+  m_exportWidth = 2480;
+  m_cullParticles = true;
+  m_drawBoundary = false;
+  m_showStats = false;
+  m_solverThread = 0;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
 NGLScene::~NGLScene()
 {
+  // Stop stepping before our solver goes
+  delete m_solverThread;
   delete m_SPHSolverCUDA;
   delete m_particleDrawer;
 }
@@ -65,7 +73,9 @@ void NGLScene::resizeGL(int _w , int _h)
 //----------------------------------------------------------------------------------------------------------------------
 void NGLScene::setSampleImage(QString _dir)
 {
+    m_solverThread->lockSolver();
     m_SPHSolverCUDA->setSampleImage(_dir);
+    m_solverThread->unlockSolver();
 }
 //----------------------------------------------------------------------------------------------------------------------
 void NGLScene::resetSim()
@@ -73,26 +83,37 @@ void NGLScene::resetSim()
 
     //m_SPHSolver->setParticles(testParticles);
 //    m_SPHSolverCUDA->genRandomSamples(m_SPHSolverCUDA->getNumParticles());
+    m_solverThread->lockSolver();
     m_SPHSolverCUDA->genRandomSamples(80000);
+    m_solverThread->unlockSolver();
     //m_particleDrawer->setPositions(positions);
 }
 //----------------------------------------------------------------------------------------------------------------------
 void NGLScene::exportSamplesToFile(QString _dir)
 {
-    std::vector<float3> p = m_SPHSolverCUDA->getParticlePositions();
-    std::ofstream f(_dir.toStdString());
-    if(f.is_open())
+    std::string file = _dir.toStdString();
+    if(StippleRaster::isRasterFile(file))
     {
-        for(unsigned int i=0;i<p.size();i++)
-        {
-            f<<p[i].x<<" "<<p[i].y<<"\n";
-        }
-        f.close();
+        // Draw our stipples at print resolution rather than our window size
+        StippleRaster raster;
+        m_solverThread->lockSolver();
+        raster.setStipples(*m_SPHSolverCUDA);
+        m_solverThread->unlockSolver();
+        raster.write(file,m_exportWidth);
+        return;
     }
-    else
+
+    // Our download is only queued while we hold our solver, we write once our solver is stepping again
+    m_solverThread->lockSolver();
+    unsigned int columns = 0;
+    if(StippleExport::isBinaryFile(file))
     {
-        std::cout<<"Cannot open file "<<_dir.toStdString()<<std::endl;
+        columns = STP_HAS_RADIUS;
+        if(m_SPHSolverCUDA->isColorStippling()) columns |= STP_HAS_CLASS;
     }
+    m_export.download(*m_SPHSolverCUDA,columns);
+    m_solverThread->unlockSolver();
+    m_export.write(file);
 }
 //----------------------------------------------------------------------------------------------------------------------
 void NGLScene::initializeGL()
@@ -171,7 +192,10 @@ void NGLScene::initializeGL()
 
   m_SPHSolverCUDA->genRandomSamples(160000);
 
-  // Start our timer event. This will begin calling the TimerEvent function that updates our simulation.
+  // Step our solver on its own thread so it isnt held back by our redraws
+  m_solverThread = new SPHSolverThread(m_SPHSolverCUDA);
+
+  // Start our timer event. This will begin calling the TimerEvent function that redraws our simulation.
   startTimer(0);
 }
 
@@ -205,10 +229,7 @@ void NGLScene::loadMatricesToShader()
 //----------------------------------------------------------------------------------------------------------------------
 void NGLScene::timerEvent(QTimerEvent *)
 {
-    if(m_update)
-    {
-        m_SPHSolverCUDA->update();
-    }
+    // Our solver thread does the stepping, we just draw its newest frame
     updateGL();
 }
 //----------------------------------------------------------------------------------------------------------------------
@@ -233,31 +254,53 @@ void NGLScene::paintGL()
   m_mouseGlobalTX[3][1] = m_modelPos.y;
   m_mouseGlobalTX[3][2] = m_modelPos.z;
 
-  if(m_SPHSolverCUDA->isColorStippling())
+  // Copy in our solvers newest frame, never reading our solver directly as it is being stepped on another thread
+  SolverFrame frame;
+  if(!m_SPHSolverCUDA->acquireFrame(frame))
   {
-      m_particleDrawer->drawCMYKFromVAO(m_SPHSolverCUDA->getActiveVAO(),m_SPHSolverCUDA->getNumParticles(), m_mouseGlobalTX,m_cam.getViewMatrix(),m_cam.getProjectionMatrix());
+      frame.numParticles = 0;
+      frame.colorStippling = false;
+      frame.converged = false;
+      frame.convergeValue = 0.f;
+      frame.stepCount = 0;
+      frame.stats = SolverStats();
+  }
+
+  bool cmyk = frame.colorStippling;
+  m_particleDrawer->setColour(0.f,0.f,0.f);
+  HostCellTable table;
+  if(m_cullParticles && m_SPHSolverCUDA->getHostCellTable(table))
+  {
+      m_particleDrawer->drawCulledFromVAO(m_SPHSolverCUDA->getActiveVAO(),frame.numParticles,cmyk,table.cellIdx,table.cellOcc,glm::ivec2(table.gridRes.x,table.gridRes.y),glm::vec2(table.cellSize.x,table.cellSize.y),glm::vec2(table.gridMin.x,table.gridMin.y),table.version,m_mouseGlobalTX,m_cam.getViewMatrix(),m_cam.getProjectionMatrix());
+  }
+  else if(cmyk)
+  {
+      m_particleDrawer->drawCMYKFromVAO(m_SPHSolverCUDA->getActiveVAO(),frame.numParticles, m_mouseGlobalTX,m_cam.getViewMatrix(),m_cam.getProjectionMatrix());
   }
   else
   {
-      m_particleDrawer->setColour(0.f,0.f,0.f);
-      m_particleDrawer->drawFromVAO(m_SPHSolverCUDA->getActiveVAO(),m_SPHSolverCUDA->getNumParticles(), m_mouseGlobalTX,m_cam.getViewMatrix(),m_cam.getProjectionMatrix());
+      m_particleDrawer->drawFromVAO(m_SPHSolverCUDA->getActiveVAO(),frame.numParticles, m_mouseGlobalTX,m_cam.getViewMatrix(),m_cam.getProjectionMatrix());
+  }
+  if(m_drawBoundary)
+  {
+      m_particleDrawer->setColour(0.f,0.f,1.f);
+      m_particleDrawer->drawFromVAO(m_SPHSolverCUDA->getWallVAO(),m_SPHSolverCUDA->getNumWallPoints(), m_mouseGlobalTX,m_cam.getViewMatrix(),m_cam.getProjectionMatrix());
   }
-  m_particleDrawer->setColour(0.f,0.f,1.f);
-  m_particleDrawer->drawFromVAO(m_SPHSolverCUDA->getBndPositionsVAO(),m_SPHSolverCUDA->getNumBoundParticles(), m_mouseGlobalTX,m_cam.getViewMatrix(),m_cam.getProjectionMatrix());
 
   QTime currentTime;
   currentTime = currentTime.currentTime();
 
 
   QString text;
-  if(m_SPHSolverCUDA->convergedState())
+  if(frame.converged)
   {
       if(m_update)
       {
         m_convergeTime = m_startTime.msecsTo(currentTime) / 1000.f;
+        m_solverThread->setStepping(false);
       }
       m_update = false;
-      text = QString("Simulation has converged! Epsilon value: %1 NumParticles: %2 Time taken to converge: %3").arg(m_SPHSolverCUDA->getConvergeValue()).arg(m_SPHSolverCUDA->getNumParticles()).arg(m_convergeTime);
+      text = QString("Simulation has converged! Epsilon value: %1 NumParticles: %2 Time taken to converge: %3").arg(frame.convergeValue).arg(frame.numParticles).arg(m_convergeTime);
       m_text->setColour(0.f,1.f,0.f);
   }
   else
@@ -265,17 +308,30 @@ void NGLScene::paintGL()
       if(m_update)
       {
         m_convergeTime = m_startTime.msecsTo(currentTime) / 1000.f;
-        text = QString("Simulation converging. Epsilon value: %1 NumParticles: %2 Time taken to converge: %3").arg(m_SPHSolverCUDA->getConvergeValue()).arg(m_SPHSolverCUDA->getNumParticles()).arg(m_convergeTime);
+        text = QString("Simulation converging. Epsilon value: %1 NumParticles: %2 Time taken to converge: %3").arg(frame.convergeValue).arg(frame.numParticles).arg(m_convergeTime);
         m_text->setColour(1.f,0.f,0.f);
       }
       else
       {
-        text = QString("Simulation paused. Epsilon value: %1 NumParticles: %2 Time taken to converge: %3").arg(m_SPHSolverCUDA->getConvergeValue()).arg(m_SPHSolverCUDA->getNumParticles()).arg(m_convergeTime);
+        text = QString("Simulation paused. Epsilon value: %1 NumParticles: %2 Time taken to converge: %3").arg(frame.convergeValue).arg(frame.numParticles).arg(m_convergeTime);
         m_text->setColour(0.f,1.f,1.f);
       }
   }
   m_text->renderText(0,0,text);
 
+  if(m_showStats)
+  {
+      const SolverStats &stats = frame.stats;
+      m_text->setColour(1.f,1.f,1.f);
+      float totalMs = 0.f;
+      for(int i=0;i<SOLVER_NUM_STAGES;i++) totalMs+=stats.stageMs[i];
+      m_text->renderText(0,20,QString("Steps per second: %1 Step: %2 ms per step: %3").arg(stats.stepsPerSecond,0,'f',1).arg(stats.stepCount).arg(totalMs,0,'f',3));
+      m_text->renderText(0,40,QString("Converged: %1% Outside grid: %2 Kernal errors: %3").arg(stats.convergedFraction*100.f,0,'f',1).arg(stats.nullHashCount).arg(stats.errorCount));
+      for(int i=0;i<SOLVER_NUM_STAGES;i++)
+      {
+          m_text->renderText(0,60+20*i,QString("%1: %2 ms").arg(SPHSolverCUDA::getStageName(i)).arg(stats.stageMs[i],0,'f',3));
+      }
+  }
 
 }
 //----------------------------------------------------------------------------------------------------------------------
@@ -373,7 +429,7 @@ void NGLScene::keyPressEvent(QKeyEvent *_event)
   // escape key to quit
   case Qt::Key_Escape : QGuiApplication::exit(EXIT_SUCCESS); break;
   // toggle colour tippling
-  case Qt::Key_Q : m_SPHSolverCUDA->toggleColorStippling(); break;
+  case Qt::Key_Q : m_solverThread->lockSolver(); m_SPHSolverCUDA->toggleColorStippling(); m_solverThread->unlockSolver(); break;
   // turn on wirframe rendering
   case Qt::Key_W : glPolygonMode(GL_FRONT_AND_BACK,GL_LINE); break;
   // turn off wire frame
@@ -383,9 +439,24 @@ void NGLScene::keyPressEvent(QKeyEvent *_event)
   // show windowed
   case Qt::Key_N : showNormal(); break;
   // update simulation by one step
-  case Qt::Key_E : m_SPHSolverCUDA->update(); break;
+  case Qt::Key_E : m_solverThread->lockSolver(); m_SPHSolverCUDA->update(); m_solverThread->unlockSolver(); break;
+  // cycle through our per particle, shared memory and neighbour list searches
+  case Qt::Key_C :
+      m_solverThread->lockSolver();
+      m_SPHSolverCUDA->setNeighbourSearchMode((NeighbourSearchMode)((m_SPHSolverCUDA->getNeighbourSearchMode()+1)%3));
+      m_solverThread->unlockSolver();
+  break;
   // toggle update automatically
-  case Qt::Key_Space : m_update = !m_update; break;
+  case Qt::Key_Space : m_update = !m_update; m_solverThread->setStepping(m_update); break;
+  case Qt::Key_L : m_cullParticles = !m_cullParticles; break;
+  case Qt::Key_B : m_drawBoundary = !m_drawBoundary; break;
+  // toggle our solver stats overlay
+  case Qt::Key_I :
+      m_showStats = !m_showStats;
+      m_solverThread->lockSolver();
+      m_SPHSolverCUDA->setLiveStats(m_showStats);
+      m_solverThread->unlockSolver();
+  break;
   case Qt::Key_Minus : m_particleDrawer->setParticleSize(m_particleDrawer->getParticleSize()-0.01f); break;
   case Qt::Key_Plus : m_particleDrawer->setParticleSize(m_particleDrawer->getParticleSize()+0.01f); break;
   default : break;
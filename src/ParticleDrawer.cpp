@@ -1,5 +1,28 @@
 #include "include/ParticleDrawer.h"
 #include <glm/gtc/type_ptr.hpp>
+#include <glm/geometric.hpp>
+#include <cmath>
+#include <algorithm>
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief returns true if all 4 corners of a cell in clip space are past the same side of our view
+//----------------------------------------------------------------------------------------------------------------------
+static bool outsideView(const glm::vec4 *_corners)
+{
+    for(int axis=0;axis<2;axis++)
+    {
+        bool allBelow = true;
+        bool allAbove = true;
+        for(int i=0;i<4;i++)
+        {
+            if(_corners[i][axis]>=-_corners[i].w) allBelow = false;
+            if(_corners[i][axis]<=_corners[i].w) allAbove = false;
+        }
+        if(allBelow || allAbove) return true;
+    }
+    return false;
+}
+//----------------------------------------------------------------------------------------------------------------------
 
 ParticleDrawer::ParticleDrawer() : m_numParticles(0)
 {
@@ -49,6 +72,40 @@ ParticleDrawer::ParticleDrawer() : m_numParticles(0)
     m_CMYKscreenWidthHndl = m_CMYKParticleShader->getUniformLoc("screenWidth");
 
     glUniform1f(m_CMYKpointSizeHndl,10.f);
+    m_particleSize = 10.f;
+
+    //set up our density splat shader for when our particles are too small to see
+    m_splatShader = new ShaderProgram();
+    Shader splatVert("shaders/DensitySplatVert.glsl",GL_VERTEX_SHADER);
+    Shader splatFrag("shaders/DensitySplatFrag.glsl",GL_FRAGMENT_SHADER);
+    m_splatShader->attachShader(&splatVert);
+    m_splatShader->attachShader(&splatFrag);
+    m_splatShader->bindFragDataLocation(0, "fragout");
+    m_splatShader->link();
+    m_splatShader->use();
+    m_splatMVPHndl = m_splatShader->getUniformLoc("MVP");
+    m_splatSizeHndl = m_splatShader->getUniformLoc("splatSize");
+    m_lastSplatSize = 0.f;
+    glUniform1f(m_splatSizeHndl,m_lastSplatSize);
+
+    m_numSplats = 0;
+    m_splatVersion = 0;
+    m_splatParticleSize = 0.f;
+    m_splatsValid = false;
+    m_lodPixelSize = 1.f;
+    m_screenWidth = 0;
+    m_numDrawn = 0;
+    m_drawingSplats = false;
+    m_lastColour = glm::vec3(0.f,1.f,1.f);
+    for(int i=0;i<3;i++) m_matricesValid[i] = false;
+
+    glGenVertexArrays(1, &m_splatVAO);
+    glBindVertexArray(m_splatVAO);
+    glGenBuffers(1, &m_splatVBO);
+    glBindBuffer(GL_ARRAY_BUFFER, m_splatVBO);
+    glBufferData(GL_ARRAY_BUFFER, 0, NULL, GL_DYNAMIC_DRAW);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
 
     // Create our VAO and position buffer
     glGenVertexArrays(1, &m_VAO);
@@ -66,9 +123,12 @@ ParticleDrawer::~ParticleDrawer()
 {
     delete m_particleShader;
     delete m_CMYKParticleShader;
+    delete m_splatShader;
     // Delete our buffers
     glDeleteBuffers(1,&m_posVBO);
     glDeleteVertexArrays(1,&m_VAO);
+    glDeleteBuffers(1,&m_splatVBO);
+    glDeleteVertexArrays(1,&m_splatVAO);
 }
 //----------------------------------------------------------------------------------------------------------------------
 void ParticleDrawer::resizeParticleBuffer(int _n)
@@ -92,6 +152,7 @@ void ParticleDrawer::setPositions(std::vector<glm::vec3> &_posData)
 //----------------------------------------------------------------------------------------------------------------------
 void ParticleDrawer::setScreenWidth(int _width)
 {
+    m_screenWidth = _width;
     m_particleShader->use();
     glUniform1i(m_screenWidthHndl,_width);
     m_CMYKParticleShader->use();
@@ -109,6 +170,9 @@ void ParticleDrawer::setParticleSize(float _size)
 //----------------------------------------------------------------------------------------------------------------------
 void ParticleDrawer::setColour(float _r, float _g, float _b)
 {
+    glm::vec3 colour(_r,_g,_b);
+    if(colour==m_lastColour) return;
+    m_lastColour = colour;
     m_particleShader->use();
     glUniform3f(m_colourHndl,_r,_g,_b);
 }
@@ -119,9 +183,7 @@ void ParticleDrawer::draw(glm::mat4 _M, glm::mat4 _V, glm::mat4 _P)
     glm::mat4 MVP = _P*MV;
     //grab and instance of our shader library
     m_particleShader->use();
-    glUniformMatrix4fv(m_PMatHndl, 1, GL_FALSE, glm::value_ptr(_P));
-    glUniformMatrix4fv(m_MVMatHndl, 1, GL_FALSE, glm::value_ptr(MV));
-    glUniformMatrix4fv(m_MVPMatHndl, 1, GL_FALSE, glm::value_ptr(MVP));
+    setMatrices(false,MV,_P,MVP);
 
     glBindVertexArray(m_VAO);
     glDrawArrays(GL_POINTS, 0, m_numParticles);
@@ -134,9 +196,7 @@ void ParticleDrawer::drawFromVAO(GLuint _VAO, int _n, glm::mat4 _M, glm::mat4 _V
     glm::mat4 MVP = _P*MV;
     //grab and instance of our shader library
     m_particleShader->use();
-    glUniformMatrix4fv(m_PMatHndl, 1, GL_FALSE, glm::value_ptr(_P));
-    glUniformMatrix4fv(m_MVMatHndl, 1, GL_FALSE, glm::value_ptr(MV));
-    glUniformMatrix4fv(m_MVPMatHndl, 1, GL_FALSE, glm::value_ptr(MVP));
+    setMatrices(false,MV,_P,MVP);
 
     glBindVertexArray(_VAO);
     glDrawArrays(GL_POINTS, 0, _n);
@@ -148,14 +208,156 @@ void ParticleDrawer::drawCMYKFromVAO(GLuint _VAO, int _n, glm::mat4 _M, glm::mat
     glm::mat4 MVP = _P*MV;
     //grab and instance of our shader library
     m_CMYKParticleShader->use();
-    glUniformMatrix4fv(m_CMYKPMatHndl, 1, GL_FALSE, glm::value_ptr(_P));
-    glUniformMatrix4fv(m_CMYKMVMatHndl, 1, GL_FALSE, glm::value_ptr(MV));
-    glUniformMatrix4fv(m_CMYKMVPMatHndl, 1, GL_FALSE, glm::value_ptr(MVP));
+    setMatrices(true,MV,_P,MVP);
 
     glBindVertexArray(_VAO);
     glDrawArrays(GL_POINTS, 0, _n);
 }
 //----------------------------------------------------------------------------------------------------------------------
+void ParticleDrawer::setMatrices(bool _cmyk, const glm::mat4 &_MV, const glm::mat4 &_P, const glm::mat4 &_MVP)
+{
+    // Our camera barely changes between frames so most of the time there is nothing to send
+    int s = (_cmyk) ? 1 : 0;
+    if(m_matricesValid[s] && m_lastMVP[s]==_MVP && m_lastMV[s]==_MV && m_lastP[s]==_P) return;
+    glUniformMatrix4fv((_cmyk) ? m_CMYKPMatHndl : m_PMatHndl, 1, GL_FALSE, glm::value_ptr(_P));
+    glUniformMatrix4fv((_cmyk) ? m_CMYKMVMatHndl : m_MVMatHndl, 1, GL_FALSE, glm::value_ptr(_MV));
+    glUniformMatrix4fv((_cmyk) ? m_CMYKMVPMatHndl : m_MVPMatHndl, 1, GL_FALSE, glm::value_ptr(_MVP));
+    m_lastMVP[s] = _MVP;
+    m_lastMV[s] = _MV;
+    m_lastP[s] = _P;
+    m_matricesValid[s] = true;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void ParticleDrawer::buildSplats(const int *_cellOcc, glm::ivec2 _gridRes, glm::vec2 _cellSize, glm::vec2 _gridMin)
+{
+    // Each of our splats is shaded by how much of its cell its particles would cover if we could see them
+    float cellArea = _cellSize.x*_cellSize.y;
+    float dotArea = (float)M_PI*0.25f*m_particleSize*m_particleSize;
+    std::vector<glm::vec3> splats;
+    splats.reserve(_gridRes.x*_gridRes.y);
+    for(int y=0;y<_gridRes.y;y++)
+    {
+        for(int x=0;x<_gridRes.x;x++)
+        {
+            int occ = _cellOcc[x+y*_gridRes.x];
+            if(!occ) continue;
+            float coverage = std::min(occ*dotArea/cellArea,1.f);
+            splats.push_back(glm::vec3(_gridMin.x+(x+0.5f)*_cellSize.x,_gridMin.y+(y+0.5f)*_cellSize.y,coverage));
+        }
+    }
+
+    glBindVertexArray(m_splatVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, m_splatVBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec3)*splats.size(), (splats.empty()) ? NULL : &splats[0], GL_DYNAMIC_DRAW);
+    m_numSplats = splats.size();
+}
+//----------------------------------------------------------------------------------------------------------------------
+void ParticleDrawer::drawCulledFromVAO(GLuint _VAO, int _n, bool _cmyk, const int *_cellIdx, const int *_cellOcc, glm::ivec2 _gridRes, glm::vec2 _cellSize, glm::vec2 _gridMin, unsigned int _tableVersion, glm::mat4 _M, glm::mat4 _V, glm::mat4 _P)
+{
+    m_numDrawn = 0;
+    m_drawingSplats = false;
+    if(!_cellIdx || !_cellOcc || _gridRes.x<=0 || _gridRes.y<=0 || _cellSize.x<=0.f || _cellSize.y<=0.f)
+    {
+        // No cell table yet so just draw everyone
+        if(_cmyk) drawCMYKFromVAO(_VAO,_n,_M,_V,_P);
+        else drawFromVAO(_VAO,_n,_M,_V,_P);
+        m_numDrawn = _n;
+        return;
+    }
+
+    glm::mat4 MV = _V*_M;
+    glm::mat4 MVP = _P*MV;
+    // Our grid is flat so any point on it in clip space is c0 + x*cx + y*cy for cell coordinates x,y.
+    // Our first cell is at our grid min, not our origin.
+    glm::vec4 c0 = MVP*glm::vec4(_gridMin.x,_gridMin.y,0.f,1.f);
+    glm::vec4 cx = MVP*glm::vec4(_cellSize.x,0.f,0.f,0.f);
+    glm::vec4 cy = MVP*glm::vec4(0.f,_cellSize.y,0.f,0.f);
+
+    // How big one of our cells and particles are on screen, measured at the middle of our grid
+    glm::vec4 centre = c0 + cx*(0.5f*_gridRes.x) + cy*(0.5f*_gridRes.y);
+    float cellPixels = 0.f;
+    if(centre.w>0.f) cellPixels = 0.5f*m_screenWidth*glm::length(glm::vec2(cx.x,cx.y))/centre.w;
+    float particlePixels = cellPixels*m_particleSize/_cellSize.x;
+
+    if(particlePixels<m_lodPixelSize)
+    {
+        if(!m_splatsValid || m_splatVersion!=_tableVersion || m_splatParticleSize!=m_particleSize)
+        {
+            buildSplats(_cellOcc,_gridRes,_cellSize,_gridMin);
+            m_splatVersion = _tableVersion;
+            m_splatParticleSize = m_particleSize;
+            m_splatsValid = true;
+        }
+        m_splatShader->use();
+        if(!m_matricesValid[2] || m_lastMVP[2]!=MVP)
+        {
+            glUniformMatrix4fv(m_splatMVPHndl, 1, GL_FALSE, glm::value_ptr(MVP));
+            m_lastMVP[2] = MVP;
+            m_matricesValid[2] = true;
+        }
+        // A pixel bigger than our cells so neighbouring splats never leave gaps
+        float splatSize = std::max(ceilf(cellPixels)+1.f,1.f);
+        if(splatSize!=m_lastSplatSize)
+        {
+            glUniform1f(m_splatSizeHndl,splatSize);
+            m_lastSplatSize = splatSize;
+        }
+        glBindVertexArray(m_splatVAO);
+        glDrawArrays(GL_POINTS, 0, m_numSplats);
+        m_numDrawn = m_numSplats;
+        m_drawingSplats = true;
+        return;
+    }
+
+    // Our particles drift a little from the cells they were sorted into and are drawn with a radius so pad our cells
+    float padX = 1.f + 0.5f*m_particleSize/_cellSize.x;
+    float padY = 1.f + 0.5f*m_particleSize/_cellSize.y;
+    m_drawFirsts.clear();
+    m_drawCounts.clear();
+    for(int y=0;y<_gridRes.y;y++)
+    {
+        glm::vec4 rowLo = c0 + cy*(y-padY);
+        glm::vec4 rowHi = c0 + cy*(y+1.f+padY);
+        for(int x=0;x<_gridRes.x;x++)
+        {
+            int cell = x+y*_gridRes.x;
+            int occ = _cellOcc[cell];
+            if(!occ) continue;
+
+            glm::vec4 corners[4];
+            corners[0] = rowLo + cx*(x-padX);
+            corners[1] = rowLo + cx*(x+1.f+padX);
+            corners[2] = rowHi + cx*(x-padX);
+            corners[3] = rowHi + cx*(x+1.f+padX);
+            if(outsideView(corners)) continue;
+
+            // Our table can be a step behind our buffer so never draw past the end of it
+            int first = _cellIdx[cell];
+            if(first>=_n) continue;
+            int count = std::min(occ,_n-first);
+
+            // Neighbouring visible cells are neighbouring ranges of our buffer so merge them
+            if(!m_drawFirsts.empty() && m_drawFirsts.back()+m_drawCounts.back()==first)
+            {
+                m_drawCounts.back()+=count;
+            }
+            else
+            {
+                m_drawFirsts.push_back(first);
+                m_drawCounts.push_back(count);
+            }
+            m_numDrawn+=count;
+        }
+    }
+    if(m_drawFirsts.empty()) return;
+
+    if(_cmyk) m_CMYKParticleShader->use();
+    else m_particleShader->use();
+    setMatrices(_cmyk,MV,_P,MVP);
+    glBindVertexArray(_VAO);
+    glMultiDrawArrays(GL_POINTS, &m_drawFirsts[0], &m_drawCounts[0], m_drawFirsts.size());
+}
+//----------------------------------------------------------------------------------------------------------------------
 void *ParticleDrawer::bindPosBufferPtr()
 {
     glBindVertexArray(m_VAO);
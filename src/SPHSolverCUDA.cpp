@@ -1,13 +1,17 @@
 #include "SPHSolverCUDA.h"
+#include "StippleSnapshotWriter.h"
+#include "SPHNvtx.h"
 #include <iostream>
+#include <QMutexLocker>
+#include <map>
 #define SpeedOfSound 34.29f
 #include <helper_math.h>
 #include <ctime>
-#include <boost/random.hpp>
-#include <boost/generator_iterator.hpp>
+#include <cstring>
+#include <algorithm>
 
 //----------------------------------------------------------------------------------------------------------------------
-SPHSolverCUDA::SPHSolverCUDA(float _x, float _y, float _t, float _l)
+SPHSolverCUDA::SPHSolverCUDA(float _x, float _y, float _t, float _l, bool _headless, int _device) : m_headless(_headless)
 {
     //Lets test some cuda stuff
     int count;
@@ -25,44 +29,215 @@ SPHSolverCUDA::SPHSolverCUDA(float _x, float _y, float _t, float _l)
         std::cout<<prop.name<<", Compute capability:"<<prop.major<<"."<<prop.minor<<std::endl;;
         std::cout<<"  Global mem: "<<prop.totalGlobalMem/ 1024 / 1024<<"M, Shared mem per block: "<<prop.sharedMemPerBlock / 1024<<"k, Registers per block: "<<prop.regsPerBlock<<std::endl;
         std::cout<<"  Warp size: "<<prop.warpSize<<" threads, Max threads per block: "<<prop.maxThreadsPerBlock<<", Multiprocessor count: "<<prop.multiProcessorCount<<" MaxBlocks: "<<prop.maxGridSize[0]<<std::endl;
-        m_threadsPerBlock = prop.maxThreadsPerBlock;
     }
 
+    // Unless we are told which device to use we stay on the current one. Everything we create from
+    // here on belongs to this device.
+    if(_device<0 || _device>=count) checkCudaErrors(cudaGetDevice(&_device));
+    m_device = _device;
+    checkCudaErrors(cudaSetDevice(m_device));
+    cudaDeviceProp prop;
+    checkCudaErrors(cudaGetDeviceProperties(&prop,m_device));
+    m_maxThreadsPerBlock = prop.maxThreadsPerBlock;
+    m_threadsPerBlock = m_maxThreadsPerBlock;
+    std::cout<<"Using device "<<m_device<<" ("<<prop.name<<")"<<std::endl;
+
     // Create our CUDA stream to run our kernals on. This helps with running kernals concurrently.
     // Check them out at http://on-demand.gputechconf.com/gtc-express/2011/presentations/StreamsAndConcurrencyWebinar.pdf
     checkCudaErrors(cudaStreamCreate(&m_cudaStream));
+    // and our own thrust temporary storage, which is handed back in the order of our stream
+    m_fluidBuffers.thrustAlloc = createThrustAllocator(m_cudaStream);
 
     // Make sure these are init to 0
-    m_fluidBuffers.accPtr = 0;
     m_fluidBuffers.velPtr = 0;
     m_fluidBuffers.cellIndexBuffer = 0;
     m_fluidBuffers.cellOccBuffer = 0;
     m_fluidBuffers.hashKeys = 0;
-    m_fluidBuffers.hashMap = 0;
-    m_fluidBuffers.denPtr = 0;
     m_fluidBuffers.convergedPtr = 0;
-    m_fluidBuffers.bndCellIdxBuff = 0;
-    m_fluidBuffers.bndCellOccBuff = 0;
+    m_fluidBuffers.wallTable = 0;
+    m_wallArray = 0;
+    m_wallTableH = 0.f;
+    m_wallThickness = _t;
+    m_wallLayers = _l;
     m_fluidBuffers.pixelI = 0;
     m_fluidBuffers.pixelCMYK = 0;
-    m_fluidBuffers.classBuff = 0;
-
-    m_simBounds = make_float3(_x,_y,0.f);
-    std::vector<float> intensity;
-    intensity.resize(200*200);
-    std::vector<float4> cmyk;
-    cmyk.resize(200*200);
-    for(unsigned int i=0;i<intensity.size();i++)
+    m_pixelIArray = 0;
+    m_pixelCMYKArray = 0;
+    m_sampleCDF = 0;
+    m_sampleCDFWidth = 0;
+    m_sampleCDFHeight = 0;
+    m_sampleSeed = (unsigned long long)time(NULL);
+    m_sampleGeneration = 0;
+    m_importanceSampling = false;
+    m_progressiveStages = 1;
+    m_progressiveStage = 0;
+    m_progressiveTarget = 0;
+    m_progressiveFinalH = 0.f;
+    m_stageIterations = 0;
+    m_stageMaxIterations = 500;
+    m_fluidBuffers.posPtr = 0;
+    m_numWallPoints = 0;
+    m_cellTableCapacity = 0;
+    m_particleCapacity = 0;
+    m_glParticleCapacity = 0;
+    m_hostCellTable[0] = m_hostCellTable[1] = 0;
+    m_hostCellTableCapacity = 0;
+    m_hostCellTableRead = -1;
+    m_hostCellTablePending = false;
+    m_hostCellTableEvent = 0;
+    m_hostCellTableVersion = 0;
+    m_hostCellTableWanted = 0;
+    m_deferPublish = false;
+    m_frameBuffer[0] = m_frameBuffer[1] = 0;
+    m_frameStaged[0] = m_frameStaged[1] = 0;
+    m_frameDrawn[0] = m_frameDrawn[1] = 0;
+    m_frameCapacity = 0;
+    m_frameRead = -1;
+    m_frameWrite = -1;
+    m_renderStream = 0;
+    m_fluidBuffers.denPartials = 0;
+    m_fluidBuffers.restDenPtr = 0;
+    m_fluidBuffers.convergedCount = 0;
+    m_fluidBuffers.particleIdx = 0;
+    m_fluidBuffers.sortedHashKeys = 0;
+    m_fluidBuffers.sortedIdx = 0;
+    m_fluidBuffers.sortTempStorage = 0;
+    m_fluidBuffers.sortTempBytes = 0;
+    m_fluidBuffers.posSwap = 0;
+    m_fluidBuffers.velSwap = 0;
+    m_fluidBuffers.packedKeys = 0;
+    m_fluidBuffers.repairKeys = 0;
+    m_fluidBuffers.stayFlags = 0;
+    m_fluidBuffers.sortStats = 0;
+    m_fluidBuffers.nullHashCount = 0;
+    m_fluidBuffers.errors = 0;
+    m_fluidBuffers.scalePtr = 0;
+    m_fluidBuffers.nbrCount = 0;
+    m_fluidBuffers.nbrOffsets = 0;
+    m_fluidBuffers.nbrList = 0;
+    m_fluidBuffers.nbrRefPos = 0;
+    m_fluidBuffers.nbrStale = 0;
+    m_fluidBuffers.dtPtr = 0;
+    m_fluidBuffers.motionMax = 0;
+    m_fluidBuffers.activeIdx = 0;
+    m_fluidBuffers.activeCount = 0;
+    m_fluidBuffers.activeFlags = 0;
+    m_fluidBuffers.cellHot = 0;
+    m_activeSet = false;
+    m_maxNeighbours = 128;
+    m_nbrRebuildInterval = 1;
+    m_stepsSinceNbrBuild = 0;
+    m_nbrListValid = false;
+    m_nbrRebuildRequested = false;
+    m_nbrOverflowWarned = false;
+    m_incrementalSort = false;
+    m_incrementalThreshold = 0.05f;
+    m_neighbourSearchMode = NEIGHBOUR_SEARCH_PARTICLE;
+    m_graphNeighbourSearchMode = NEIGHBOUR_SEARCH_PARTICLE;
+    m_sortValid = false;
+    m_activeVAO = 0;
+    m_wallVAO = 0;
+    m_wallVBO = 0;
+    m_bufferParity = 0;
+    m_useCudaGraph = false;
+    for(int i=0;i<2;i++)
     {
-        intensity[i]=1.f;
-        cmyk[i] = make_float4(1.f,1.f,1.f,1.f);
+        m_graph[i] = 0;
+        m_graphExec[i] = 0;
     }
-    checkCudaErrors(cudaMalloc(&m_fluidBuffers.pixelI,sizeof(float)*intensity.size()));
-    checkCudaErrors(cudaMemcpy(m_fluidBuffers.pixelI,&intensity[0],sizeof(float)*intensity.size(),cudaMemcpyHostToDevice));
-    checkCudaErrors(cudaMalloc(&m_fluidBuffers.pixelCMYK,sizeof(float4)*cmyk.size()));
-    checkCudaErrors(cudaMemcpy(m_fluidBuffers.pixelCMYK,&cmyk[0],sizeof(float)*cmyk.size(),cudaMemcpyHostToDevice));
+    m_graphNumParticles = -1;
+    m_graphTableSize = -1;
+    m_graphStippleMode = STIPPLE_MODE_MONO;
+    m_graphDensityDiff = 0.f;
+
+    // Our own copy of our simulation properties on the device
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.props,sizeof(SimProps)));
+    // and the pinned memory we upload them from
+    checkCudaErrors(cudaHostAlloc(&m_hostSimProps,sizeof(SimProps),cudaHostAllocDefault));
+    checkCudaErrors(cudaEventCreateWithFlags(&m_simPropsEvent,cudaEventDisableTiming));
+    m_simPropsDirty = true;
+    m_simPropsVersion = 0;
+
+    // Our single value reduction results
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.restDenPtr,sizeof(float)));
+    checkCudaErrors(cudaMemset(m_fluidBuffers.restDenPtr,0,sizeof(float)));
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.convergedCount,sizeof(int)));
+    checkCudaErrors(cudaMemset(m_fluidBuffers.convergedCount,0,sizeof(int)));
+
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.nullHashCount,sizeof(int)));
+    checkCudaErrors(cudaMemset(m_fluidBuffers.nullHashCount,0,sizeof(int)));
+
+    // Pinned memory our converged count and number of particles outside our grid are copied back into
+    checkCudaErrors(cudaHostAlloc(&m_hostConvergedCount,2*sizeof(int),cudaHostAllocDefault));
+    m_hostConvergedCount[0] = 0;
+    m_hostConvergedCount[1] = 0;
+    m_lastConvergedCount = 0;
+    m_lastNullHashCount = 0;
+
+    // What our kernals have reported and the pinned memory we read it back into
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.errors,sizeof(SolverErrors)));
+    checkCudaErrors(cudaMemset(m_fluidBuffers.errors,0,sizeof(SolverErrors)));
+    checkCudaErrors(cudaHostAlloc(&m_hostErrors,sizeof(SolverErrors),cudaHostAllocDefault));
+    memset(m_hostErrors,0,sizeof(SolverErrors));
+    for(int i=0;i<SPH_NUM_ERRORS;i++) m_reportedErrors[i] = 0;
+    checkCudaErrors(cudaEventCreateWithFlags(&m_convergeEvent,cudaEventDisableTiming));
+
+    // Counters for our incremental sort and the pinned memory we read them back into
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.sortStats,3*sizeof(int)));
+    checkCudaErrors(cudaMemset(m_fluidBuffers.sortStats,0,3*sizeof(int)));
+    checkCudaErrors(cudaHostAlloc(&m_hostSortStats,2*sizeof(int),cudaHostAllocDefault));
+    checkCudaErrors(cudaEventCreateWithFlags(&m_sortStatsEvent,cudaEventDisableTiming));
+
+    // Our float2 export buffers are only made when we first need them
+    m_devPosF2 = 0;
+    m_hostPosF2 = 0;
+    m_posF2Capacity = 0;
+    checkCudaErrors(cudaEventCreateWithFlags(&m_posF2Event,cudaEventDisableTiming));
+
+    // Flags for our neighbour list and the pinned memory we read them back into
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.nbrStale,sizeof(int)));
+    checkCudaErrors(cudaMemset(m_fluidBuffers.nbrStale,0,sizeof(int)));
+    checkCudaErrors(cudaHostAlloc(&m_hostNbrStale,sizeof(int),cudaHostAllocDefault));
+    *m_hostNbrStale = 0;
+    checkCudaErrors(cudaEventCreateWithFlags(&m_nbrStaleEvent,cudaEventDisableTiming));
+    m_nbrStaleReadPending = false;
+
+    // Our adaptive timestep and the largest motion of each step it is picked from
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.dtPtr,sizeof(float)));
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.motionMax,2*sizeof(unsigned int)));
+    checkCudaErrors(cudaMemset(m_fluidBuffers.motionMax,0,2*sizeof(unsigned int)));
+    m_convergeReadPending = false;
+    m_converged = false;
+    m_convergeCheckInterval = 10;
+    m_stageTiming = false;
+    m_liveStats = false;
+    m_stageSet = -1;
+    m_stageSetHead = 0;
+    m_stageSetsPending = 0;
+    for(int i=0;i<SPH_STAGE_TIMER_SETS;i++) m_stageSets[i].numMarks = 0;
+    m_stageRollingValid = false;
+    for(int i=0;i<SOLVER_NUM_STAGES;i++) m_stageRolling[i] = 0.f;
+    m_nvtxStage = -1;
+    m_statsSteps = 0;
+    m_stepsPerSecond = 0.f;
+    m_statsClock.start();
+    m_numTimedSteps = 0;
+    for(int i=0;i<SOLVER_NUM_STAGES;i++) m_stageTimes[i] = 0.0;
+    m_stepsSinceConvergeCheck = 0;
+    m_stepCount = 0;
+    m_snapshotWriter = 0;
+    m_snapshotInterval = 1;
+
+    m_simBounds = make_float3(_x,_y,0.f);
+    m_simProperties.simBounds = make_float2(_x,_y);
+    // Until we are given an image sample from a plain white one
+    std::vector<float> intensity(1,1.f);
+    std::vector<float4> cmyk(1,make_float4(1.f,1.f,1.f,1.f));
+    setImageTextures(1,1,intensity,cmyk);
 
     m_simProperties.gridDim = make_float2(0,0);
+    m_simProperties.skin = 0.f;
+    m_simProperties.numParticles = 0;
     setSmoothingLength(0.3f);
     m_simProperties.timeStep = 0.001f;
     m_simProperties.gravity = make_float3(0.f,-9.8f,0.f);
@@ -74,62 +249,59 @@ SPHSolverCUDA::SPHSolverCUDA(float _x, float _y, float _t, float _l)
     m_simProperties.accLimit2 = m_simProperties.accLimit*m_simProperties.accLimit;
     m_simProperties.velLimit = 1.f;
     m_simProperties.velLimit2 = m_simProperties.velLimit*m_simProperties.velLimit;
+    m_simProperties.adaptiveTimeStep = 0;
+    m_simProperties.minTimeStep = 0.0005f;
+    m_simProperties.maxTimeStep = 0.02f;
+    m_simProperties.cflFactor = 0.4f;
+    resetTimeStep(m_cudaStream,m_fluidBuffers,m_simProperties.timeStep);
     m_restDensity = 500.f;
     m_densityDiff = 150.f;
     m_volume = 0;
     m_multiclass = false;
+    m_colorStippleMode = STIPPLE_MODE_MULTICLASS;
 
-    //Define our boundaries
+    //Define our boundaries. Our walls are a table our kernals look up by distance, built by setSmoothingLength above,
+    //so all we need is a grid with room for our particles.
     float2 hmin = make_float2(-_t,-_t);
     float2 hmax = make_float2(_x+m_simProperties.h+_t,_y+m_simProperties.h+_t);
-    float step = _t/_l;
-    std::vector<float3> bndTemp;
-    for (float x=-_t;x<_x+_t;x+=step)
-    for (float y=-_t;y<_y+_t;y+=step)
-        if (!((x>=0.f)&&(x<=_x) && (y>=0.f) && (y<=_y)))
-            bndTemp.push_back(make_float3(x,y,0.f));
-
-    m_numBoundParticles = (int)bndTemp.size();
-    // Create an OpenGL buffer for our boundary position buffer
-    // Create our VAO and vertex buffers
-    glGenVertexArrays(1, &m_bndPosVAO);
-    glBindVertexArray(m_bndPosVAO);
-
-    // Put our vertices into an OpenGL buffer
-    glGenBuffers(1, &m_bndVBO);
-    glBindBuffer(GL_ARRAY_BUFFER, m_bndVBO);
-    // We must alocate some space otherwise cuda cannot register it
-    glBufferData(GL_ARRAY_BUFFER, sizeof(float3)*bndTemp.size(), &bndTemp[0], GL_DYNAMIC_DRAW);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    // create our cuda graphics resource for our vertexs used for our OpenGL interop
-    checkCudaErrors(cudaGraphicsGLRegisterBuffer(&m_resourceBndPos, m_bndVBO, cudaGraphicsRegisterFlagsWriteDiscard));
-
-    // Unbind everything just in case
-    glBindVertexArray(0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    if(!m_headless && m_fluidBuffers.wallTable)
+    {
+        // Points along our walls so we can see where they are. This is only used for drawing and never changes.
+        float step = _t/_l;
+        std::vector<float2> wallTemp;
+        for (float x=0.f;x<_x;x+=step)
+        {
+            wallTemp.push_back(make_float2(x,0.f));
+            wallTemp.push_back(make_float2(x,_y));
+        }
+        for (float y=0.f;y<=_y;y+=step)
+        {
+            wallTemp.push_back(make_float2(0.f,y));
+            wallTemp.push_back(make_float2(_x,y));
+        }
+        m_numWallPoints = (int)wallTemp.size();
+
+        // Create our VAO and vertex buffers
+        glGenVertexArrays(1, &m_wallVAO);
+        glBindVertexArray(m_wallVAO);
+
+        // Put our vertices into an OpenGL buffer
+        glGenBuffers(1, &m_wallVBO);
+        glBindBuffer(GL_ARRAY_BUFFER, m_wallVBO);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(float2)*wallTemp.size(), &wallTemp[0], GL_STATIC_DRAW);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+
+        // Unbind everything just in case
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
 
     // Create our hash table
     setHashPosAndDim(hmin,hmax);
 
-    // Hash and sort our boundary particles
-    // Map our pointer for our position data
-    size_t posSize;
-    checkCudaErrors(cudaGraphicsMapResources(1,&m_resourceBndPos));
-    checkCudaErrors(cudaGraphicsResourceGetMappedPointer((void**)&m_fluidBuffers.bndPos,&posSize,m_resourceBndPos));
-
-    int tableSize = ceil(m_simProperties.gridRes.x *m_simProperties.gridRes.y);
-    checkCudaErrors(cudaMalloc(&m_fluidBuffers.bndCellOccBuff,tableSize*sizeof(int)));
-    fillIntZero(m_cudaStream,m_threadsPerBlock,m_fluidBuffers.bndCellOccBuff,tableSize);
-    checkCudaErrors(cudaMalloc(&m_fluidBuffers.bndCellIdxBuff,tableSize*sizeof(int)));
-    fillIntZero(m_cudaStream,m_threadsPerBlock,m_fluidBuffers.bndCellIdxBuff,tableSize);
-
-    hashAndSortBnd(m_cudaStream,m_threadsPerBlock,(int)bndTemp.size(),tableSize,m_fluidBuffers.bndPos,m_fluidBuffers.bndCellOccBuff,m_fluidBuffers.bndCellIdxBuff);
-
-    checkCudaErrors(cudaGraphicsUnmapResources(1,&m_resourceBndPos));
-
-    // Send these to the GPU
-    updateGPUSimProps();
+    // In headless mode we have nothing to draw our particles with
+    if(m_headless) return;
 
     // Create an OpenGL buffer for our position buffer
     // Create our VAO and vertex buffers
@@ -140,21 +312,15 @@ SPHSolverCUDA::SPHSolverCUDA(float _x, float _y, float _t, float _l)
     glGenBuffers(1, &m_posVBO);
     glBindBuffer(GL_ARRAY_BUFFER, m_posVBO);
     // We must alocate some space otherwise cuda cannot register it
-    glBufferData(GL_ARRAY_BUFFER, sizeof(float3), NULL, GL_DYNAMIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(float4), NULL, GL_DYNAMIC_DRAW);
+    // Our particles are packed as (x,y,density,class) so our position and class
+    // attributes both read from the same buffer
     glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    // create our cuda graphics resource for our vertexs used for our OpenGL interop
-    checkCudaErrors(cudaGraphicsGLRegisterBuffer(&m_resourcePos, m_posVBO, cudaGraphicsRegisterFlagsWriteDiscard));
-
-    // Put our vertices into an OpenGL buffer
-    glGenBuffers(1, &m_classVBO);
-    glBindBuffer(GL_ARRAY_BUFFER, m_classVBO);
-    // We must alocate some space otherwise cuda cannot register it
-    glBufferData(GL_ARRAY_BUFFER, sizeof(float), NULL, GL_DYNAMIC_DRAW);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(float4), 0);
     glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, 0, 0);
+    glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, sizeof(float4), (void*)(3*sizeof(float)));
     // create our cuda graphics resource for our vertexs used for our OpenGL interop
-    checkCudaErrors(cudaGraphicsGLRegisterBuffer(&m_resourceClass, m_classVBO, cudaGraphicsRegisterFlagsWriteDiscard));
+    checkCudaErrors(cudaGraphicsGLRegisterBuffer(&m_resourcePos, m_posVBO, cudaGraphicsRegisterFlagsWriteDiscard));
 
     // Unbind everything just in case
     glBindVertexArray(0);
@@ -163,220 +329,584 @@ SPHSolverCUDA::SPHSolverCUDA(float _x, float _y, float _t, float _l)
 //----------------------------------------------------------------------------------------------------------------------
 SPHSolverCUDA::~SPHSolverCUDA()
 {
-    // Make sure we remember to unregister our cuda resource
-    checkCudaErrors(cudaGraphicsUnregisterResource(m_resourcePos));
-    checkCudaErrors(cudaGraphicsUnregisterResource(m_resourceClass));
-    checkCudaErrors(cudaGraphicsUnregisterResource(m_resourceBndPos));
+    // All our resources live on our device
+    checkCudaErrors(cudaSetDevice(m_device));
+    destroyGraph();
+
+    if(!m_headless)
+    {
+        // Make sure we remember to unregister our cuda resource
+        checkCudaErrors(cudaGraphicsUnregisterResource(m_resourcePos));
+    }
+    if(m_hostCellTableEvent)
+    {
+        checkCudaErrors(cudaEventSynchronize(m_hostCellTableEvent));
+        checkCudaErrors(cudaEventDestroy(m_hostCellTableEvent));
+    }
+    for(int i=0;i<2;i++)
+    {
+        if(m_hostCellTable[i]) checkCudaErrors(cudaFreeHost(m_hostCellTable[i]));
+    }
+    if(m_renderStream)
+    {
+        checkCudaErrors(cudaStreamSynchronize(m_renderStream));
+        checkCudaErrors(cudaStreamDestroy(m_renderStream));
+    }
+    for(int i=0;i<2;i++)
+    {
+        if(m_frameBuffer[i]) checkCudaErrors(cudaFree(m_frameBuffer[i]));
+        if(m_frameStaged[i]) checkCudaErrors(cudaEventDestroy(m_frameStaged[i]));
+        if(m_frameDrawn[i]) checkCudaErrors(cudaEventDestroy(m_frameDrawn[i]));
+    }
 
     // Delete our CUDA buffers
-    if(m_fluidBuffers.velPtr) checkCudaErrors(cudaFree(m_fluidBuffers.velPtr));
-    if(m_fluidBuffers.accPtr) checkCudaErrors(cudaFree(m_fluidBuffers.accPtr));
+    freeParticleBuffers();
     if(m_fluidBuffers.cellIndexBuffer) checkCudaErrors(cudaFree(m_fluidBuffers.cellIndexBuffer));
     if(m_fluidBuffers.cellOccBuffer) checkCudaErrors(cudaFree(m_fluidBuffers.cellOccBuffer));
-    if(m_fluidBuffers.hashKeys) checkCudaErrors(cudaFree(m_fluidBuffers.hashKeys));
-    if(m_fluidBuffers.hashMap) checkCudaErrors(cudaFree(m_fluidBuffers.hashMap));
-    if(m_fluidBuffers.denPtr) checkCudaErrors(cudaFree(m_fluidBuffers.denPtr));
-    if(m_fluidBuffers.convergedPtr) checkCudaErrors(cudaFree(m_fluidBuffers.convergedPtr));
-    if(m_fluidBuffers.bndCellIdxBuff) checkCudaErrors(cudaFree(m_fluidBuffers.bndCellIdxBuff));
-    if(m_fluidBuffers.bndCellOccBuff) checkCudaErrors(cudaFree(m_fluidBuffers.bndCellOccBuff));
-    if(m_fluidBuffers.pixelI) checkCudaErrors(cudaFree(m_fluidBuffers.pixelI));
-    if(m_fluidBuffers.pixelCMYK) checkCudaErrors(cudaFree(m_fluidBuffers.pixelCMYK));
+    if(m_fluidBuffers.cellHot) checkCudaErrors(cudaFree(m_fluidBuffers.cellHot));
+    destroyImageTextures();
+    destroyWallTable();
+    if(m_fluidBuffers.restDenPtr) checkCudaErrors(cudaFree(m_fluidBuffers.restDenPtr));
+    if(m_fluidBuffers.convergedCount) checkCudaErrors(cudaFree(m_fluidBuffers.convergedCount));
+    if(m_fluidBuffers.sortStats) checkCudaErrors(cudaFree(m_fluidBuffers.sortStats));
+    if(m_fluidBuffers.nullHashCount) checkCudaErrors(cudaFree(m_fluidBuffers.nullHashCount));
+    if(m_fluidBuffers.errors) checkCudaErrors(cudaFree(m_fluidBuffers.errors));
+    if(m_fluidBuffers.nbrStale) checkCudaErrors(cudaFree(m_fluidBuffers.nbrStale));
+    if(m_fluidBuffers.dtPtr) checkCudaErrors(cudaFree(m_fluidBuffers.dtPtr));
+    if(m_fluidBuffers.motionMax) checkCudaErrors(cudaFree(m_fluidBuffers.motionMax));
+    if(m_fluidBuffers.props) checkCudaErrors(cudaFree(m_fluidBuffers.props));
     // Make sure these are set to 0 just in case
-    m_fluidBuffers.accPtr = 0;
-    m_fluidBuffers.velPtr = 0;
     m_fluidBuffers.cellIndexBuffer = 0;
     m_fluidBuffers.cellOccBuffer = 0;
-    m_fluidBuffers.hashKeys = 0;
-    m_fluidBuffers.hashMap = 0;
-    m_fluidBuffers.denPtr = 0;
-    m_fluidBuffers.convergedPtr = 0;
-    m_fluidBuffers.bndCellIdxBuff = 0;
-    m_fluidBuffers.bndCellOccBuff = 0;
-    m_fluidBuffers.pixelI = 0;
-    m_fluidBuffers.pixelCMYK = 0;
+    m_fluidBuffers.restDenPtr = 0;
+    m_fluidBuffers.convergedCount = 0;
+    m_fluidBuffers.sortStats = 0;
+    m_fluidBuffers.nullHashCount = 0;
+    m_fluidBuffers.errors = 0;
+    m_fluidBuffers.nbrStale = 0;
+    m_fluidBuffers.dtPtr = 0;
+    m_fluidBuffers.motionMax = 0;
+    m_fluidBuffers.cellHot = 0;
+    m_fluidBuffers.props = 0;
+    checkCudaErrors(cudaEventSynchronize(m_convergeEvent));
+    checkCudaErrors(cudaEventSynchronize(m_nbrStaleEvent));
+    checkCudaErrors(cudaEventDestroy(m_nbrStaleEvent));
+    checkCudaErrors(cudaFreeHost(m_hostNbrStale));
+    checkCudaErrors(cudaEventDestroy(m_convergeEvent));
+    for(int s=0;s<SPH_STAGE_TIMER_SETS;s++)
+    {
+        for(unsigned int i=0;i<m_stageSets[s].events.size();i++)
+        {
+            checkCudaErrors(cudaEventDestroy(m_stageSets[s].events[i]));
+        }
+    }
+    checkCudaErrors(cudaFreeHost(m_hostConvergedCount));
+    checkCudaErrors(cudaFreeHost(m_hostErrors));
+    checkCudaErrors(cudaEventSynchronize(m_simPropsEvent));
+    checkCudaErrors(cudaEventDestroy(m_simPropsEvent));
+    checkCudaErrors(cudaFreeHost(m_hostSimProps));
+    checkCudaErrors(cudaEventSynchronize(m_sortStatsEvent));
+    checkCudaErrors(cudaEventDestroy(m_sortStatsEvent));
+    checkCudaErrors(cudaFreeHost(m_hostSortStats));
+    checkCudaErrors(cudaEventSynchronize(m_posF2Event));
+    checkCudaErrors(cudaEventDestroy(m_posF2Event));
+    if(m_devPosF2) checkCudaErrors(cudaFree(m_devPosF2));
+    if(m_hostPosF2) checkCudaErrors(cudaFreeHost(m_hostPosF2));
+    // Our graphs are gone so nothing still refers to our thrust storage once our stream is done
+    checkCudaErrors(cudaStreamSynchronize(m_cudaStream));
+    destroyThrustAllocator(m_fluidBuffers.thrustAlloc);
+    m_fluidBuffers.thrustAlloc = 0;
     // Delete our CUDA streams as well
     checkCudaErrors(cudaStreamDestroy(m_cudaStream));
     // Delete our openGL objects
+    if(m_headless) return;
     glDeleteBuffers(1,&m_posVBO);
-    glDeleteBuffers(1,&m_classVBO);
     glDeleteVertexArrays(1,&m_activeVAO);
-    glDeleteBuffers(1,&m_bndVBO);
-    glDeleteVertexArrays(1,&m_bndPosVAO);
+    if(m_wallVBO) glDeleteBuffers(1,&m_wallVBO);
+    if(m_wallVAO) glDeleteVertexArrays(1,&m_wallVAO);
 
 }
 //----------------------------------------------------------------------------------------------------------------------
 void SPHSolverCUDA::setParticles(std::vector<float3> &_particles)
+{
+    // Particles given to us are always run as they are
+    if(m_progressiveTarget) applyProgressiveStage(m_progressiveStages-1);
+    m_progressiveTarget = 0;
+
+    int n = (int)_particles.size();
+    m_stepCount = 0;
+    beginSetParticles(n);
+    if(!n) return;
+
+    // Pack our particles as (x,y,density,class) and generate some classes for them
+    std::vector<float4> packed;
+    packed.resize(n);
+    float ccount = 0.f;
+    for(unsigned int i=0;i<packed.size();i++)
+    {
+        packed[i] = make_float4(_particles[i].x,_particles[i].y,0.f,ccount);
+        ccount+=1.f;
+        if(ccount>3)ccount=0.f;
+    }
+    checkCudaErrors(cudaMemcpyAsync(m_fluidBuffers.posPtr,&packed[0],sizeof(float4)*n,cudaMemcpyHostToDevice,m_cudaStream));
+
+    finishSetParticles();
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::beginSetParticles(int _n)
 {
     // Set how many particles we have
-    m_simProperties.numParticles = (int)_particles.size();
+    m_simProperties.numParticles = _n;
 
-    // Unregister our resource
-    checkCudaErrors(cudaGraphicsUnregisterResource(m_resourcePos));
-    checkCudaErrors(cudaGraphicsUnregisterResource(m_resourceClass));
+    // Any converged count still on its way belongs to our old particles
+    if(m_convergeReadPending) checkCudaErrors(cudaEventSynchronize(m_convergeEvent));
+    if(m_nbrStaleReadPending) checkCudaErrors(cudaEventSynchronize(m_nbrStaleEvent));
+    m_nbrStaleReadPending = false;
+    m_convergeReadPending = false;
+    m_converged = false;
+    m_stepsSinceConvergeCheck = 0;
 
-    // Fill our buffer with our positions
-    glBindVertexArray(m_activeVAO);
-    if(_particles.size())
-    {
-        glBindBuffer(GL_ARRAY_BUFFER, m_posVBO);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(float3)*_particles.size(), &_particles[0], GL_DYNAMIC_DRAW);
-        // create our cuda graphics resource for our vertexs used for our OpenGL interop
-        checkCudaErrors(cudaGraphicsGLRegisterBuffer(&m_resourcePos, m_posVBO, cudaGraphicsRegisterFlagsWriteDiscard));
-
-        // Generate some classes for our particles
-        std::vector<float> classes;
-        classes.resize(_particles.size());
-        float ccount = 0.f;
-        for(unsigned int i=0;i<classes.size();i++)
-        {
-            classes[i] = ccount;
-            ccount+=1.f;
-            if(ccount>3)ccount=0.f;
-        }
-        glBindBuffer(GL_ARRAY_BUFFER, m_classVBO);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(float)*classes.size(), &classes[0], GL_DYNAMIC_DRAW);
-
-        // create our cuda graphics resource for our vertexs used for our OpenGL interop
-        checkCudaErrors(cudaGraphicsGLRegisterBuffer(&m_resourceClass, m_classVBO, cudaGraphicsRegisterFlagsWriteDiscard));
-
-
-        // Delete our CUDA buffers fi they have anything in them
-        if(m_fluidBuffers.velPtr) checkCudaErrors(cudaFree(m_fluidBuffers.velPtr));
-        if(m_fluidBuffers.accPtr) checkCudaErrors(cudaFree(m_fluidBuffers.accPtr));
-        if(m_fluidBuffers.denPtr) checkCudaErrors(cudaFree(m_fluidBuffers.denPtr));
-        if(m_fluidBuffers.hashKeys) checkCudaErrors(cudaFree(m_fluidBuffers.hashKeys));
-        if(m_fluidBuffers.convergedPtr) checkCudaErrors(cudaFree(m_fluidBuffers.convergedPtr));
-        m_fluidBuffers.velPtr = 0;
-        m_fluidBuffers.accPtr = 0;
-        m_fluidBuffers.denPtr = 0;
-        m_fluidBuffers.hashKeys = 0;
-        m_fluidBuffers.convergedPtr = 0;
-        // Fill them up with some blank data
-        std::vector<float3> blankFloat3s;
-        blankFloat3s.resize(_particles.size());
-        for(unsigned int i=0;i<blankFloat3s.size();i++) blankFloat3s[i] = make_float3(0.f,0.f,0.f);
-
-        // Send the data to the GPU
-        checkCudaErrors(cudaMalloc(&m_fluidBuffers.velPtr,blankFloat3s.size()*sizeof(float3)));
-        checkCudaErrors(cudaMemcpy(m_fluidBuffers.velPtr,&blankFloat3s[0],sizeof(float3)*blankFloat3s.size(),cudaMemcpyHostToDevice));
-        checkCudaErrors(cudaMalloc(&m_fluidBuffers.accPtr,blankFloat3s.size()*sizeof(float3)));
-        checkCudaErrors(cudaMemcpy(m_fluidBuffers.accPtr,&blankFloat3s[0],sizeof(float3)*blankFloat3s.size(),cudaMemcpyHostToDevice));
-        checkCudaErrors(cudaMalloc(&m_fluidBuffers.hashKeys,_particles.size()*sizeof(int)));
-        checkCudaErrors(cudaMalloc(&m_fluidBuffers.convergedPtr,_particles.size()*sizeof(int)));
-        checkCudaErrors(cudaMalloc(&m_fluidBuffers.denPtr,_particles.size()*sizeof(float)));
-        fillIntZero(m_cudaStream,m_threadsPerBlock,m_fluidBuffers.hashKeys,(int)_particles.size());
-        fillIntZero(m_cudaStream,m_threadsPerBlock,m_fluidBuffers.convergedPtr,(int)_particles.size());
-
-        //Send our sim properties to the GPU
-        updateSimProps(&m_simProperties);
-
-        // Map our pointer for our position data
-        size_t posSize;
-        checkCudaErrors(cudaGraphicsMapResources(1,&m_resourcePos));
-        checkCudaErrors(cudaGraphicsResourceGetMappedPointer((void**)&m_fluidBuffers.posPtr,&posSize,m_resourcePos));
-        checkCudaErrors(cudaGraphicsMapResources(1,&m_resourceClass));
-        checkCudaErrors(cudaGraphicsResourceGetMappedPointer((void**)&m_fluidBuffers.classBuff,&posSize,m_resourceClass));
-
-        int tableSize = (int)ceil(m_simProperties.gridRes.x *m_simProperties.gridRes.y);
-        fillIntZero(m_cudaStream,m_threadsPerBlock,m_fluidBuffers.cellIndexBuffer,tableSize);
-        fillIntZero(m_cudaStream,m_threadsPerBlock,m_fluidBuffers.cellOccBuffer,tableSize);
+    // Our graphs were captured for our old particle count
+    destroyGraph();
 
-        // Hash and sort our particles
-        hashAndSort(m_cudaStream, m_threadsPerBlock, m_simProperties.numParticles, tableSize , m_fluidBuffers);
+    if(!_n) return;
 
-        //unmap our buffer pointer and set it free into the wild
-        checkCudaErrors(cudaGraphicsUnmapResources(1,&m_resourcePos));
-        checkCudaErrors(cudaGraphicsUnmapResources(1,&m_resourceClass));
+    // When we are deferring we may not be on our OpenGL thread, acquireFrame() grows our buffer instead
+    if(!m_deferPublish) reserveGLBuffers(_n);
 
-        //Set our volume if it hasnt already been set
-        if(!m_volume)
-        {
-            m_volume = m_simProperties.mass * m_simProperties.numParticles;
-        }
-        else
-        {
-            m_simProperties.mass = m_volume/(m_simProperties.numParticles);
-        }
+    // Our particle attributes are double buffered so our spatial sort can gather into the other half.
+    // These only ever grow so resetting with the same or fewer particles just zeros what we already have.
+    if(_n>m_particleCapacity)
+    {
+        freeParticleBuffers();
+        allocParticleBuffers(_n);
     }
     else
     {
-        glBindBuffer(GL_ARRAY_BUFFER, m_posVBO);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(float3), NULL, GL_DYNAMIC_DRAW);
+        resetParticleBuffers(_n);
+        m_nbrListValid = false;
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::finishSetParticles()
+{
+    //Send our sim properties to the GPU
+    markSimPropsDirty();
+    updateGPUSimProps();
+
+    // Hash and sort our particles
+    m_sortValid = false;
+    spatialSort();
 
-        glBindBuffer(GL_ARRAY_BUFFER, m_classVBO);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(float), NULL, GL_DYNAMIC_DRAW);
+    // None of our new particles have converged yet
+    resetActiveSet();
 
-        // create our cuda graphics resource for our vertexs used for our OpenGL interop
-        checkCudaErrors(cudaGraphicsGLRegisterBuffer(&m_resourcePos, m_posVBO, cudaGraphicsRegisterFlagsWriteDiscard));        
-        checkCudaErrors(cudaGraphicsGLRegisterBuffer(&m_resourcePos, m_classVBO, cudaGraphicsRegisterFlagsWriteDiscard));
+    //Set our volume if it hasnt already been set
+    if(!m_volume)
+    {
+        m_volume = m_simProperties.mass * m_simProperties.numParticles;
+    }
+    else
+    {
+        m_simProperties.mass = m_volume/(m_simProperties.numParticles);
+        markSimPropsDirty();
+    }
 
+    // Give OpenGL our sorted particles to draw straight away
+    publishGLBuffers();
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::allocParticleBuffers(int _capacity)
+{
+    int n = _capacity;
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.posPtr,n*sizeof(float4)));
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.posSwap,n*sizeof(float4)));
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.velPtr,n*sizeof(float2)));
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.velSwap,n*sizeof(float2)));
+
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.hashKeys,n*sizeof(int)));
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.sortedHashKeys,n*sizeof(int)));
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.particleIdx,n*sizeof(int)));
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.sortedIdx,n*sizeof(int)));
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.packedKeys,n*sizeof(unsigned long long)));
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.repairKeys,n*sizeof(unsigned long long)));
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.stayFlags,n*sizeof(int)));
+    m_fluidBuffers.sortTempBytes = sortTempStorageBytes(n);
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.sortTempStorage,m_fluidBuffers.sortTempBytes));
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.convergedPtr,n*sizeof(int)));
+    int numPartials = (n+SPH_REDUCE_THREADS-1)/SPH_REDUCE_THREADS;
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.denPartials,numPartials*sizeof(float)));
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.scalePtr,n*sizeof(float)));
+    m_particleCapacity = n;
+    if(m_neighbourSearchMode==NEIGHBOUR_SEARCH_LIST) allocNeighbourList();
+    if(m_activeSet) allocActiveSet();
+    resetParticleBuffers(n);
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::resetParticleBuffers(int _n)
+{
+    // Zero these on the device rather than uploading blank data from the host
+    checkCudaErrors(cudaMemsetAsync(m_fluidBuffers.velPtr,0,_n*sizeof(float2),m_cudaStream));
+    checkCudaErrors(cudaMemsetAsync(m_fluidBuffers.hashKeys,0,_n*sizeof(int),m_cudaStream));
+    checkCudaErrors(cudaMemsetAsync(m_fluidBuffers.convergedPtr,0,_n*sizeof(int),m_cudaStream));
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::reserveParticles(int _capacity)
+{
+    if(_capacity<=m_particleCapacity) return;
 
+    // Hold on to our current particles while everything else is reallocated
+    float4 *oldPos = m_fluidBuffers.posPtr;
+    float2 *oldVel = m_fluidBuffers.velPtr;
+    m_fluidBuffers.posPtr = 0;
+    m_fluidBuffers.velPtr = 0;
 
-        // Delete our CUDA buffers fi they have anything in them
-        if(m_fluidBuffers.velPtr) checkCudaErrors(cudaFree(m_fluidBuffers.velPtr));
-        if(m_fluidBuffers.accPtr) checkCudaErrors(cudaFree(m_fluidBuffers.accPtr));
-        if(m_fluidBuffers.denPtr) checkCudaErrors(cudaFree(m_fluidBuffers.denPtr));
-        if(m_fluidBuffers.hashKeys) checkCudaErrors(cudaFree(m_fluidBuffers.hashKeys));
-        if(m_fluidBuffers.convergedPtr) checkCudaErrors(cudaFree(m_fluidBuffers.convergedPtr));
-        m_fluidBuffers.velPtr = 0;
-        m_fluidBuffers.accPtr = 0;
-        m_fluidBuffers.denPtr = 0;
-        m_fluidBuffers.hashKeys = 0;
-        m_fluidBuffers.convergedPtr = 0;
+    // Our graphs point at the buffers we are about to free
+    destroyGraph();
+    freeParticleBuffers();
+    allocParticleBuffers(_capacity);
 
+    int n = m_simProperties.numParticles;
+    if(n && oldPos)
+    {
+        checkCudaErrors(cudaMemcpyAsync(m_fluidBuffers.posPtr,oldPos,n*sizeof(float4),cudaMemcpyDeviceToDevice,m_cudaStream));
+        checkCudaErrors(cudaMemcpyAsync(m_fluidBuffers.velPtr,oldVel,n*sizeof(float2),cudaMemcpyDeviceToDevice,m_cudaStream));
+    }
+    // Other devices may read our particles straight after this so make sure they have landed
+    checkCudaErrors(cudaStreamSynchronize(m_cudaStream));
+    if(oldPos) checkCudaErrors(cudaFree(oldPos));
+    if(oldVel) checkCudaErrors(cudaFree(oldVel));
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::freeParticleBuffers()
+{
+    if(m_fluidBuffers.posPtr) checkCudaErrors(cudaFree(m_fluidBuffers.posPtr));
+    if(m_fluidBuffers.posSwap) checkCudaErrors(cudaFree(m_fluidBuffers.posSwap));
+    if(m_fluidBuffers.velPtr) checkCudaErrors(cudaFree(m_fluidBuffers.velPtr));
+    if(m_fluidBuffers.velSwap) checkCudaErrors(cudaFree(m_fluidBuffers.velSwap));
+    if(m_fluidBuffers.hashKeys) checkCudaErrors(cudaFree(m_fluidBuffers.hashKeys));
+    if(m_fluidBuffers.sortedHashKeys) checkCudaErrors(cudaFree(m_fluidBuffers.sortedHashKeys));
+    if(m_fluidBuffers.particleIdx) checkCudaErrors(cudaFree(m_fluidBuffers.particleIdx));
+    if(m_fluidBuffers.sortedIdx) checkCudaErrors(cudaFree(m_fluidBuffers.sortedIdx));
+    if(m_fluidBuffers.packedKeys) checkCudaErrors(cudaFree(m_fluidBuffers.packedKeys));
+    if(m_fluidBuffers.repairKeys) checkCudaErrors(cudaFree(m_fluidBuffers.repairKeys));
+    if(m_fluidBuffers.stayFlags) checkCudaErrors(cudaFree(m_fluidBuffers.stayFlags));
+    if(m_fluidBuffers.sortTempStorage) checkCudaErrors(cudaFree(m_fluidBuffers.sortTempStorage));
+    if(m_fluidBuffers.convergedPtr) checkCudaErrors(cudaFree(m_fluidBuffers.convergedPtr));
+    if(m_fluidBuffers.denPartials) checkCudaErrors(cudaFree(m_fluidBuffers.denPartials));
+    if(m_fluidBuffers.scalePtr) checkCudaErrors(cudaFree(m_fluidBuffers.scalePtr));
+    m_fluidBuffers.posPtr = 0;
+    m_fluidBuffers.posSwap = 0;
+    m_fluidBuffers.velPtr = 0;
+    m_fluidBuffers.velSwap = 0;
+    m_fluidBuffers.hashKeys = 0;
+    m_fluidBuffers.sortedHashKeys = 0;
+    m_fluidBuffers.particleIdx = 0;
+    m_fluidBuffers.sortedIdx = 0;
+    m_fluidBuffers.packedKeys = 0;
+    m_fluidBuffers.repairKeys = 0;
+    m_fluidBuffers.stayFlags = 0;
+    m_fluidBuffers.sortTempStorage = 0;
+    m_fluidBuffers.sortTempBytes = 0;
+    m_fluidBuffers.convergedPtr = 0;
+    m_fluidBuffers.denPartials = 0;
+    m_fluidBuffers.scalePtr = 0;
+    m_particleCapacity = 0;
+    freeNeighbourList();
+    freeActiveSet();
+    m_bufferParity = 0;
+    m_sortValid = false;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::allocNeighbourList()
+{
+    int n = m_particleCapacity;
+    if(!n) return;
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.nbrCount,n*sizeof(int)));
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.nbrOffsets,n*sizeof(int)));
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.nbrRefPos,n*sizeof(float2)));
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.nbrList,(size_t)n*m_maxNeighbours*sizeof(int)));
+    m_nbrListValid = false;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::allocActiveSet()
+{
+    int n = m_particleCapacity;
+    if(!n) return;
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.activeIdx,n*sizeof(int)));
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.activeFlags,n*sizeof(int)));
+    checkCudaErrors(cudaMalloc(&m_fluidBuffers.activeCount,sizeof(int)));
+    resetActiveSet();
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::freeActiveSet()
+{
+    if(m_fluidBuffers.activeIdx) checkCudaErrors(cudaFree(m_fluidBuffers.activeIdx));
+    if(m_fluidBuffers.activeFlags) checkCudaErrors(cudaFree(m_fluidBuffers.activeFlags));
+    if(m_fluidBuffers.activeCount) checkCudaErrors(cudaFree(m_fluidBuffers.activeCount));
+    m_fluidBuffers.activeIdx = 0;
+    m_fluidBuffers.activeFlags = 0;
+    m_fluidBuffers.activeCount = 0;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::resetActiveSet()
+{
+    // Any non zero int counts as hot
+    if(m_fluidBuffers.cellHot) checkCudaErrors(cudaMemsetAsync(m_fluidBuffers.cellHot,1,m_cellTableCapacity*sizeof(int),m_cudaStream));
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::setActiveSet(bool _active)
+{
+    if(_active==m_activeSet) return;
+    // Our graphs point at our active set buffers
+    destroyGraph();
+    m_activeSet = _active;
+    // Like our neighbour lists these are only worth the memory when we are using them
+    if(_active)
+    {
+        allocActiveSet();
+    }
+    else
+    {
+        freeActiveSet();
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::freeNeighbourList()
+{
+    if(m_fluidBuffers.nbrCount) checkCudaErrors(cudaFree(m_fluidBuffers.nbrCount));
+    if(m_fluidBuffers.nbrOffsets) checkCudaErrors(cudaFree(m_fluidBuffers.nbrOffsets));
+    if(m_fluidBuffers.nbrRefPos) checkCudaErrors(cudaFree(m_fluidBuffers.nbrRefPos));
+    if(m_fluidBuffers.nbrList) checkCudaErrors(cudaFree(m_fluidBuffers.nbrList));
+    m_fluidBuffers.nbrCount = 0;
+    m_fluidBuffers.nbrOffsets = 0;
+    m_fluidBuffers.nbrRefPos = 0;
+    m_fluidBuffers.nbrList = 0;
+    m_nbrListValid = false;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::setNeighbourSearchMode(NeighbourSearchMode _mode)
+{
+    if(_mode==m_neighbourSearchMode) return;
+    // Our graphs may point at our neighbour list buffers
+    destroyGraph();
+    m_neighbourSearchMode = _mode;
+    // Our cell shared kernal doesnt keep our hot cells up to date
+    resetActiveSet();
+    // Our neighbour lists are only worth the memory when we are using them
+    if(_mode==NEIGHBOUR_SEARCH_LIST)
+    {
+        allocNeighbourList();
+    }
+    else
+    {
+        freeNeighbourList();
     }
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::updateGPUSimProps()
+{
+    if(!m_simPropsDirty) return;
 
+    // Our last upload may still be reading our pinned copy. Uploads are rare so this almost never waits.
+    checkCudaErrors(cudaEventSynchronize(m_simPropsEvent));
+    *m_hostSimProps = m_simProperties;
+    updateSimProps(m_hostSimProps,m_fluidBuffers,m_cudaStream);
+    checkCudaErrors(cudaEventRecord(m_simPropsEvent,m_cudaStream));
+
+    m_simPropsDirty = false;
+    m_simPropsVersion++;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::setThreadsPerBlock(int _threads)
+{
+    // Keep to whole warps
+    _threads = std::max(32,std::min(_threads,m_maxThreadsPerBlock));
+    _threads -= _threads%32;
+    if(_threads==m_threadsPerBlock) return;
+    // Our launch sizes are baked into our graphs
+    destroyGraph();
+    m_threadsPerBlock = _threads;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::setMaxNeighbours(int _max)
+{
+    if(_max<1 || _max==m_maxNeighbours) return;
+    m_maxNeighbours = _max;
+    m_nbrOverflowWarned = false;
+    if(!m_fluidBuffers.nbrList) return;
+    destroyGraph();
+    freeNeighbourList();
+    allocNeighbourList();
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::setNeighbourListSkin(float _skin)
+{
+    m_simProperties.skin = (_skin>0.f) ? _skin : 0.f;
+    // Our grid cells have to cover our smoothing length plus our skin
+    setHashPosAndDim(m_simProperties.gridMin,m_simProperties.gridDim);
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::checkNeighbourList()
+{
+    // Pick up our last flags once their copy has landed
+    if(m_nbrStaleReadPending && cudaEventQuery(m_nbrStaleEvent)==cudaSuccess)
+    {
+        if(*m_hostNbrStale & SPH_NEIGHBOUR_STALE) m_nbrRebuildRequested = true;
+        if((*m_hostNbrStale & SPH_NEIGHBOUR_OVERFLOW) && !m_nbrOverflowWarned)
+        {
+            std::cout<<"Warning: particles have more than "<<m_maxNeighbours<<" neighbours, some have been dropped. Try setMaxNeighbours()"<<std::endl;
+            m_nbrOverflowWarned = true;
+        }
+        m_nbrStaleReadPending = false;
+    }
+    // Start our next copy without waiting on our stream
+    if(!m_nbrStaleReadPending)
+    {
+        checkCudaErrors(cudaMemcpyAsync(m_hostNbrStale,m_fluidBuffers.nbrStale,sizeof(int),cudaMemcpyDeviceToHost,m_cudaStream));
+        checkCudaErrors(cudaEventRecord(m_nbrStaleEvent,m_cudaStream));
+        m_nbrStaleReadPending = true;
+    }
 }
 //----------------------------------------------------------------------------------------------------------------------
 std::vector<float3> SPHSolverCUDA::getParticlePositions()
 {
-    // Map our pointer for our position data
-    size_t posSize;
-    checkCudaErrors(cudaGraphicsMapResources(1,&m_resourcePos));
-    checkCudaErrors(cudaGraphicsResourceGetMappedPointer((void**)&m_fluidBuffers.posPtr,&posSize,m_resourcePos));
-
     std::vector<float3> positions;
     positions.resize(m_simProperties.numParticles);
+    if(!m_simProperties.numParticles) return positions;
 
-    // Copy our data from the GPU
-    checkCudaErrors(cudaMemcpy(&positions[0],m_fluidBuffers.posPtr,sizeof(float3)*m_simProperties.numParticles,cudaMemcpyDeviceToHost));
+    // Copy our packed data from the GPU
+    std::vector<float4> packed;
+    packed.resize(m_simProperties.numParticles);
+    checkCudaErrors(cudaMemcpyAsync(&packed[0],m_fluidBuffers.posPtr,sizeof(float4)*m_simProperties.numParticles,cudaMemcpyDeviceToHost,m_cudaStream));
+    checkCudaErrors(cudaStreamSynchronize(m_cudaStream));
 
-    //unmap our buffer pointer and set it free into the wild
-    checkCudaErrors(cudaGraphicsUnmapResources(1,&m_resourcePos));
+    for(unsigned int i=0;i<packed.size();i++)
+    {
+        positions[i] = make_float3(packed[i].x,packed[i].y,0.f);
+    }
 
     return positions;
 }
 //----------------------------------------------------------------------------------------------------------------------
 std::vector<float2> SPHSolverCUDA::getParticlePosF2()
 {
-    std::vector<float3> posf3 = getParticlePositions();
-    std::vector<float2> posf2;
-    posf2.resize(posf3.size());
-    for(unsigned int i=0;i<posf3.size();i++)
+    std::vector<float2> positions;
+    positions.resize(m_simProperties.numParticles);
+    if(!m_simProperties.numParticles) return positions;
+
+    int n = m_simProperties.numParticles;
+    checkCudaErrors(cudaSetDevice(m_device));
+    if(n>m_posF2Capacity)
     {
-        posf2[i] = make_float2(posf3[i].x,posf3[i].y);
+        // Our last copy has to be done with our old buffers before we free them. Growing is the only time we allocate.
+        checkCudaErrors(cudaEventSynchronize(m_posF2Event));
+        if(m_devPosF2) checkCudaErrors(cudaFree(m_devPosF2));
+        if(m_hostPosF2) checkCudaErrors(cudaFreeHost(m_hostPosF2));
+        m_posF2Capacity = n+n/4;
+        checkCudaErrors(cudaMalloc(&m_devPosF2,sizeof(float2)*m_posF2Capacity));
+        checkCudaErrors(cudaHostAlloc(&m_hostPosF2,sizeof(float2)*m_posF2Capacity,cudaHostAllocDefault));
     }
-    return posf2;
+
+    // Pack our positions on the GPU and copy them back on our stream. We only wait for our copy, not for
+    // anything queued behind it.
+    packParticles(m_devPosF2,0,0);
+    checkCudaErrors(cudaMemcpyAsync(m_hostPosF2,m_devPosF2,sizeof(float2)*n,cudaMemcpyDeviceToHost,m_cudaStream));
+    checkCudaErrors(cudaEventRecord(m_posF2Event,m_cudaStream));
+    checkCudaErrors(cudaEventSynchronize(m_posF2Event));
+    positions.assign(m_hostPosF2,m_hostPosF2+n);
+
+    return positions;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::packParticles(float2 *_xy, unsigned char *_class, float *_radius)
+{
+    if(!m_simProperties.numParticles) return;
+    checkCudaErrors(cudaSetDevice(m_device));
+    updateGPUSimProps();
+    packParticleExport(m_cudaStream,m_threadsPerBlock,m_simProperties.numParticles,m_fluidBuffers,m_multiclass,_xy,_class,_radius);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
 void SPHSolverCUDA::genRandomSamples(float _n)
 {
-    float3 tempVec;
-    boost::uniform_real<float> MinusPlusOneFloatDistrib(0.f, 1.f);
-    boost::mt19937 rng(time(NULL));
-    boost::variate_generator< boost::mt19937, boost::uniform_real<float> > gen(rng, MinusPlusOneFloatDistrib);
-    std::vector<float3> positionsfloat;
-    positionsfloat.resize(_n);
-    for(unsigned int i=0;i<_n;i++)
+    int n = (int)_n;
+
+    // Go back to our full resolution if we were already running progressively then start our first stage
+    if(m_progressiveTarget) applyProgressiveStage(m_progressiveStages-1);
+    m_progressiveTarget = 0;
+    if(m_progressiveStages>1 && n>0)
+    {
+        m_progressiveTarget = n;
+        m_progressiveFinalH = m_simProperties.h;
+        m_stageIterations = 0;
+        applyProgressiveStage(0);
+        n = progressiveStageCount(0);
+    }
+
+    m_stepCount = 0;
+    beginSetParticles(n);
+    if(!n) return;
+
+    // Give each call its own seed so calling us again gives new samples, but the
+    // same seed and sequence of calls always gives the same samples
+    unsigned long long seed = m_sampleSeed + m_sampleGeneration*0x9E3779B97F4A7C15ULL;
+    m_sampleGeneration++;
+
+    // Write our samples straight into our particle buffer, nothing goes through the host
+    const double *cdf = (m_importanceSampling) ? m_sampleCDF : 0;
+    generateRandomSamples(m_cudaStream,m_threadsPerBlock,n,m_fluidBuffers.posPtr,make_float2(m_simBounds.x,m_simBounds.y),seed,cdf,m_sampleCDFWidth,m_sampleCDFHeight);
+
+    finishSetParticles();
+}
+//----------------------------------------------------------------------------------------------------------------------
+int SPHSolverCUDA::progressiveStageCount(int _stage)
+{
+    int n = m_progressiveTarget;
+    for(int s=_stage;s<m_progressiveStages-1;s++) n/=4;
+    return (n>0) ? n : 1;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::applyProgressiveStage(int _stage)
+{
+    m_progressiveStage = _stage;
+    bool last = (_stage>=m_progressiveStages-1);
+
+    // Our particle spacing goes with 1/sqrt(count) so our smoothing length does too. This also rebuilds our hash grid.
+    float scale = last ? 1.f : sqrtf((float)m_progressiveTarget/(float)progressiveStageCount(_stage));
+    if(m_progressiveFinalH>0.f) setSmoothingLength(m_progressiveFinalH*scale);
+
+    // Give each stage an image with about as much detail as its particles can show
+    if(m_sampleImage.isNull()) return;
+    if(last)
     {
-        tempVec = make_float3(gen(),gen(),0.f);
-        while(tempVec.x==0.f || tempVec.x==1.f || tempVec.y==0.f || tempVec.y==1.f) tempVec = make_float3(gen(),gen(),0.f);
-        tempVec.x*=m_simBounds.x;
-        tempVec.y*=m_simBounds.y;
-        positionsfloat[i] = make_float3(tempVec.x,tempVec.y,tempVec.z);
+        uploadSampleImage(m_sampleImage);
+        return;
     }
-    setParticles(positionsfloat);
+    int w = std::max(1,(int)(m_sampleImage.width()/scale));
+    int h = std::max(1,(int)(m_sampleImage.height()/scale));
+    uploadSampleImage(m_sampleImage.scaled(w,h,Qt::IgnoreAspectRatio,Qt::SmoothTransformation));
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::refineProgressiveStage()
+{
+    int numOld = m_simProperties.numParticles;
+    int stage = m_progressiveStage+1;
+    int numNew = std::max(progressiveStageCount(stage),numOld);
+    applyProgressiveStage(stage);
+    m_stageIterations = 0;
+
+    // Grow our buffers while keeping our current positions, then add our new particles in between our old ones
+    reserveParticles(numNew);
+    beginSetParticles(numNew);
+    unsigned long long seed = m_sampleSeed + m_sampleGeneration*0x9E3779B97F4A7C15ULL;
+    m_sampleGeneration++;
+    float2 bounds = make_float2(m_simBounds.x,m_simBounds.y);
+    float spacing = sqrtf(bounds.x*bounds.y/(float)numNew);
+    splitParticles(m_cudaStream,m_threadsPerBlock,numOld,numNew,m_fluidBuffers.posPtr,bounds,0.5f*spacing,seed);
+    finishSetParticles();
+
+    std::cout<<"Progressive stage "<<stage+1<<"/"<<m_progressiveStages<<": "<<numNew<<" particles, h "<<m_simProperties.h<<std::endl;
 }
 //----------------------------------------------------------------------------------------------------------------------
 void SPHSolverCUDA::setSmoothingLength(float _h)
@@ -389,6 +919,7 @@ void SPHSolverCUDA::setSmoothingLength(float _h)
     m_simProperties.cWConst1 = 32.f/((float)M_PI*_h*_h*_h*_h*_h*_h*_h*_h*_h);
     m_simProperties.cWConst2 = (_h*_h*_h*_h*_h*_h)/64.f;
 
+    updateWallTable();
     setHashPosAndDim(m_simProperties.gridMin,m_simProperties.gridDim);
 }
 //----------------------------------------------------------------------------------------------------------------------
@@ -396,108 +927,915 @@ void SPHSolverCUDA::setHashPosAndDim(float2 _gridMin, float2 _gridDim)
 {
     m_simProperties.gridMin = _gridMin;
     m_simProperties.gridDim = _gridDim;
-    m_simProperties.gridRes.x = (int)ceil(_gridDim.x/m_simProperties.h);
-    m_simProperties.gridRes.y = (int)ceil(_gridDim.y/m_simProperties.h);
+    // Our cells cover our smoothing length plus our neighbour list skin so a 3x3 search finds everything
+    float cellSize = m_simProperties.h + m_simProperties.skin;
+    m_simProperties.gridRes.x = (int)ceil(_gridDim.x/cellSize);
+    m_simProperties.gridRes.y = (int)ceil(_gridDim.y/cellSize);
     int tableSize = ceil(m_simProperties.gridRes.x *m_simProperties.gridRes.y);
 
     // No point in alocating a buffer size of zero so lets just return
     if(tableSize==0)return;
 
-    std::cout<<"table size "<<tableSize<<std::endl;
+    // Our last sort and neighbour list were for our old grid
+    m_sortValid = false;
+    m_nbrListValid = false;
 
-    // Remove anything that is in our bufferes currently
-    if(m_fluidBuffers.cellIndexBuffer) checkCudaErrors(cudaFree(m_fluidBuffers.cellIndexBuffer));
-    if(m_fluidBuffers.cellOccBuffer) checkCudaErrors(cudaFree(m_fluidBuffers.cellOccBuffer));
-    if(m_fluidBuffers.hashMap) checkCudaErrors(cudaFree(m_fluidBuffers.hashMap));
-    m_fluidBuffers.cellIndexBuffer = 0;
-    m_fluidBuffers.cellOccBuffer = 0;
-    m_fluidBuffers.hashMap = 0;
-    // Send the data to our GPU buffers
-    checkCudaErrors(cudaMalloc(&m_fluidBuffers.cellIndexBuffer,tableSize*sizeof(int)));
-    checkCudaErrors(cudaMalloc(&m_fluidBuffers.cellOccBuffer,tableSize*sizeof(int)));
+    // Our cell buffers only ever grow so sweeping our smoothing length doesnt reallocate every time
+    if(tableSize>m_cellTableCapacity)
+    {
+        std::cout<<"table size "<<tableSize<<std::endl;
+
+        // Our graphs point at the buffers we are about to free
+        destroyGraph();
+
+        // Remove anything that is in our bufferes currently
+        if(m_fluidBuffers.cellIndexBuffer) checkCudaErrors(cudaFree(m_fluidBuffers.cellIndexBuffer));
+        if(m_fluidBuffers.cellOccBuffer) checkCudaErrors(cudaFree(m_fluidBuffers.cellOccBuffer));
+        // Send the data to our GPU buffers
+        checkCudaErrors(cudaMalloc(&m_fluidBuffers.cellIndexBuffer,tableSize*sizeof(int)));
+        checkCudaErrors(cudaMalloc(&m_fluidBuffers.cellOccBuffer,tableSize*sizeof(int)));
+        if(m_fluidBuffers.cellHot) checkCudaErrors(cudaFree(m_fluidBuffers.cellHot));
+        checkCudaErrors(cudaMalloc(&m_fluidBuffers.cellHot,tableSize*sizeof(int)));
+        m_cellTableCapacity = tableSize;
+    }
+    // Our hot cells were for our old grid
+    resetActiveSet();
     // Fill with blank data
     fillIntZero(m_cudaStream,m_threadsPerBlock,m_fluidBuffers.cellOccBuffer,tableSize);
 
-    // Update this our simulation properties on the GPU
+    // Update this our simulation properties on the GPU. Our neighbour cells are worked out from our grid
+    // resolution in our kernals so that is all there is to it.
+    markSimPropsDirty();
     updateGPUSimProps();
-
-    // Allocate memory for our hash map
-    checkCudaErrors(cudaMalloc(&m_fluidBuffers.hashMap,tableSize*sizeof(cellInfo)));
-    // Compute our hash map
-    createHashMap(m_cudaStream,m_threadsPerBlock,tableSize,m_fluidBuffers);
-
-
 }
 //----------------------------------------------------------------------------------------------------------------------
-void SPHSolverCUDA::update()
+void SPHSolverCUDA::update(int _iterations)
 {
+    SPH_NVTX_RANGE("SPHSolverCUDA::update");
     //if no particles then theres no point in updating so just return
     if(!m_simProperties.numParticles)return;
 
-    // Set our hash table values back to zero
+    // Move on to our next stage once this one has converged or had long enough
+    if(m_progressiveTarget && m_progressiveStage<m_progressiveStages-1)
+    {
+        if(pollConverged() || m_stageIterations>=m_stageMaxIterations) refineProgressiveStage();
+        m_stageIterations+=_iterations;
+    }
+
+    //Send our sim properties to the GPU, this does nothing unless they have changed
+    updateGPUSimProps();
+
+    for(int i=0;i<_iterations;i++)
+    {
+        if(!m_useCudaGraph || m_stageTiming || m_liveStats)
+        {
+            beginStageStep();
+            enqueueDeviceStep();
+            if(m_neighbourSearchMode==NEIGHBOUR_SEARCH_LIST) checkNeighbourList();
+            collectStageTimes();
+        }
+        else if(!graphIsValid())
+        {
+            // Run this step normally first so all our temporary storage is allocated before we capture.
+            // Our step swaps our buffers so swap back to capture from the same state.
+            enqueueDeviceStep();
+            swapParticleBuffers();
+            buildGraph();
+        }
+        else
+        {
+            SPH_NVTX_PUSH("step graph");
+            checkCudaErrors(cudaGraphLaunch(m_graphExec[m_bufferParity],m_cudaStream));
+            SPH_NVTX_POP();
+            swapParticleBuffers();
+        }
+        m_stepsSinceConvergeCheck++;
+        m_stepCount++;
+
+        // Our snapshot only queues more work behind this step, our writer thread does the waiting
+        if(m_snapshotWriter && m_stepCount%m_snapshotInterval==0) m_snapshotWriter->capture(*this,m_stepCount);
+    }
+
+    // Our step rate is only worked out every so often so it doesnt jitter from call to call
+    m_statsSteps+=_iterations;
+    int elapsed = m_statsClock.elapsed();
+    if(elapsed>=500)
+    {
+        m_stepsPerSecond = m_statsSteps*1000.f/elapsed;
+        m_statsSteps = 0;
+        m_statsClock.restart();
+    }
+
+    // Every few steps copy our converged count back into pinned memory. The host only looks at
+    // it once our event says the copy is done so we never wait on the stream here. Our count of
+    // particles outside our grid and anything our kernals reported ride along with it.
+    if(m_stepsSinceConvergeCheck>=m_convergeCheckInterval && !m_convergeReadPending)
+    {
+        checkCudaErrors(cudaMemcpyAsync(m_hostConvergedCount,m_fluidBuffers.convergedCount,sizeof(int),cudaMemcpyDeviceToHost,m_cudaStream));
+        checkCudaErrors(cudaMemcpyAsync(m_hostConvergedCount+1,m_fluidBuffers.nullHashCount,sizeof(int),cudaMemcpyDeviceToHost,m_cudaStream));
+        checkCudaErrors(cudaMemcpyAsync(m_hostErrors,m_fluidBuffers.errors,sizeof(SolverErrors),cudaMemcpyDeviceToHost,m_cudaStream));
+        checkCudaErrors(cudaEventRecord(m_convergeEvent,m_cudaStream));
+        m_convergeReadPending = true;
+        m_stepsSinceConvergeCheck = 0;
+    }
+
+    // Our launches are all asynchronous so just check for errors once per call
+    checkSolverErrors("SPHSolverCUDA::update");
+
+    // Give OpenGL our new positions to draw
+    publishGLBuffers();
+}
+//----------------------------------------------------------------------------------------------------------------------
+bool SPHSolverCUDA::convergedState()
+{
+    // Our earlier progressive stages converging doesnt mean we are done
+    bool converged = pollConverged();
+    if(m_progressiveTarget && m_progressiveStage<m_progressiveStages-1) return false;
+    return converged;
+}
+//----------------------------------------------------------------------------------------------------------------------
+bool SPHSolverCUDA::waitConvergedState()
+{
+    if(m_convergeReadPending) checkCudaErrors(cudaEventSynchronize(m_convergeEvent));
+    return convergedState();
+}
+//----------------------------------------------------------------------------------------------------------------------
+bool SPHSolverCUDA::pollConverged()
+{
+    // Only pick up our count once its copy has landed, otherwise report what we knew last time
+    if(m_convergeReadPending && cudaEventQuery(m_convergeEvent)==cudaSuccess)
+    {
+        m_lastConvergedCount = m_hostConvergedCount[0];
+        m_lastNullHashCount = m_hostConvergedCount[1];
+        m_converged = (m_lastConvergedCount==m_simProperties.numParticles);
+        m_convergeReadPending = false;
+        reportDeviceErrors();
+    }
+    return m_converged;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::reportDeviceErrors()
+{
+    static const char *names[SPH_NUM_ERRORS] = {"particles outside our hash grid","image samples out of bounds","NaN size functions","non finite motion in our adaptive timestep"};
+    // Only say something when our counts have grown since we last looked, so an unstable run gives us one line
+    // per check rather than one per thread
+    for(int i=0;i<SPH_NUM_ERRORS;i++)
+    {
+        int count = m_hostErrors->count[i];
+        if(count<=m_reportedErrors[i]) continue;
+        float4 info = m_hostErrors->firstInfo[i];
+        std::cerr<<"Warning: "<<count-m_reportedErrors[i]<<" more "<<names[i]<<" ("<<count<<" total). First from thread "
+                 <<m_hostErrors->firstThread[i]<<" with "<<info.x<<", "<<info.y<<", "<<info.z<<", "<<info.w<<std::endl;
+        m_reportedErrors[i] = count;
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::spatialSort()
+{
     int tableSize = ceil(m_simProperties.gridRes.x *m_simProperties.gridRes.y);
-    fillIntZero(m_cudaStream,m_threadsPerBlock,m_fluidBuffers.cellIndexBuffer,tableSize);
+
+    // Our incremental sort makes decisions on the host so it cant be captured in our graphs
+    if(m_incrementalSort && m_sortValid && !m_useCudaGraph)
+    {
+        incrementalSort(tableSize);
+        return;
+    }
+
+    // Set our cell occupancy back to zero. Our cell indices are completely written by our scan.
+    markStage(SOLVER_STAGE_HASH);
     fillIntZero(m_cudaStream,m_threadsPerBlock,m_fluidBuffers.cellOccBuffer,tableSize);
 
-    //Send our sim properties to the GPU
-    updateSimProps(&m_simProperties);
+    // Hash our particles and sort their indices by cell
+    hashParticles(m_cudaStream,m_threadsPerBlock,m_simProperties.numParticles,m_fluidBuffers);
+    markStage(SOLVER_STAGE_SORT);
+    sortParticleKeys(m_cudaStream,m_simProperties.numParticles,tableSize,m_fluidBuffers);
 
-    // Map our pointer for our position data
-    size_t posSize;
-    checkCudaErrors(cudaGraphicsMapResources(1,&m_resourcePos));
-    checkCudaErrors(cudaGraphicsResourceGetMappedPointer((void**)&m_fluidBuffers.posPtr,&posSize,m_resourcePos));
-    checkCudaErrors(cudaGraphicsMapResources(1,&m_resourceClass));
-    checkCudaErrors(cudaGraphicsResourceGetMappedPointer((void**)&m_fluidBuffers.classBuff,&posSize,m_resourceClass));
-    checkCudaErrors(cudaGraphicsMapResources(1,&m_resourceBndPos));
-    checkCudaErrors(cudaGraphicsResourceGetMappedPointer((void**)&m_fluidBuffers.bndPos,&posSize,m_resourceBndPos));
+    // Move our particles into sorted order and make that our current data
+    gatherParticles(m_cudaStream,m_threadsPerBlock,m_simProperties.numParticles,m_fluidBuffers);
+    swapParticleBuffers();
 
-    // Hash and sort our particles
-    hashAndSort(m_cudaStream, m_threadsPerBlock, m_simProperties.numParticles, tableSize , m_fluidBuffers);
+    // Find where each of our cells begin
+    markStage(SOLVER_STAGE_SCAN);
+    computeCellIndices(m_cudaStream,tableSize,m_fluidBuffers);
+    m_sortValid = true;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::incrementalSort(int _tableSize)
+{
+    int n = m_simProperties.numParticles;
+
+    // Compute our new keys against last steps order. This also keeps our cell occupancy up to date.
+    markStage(SOLVER_STAGE_HASH);
+    rehashParticles(m_cudaStream,m_threadsPerBlock,n,m_fluidBuffers);
+
+    // We need to know how much has moved to pick how to sort. Our partition only needs our device side counts
+    // so queue it behind our readback and keep our device busy while we wait for our counts to land, rather
+    // than draining our stream. It is wasted if nothing is out of order or too much has moved, but it is one
+    // cheap pass over our keys.
+    markStage(SOLVER_STAGE_SORT);
+    checkCudaErrors(cudaMemcpyAsync(m_hostSortStats,m_fluidBuffers.sortStats,2*sizeof(int),cudaMemcpyDeviceToHost,m_cudaStream));
+    checkCudaErrors(cudaEventRecord(m_sortStatsEvent,m_cudaStream));
+    partitionStayingKeys(m_cudaStream,n,m_fluidBuffers);
+    checkCudaErrors(cudaEventSynchronize(m_sortStatsEvent));
+    int numMoved = m_hostSortStats[0];
+    int numOutOfOrder = m_hostSortStats[1];
+
+    if(numOutOfOrder==0)
+    {
+        // Still sorted so our particles can stay where they are. Our new keys are now the ones we are sorted by.
+        std::swap(m_fluidBuffers.hashKeys,m_fluidBuffers.sortedHashKeys);
+        if(numMoved==0) return;
+    }
+    else
+    {
+        if(numMoved<=m_incrementalThreshold*n)
+        {
+            // Only sort the few that moved and merge them back in
+            repairSortedKeys(m_cudaStream,n,numMoved,_tableSize,m_fluidBuffers);
+        }
+        else
+        {
+            // Too much has moved so just sort everything again
+            sortParticleKeys(m_cudaStream,n,_tableSize,m_fluidBuffers);
+        }
+        gatherParticles(m_cudaStream,m_threadsPerBlock,n,m_fluidBuffers);
+        swapParticleBuffers();
+    }
+
+    // Find where each of our cells begin
+    markStage(SOLVER_STAGE_SCAN);
+    computeCellIndices(m_cudaStream,_tableSize,m_fluidBuffers);
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::swapParticleBuffers()
+{
+    std::swap(m_fluidBuffers.posPtr,m_fluidBuffers.posSwap);
+    std::swap(m_fluidBuffers.velPtr,m_fluidBuffers.velSwap);
+    m_bufferParity = 1 - m_bufferParity;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::enqueueDeviceStep()
+{
+    int tableSize = ceil(m_simProperties.gridRes.x *m_simProperties.gridRes.y);
+    if(m_neighbourSearchMode==NEIGHBOUR_SEARCH_LIST)
+    {
+        // Only sort and rebuild our neighbour list every few steps or when it has gone stale. Our graphs
+        // cant make this decision on the host so they rebuild every step.
+        if(m_useCudaGraph || !m_nbrListValid || m_nbrRebuildRequested || m_stepsSinceNbrBuild>=m_nbrRebuildInterval)
+        {
+            spatialSort();
+            markStage(SOLVER_STAGE_OTHER);
+            buildNeighbourList(m_cudaStream,m_threadsPerBlock,m_simProperties.numParticles,m_maxNeighbours,m_fluidBuffers);
+            m_nbrListValid = true;
+            m_nbrRebuildRequested = false;
+            m_stepsSinceNbrBuild = 0;
+        }
+        m_stepsSinceNbrBuild++;
+    }
+    else
+    {
+        // Hash and sort our particles
+        spatialSort();
+    }
+
+    // Work out who needs their forces solving this step from who was still moving last step
+    bool activeSet = (m_fluidBuffers.activeIdx && m_neighbourSearchMode!=NEIGHBOUR_SEARCH_CELL_SHARED);
+    markStage(SOLVER_STAGE_OTHER);
+    if(activeSet) buildActiveSet(m_cudaStream,m_threadsPerBlock,m_simProperties.numParticles,tableSize,m_fluidBuffers);
+
+    // Sample our image once for each of our sorted particles
+    markStage(SOLVER_STAGE_DENSITY);
+    computeParticleScales(m_cudaStream,m_threadsPerBlock,m_simProperties.numParticles,m_fluidBuffers,m_multiclass);
 
     // Compute our density
-    initDensity(m_cudaStream,m_threadsPerBlock,m_simProperties.numParticles,m_fluidBuffers,m_multiclass);
+    initDensity(m_cudaStream,m_threadsPerBlock,m_simProperties.numParticles,tableSize,m_fluidBuffers,getStippleMode(),m_neighbourSearchMode);
 
-    // Compute our rest density
-    m_restDensity = getAverageDensity() - m_densityDiff;
-    //std::cout<<"AvgDenstiy: "<<m_restDensity+m_densityDiff<<std::endl;
+    // Compute our rest density on the device. Our forces kernal reads it from there.
+    markStage(SOLVER_STAGE_REDUCE);
+    computeRestDensity(m_cudaStream,m_simProperties.numParticles,m_densityDiff,m_fluidBuffers);
 
     // Solve for our new positions
-    solve(m_cudaStream,m_threadsPerBlock,m_simProperties.numParticles,m_restDensity,m_fluidBuffers,m_multiclass);
+    markStage(SOLVER_STAGE_FORCES);
+    solve(m_cudaStream,m_threadsPerBlock,m_simProperties.numParticles,tableSize,m_fluidBuffers,getStippleMode(),m_neighbourSearchMode);
+    if(activeSet) markActiveCells(m_cudaStream,m_threadsPerBlock,m_simProperties.numParticles,m_fluidBuffers);
+
+    // Keep our converged count up to date on the device
+    markStage(SOLVER_STAGE_CONVERGE);
+    countConverged(m_cudaStream,m_simProperties.numParticles,m_fluidBuffers);
+
+    // Pick our next timestep from how fast our particles moved this step
+    markStage(SOLVER_STAGE_OTHER);
+    if(m_simProperties.adaptiveTimeStep) updateTimeStep(m_cudaStream,m_fluidBuffers);
+    markStage(-1);
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::setStageTiming(bool _timing)
+{
+    m_stageTiming = _timing;
+    m_stageSet = -1;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::setLiveStats(bool _live)
+{
+    m_liveStats = _live;
+    m_stageRollingValid = false;
+    for(int i=0;i<SOLVER_NUM_STAGES;i++) m_stageRolling[i] = 0.f;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::getSolverStats(SolverStats &_stats)
+{
+    for(int i=0;i<SOLVER_NUM_STAGES;i++) _stats.stageMs[i] = m_stageRolling[i];
+    _stats.stepsPerSecond = m_stepsPerSecond;
+    _stats.convergedFraction = (m_simProperties.numParticles) ? (float)m_lastConvergedCount/m_simProperties.numParticles : 0.f;
+    _stats.nullHashCount = m_lastNullHashCount;
+    _stats.errorCount = 0;
+    for(int i=0;i<SPH_NUM_ERRORS;i++) _stats.errorCount+=m_reportedErrors[i];
+    _stats.stepCount = m_stepCount;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::resetStageTimes()
+{
+    for(int i=0;i<SOLVER_NUM_STAGES;i++) m_stageTimes[i] = 0.0;
+    m_numTimedSteps = 0;
+}
+//----------------------------------------------------------------------------------------------------------------------
+const char *SPHSolverCUDA::getStageName(int _stage)
+{
+    static const char *names[SOLVER_NUM_STAGES] = {"hash","sort","scan","density","reduce","forces","convergence","other"};
+    if(_stage<0 || _stage>=SOLVER_NUM_STAGES) return "unknown";
+    return names[_stage];
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::beginStageStep()
+{
+    m_stageSet = -1;
+    if(!m_stageTiming && !m_liveStats) return;
+    // When all of our sets are still in flight we just dont time this step rather than wait on one
+    if(m_stageSetsPending==SPH_STAGE_TIMER_SETS) return;
+    m_stageSet = (m_stageSetHead+m_stageSetsPending)%SPH_STAGE_TIMER_SETS;
+    m_stageSets[m_stageSet].numMarks = 0;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::markStage(int _stage)
+{
+#ifdef SPH_USE_NVTX
+    if(m_nvtxStage>=0) SPH_NVTX_POP();
+    if(_stage>=0) SPH_NVTX_PUSH(getStageName(_stage));
+    m_nvtxStage = _stage;
+#endif
+    if(m_stageSet<0) return;
+    StageTimerSet &set = m_stageSets[m_stageSet];
+    // Our events are reused every step so we only create them the first time through
+    if(set.numMarks==(int)set.events.size())
+    {
+        cudaEvent_t e;
+        checkCudaErrors(cudaEventCreate(&e));
+        set.events.push_back(e);
+        set.marks.push_back(-1);
+    }
+    checkCudaErrors(cudaEventRecord(set.events[set.numMarks],m_cudaStream));
+    set.marks[set.numMarks] = _stage;
+    set.numMarks++;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::collectStageTimes()
+{
+    if(m_stageSet>=0)
+    {
+        m_stageSetsPending++;
+        m_stageSet = -1;
+    }
 
-    //unmap our buffer pointer and set it free into the wild
-    checkCudaErrors(cudaGraphicsUnmapResources(1,&m_resourcePos));
-    checkCudaErrors(cudaGraphicsUnmapResources(1,&m_resourceClass));
-    checkCudaErrors(cudaGraphicsUnmapResources(1,&m_resourceBndPos));
+    // Oldest first so our sets free up in the order we hand them out. When benchmarking we wait on
+    // every step, otherwise we only take the sets the device has already finished with.
+    while(m_stageSetsPending)
+    {
+        StageTimerSet &set = m_stageSets[m_stageSetHead];
+        if(set.numMarks>1)
+        {
+            cudaEvent_t last = set.events[set.numMarks-1];
+            if(m_stageTiming) checkCudaErrors(cudaEventSynchronize(last));
+            else if(cudaEventQuery(last)!=cudaSuccess) break;
+
+            float stepMs[SOLVER_NUM_STAGES];
+            for(int i=0;i<SOLVER_NUM_STAGES;i++) stepMs[i] = 0.f;
+            for(int i=0;i<set.numMarks-1;i++)
+            {
+                if(set.marks[i]<0) continue;
+                float ms;
+                checkCudaErrors(cudaEventElapsedTime(&ms,set.events[i],set.events[i+1]));
+                stepMs[set.marks[i]]+=ms;
+            }
+            for(int i=0;i<SOLVER_NUM_STAGES;i++)
+            {
+                m_stageTimes[i]+=stepMs[i];
+                m_stageRolling[i] = (m_stageRollingValid) ? 0.9f*m_stageRolling[i]+0.1f*stepMs[i] : stepMs[i];
+            }
+            m_stageRollingValid = true;
+            m_numTimedSteps++;
+        }
+        m_stageSetHead = (m_stageSetHead+1)%SPH_STAGE_TIMER_SETS;
+        m_stageSetsPending--;
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::setAdaptiveTimeStep(bool _adaptive, float _minStep, float _maxStep, float _cfl)
+{
+    // Our graphs only launch our timestep kernal if we were adaptive when they were captured
+    destroyGraph();
+    m_simProperties.adaptiveTimeStep = _adaptive ? 1 : 0;
+    m_simProperties.minTimeStep = std::min(_minStep,_maxStep);
+    m_simProperties.maxTimeStep = std::max(_minStep,_maxStep);
+    m_simProperties.cflFactor = _cfl;
+    markSimPropsDirty();
+    // Start again from our fixed timestep
+    float dt = std::min(std::max(m_simProperties.timeStep,m_simProperties.minTimeStep),m_simProperties.maxTimeStep);
+    resetTimeStep(m_cudaStream,m_fluidBuffers,dt);
+}
+//----------------------------------------------------------------------------------------------------------------------
+float SPHSolverCUDA::getCurrentTimeStep()
+{
+    if(!m_simProperties.adaptiveTimeStep) return m_simProperties.timeStep;
+    float dt;
+    checkCudaErrors(cudaMemcpyAsync(&dt,m_fluidBuffers.dtPtr,sizeof(float),cudaMemcpyDeviceToHost,m_cudaStream));
+    checkCudaErrors(cudaStreamSynchronize(m_cudaStream));
+    return dt;
 }
+//----------------------------------------------------------------------------------------------------------------------
+bool SPHSolverCUDA::graphIsValid()
+{
+    int p = m_bufferParity;
+    if(!m_graphExec[p]) return false;
+    int tableSize = ceil(m_simProperties.gridRes.x *m_simProperties.gridRes.y);
+    return (m_graphNumParticles == m_simProperties.numParticles &&
+            m_graphTableSize == tableSize &&
+            m_graphStippleMode == getStippleMode() &&
+            m_graphDensityDiff == m_densityDiff &&
+            m_graphNeighbourSearchMode == m_neighbourSearchMode &&
+            memcmp(&m_graphBuffers[p],&m_fluidBuffers,sizeof(fluidBuffers)) == 0);
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::buildGraph()
+{
+    // If our settings have changed our other graph is stale as well
+    int tableSize = ceil(m_simProperties.gridRes.x *m_simProperties.gridRes.y);
+    if(m_graphNumParticles != m_simProperties.numParticles || m_graphTableSize != tableSize ||
+       m_graphStippleMode != getStippleMode() || m_graphDensityDiff != m_densityDiff ||
+       m_graphNeighbourSearchMode != m_neighbourSearchMode)
+    {
+        destroyGraph();
+    }
 
+    // We have one graph for each half of our double buffers
+    int p = m_bufferParity;
+    if(m_graphExec[p]) checkCudaErrors(cudaGraphExecDestroy(m_graphExec[p]));
+    if(m_graph[p]) checkCudaErrors(cudaGraphDestroy(m_graph[p]));
+    m_graphBuffers[p] = m_fluidBuffers;
+
+#if SPH_CUDA_GRAPHS
+    // Capturing doesnt run anything but our host side buffer swap still happens
+    checkCudaErrors(cudaStreamBeginCapture(m_cudaStream,cudaStreamCaptureModeRelaxed));
+    enqueueDeviceStep();
+    checkCudaErrors(cudaStreamEndCapture(m_cudaStream,&m_graph[p]));
+    checkCudaErrors(cudaGraphInstantiateWithFlags(&m_graphExec[p],m_graph[p],0));
+#else
+    // setUseCudaGraph never lets us get here, just run our step as normal
+    enqueueDeviceStep();
+    return;
+#endif
+
+    // Remember what this graph was built with
+    m_graphNumParticles = m_simProperties.numParticles;
+    m_graphTableSize = tableSize;
+    m_graphStippleMode = getStippleMode();
+    m_graphDensityDiff = m_densityDiff;
+    m_graphNeighbourSearchMode = m_neighbourSearchMode;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::destroyGraph()
+{
+    for(int i=0;i<2;i++)
+    {
+        if(m_graphExec[i]) checkCudaErrors(cudaGraphExecDestroy(m_graphExec[i]));
+        if(m_graph[i]) checkCudaErrors(cudaGraphDestroy(m_graph[i]));
+        m_graphExec[i] = 0;
+        m_graph[i] = 0;
+    }
+}
 //----------------------------------------------------------------------------------------------------------------------
 void SPHSolverCUDA::setSampleImage(QString _loc)
 {
     QImage img(_loc);
+    if(img.isNull())
+    {
+        std::cerr<<"Cannot load sample image "<<_loc.toStdString()<<std::endl;
+        return;
+    }
+    m_sampleImage = img;
+    // If we are part way through our progressive stages keep using the image for our stage
+    if(m_progressiveTarget) applyProgressiveStage(m_progressiveStage);
+    else uploadSampleImage(img);
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::uploadSampleImage(const QImage &_img)
+{
     QColor c;
-    float i;
+    int w = _img.width();
+    int h = _img.height();
+    // Our textures are stored bottom row first so they line up with our sim
     std::vector<float> intensity;
     std::vector<float4> cmyk;
-    intensity.resize(img.width()*img.height());
-    cmyk.resize(img.width()*img.height());
-    for(int x=0;x<img.width();x++)
-    for(int y=0;y<img.width();y++)
-    {
-        c = QColor(img.pixel(x,y));
-        i = 0.2989f*c.redF()+0.5870f*c.greenF()+0.1140f*c.blueF();
-        intensity[x+(img.height()-1-y)*img.width()] = i;
-        cmyk[i] = make_float4(c.cyanF(),c.magentaF(),c.yellowF(),c.blackF());
-        std::cout<<cmyk[i].x<<","<<cmyk[i].y<<","<<cmyk[i].z<<","<<cmyk[i].w<<std::endl;
-    }
-    checkCudaErrors(cudaFree(m_fluidBuffers.pixelI));
+    intensity.resize(w*h);
+    cmyk.resize(w*h);
+    for(int y=0;y<h;y++)
+    for(int x=0;x<w;x++)
+    {
+        c = QColor(_img.pixel(x,y));
+        int idx = x+(h-1-y)*w;
+        intensity[idx] = 0.2989f*c.redF()+0.5870f*c.greenF()+0.1140f*c.blueF();
+        cmyk[idx] = make_float4(c.cyanF(),c.magentaF(),c.yellowF(),c.blackF());
+    }
+    setImageTextures(w,h,intensity,cmyk);
+
+    updateGPUSimProps();
+}
+//----------------------------------------------------------------------------------------------------------------------
+static cudaTextureObject_t createImageTexture(cudaArray_t _array)
+{
+    cudaResourceDesc resDesc;
+    memset(&resDesc,0,sizeof(resDesc));
+    resDesc.resType = cudaResourceTypeArray;
+    resDesc.res.array.array = _array;
+
+    // Normalised coordinates so our kernals dont need to know our image resolution
+    cudaTextureDesc texDesc;
+    memset(&texDesc,0,sizeof(texDesc));
+    texDesc.addressMode[0] = cudaAddressModeClamp;
+    texDesc.addressMode[1] = cudaAddressModeClamp;
+    texDesc.filterMode = cudaFilterModeLinear;
+    texDesc.readMode = cudaReadModeElementType;
+    texDesc.normalizedCoords = 1;
+
+    cudaTextureObject_t tex = 0;
+    checkCudaErrors(cudaCreateTextureObject(&tex,&resDesc,&texDesc,NULL));
+    return tex;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::setImageTextures(int _w, int _h, std::vector<float> &_intensity, std::vector<float4> &_cmyk)
+{
+    // Our old textures may still be in use by work on our stream
+    checkCudaErrors(cudaStreamSynchronize(m_cudaStream));
+    destroyImageTextures();
+
+    cudaChannelFormatDesc descI = cudaCreateChannelDesc<float>();
+    checkCudaErrors(cudaMallocArray(&m_pixelIArray,&descI,_w,_h));
+    checkCudaErrors(cudaMemcpy2DToArray(m_pixelIArray,0,0,&_intensity[0],_w*sizeof(float),_w*sizeof(float),_h,cudaMemcpyHostToDevice));
+    m_fluidBuffers.pixelI = createImageTexture(m_pixelIArray);
+
+    cudaChannelFormatDesc descCMYK = cudaCreateChannelDesc<float4>();
+    checkCudaErrors(cudaMallocArray(&m_pixelCMYKArray,&descCMYK,_w,_h));
+    checkCudaErrors(cudaMemcpy2DToArray(m_pixelCMYKArray,0,0,&_cmyk[0],_w*sizeof(float4),_w*sizeof(float4),_h,cudaMemcpyHostToDevice));
+    m_fluidBuffers.pixelCMYK = createImageTexture(m_pixelCMYKArray);
+
+    // Build the CDF our importance sampling draws from
+    float *intensity;
+    checkCudaErrors(cudaMalloc(&intensity,_w*_h*sizeof(float)));
+    checkCudaErrors(cudaMemcpy(intensity,&_intensity[0],_w*_h*sizeof(float),cudaMemcpyHostToDevice));
+    checkCudaErrors(cudaMalloc(&m_sampleCDF,(size_t)_w*_h*sizeof(double)));
+    buildSampleCDF(m_cudaStream,m_threadsPerBlock,_w*_h,intensity,m_sampleCDF,m_fluidBuffers.thrustAlloc);
+    m_sampleCDFWidth = _w;
+    m_sampleCDFHeight = _h;
+    // This waits on our scan but we only do this when our image changes
+    checkCudaErrors(cudaFree(intensity));
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::destroyImageTextures()
+{
+    if(m_fluidBuffers.pixelI) checkCudaErrors(cudaDestroyTextureObject(m_fluidBuffers.pixelI));
+    if(m_fluidBuffers.pixelCMYK) checkCudaErrors(cudaDestroyTextureObject(m_fluidBuffers.pixelCMYK));
+    if(m_pixelIArray) checkCudaErrors(cudaFreeArray(m_pixelIArray));
+    if(m_pixelCMYKArray) checkCudaErrors(cudaFreeArray(m_pixelCMYKArray));
     m_fluidBuffers.pixelI = 0;
-    checkCudaErrors(cudaMalloc(&m_fluidBuffers.pixelI,sizeof(float)*intensity.size()));
-    checkCudaErrors(cudaMemcpy(m_fluidBuffers.pixelI,&intensity[0],sizeof(float)*intensity.size(),cudaMemcpyHostToDevice));
-    checkCudaErrors(cudaFree(m_fluidBuffers.pixelCMYK));
     m_fluidBuffers.pixelCMYK = 0;
-    checkCudaErrors(cudaMalloc(&m_fluidBuffers.pixelCMYK,sizeof(float4)*cmyk.size()));
-    checkCudaErrors(cudaMemcpy(m_fluidBuffers.pixelCMYK,&cmyk[0],sizeof(float4)*cmyk.size(),cudaMemcpyHostToDevice));
+    m_pixelIArray = 0;
+    m_pixelCMYKArray = 0;
+    if(m_sampleCDF) checkCudaErrors(cudaFree(m_sampleCDF));
+    m_sampleCDF = 0;
+    m_sampleCDFWidth = 0;
+    m_sampleCDFHeight = 0;
+}
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief What our wall tables are cached by. A wall looks the same wherever it is so our bounds dont matter.
+//----------------------------------------------------------------------------------------------------------------------
+struct WallTableKey
+{
+    float h;
+    float thickness;
+    float layers;
+    bool operator<(const WallTableKey &_k) const
+    {
+        if(h!=_k.h) return h<_k.h;
+        if(thickness!=_k.thickness) return thickness<_k.thickness;
+        return layers<_k.layers;
+    }
+};
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Every wall table we have tabulated, shared by all of our solvers so batch jobs only ever build each once
+//----------------------------------------------------------------------------------------------------------------------
+static std::map<WallTableKey,std::vector<float2> > s_wallTables;
+static QMutex s_wallTablesMutex;
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief the number of offsets along our wall we average our ghost lattice over
+//----------------------------------------------------------------------------------------------------------------------
+#define SPH_WALL_TABLE_OFFSETS 4
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Sums up what one straight wall of _l layers of ghost particles _t/_l apart adds to a particle for each
+/// @brief distance and scale of our table. These are the same sums our kernals used to do over every ghost particle
+/// @brief in range, without the constants of our smoothing kernals. As our particles dont line up with our ghost
+/// @brief lattice we average over where along it they are.
+//----------------------------------------------------------------------------------------------------------------------
+static void tabulateWall(float _h, float _t, float _l, std::vector<float2> &_table)
+{
+    float step = _t/_l;
+    int layers = std::max((int)(_l+0.5f),1);
+    int rows = (int)ceil(_h/step)+1;
+    float h2 = _h*_h;
+    _table.assign(SPH_WALL_TABLE_DISTANCES*SPH_WALL_TABLE_SCALES,make_float2(0.f,0.f));
+    for(int j=0;j<SPH_WALL_TABLE_SCALES;j++)
+    {
+        // Our texels are sampled at their centres
+        float scalei = (j+0.5f)/SPH_WALL_TABLE_SCALES;
+        for(int i=0;i<SPH_WALL_TABLE_DISTANCES;i++)
+        {
+            float d = _h*(i+0.5f)/SPH_WALL_TABLE_DISTANCES;
+            double density = 0.0;
+            double force = 0.0;
+            for(int o=0;o<SPH_WALL_TABLE_OFFSETS;o++)
+            {
+                float offset = step*(o+0.5f)/SPH_WALL_TABLE_OFFSETS;
+                for(int l=1;l<=layers;l++)
+                {
+                    // How far into our domain we are from this layer
+                    float n = d + l*step;
+                    for(int k=-rows;k<=rows;k++)
+                    {
+                        float tangent = k*step - offset;
+                        float rLength = sqrtf(n*n + tangent*tangent);
+                        // Same as our sizeFunction against a ghost particle with a scale of 1
+                        float s = (2.f*rLength)/(scalei+1.f);
+                        if(s<=0.f || s>=_h) continue;
+                        density+= (h2-s*s)*(h2-s*s)*(h2-s*s);
+                        // Only the part of our pressure weight along our wall normal survives our average
+                        force+= (n/rLength)*(_h-s)*(_h-s);
+                    }
+                }
+            }
+            _table[j*SPH_WALL_TABLE_DISTANCES+i] = make_float2((float)(density/SPH_WALL_TABLE_OFFSETS),(float)(force/SPH_WALL_TABLE_OFFSETS));
+        }
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief returns our shared wall table for _h, _t and _l, tabulating it if nobody has needed it before
+//----------------------------------------------------------------------------------------------------------------------
+static const std::vector<float2> &sharedWallTable(float _h, float _t, float _l)
+{
+    WallTableKey key;
+    key.h = _h;
+    key.thickness = _t;
+    key.layers = _l;
+    QMutexLocker lock(&s_wallTablesMutex);
+    // We never erase from our map so our tables stay where they are for as long as we run
+    std::map<WallTableKey,std::vector<float2> >::iterator it = s_wallTables.find(key);
+    if(it==s_wallTables.end())
+    {
+        it = s_wallTables.insert(std::make_pair(key,std::vector<float2>())).first;
+        tabulateWall(_h,_t,_l,it->second);
+    }
+    return it->second;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::updateWallTable()
+{
+    // No walls, nothing to push our particles back in our domain other than our clamp
+    if(m_wallThickness<=0.f || m_wallLayers<=0.f) return;
+    if(m_fluidBuffers.wallTable && m_wallTableH==m_simProperties.h) return;
+    const std::vector<float2> &table = sharedWallTable(m_simProperties.h,m_wallThickness,m_wallLayers);
+
+    // Our old table may still be in use by work on our stream
+    checkCudaErrors(cudaStreamSynchronize(m_cudaStream));
+    destroyWallTable();
+    cudaChannelFormatDesc desc = cudaCreateChannelDesc<float2>();
+    checkCudaErrors(cudaMallocArray(&m_wallArray,&desc,SPH_WALL_TABLE_DISTANCES,SPH_WALL_TABLE_SCALES));
+    checkCudaErrors(cudaMemcpy2DToArray(m_wallArray,0,0,&table[0],SPH_WALL_TABLE_DISTANCES*sizeof(float2),SPH_WALL_TABLE_DISTANCES*sizeof(float2),SPH_WALL_TABLE_SCALES,cudaMemcpyHostToDevice));
+    // Our kernals never look past our smoothing length so clamping is all we need at our edges
+    m_fluidBuffers.wallTable = createImageTexture(m_wallArray);
+    m_wallTableH = m_simProperties.h;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::destroyWallTable()
+{
+    if(m_fluidBuffers.wallTable) checkCudaErrors(cudaDestroyTextureObject(m_fluidBuffers.wallTable));
+    if(m_wallArray) checkCudaErrors(cudaFreeArray(m_wallArray));
+    m_fluidBuffers.wallTable = 0;
+    m_wallArray = 0;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::publishGLBuffers()
+{
+    // Nothing to draw with in headless mode
+    if(m_headless || !m_simProperties.numParticles) return;
+    if(m_deferPublish)
+    {
+        stageFrame();
+        return;
+    }
+    size_t size;
+    float4 *glPos;
+    checkCudaErrors(cudaGraphicsMapResources(1,&m_resourcePos,m_cudaStream));
+    checkCudaErrors(cudaGraphicsResourceGetMappedPointer((void**)&glPos,&size,m_resourcePos));
+    checkCudaErrors(cudaMemcpyAsync(glPos,m_fluidBuffers.posPtr,sizeof(float4)*m_simProperties.numParticles,cudaMemcpyDeviceToDevice,m_cudaStream));
+    checkCudaErrors(cudaGraphicsUnmapResources(1,&m_resourcePos,m_cudaStream));
+
+    // Our drawing culls by cell so it needs to know which cell each of our particles is in
+    publishCellTable();
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::publishCellTable()
+{
+    // When we are deferring only our renderer picks up our copies, so we never write over a table it is reading
+    if(!m_deferPublish) pollCellTable();
+    if(m_hostCellTablePending || !m_fluidBuffers.cellIndexBuffer) return;
 
-    updateGPUSimProps();
+    int tableSize = m_simProperties.gridRes.x*m_simProperties.gridRes.y;
+    if(tableSize>m_hostCellTableCapacity)
+    {
+        // Our renderer may be reading our tables right now so leave it to grow them
+        if(m_deferPublish)
+        {
+            m_hostCellTableWanted = tableSize;
+            return;
+        }
+        reserveHostCellTable(tableSize);
+    }
+    if(!m_hostCellTableEvent) checkCudaErrors(cudaEventCreateWithFlags(&m_hostCellTableEvent,cudaEventDisableTiming));
+
+    int w = (m_hostCellTableRead==0) ? 1 : 0;
+    checkCudaErrors(cudaMemcpyAsync(m_hostCellTable[w],m_fluidBuffers.cellIndexBuffer,tableSize*sizeof(int),cudaMemcpyDeviceToHost,m_cudaStream));
+    checkCudaErrors(cudaMemcpyAsync(m_hostCellTable[w]+tableSize,m_fluidBuffers.cellOccBuffer,tableSize*sizeof(int),cudaMemcpyDeviceToHost,m_cudaStream));
+    checkCudaErrors(cudaEventRecord(m_hostCellTableEvent,m_cudaStream));
+
+    HostCellTable &info = m_hostCellTableInfo[w];
+    info.cellIdx = m_hostCellTable[w];
+    info.cellOcc = m_hostCellTable[w]+tableSize;
+    info.gridRes = m_simProperties.gridRes;
+    info.cellSize = make_float2(m_simProperties.gridDim.x/m_simProperties.gridRes.x,m_simProperties.gridDim.y/m_simProperties.gridRes.y);
+    info.gridMin = m_simProperties.gridMin;
+    info.numParticles = m_simProperties.numParticles;
+    info.version = ++m_hostCellTableVersion;
+    m_hostCellTablePending = true;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::pollCellTable()
+{
+    if(m_hostCellTablePending && cudaEventQuery(m_hostCellTableEvent)==cudaSuccess)
+    {
+        m_hostCellTableRead = (m_hostCellTableRead==0) ? 1 : 0;
+        m_hostCellTablePending = false;
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::reserveHostCellTable(int _tableSize)
+{
+    if(_tableSize<=m_hostCellTableCapacity) return;
+    // Only grows, and nothing is copying into either of these while we arent pending
+    for(int i=0;i<2;i++)
+    {
+        if(m_hostCellTable[i]) checkCudaErrors(cudaFreeHost(m_hostCellTable[i]));
+        checkCudaErrors(cudaMallocHost(&m_hostCellTable[i],2*_tableSize*sizeof(int)));
+    }
+    m_hostCellTableCapacity = _tableSize;
+    m_hostCellTableRead = -1;
+}
+//----------------------------------------------------------------------------------------------------------------------
+bool SPHSolverCUDA::getHostCellTable(HostCellTable &_table)
+{
+    QMutexLocker lock(&m_frameMutex);
+    pollCellTable();
+    if(m_hostCellTableRead<0) return false;
+    _table = m_hostCellTableInfo[m_hostCellTableRead];
+    return true;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::reserveGLBuffers(int _n)
+{
+    if(m_headless || _n<=m_glParticleCapacity) return;
+    // Our OpenGL buffers are only used for drawing, publishGLBuffers() copies our particles into them
+    if(m_renderStream) checkCudaErrors(cudaStreamSynchronize(m_renderStream));
+    checkCudaErrors(cudaGraphicsUnregisterResource(m_resourcePos));
+    glBindBuffer(GL_ARRAY_BUFFER, m_posVBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(float4)*_n, NULL, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    // create our cuda graphics resource for our vertexs used for our OpenGL interop
+    checkCudaErrors(cudaGraphicsGLRegisterBuffer(&m_resourcePos, m_posVBO, cudaGraphicsRegisterFlagsWriteDiscard));
+    m_glParticleCapacity = _n;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::setDeferredPublish(bool _defer)
+{
+    QMutexLocker lock(&m_frameMutex);
+    if(_defer==m_deferPublish) return;
+    m_deferPublish = _defer;
+    if(!_defer) return;
+
+    if(!m_renderStream) checkCudaErrors(cudaStreamCreateWithFlags(&m_renderStream,cudaStreamNonBlocking));
+    for(int i=0;i<2;i++)
+    {
+        if(!m_frameStaged[i]) checkCudaErrors(cudaEventCreateWithFlags(&m_frameStaged[i],cudaEventDisableTiming));
+        if(!m_frameDrawn[i]) checkCudaErrors(cudaEventCreateWithFlags(&m_frameDrawn[i],cudaEventDisableTiming));
+    }
+    m_frameRead = -1;
+    m_frameWrite = -1;
+    lock.unlock();
+
+    // Our renderer starts with whatever we have now
+    publishGLBuffers();
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverCUDA::stageFrame()
+{
+    QMutexLocker lock(&m_frameMutex);
+    int n = m_simProperties.numParticles;
+    if(n>m_frameCapacity)
+    {
+        // Our renderer may still be copying out of our old frames
+        for(int i=0;i<2;i++)
+        {
+            checkCudaErrors(cudaEventSynchronize(m_frameDrawn[i]));
+            if(m_frameBuffer[i]) checkCudaErrors(cudaFree(m_frameBuffer[i]));
+            checkCudaErrors(cudaMalloc(&m_frameBuffer[i],n*sizeof(float4)));
+        }
+        m_frameCapacity = n;
+        m_frameRead = -1;
+    }
+
+    // Never write over the frame in our OpenGL buffer. If our renderer hasnt picked up our last frame yet we
+    // just write over that one, our renderer only ever wants our newest.
+    int w = (m_frameRead==0) ? 1 : 0;
+    checkCudaErrors(cudaStreamWaitEvent(m_cudaStream,m_frameDrawn[w],0));
+    checkCudaErrors(cudaMemcpyAsync(m_frameBuffer[w],m_fluidBuffers.posPtr,n*sizeof(float4),cudaMemcpyDeviceToDevice,m_cudaStream));
+    checkCudaErrors(cudaEventRecord(m_frameStaged[w],m_cudaStream));
+
+    SolverFrame &info = m_frameInfo[w];
+    info.numParticles = n;
+    info.colorStippling = isColorStippling();
+    info.converged = convergedState();
+    info.convergeValue = getConvergeValue();
+    info.stepCount = m_stepCount;
+    getSolverStats(info.stats);
+    m_frameWrite = w;
+
+    publishCellTable();
+}
+//----------------------------------------------------------------------------------------------------------------------
+bool SPHSolverCUDA::acquireFrame(SolverFrame &_frame)
+{
+    if(!m_deferPublish)
+    {
+        _frame.numParticles = m_simProperties.numParticles;
+        _frame.colorStippling = isColorStippling();
+        _frame.converged = convergedState();
+        _frame.convergeValue = getConvergeValue();
+        _frame.stepCount = m_stepCount;
+        getSolverStats(_frame.stats);
+        return true;
+    }
+
+    QMutexLocker lock(&m_frameMutex);
+    // Anything our solver couldnt grow without our OpenGL thread
+    if(m_hostCellTableWanted>m_hostCellTableCapacity) reserveHostCellTable(m_hostCellTableWanted);
+
+    if(m_frameWrite>=0)
+    {
+        int r = m_frameWrite;
+        int n = m_frameInfo[r].numParticles;
+        if(!m_headless && n)
+        {
+            reserveGLBuffers(n);
+            // Our copy waits on our solver finishing this frame on the device, our host never waits
+            size_t size;
+            float4 *glPos;
+            checkCudaErrors(cudaStreamWaitEvent(m_renderStream,m_frameStaged[r],0));
+            checkCudaErrors(cudaGraphicsMapResources(1,&m_resourcePos,m_renderStream));
+            checkCudaErrors(cudaGraphicsResourceGetMappedPointer((void**)&glPos,&size,m_resourcePos));
+            checkCudaErrors(cudaMemcpyAsync(glPos,m_frameBuffer[r],sizeof(float4)*n,cudaMemcpyDeviceToDevice,m_renderStream));
+            checkCudaErrors(cudaGraphicsUnmapResources(1,&m_resourcePos,m_renderStream));
+            checkCudaErrors(cudaEventRecord(m_frameDrawn[r],m_renderStream));
+        }
+        m_frameRead = r;
+        m_frameWrite = -1;
+    }
+    if(m_frameRead<0) return false;
+    _frame = m_frameInfo[m_frameRead];
+    return true;
 }
 //----------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,564 @@
+#include "SPHSolverMultiGPU.h"
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+
+//----------------------------------------------------------------------------------------------------------------------
+static void enablePeerAccess(int _from, int _to)
+{
+    int canAccess = 0;
+    checkCudaErrors(cudaDeviceCanAccessPeer(&canAccess,_from,_to));
+    if(!canAccess) return;
+    checkCudaErrors(cudaSetDevice(_from));
+    cudaError_t error = cudaDeviceEnablePeerAccess(_to,0);
+    // Being enabled already is fine
+    if(error == cudaErrorPeerAccessAlreadyEnabled)
+    {
+        cudaGetLastError();
+        return;
+    }
+    checkCudaErrors(error);
+    std::cout<<"Peer access enabled from device "<<_from<<" to device "<<_to<<std::endl;
+}
+//----------------------------------------------------------------------------------------------------------------------
+SPHSolverMultiGPU::SPHSolverMultiGPU(float _x, float _y, float _t, float _l, int _numDevices)
+{
+    int count = 0;
+    checkCudaErrors(cudaGetDeviceCount(&count));
+    if(count == 0){
+        std::cerr<<"Install an Nvidia chip!"<<std::endl;
+        exit(-1);
+    }
+    if(_numDevices<=0 || _numDevices>count) _numDevices = count;
+
+    m_numParticles = 0;
+    m_volume = 0.f;
+    m_densityDiff = 150.f;
+    m_multiclass = false;
+    m_converged = false;
+    m_neighbourSearchMode = NEIGHBOUR_SEARCH_PARTICLE;
+
+    // Our first device tells us how big our grid is
+    m_domains.push_back(new SPHSolverCUDA(_x,_y,_t,_l,true,0));
+    m_mass = m_domains[0]->m_simProperties.mass;
+    int gridRows = m_domains[0]->m_simProperties.gridRes.y;
+
+    // Our strips must be at least two halos high so the halo rows of a strip are only ever in the strips either side
+    int maxDomains = std::max(1,gridRows/(2*SPH_HALO_ROWS));
+    if(_numDevices>maxDomains)
+    {
+        std::cout<<"Our grid only has "<<gridRows<<" rows, only using "<<maxDomains<<" devices"<<std::endl;
+        _numDevices = maxDomains;
+    }
+    for(int d=1;d<_numDevices;d++)
+    {
+        m_domains.push_back(new SPHSolverCUDA(_x,_y,_t,_l,true,d));
+    }
+
+    // Let our devices copy particles straight between each other, anyone can send to anyone when a particle
+    // moves more than one strip. If they cant cudaMemcpyPeerAsync still works, it is just staged through the host.
+    for(int from=0;from<_numDevices;from++)
+    {
+        for(int to=0;to<_numDevices;to++)
+        {
+            if(from!=to) enablePeerAccess(from,to);
+        }
+    }
+
+    // Events so our devices can wait on each other without our host waiting on everyone
+    m_meanEvents.resize(_numDevices);
+    m_copyEvents.resize(_numDevices);
+    for(int d=0;d<_numDevices;d++)
+    {
+        checkCudaErrors(cudaSetDevice(m_domains[d]->m_device));
+        checkCudaErrors(cudaEventCreateWithFlags(&m_meanEvents[d],cudaEventDisableTiming));
+        checkCudaErrors(cudaEventCreateWithFlags(&m_copyEvents[d],cudaEventDisableTiming));
+    }
+
+    // Until we have some particles just split our grid evenly
+    m_stripRows.resize(_numDevices+1);
+    for(int d=0;d<=_numDevices;d++) m_stripRows[d] = (d*gridRows)/_numDevices;
+    m_ownedBegin.assign(_numDevices,0);
+    m_ownedEnd.assign(_numDevices,0);
+
+    // Pinned memory for everything we read back each step. Portable so every device can use it.
+    checkCudaErrors(cudaHostAlloc(&m_hostRowStarts,_numDevices*rowStartStride()*sizeof(int),cudaHostAllocPortable));
+    // Our means and counts are also mapped so every device can combine them without coming back to our host.
+    // With unified addressing their host pointers work on every device.
+    checkCudaErrors(cudaHostAlloc(&m_hostMeanDensity,_numDevices*sizeof(float),cudaHostAllocPortable|cudaHostAllocMapped));
+    checkCudaErrors(cudaHostAlloc(&m_hostOwnedCount,_numDevices*sizeof(int),cudaHostAllocPortable|cudaHostAllocMapped));
+    checkCudaErrors(cudaHostAlloc(&m_hostConvergedCount,_numDevices*sizeof(int),cudaHostAllocPortable));
+    for(int d=0;d<_numDevices;d++) m_hostConvergedCount[d] = 0;
+
+    std::cout<<"Split our simulation across "<<_numDevices<<" device(s)"<<std::endl;
+}
+//----------------------------------------------------------------------------------------------------------------------
+SPHSolverMultiGPU::~SPHSolverMultiGPU()
+{
+    synchronize();
+    // Our solvers set their own device before cleaning up
+    for(unsigned int d=0;d<m_domains.size();d++)
+    {
+        checkCudaErrors(cudaSetDevice(m_domains[d]->m_device));
+        checkCudaErrors(cudaEventDestroy(m_meanEvents[d]));
+        checkCudaErrors(cudaEventDestroy(m_copyEvents[d]));
+    }
+    for(unsigned int d=0;d<m_domains.size();d++) delete m_domains[d];
+    m_domains.clear();
+    checkCudaErrors(cudaFreeHost(m_hostRowStarts));
+    checkCudaErrors(cudaFreeHost(m_hostMeanDensity));
+    checkCudaErrors(cudaFreeHost(m_hostOwnedCount));
+    checkCudaErrors(cudaFreeHost(m_hostConvergedCount));
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverMultiGPU::setParticles(std::vector<float3> &_particles)
+{
+    synchronize();
+    int nd = (int)m_domains.size();
+    m_numParticles = (int)_particles.size();
+    m_converged = false;
+    for(int d=0;d<nd;d++) m_hostConvergedCount[d] = 0;
+
+    // Work out the cell row of each of our particles the same way our hash does
+    SimProps &props = m_domains[0]->m_simProperties;
+    std::vector<int> rows(_particles.size());
+    for(unsigned int i=0;i<_particles.size();i++)
+    {
+        int r = (int)floor(((_particles[i].y-props.gridMin.y)/props.gridDim.y)*props.gridRes.y);
+        rows[i] = std::min(std::max(r,0),props.gridRes.y-1);
+    }
+    balanceStrips(rows);
+
+    // Each device starts off with just the particles in its strip
+    std::vector<std::vector<float3> > owned(nd);
+    for(unsigned int i=0;i<_particles.size();i++)
+    {
+        int d = (int)(std::upper_bound(m_stripRows.begin(),m_stripRows.end(),rows[i])-m_stripRows.begin())-1;
+        d = std::min(std::max(d,0),nd-1);
+        owned[d].push_back(_particles[i]);
+    }
+
+    // Our mass is set from our total particle count, not what each device has
+    if(!m_volume)
+    {
+        m_volume = m_mass * m_numParticles;
+    }
+    else if(m_numParticles)
+    {
+        m_mass = m_volume/m_numParticles;
+    }
+
+    for(int d=0;d<nd;d++)
+    {
+        SPHSolverCUDA *s = m_domains[d];
+        checkCudaErrors(cudaSetDevice(s->m_device));
+        s->setParticles(owned[d]);
+        s->setMass(m_mass);
+        m_ownedBegin[d] = 0;
+        m_ownedEnd[d] = (int)owned[d].size();
+    }
+
+    // Give each device its halos before our first step
+    if(m_numParticles) exchangeHalos();
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverMultiGPU::genRandomSamples(float _n)
+{
+    // Draw our samples on our first device exactly as our single device solver does, so the same seed and
+    // image give the same samples however many devices we have. Then split them into our strips.
+    SPHSolverCUDA *s = m_domains[0];
+    checkCudaErrors(cudaSetDevice(s->m_device));
+    s->genRandomSamples(_n);
+    std::vector<float3> samples = s->getParticlePositions();
+    setParticles(samples);
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverMultiGPU::setSampleSeed(unsigned long long _seed)
+{
+    // Only our first device draws our samples
+    m_domains[0]->setSampleSeed(_seed);
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverMultiGPU::setImportanceSampling(bool _importance)
+{
+    m_domains[0]->setImportanceSampling(_importance);
+}
+//----------------------------------------------------------------------------------------------------------------------
+std::vector<float3> SPHSolverMultiGPU::getParticlePositions()
+{
+    std::vector<float3> positions;
+    positions.reserve(m_numParticles);
+    std::vector<float4> packed;
+    for(unsigned int d=0;d<m_domains.size();d++)
+    {
+        // Only our owned particles, our halos are copies of another device's
+        SPHSolverCUDA *s = m_domains[d];
+        int n = m_ownedEnd[d]-m_ownedBegin[d];
+        if(n<=0) continue;
+        packed.resize(n);
+        checkCudaErrors(cudaSetDevice(s->m_device));
+        checkCudaErrors(cudaMemcpyAsync(&packed[0],s->m_fluidBuffers.posPtr+m_ownedBegin[d],sizeof(float4)*n,cudaMemcpyDeviceToHost,s->m_cudaStream));
+        checkCudaErrors(cudaStreamSynchronize(s->m_cudaStream));
+        for(int i=0;i<n;i++)
+        {
+            positions.push_back(make_float3(packed[i].x,packed[i].y,0.f));
+        }
+    }
+    return positions;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverMultiGPU::update(int _iterations)
+{
+    //if no particles then theres no point in updating so just return
+    if(!m_numParticles)return;
+
+    for(int i=0;i<_iterations;i++)
+    {
+        solveDomains();
+        exchangeHalos();
+    }
+
+    // Our converged counts were copied back before our halo swap synchronised
+    int converged = 0;
+    for(unsigned int d=0;d<m_domains.size();d++) converged+=m_hostConvergedCount[d];
+    m_converged = (converged>=m_numParticles);
+
+    // Our launches are all asynchronous so just check for errors once per call
+    checkSolverErrors("SPHSolverMultiGPU::update");
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverMultiGPU::setConvergeValue(float _x)
+{
+    for(unsigned int d=0;d<m_domains.size();d++)
+    {
+        checkCudaErrors(cudaSetDevice(m_domains[d]->m_device));
+        m_domains[d]->setConvergeValue(_x);
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverMultiGPU::setMass(float _m)
+{
+    m_mass = _m;
+    for(unsigned int d=0;d<m_domains.size();d++)
+    {
+        checkCudaErrors(cudaSetDevice(m_domains[d]->m_device));
+        m_domains[d]->setMass(_m);
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverMultiGPU::setTimeStep(float _t)
+{
+    for(unsigned int d=0;d<m_domains.size();d++)
+    {
+        checkCudaErrors(cudaSetDevice(m_domains[d]->m_device));
+        m_domains[d]->setTimeStep(_t);
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverMultiGPU::setKConst(float _k)
+{
+    for(unsigned int d=0;d<m_domains.size();d++)
+    {
+        checkCudaErrors(cudaSetDevice(m_domains[d]->m_device));
+        m_domains[d]->setKConst(_k);
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverMultiGPU::setNeighbourSearchMode(NeighbourSearchMode _mode)
+{
+    if(_mode==NEIGHBOUR_SEARCH_LIST)
+    {
+        std::cout<<"Neighbour lists are not supported across devices, keeping our current search mode"<<std::endl;
+        return;
+    }
+    m_neighbourSearchMode = _mode;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverMultiGPU::setSampleImage(QString _loc)
+{
+    for(unsigned int d=0;d<m_domains.size();d++)
+    {
+        checkCudaErrors(cudaSetDevice(m_domains[d]->m_device));
+        m_domains[d]->setSampleImage(_loc);
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverMultiGPU::balanceStrips(std::vector<int> &_rows)
+{
+    int nd = (int)m_domains.size();
+    int gridRows = m_domains[0]->m_simProperties.gridRes.y;
+    int minRows = 2*SPH_HALO_ROWS;
+
+    std::vector<int> count(gridRows,0);
+    for(unsigned int i=0;i<_rows.size();i++) count[_rows[i]]++;
+
+    // Move each strip boundary on until the strips before it have their share of our particles,
+    // keeping every strip at least minRows high
+    m_stripRows.assign(nd+1,0);
+    m_stripRows[nd] = gridRows;
+    int row = 0;
+    long long sum = 0;
+    for(int d=1;d<nd;d++)
+    {
+        long long target = ((long long)_rows.size()*d)/nd;
+        int first = m_stripRows[d-1]+minRows;
+        int last = gridRows-(nd-d)*minRows;
+        while(row<first || (row<last && sum<target))
+        {
+            sum+=count[row];
+            row++;
+        }
+        m_stripRows[d] = row;
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverMultiGPU::solveDomains()
+{
+    int nd = (int)m_domains.size();
+
+    // Sort and compute our densities on every device. Our halos are wide enough that every particle our owned
+    // particles touch gets the right density.
+    for(int d=0;d<nd;d++)
+    {
+        SPHSolverCUDA *s = m_domains[d];
+        int n = s->m_simProperties.numParticles;
+        int *starts = &m_hostRowStarts[d*rowStartStride()];
+        if(!n)
+        {
+            starts[0] = starts[1] = 0;
+            continue;
+        }
+        checkCudaErrors(cudaSetDevice(s->m_device));
+        int tableSize = s->m_simProperties.gridRes.x*s->m_simProperties.gridRes.y;
+        // Our particle count changes every step
+        s->markSimPropsDirty();
+        s->updateGPUSimProps();
+        s->m_sortValid = false;
+        s->spatialSort();
+        computeParticleScales(s->m_cudaStream,s->m_threadsPerBlock,n,s->m_fluidBuffers,m_multiclass);
+        initDensity(s->m_cudaStream,s->m_threadsPerBlock,n,tableSize,s->m_fluidBuffers,getStippleMode(),m_neighbourSearchMode);
+
+        // The rows of our strip are contiguous after our sort so thats where our owned particles are
+        int rows[2] = {m_stripRows[d],m_stripRows[d+1]};
+        queueRowStarts(d,rows,2,n,starts);
+    }
+    synchronize();
+
+    // Mean density of each of our devices owned particles
+    for(int d=0;d<nd;d++)
+    {
+        SPHSolverCUDA *s = m_domains[d];
+        int *starts = &m_hostRowStarts[d*rowStartStride()];
+        m_ownedBegin[d] = starts[0];
+        m_ownedEnd[d] = starts[1];
+        int numOwned = starts[1]-starts[0];
+        // Everyone has finished our last step so nobody is reading these
+        m_hostMeanDensity[d] = 0.f;
+        m_hostOwnedCount[d] = std::max(numOwned,0);
+        checkCudaErrors(cudaSetDevice(s->m_device));
+        if(numOwned>0)
+        {
+            fluidBuffers owned = offsetBuffers(d,starts[0]);
+            computeRestDensity(s->m_cudaStream,numOwned,0.f,owned);
+            checkCudaErrors(cudaMemcpyAsync(&m_hostMeanDensity[d],owned.restDenPtr,sizeof(float),cudaMemcpyDeviceToHost,s->m_cudaStream));
+        }
+        checkCudaErrors(cudaEventRecord(m_meanEvents[d],s->m_cudaStream));
+    }
+
+    // Now every device can combine our means into our global rest density and solve its forces. Each device
+    // only waits for everyones means to land, our host doesnt wait at all.
+    for(int d=0;d<nd;d++)
+    {
+        SPHSolverCUDA *s = m_domains[d];
+        int n = s->m_simProperties.numParticles;
+        m_hostConvergedCount[d] = 0;
+        if(!n) continue;
+        checkCudaErrors(cudaSetDevice(s->m_device));
+        int tableSize = s->m_simProperties.gridRes.x*s->m_simProperties.gridRes.y;
+        for(int src=0;src<nd;src++) checkCudaErrors(cudaStreamWaitEvent(s->m_cudaStream,m_meanEvents[src],0));
+        combineRestDensity(s->m_cudaStream,nd,m_hostMeanDensity,m_hostOwnedCount,m_densityDiff,s->m_fluidBuffers);
+        solve(s->m_cudaStream,s->m_threadsPerBlock,n,tableSize,s->m_fluidBuffers,getStippleMode(),m_neighbourSearchMode);
+
+        // Only our owned particles count towards converging
+        int numOwned = m_ownedEnd[d]-m_ownedBegin[d];
+        if(numOwned<=0) continue;
+        countConverged(s->m_cudaStream,numOwned,offsetBuffers(d,m_ownedBegin[d]));
+        checkCudaErrors(cudaMemcpyAsync(&m_hostConvergedCount[d],s->m_fluidBuffers.convergedCount,sizeof(int),cudaMemcpyDeviceToHost,s->m_cudaStream));
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverMultiGPU::exchangeHalos()
+{
+    int nd = (int)m_domains.size();
+    int stride = rowStartStride();
+
+    // Sort just our owned particles by cell so everything we send to another device is one contiguous range
+    for(int d=0;d<nd;d++)
+    {
+        SPHSolverCUDA *s = m_domains[d];
+        int numOwned = m_ownedEnd[d]-m_ownedBegin[d];
+        int *starts = &m_hostRowStarts[d*stride];
+        if(numOwned<=0)
+        {
+            for(int i=0;i<stride;i++) starts[i] = 0;
+            continue;
+        }
+        checkCudaErrors(cudaSetDevice(s->m_device));
+        int tableSize = s->m_simProperties.gridRes.x*s->m_simProperties.gridRes.y;
+        fluidBuffers owned = offsetBuffers(d,m_ownedBegin[d]);
+        fillIntZero(s->m_cudaStream,s->m_threadsPerBlock,s->m_fluidBuffers.cellOccBuffer,tableSize);
+        hashParticles(s->m_cudaStream,s->m_threadsPerBlock,numOwned,owned);
+        sortParticleKeys(s->m_cudaStream,numOwned,tableSize,owned);
+        gatherParticles(s->m_cudaStream,s->m_threadsPerBlock,numOwned,owned);
+        computeCellIndices(s->m_cudaStream,tableSize,owned);
+        // Our sorted particles are in our swap buffers. Make them current so we can build our new particles in the other half.
+        s->swapParticleBuffers();
+
+        // Where our rows either side of every strip edge start. A particle can have moved into any strip
+        // so we need them all, not just our own edges.
+        std::vector<int> rows(stride);
+        for(int e=0;e<=nd;e++)
+        {
+            rows[e*SPH_EDGE_STARTS] = m_stripRows[e]-SPH_HALO_ROWS;
+            rows[e*SPH_EDGE_STARTS+1] = m_stripRows[e];
+            rows[e*SPH_EDGE_STARTS+2] = m_stripRows[e]+SPH_HALO_ROWS;
+        }
+        queueRowStarts(d,&rows[0],stride,numOwned,starts);
+    }
+    synchronize();
+
+    // Work out how many particles each device ends up with. Device d owns the rows between edges d and d+1
+    // of every device and its halos are the rows just outside them.
+    std::vector<int> numOwned(nd);
+    std::vector<int> numTotal(nd);
+    for(int d=0;d<nd;d++)
+    {
+        int lo = d*SPH_EDGE_STARTS;
+        int hi = (d+1)*SPH_EDGE_STARTS;
+        int owned = 0;
+        int halo = 0;
+        for(int src=0;src<nd;src++)
+        {
+            int *c = &m_hostRowStarts[src*stride];
+            owned+=c[hi+1]-c[lo+1];
+            halo+=(c[lo+1]-c[lo])+(c[hi+2]-c[hi+1]);
+        }
+        numOwned[d] = owned;
+        numTotal[d] = owned+halo;
+    }
+
+    // Make sure everyone has room before any copies start, growing moves our buffers
+    for(int d=0;d<nd;d++)
+    {
+        SPHSolverCUDA *s = m_domains[d];
+        if(numTotal[d]<=s->m_particleCapacity) continue;
+        checkCudaErrors(cudaSetDevice(s->m_device));
+        s->reserveParticles(numTotal[d]+numTotal[d]/4);
+    }
+
+    // Build each devices new particles in its swap buffers. Our owned particles from every device go first,
+    // then our halos.
+    for(int d=0;d<nd;d++)
+    {
+        int offset = 0;
+        int lo = d*SPH_EDGE_STARTS;
+        int hi = (d+1)*SPH_EDGE_STARTS;
+        for(int src=0;src<nd;src++)
+        {
+            int *c = &m_hostRowStarts[src*stride];
+            copyParticles(d,src,c[lo+1],c[hi+1],offset);
+        }
+        for(int src=0;src<nd;src++)
+        {
+            int *c = &m_hostRowStarts[src*stride];
+            copyParticles(d,src,c[lo],c[lo+1],offset);
+            copyParticles(d,src,c[hi+1],c[hi+2],offset);
+        }
+        checkCudaErrors(cudaSetDevice(m_domains[d]->m_device));
+        checkCudaErrors(cudaEventRecord(m_copyEvents[d],m_domains[d]->m_cudaStream));
+    }
+    // Other devices read our current buffers, which become our swap buffers below. Our next sort writes over
+    // them so our streams wait for everyone to finish copying, our host carries straight on.
+    for(int d=0;d<nd;d++)
+    {
+        SPHSolverCUDA *s = m_domains[d];
+        checkCudaErrors(cudaSetDevice(s->m_device));
+        for(int dst=0;dst<nd;dst++)
+        {
+            if(dst!=d) checkCudaErrors(cudaStreamWaitEvent(s->m_cudaStream,m_copyEvents[dst],0));
+        }
+    }
+
+    // Every particle lands in exactly one strip so our total never changes
+    for(int d=0;d<nd;d++)
+    {
+        SPHSolverCUDA *s = m_domains[d];
+        s->swapParticleBuffers();
+        s->m_simProperties.numParticles = numTotal[d];
+        s->m_sortValid = false;
+        m_ownedBegin[d] = 0;
+        m_ownedEnd[d] = numOwned[d];
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverMultiGPU::queueRowStarts(int _d, const int *_rows, int _numRows, int _numSorted, int *_out)
+{
+    SPHSolverCUDA *s = m_domains[_d];
+    int resX = s->m_simProperties.gridRes.x;
+    int resY = s->m_simProperties.gridRes.y;
+    for(int i=0;i<_numRows;i++)
+    {
+        if(_rows[i]<=0)
+        {
+            _out[i] = 0;
+        }
+        else if(_rows[i]>=resY)
+        {
+            _out[i] = _numSorted;
+        }
+        else
+        {
+            // Our cell indices are an exclusive scan so the first cell of a row is where that row starts
+            checkCudaErrors(cudaMemcpyAsync(&_out[i],s->m_fluidBuffers.cellIndexBuffer+_rows[i]*resX,sizeof(int),cudaMemcpyDeviceToHost,s->m_cudaStream));
+        }
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverMultiGPU::copyParticles(int _dst, int _src, int _begin, int _end, int &_offset)
+{
+    int n = _end-_begin;
+    if(n<=0) return;
+    SPHSolverCUDA *dst = m_domains[_dst];
+    SPHSolverCUDA *src = m_domains[_src];
+    int first = m_ownedBegin[_src]+_begin;
+    checkCudaErrors(cudaSetDevice(dst->m_device));
+    checkCudaErrors(cudaMemcpyPeerAsync(dst->m_fluidBuffers.posSwap+_offset,dst->m_device,src->m_fluidBuffers.posPtr+first,src->m_device,n*sizeof(float4),dst->m_cudaStream));
+    checkCudaErrors(cudaMemcpyPeerAsync(dst->m_fluidBuffers.velSwap+_offset,dst->m_device,src->m_fluidBuffers.velPtr+first,src->m_device,n*sizeof(float2),dst->m_cudaStream));
+    _offset+=n;
+}
+//----------------------------------------------------------------------------------------------------------------------
+fluidBuffers SPHSolverMultiGPU::offsetBuffers(int _d, int _offset)
+{
+    fluidBuffers buff = m_domains[_d]->m_fluidBuffers;
+    buff.posPtr+=_offset;
+    buff.posSwap+=_offset;
+    buff.velPtr+=_offset;
+    buff.velSwap+=_offset;
+    buff.hashKeys+=_offset;
+    buff.sortedHashKeys+=_offset;
+    buff.particleIdx+=_offset;
+    buff.sortedIdx+=_offset;
+    buff.convergedPtr+=_offset;
+    buff.scalePtr+=_offset;
+    return buff;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverMultiGPU::synchronize()
+{
+    for(unsigned int d=0;d<m_domains.size();d++)
+    {
+        checkCudaErrors(cudaSetDevice(m_domains[d]->m_device));
+        checkCudaErrors(cudaStreamSynchronize(m_domains[d]->m_cudaStream));
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
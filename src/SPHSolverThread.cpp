@@ -0,0 +1,90 @@
+#include "SPHSolverThread.h"
+#include "SPHSolverCUDA.h"
+#include <QMutexLocker>
+
+//----------------------------------------------------------------------------------------------------------------------
+SPHSolverThread::SPHSolverThread(SPHSolverCUDA *_solver, int _stepsPerBatch)
+{
+    m_solver = _solver;
+    m_stepping = false;
+    m_stepsPerBatch = (_stepsPerBatch>0) ? _stepsPerBatch : 1;
+    m_stop = false;
+    m_numWaiting = 0;
+    m_solver->setDeferredPublish(true);
+    start();
+}
+//----------------------------------------------------------------------------------------------------------------------
+SPHSolverThread::~SPHSolverThread()
+{
+    m_stateMutex.lock();
+    m_stop = true;
+    m_stateChanged.wakeAll();
+    m_stateMutex.unlock();
+    wait();
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverThread::setStepping(bool _stepping)
+{
+    QMutexLocker lock(&m_stateMutex);
+    m_stepping = _stepping;
+    m_stateChanged.wakeAll();
+}
+//----------------------------------------------------------------------------------------------------------------------
+bool SPHSolverThread::isStepping()
+{
+    QMutexLocker lock(&m_stateMutex);
+    return m_stepping;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverThread::setStepsPerBatch(int _steps)
+{
+    QMutexLocker lock(&m_stateMutex);
+    if(_steps>0) m_stepsPerBatch = _steps;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverThread::lockSolver()
+{
+    // Let our thread know to hold off so it doesnt grab our solver straight back after each batch
+    m_stateMutex.lock();
+    m_numWaiting++;
+    m_stateMutex.unlock();
+
+    m_solverMutex.lock();
+
+    m_stateMutex.lock();
+    m_numWaiting--;
+    m_stateMutex.unlock();
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverThread::unlockSolver()
+{
+    m_solverMutex.unlock();
+    QMutexLocker lock(&m_stateMutex);
+    m_stateChanged.wakeAll();
+}
+//----------------------------------------------------------------------------------------------------------------------
+void SPHSolverThread::run()
+{
+    // Our device is set per thread
+    checkCudaErrors(cudaSetDevice(m_solver->getDevice()));
+
+    QMutexLocker lock(&m_stateMutex);
+    for(;;)
+    {
+        while(!m_stop && (!m_stepping || m_numWaiting>0))
+        {
+            m_stateChanged.wait(&m_stateMutex);
+        }
+        if(m_stop) return;
+        int steps = m_stepsPerBatch;
+        lock.unlock();
+
+        // Our update only queues work on our solvers stream and publishes into our frames, it never waits on our renderer
+        m_solverMutex.lock();
+        m_solver->update(steps);
+        m_solverMutex.unlock();
+
+        lock.relock();
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,214 @@
+#include "StippleExport.h"
+#include "SPHSolverCUDA.h"
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <QByteArray>
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief size of the buffer we write our text files through
+//----------------------------------------------------------------------------------------------------------------------
+#define STP_WRITE_BUFFER (4<<20)
+
+//----------------------------------------------------------------------------------------------------------------------
+StippleExport::StippleExport()
+{
+    m_devXY = 0;
+    m_devClass = 0;
+    m_devRadius = 0;
+    m_hostXY = 0;
+    m_hostClass = 0;
+    m_hostRadius = 0;
+    m_capacity = 0;
+    m_device = -1;
+    m_downloadEvent = 0;
+    m_count = 0;
+    m_columns = 0;
+    m_width = 0.f;
+    m_height = 0.f;
+}
+//----------------------------------------------------------------------------------------------------------------------
+StippleExport::~StippleExport()
+{
+    if(m_downloadEvent) checkCudaErrors(cudaEventSynchronize(m_downloadEvent));
+    freeBuffers();
+}
+//----------------------------------------------------------------------------------------------------------------------
+void StippleExport::freeBuffers()
+{
+    if(m_device>=0) checkCudaErrors(cudaSetDevice(m_device));
+    if(m_devXY) checkCudaErrors(cudaFree(m_devXY));
+    if(m_devClass) checkCudaErrors(cudaFree(m_devClass));
+    if(m_devRadius) checkCudaErrors(cudaFree(m_devRadius));
+    if(m_hostXY) checkCudaErrors(cudaFreeHost(m_hostXY));
+    if(m_hostClass) checkCudaErrors(cudaFreeHost(m_hostClass));
+    if(m_hostRadius) checkCudaErrors(cudaFreeHost(m_hostRadius));
+    if(m_downloadEvent) checkCudaErrors(cudaEventDestroy(m_downloadEvent));
+    m_devXY = 0;
+    m_devClass = 0;
+    m_devRadius = 0;
+    m_hostXY = 0;
+    m_hostClass = 0;
+    m_hostRadius = 0;
+    m_downloadEvent = 0;
+    m_capacity = 0;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void StippleExport::reserve(int _n, int _device)
+{
+    if(_n<=m_capacity && _device==m_device) return;
+
+    // Anything still downloading into our old buffers has to finish before we free them
+    if(m_downloadEvent) checkCudaErrors(cudaEventSynchronize(m_downloadEvent));
+    freeBuffers();
+
+    m_device = _device;
+    checkCudaErrors(cudaSetDevice(m_device));
+    checkCudaErrors(cudaMalloc(&m_devXY,_n*sizeof(float2)));
+    checkCudaErrors(cudaMalloc(&m_devClass,_n*sizeof(unsigned char)));
+    checkCudaErrors(cudaMalloc(&m_devRadius,_n*sizeof(float)));
+    checkCudaErrors(cudaMallocHost(&m_hostXY,_n*sizeof(float2)));
+    checkCudaErrors(cudaMallocHost(&m_hostClass,_n*sizeof(unsigned char)));
+    checkCudaErrors(cudaMallocHost(&m_hostRadius,_n*sizeof(float)));
+    checkCudaErrors(cudaEventCreateWithFlags(&m_downloadEvent,cudaEventDisableTiming));
+    m_capacity = _n;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void StippleExport::download(SPHSolverCUDA &_solver, unsigned int _columns)
+{
+    int n = _solver.getNumParticles();
+    float2 bounds = _solver.getSimBounds();
+    m_width = bounds.x;
+    m_height = bounds.y;
+    m_columns = _columns & (STP_HAS_CLASS|STP_HAS_RADIUS);
+    m_count = n;
+    if(!n) return;
+
+    // We may still be writing our last download out of our pinned buffers
+    if(m_downloadEvent) checkCudaErrors(cudaEventSynchronize(m_downloadEvent));
+    reserve(n,_solver.getDevice());
+
+    unsigned char *devClass = (m_columns&STP_HAS_CLASS) ? m_devClass : 0;
+    float *devRadius = (m_columns&STP_HAS_RADIUS) ? m_devRadius : 0;
+    _solver.packParticles(m_devXY,devClass,devRadius);
+
+    // One copy per column straight into our pinned buffers, nothing on the host waits on these
+    cudaStream_t stream = _solver.getStream();
+    checkCudaErrors(cudaMemcpyAsync(m_hostXY,m_devXY,n*sizeof(float2),cudaMemcpyDeviceToHost,stream));
+    if(devClass) checkCudaErrors(cudaMemcpyAsync(m_hostClass,devClass,n*sizeof(unsigned char),cudaMemcpyDeviceToHost,stream));
+    if(devRadius) checkCudaErrors(cudaMemcpyAsync(m_hostRadius,devRadius,n*sizeof(float),cudaMemcpyDeviceToHost,stream));
+    checkCudaErrors(cudaEventRecord(m_downloadEvent,stream));
+}
+//----------------------------------------------------------------------------------------------------------------------
+void StippleExport::setPositions(const std::vector<float3> &_positions, float _width, float _height)
+{
+    int n = (int)_positions.size();
+    m_width = _width;
+    m_height = _height;
+    m_columns = 0;
+    m_count = n;
+    if(!n) return;
+
+    int device;
+    checkCudaErrors(cudaGetDevice(&device));
+    if(m_downloadEvent) checkCudaErrors(cudaEventSynchronize(m_downloadEvent));
+    reserve(n,(m_device>=0) ? m_device : device);
+    for(int i=0;i<n;i++)
+    {
+        m_hostXY[i] = make_float2(_positions[i].x,_positions[i].y);
+    }
+    checkCudaErrors(cudaSetDevice(m_device));
+    checkCudaErrors(cudaMemcpy(m_devXY,m_hostXY,n*sizeof(float2),cudaMemcpyHostToDevice));
+}
+//----------------------------------------------------------------------------------------------------------------------
+bool StippleExport::ready()
+{
+    if(!m_downloadEvent) return true;
+    return cudaEventQuery(m_downloadEvent)==cudaSuccess;
+}
+//----------------------------------------------------------------------------------------------------------------------
+bool StippleExport::isBinaryFile(const std::string &_file)
+{
+    if(isCompressedFile(_file)) return true;
+    return _file.size()>=4 && _file.compare(_file.size()-4,4,".stp")==0;
+}
+//----------------------------------------------------------------------------------------------------------------------
+bool StippleExport::isCompressedFile(const std::string &_file)
+{
+    return _file.size()>=5 && _file.compare(_file.size()-5,5,".stpz")==0;
+}
+//----------------------------------------------------------------------------------------------------------------------
+bool StippleExport::write(const std::string &_file)
+{
+    if(m_downloadEvent) checkCudaErrors(cudaEventSynchronize(m_downloadEvent));
+    if(isBinaryFile(_file)) return writeBinary(_file);
+    return writeText(_file);
+}
+//----------------------------------------------------------------------------------------------------------------------
+bool StippleExport::writeBinary(const std::string &_file)
+{
+    FILE *f = fopen(_file.c_str(),"wb");
+    if(!f)
+    {
+        std::cerr<<"Cannot open file "<<_file<<std::endl;
+        return false;
+    }
+
+    StippleFileHeader header;
+    memcpy(header.magic,"STP1",4);
+    header.version = 1;
+    header.count = m_count;
+    header.flags = m_columns;
+    header.width = m_width;
+    header.height = m_height;
+
+    bool ok = true;
+    if(isCompressedFile(_file))
+    {
+        // Our whole .stp file run through qCompress, its 4 byte big endian length prefix included
+        QByteArray raw;
+        raw.reserve(sizeof(header)+m_count*(sizeof(float2)+sizeof(unsigned char)+sizeof(float)));
+        raw.append((const char*)&header,sizeof(header));
+        if(m_count) raw.append((const char*)m_hostXY,m_count*sizeof(float2));
+        if(m_count && (m_columns&STP_HAS_CLASS)) raw.append((const char*)m_hostClass,m_count*sizeof(unsigned char));
+        if(m_count && (m_columns&STP_HAS_RADIUS)) raw.append((const char*)m_hostRadius,m_count*sizeof(float));
+        QByteArray packed = qCompress(raw);
+        ok = fwrite(packed.constData(),1,packed.size(),f)==(size_t)packed.size();
+    }
+    else
+    {
+        // Our columns are already packed in our pinned buffers so each is a single write
+        ok = fwrite(&header,sizeof(header),1,f)==1;
+        if(ok && m_count) ok = fwrite(m_hostXY,sizeof(float2),m_count,f)==(size_t)m_count;
+        if(ok && m_count && (m_columns&STP_HAS_CLASS)) ok = fwrite(m_hostClass,sizeof(unsigned char),m_count,f)==(size_t)m_count;
+        if(ok && m_count && (m_columns&STP_HAS_RADIUS)) ok = fwrite(m_hostRadius,sizeof(float),m_count,f)==(size_t)m_count;
+    }
+    if(fclose(f)!=0) ok = false;
+
+    if(!ok) std::cerr<<"Failed writing "<<_file<<std::endl;
+    return ok;
+}
+//----------------------------------------------------------------------------------------------------------------------
+bool StippleExport::writeText(const std::string &_file)
+{
+    FILE *f = fopen(_file.c_str(),"w");
+    if(!f)
+    {
+        std::cerr<<"Cannot open file "<<_file<<std::endl;
+        return false;
+    }
+
+    // Write through one big buffer rather than lots of small ones. %g matches what our old ofstream export wrote.
+    std::vector<char> buffer(STP_WRITE_BUFFER);
+    setvbuf(f,&buffer[0],_IOFBF,buffer.size());
+    bool ok = true;
+    for(int i=0;i<m_count && ok;i++)
+    {
+        ok = fprintf(f,"%g %g\n",m_hostXY[i].x,m_hostXY[i].y)>0;
+    }
+    if(fclose(f)!=0) ok = false;
+
+    if(!ok) std::cerr<<"Failed writing "<<_file<<std::endl;
+    return ok;
+}
+//----------------------------------------------------------------------------------------------------------------------
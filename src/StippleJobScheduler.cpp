@@ -0,0 +1,235 @@
+#include "StippleJobScheduler.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <QTime>
+
+//----------------------------------------------------------------------------------------------------------------------
+StippleJobScheduler::StippleJobScheduler(int _maxConcurrent, int _threadsPerBlock)
+{
+    m_maxConcurrent = (_maxConcurrent>0) ? _maxConcurrent : 1;
+    m_threadsPerBlock = _threadsPerBlock;
+    m_stepsPerRound = 16;
+    m_useCudaGraph = true;
+    m_numCompleted = 0;
+    m_numConverged = 0;
+    m_numFailed = 0;
+}
+//----------------------------------------------------------------------------------------------------------------------
+StippleJobScheduler::~StippleJobScheduler()
+{
+    for(unsigned int i=0;i<m_active.size();i++)
+    {
+        delete m_active[i].solver;
+    }
+    for(unsigned int i=0;i<m_exporting.size();i++)
+    {
+        delete m_exporting[i].exporter;
+        delete m_exporting[i].active.solver;
+    }
+    for(unsigned int i=0;i<m_exportPool.size();i++)
+    {
+        delete m_exportPool[i];
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+void StippleJobScheduler::addJob(const StippleJob &_job)
+{
+    if(_job.numParticles<=0 || _job.epsilon<=0.f)
+    {
+        std::cerr<<"Skipping job "<<_job.image.toStdString()<<", it needs a positive particle count and epsilon"<<std::endl;
+        return;
+    }
+    if(_job.width<=0.f || _job.height<=0.f || _job.wallThickness<0.f || _job.wallLayers<0.f)
+    {
+        std::cerr<<"Skipping job "<<_job.image.toStdString()<<", it needs positive bounds and a wall that isnt negative"<<std::endl;
+        return;
+    }
+    m_queue.push_back(_job);
+}
+//----------------------------------------------------------------------------------------------------------------------
+int StippleJobScheduler::loadJobFile(const std::string &_file)
+{
+    std::ifstream f(_file.c_str());
+    if(!f.is_open())
+    {
+        std::cerr<<"Cannot open job file "<<_file<<std::endl;
+        return -1;
+    }
+
+    int added = 0;
+    int lineNumber = 0;
+    std::string line;
+    while(std::getline(f,line))
+    {
+        lineNumber++;
+        std::istringstream ss(line);
+        std::string image;
+        if(!(ss>>image) || image[0]=='#') continue;
+
+        StippleJob job;
+        job.image = QString::fromStdString(image);
+        if(!(ss>>job.numParticles>>job.epsilon>>job.output))
+        {
+            std::cerr<<_file<<":"<<lineNumber<<" expected <image> <numParticles> <epsilon> <outputFile> [maxIterations] [width height] [wallThickness wallLayers]"<<std::endl;
+            continue;
+        }
+        // Our optional columns come in order so stop at the first one that isnt there
+        int maxIterations;
+        float a,b;
+        if(ss>>maxIterations)
+        {
+            job.maxIterations = maxIterations;
+            if(ss>>a>>b)
+            {
+                job.width = a;
+                job.height = b;
+                if(ss>>a>>b)
+                {
+                    job.wallThickness = a;
+                    job.wallLayers = b;
+                }
+            }
+        }
+
+        unsigned int queued = m_queue.size();
+        addJob(job);
+        if(m_queue.size()>queued) added++;
+    }
+    f.close();
+    return added;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void StippleJobScheduler::startNextJob()
+{
+    ActiveJob a;
+    a.job = m_queue.front();
+    m_queue.pop_front();
+    a.iterations = 0;
+
+    // Each job gets its own headless solver, and with it its own stream and simulation properties,
+    // so nothing it queues has to wait on any of our other jobs
+    a.solver = new SPHSolverCUDA(a.job.width,a.job.height,a.job.wallThickness,a.job.wallLayers,true);
+    a.solver->setThreadsPerBlock(m_threadsPerBlock);
+    a.solver->setUseCudaGraph(m_useCudaGraph);
+    a.solver->setSampleImage(a.job.image);
+    a.solver->setConvergeValue(a.job.epsilon);
+    a.solver->genRandomSamples((float)a.job.numParticles);
+
+    m_active.push_back(a);
+}
+//----------------------------------------------------------------------------------------------------------------------
+void StippleJobScheduler::finishJob(ActiveJob &_job)
+{
+    PendingExport p;
+    p.active = _job;
+    p.converged = _job.solver->convergedState();
+    if(m_exportPool.empty())
+    {
+        p.exporter = new StippleExport();
+    }
+    else
+    {
+        p.exporter = m_exportPool.back();
+        m_exportPool.pop_back();
+    }
+
+    // Queued on our jobs own stream so it overlaps with the steps of our other jobs
+    unsigned int columns = StippleExport::isBinaryFile(_job.job.output) ? STP_HAS_RADIUS : 0;
+    p.exporter->download(*_job.solver,columns);
+    m_exporting.push_back(p);
+    _job.solver = 0;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void StippleJobScheduler::writeExports(bool _wait)
+{
+    for(unsigned int i=0;i<m_exporting.size();)
+    {
+        PendingExport &p = m_exporting[i];
+        if(!_wait && !p.exporter->ready())
+        {
+            i++;
+            continue;
+        }
+
+        ActiveJob &a = p.active;
+        if(p.exporter->write(a.job.output))
+        {
+            m_numCompleted++;
+            if(p.converged)
+            {
+                m_numConverged++;
+                std::cout<<a.job.image.toStdString()<<" converged after "<<a.iterations<<" iterations"<<std::endl;
+            }
+            else
+            {
+                std::cout<<a.job.image.toStdString()<<" did not converge after "<<a.iterations<<" iterations, writing current samples"<<std::endl;
+            }
+        }
+        else
+        {
+            m_numFailed++;
+        }
+
+        delete a.solver;
+        m_exportPool.push_back(p.exporter);
+        m_exporting.erase(m_exporting.begin()+i);
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+void StippleJobScheduler::run()
+{
+    QTime startTime = QTime::currentTime();
+    while(!m_queue.empty() || !m_active.empty() || !m_exporting.empty())
+    {
+        // Keep all of our slots full
+        while((int)m_active.size()<m_maxConcurrent && !m_queue.empty())
+        {
+            startNextJob();
+        }
+
+        // Queue a round of steps for every job before we wait on any of them so the GPU
+        // always has work from all of our streams to overlap
+        for(unsigned int i=0;i<m_active.size();i++)
+        {
+            ActiveJob &a = m_active[i];
+            int steps = std::min(m_stepsPerRound,a.job.maxIterations-a.iterations);
+            a.solver->update(steps);
+            a.iterations+=steps;
+        }
+
+        // Write out whatever finished last round while this round runs
+        writeExports(m_active.empty());
+
+        for(unsigned int i=0;i<m_active.size();i++)
+        {
+            m_active[i].solver->synchronize();
+        }
+
+        // Retire any jobs that have converged or run out of iterations
+        for(unsigned int i=0;i<m_active.size();)
+        {
+            ActiveJob &a = m_active[i];
+            if(a.solver->convergedState() || a.iterations>=a.job.maxIterations)
+            {
+                finishJob(a);
+                m_active.erase(m_active.begin()+i);
+            }
+            else
+            {
+                i++;
+            }
+        }
+    }
+    writeExports(true);
+    float timeTaken = startTime.msecsTo(QTime::currentTime()) / 1000.f;
+
+    std::cout<<"Finished "<<m_numCompleted<<" jobs ("<<m_numConverged<<" converged, "<<m_numFailed<<" failed) in "<<timeTaken<<"s";
+    if(timeTaken>0.f)
+    {
+        std::cout<<", "<<m_numCompleted*3600.f/timeTaken<<" images per hour";
+    }
+    std::cout<<std::endl;
+}
+//----------------------------------------------------------------------------------------------------------------------
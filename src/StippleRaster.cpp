@@ -0,0 +1,422 @@
+#include "StippleRaster.h"
+#include "SPHSolverCUDA.h"
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <QImage>
+#include <QVector>
+#include <QString>
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief size of the buffer we stream our vector formats through
+//----------------------------------------------------------------------------------------------------------------------
+#define STP_VECTOR_BUFFER (4<<20)
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief the colours of our classes, the same as our CMYK particle shader
+//----------------------------------------------------------------------------------------------------------------------
+static const char *s_svgInk[4] = {"#00ffff","#ff00ff","#ffff00","#000000"};
+static const char *s_pdfInk[4] = {"1 0 0 0","0 1 0 0","0 0 1 0","0 0 0 1"};
+
+//----------------------------------------------------------------------------------------------------------------------
+StippleRaster::StippleRaster()
+{
+    m_stream = 0;
+    m_streamDevice = -1;
+    m_ink = 0;
+    m_pixels = 0;
+    m_hostPixels[0] = m_hostPixels[1] = 0;
+    m_tileEvent[0] = m_tileEvent[1] = 0;
+    memset(&m_bins,0,sizeof(RasterBins));
+    m_binStipples = 0;
+    m_binTiles = 0;
+    m_binEntries = 0;
+    m_dotScale = 1.f;
+    m_dotRadius = 0.f;
+    m_dpi = 300.f;
+}
+//----------------------------------------------------------------------------------------------------------------------
+StippleRaster::~StippleRaster()
+{
+    freeTiles();
+}
+//----------------------------------------------------------------------------------------------------------------------
+void StippleRaster::allocTiles()
+{
+    int device = m_stipples.getDevice();
+    if(m_stream && device==m_streamDevice) return;
+    freeTiles();
+
+    // Big enough for a full tile of color ink, we only ever draw one tile at a time
+    size_t tilePixels = (size_t)STP_RASTER_TILE*STP_RASTER_TILE;
+    m_streamDevice = device;
+    checkCudaErrors(cudaSetDevice(m_streamDevice));
+    checkCudaErrors(cudaStreamCreateWithFlags(&m_stream,cudaStreamNonBlocking));
+    checkCudaErrors(cudaMalloc(&m_ink,tilePixels*4*sizeof(float)));
+    checkCudaErrors(cudaMalloc(&m_pixels,tilePixels*3));
+    for(int i=0;i<2;i++)
+    {
+        checkCudaErrors(cudaMallocHost(&m_hostPixels[i],tilePixels*3));
+        checkCudaErrors(cudaEventCreateWithFlags(&m_tileEvent[i],cudaEventDisableTiming));
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+void StippleRaster::freeTiles()
+{
+    if(!m_stream) return;
+    checkCudaErrors(cudaSetDevice(m_streamDevice));
+    checkCudaErrors(cudaStreamSynchronize(m_stream));
+    freeBins();
+    checkCudaErrors(cudaFree(m_ink));
+    checkCudaErrors(cudaFree(m_pixels));
+    for(int i=0;i<2;i++)
+    {
+        checkCudaErrors(cudaFreeHost(m_hostPixels[i]));
+        checkCudaErrors(cudaEventDestroy(m_tileEvent[i]));
+        m_hostPixels[i] = 0;
+        m_tileEvent[i] = 0;
+    }
+    checkCudaErrors(cudaStreamDestroy(m_stream));
+    m_stream = 0;
+    m_streamDevice = -1;
+    m_ink = 0;
+    m_pixels = 0;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void StippleRaster::freeBins()
+{
+    // Called with our device set and our stream finished
+    if(m_bins.stippleTiles) checkCudaErrors(cudaFree(m_bins.stippleTiles));
+    if(m_bins.entryOffset) checkCudaErrors(cudaFree(m_bins.entryOffset));
+    if(m_bins.tileOcc) checkCudaErrors(cudaFree(m_bins.tileOcc));
+    if(m_bins.tileStart) checkCudaErrors(cudaFree(m_bins.tileStart));
+    if(m_bins.tileKeys) checkCudaErrors(cudaFree(m_bins.tileKeys));
+    if(m_bins.stippleIdx) checkCudaErrors(cudaFree(m_bins.stippleIdx));
+    if(m_bins.sortedKeys) checkCudaErrors(cudaFree(m_bins.sortedKeys));
+    if(m_bins.sortedIdx) checkCudaErrors(cudaFree(m_bins.sortedIdx));
+    if(m_bins.tempStorage) checkCudaErrors(cudaFree(m_bins.tempStorage));
+    memset(&m_bins,0,sizeof(RasterBins));
+    m_binStipples = 0;
+    m_binTiles = 0;
+    m_binEntries = 0;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void StippleRaster::binStipples(const RasterTile &_image, int2 _tiles, const float *_radius, float _dotRadius)
+{
+    int n = m_stipples.getCount();
+    int numTiles = _tiles.x*_tiles.y;
+    const float2 *xy = m_stipples.getDeviceXY();
+
+    // Our last image has to be done with our bins before we grow them, growing is the only time we allocate
+    checkCudaErrors(cudaStreamSynchronize(m_stream));
+    if(n>m_binStipples)
+    {
+        if(m_bins.stippleTiles) checkCudaErrors(cudaFree(m_bins.stippleTiles));
+        if(m_bins.entryOffset) checkCudaErrors(cudaFree(m_bins.entryOffset));
+        m_binStipples = n+n/4;
+        checkCudaErrors(cudaMalloc(&m_bins.stippleTiles,m_binStipples*sizeof(int)));
+        checkCudaErrors(cudaMalloc(&m_bins.entryOffset,m_binStipples*sizeof(int)));
+    }
+    if(numTiles+1>m_binTiles)
+    {
+        if(m_bins.tileOcc) checkCudaErrors(cudaFree(m_bins.tileOcc));
+        if(m_bins.tileStart) checkCudaErrors(cudaFree(m_bins.tileStart));
+        m_binTiles = numTiles+1;
+        checkCudaErrors(cudaMalloc(&m_bins.tileOcc,m_binTiles*sizeof(int)));
+        checkCudaErrors(cudaMalloc(&m_bins.tileStart,m_binTiles*sizeof(int)));
+    }
+    size_t tempBytes = binTempStorageBytes(n,numTiles,0);
+    if(tempBytes>m_bins.tempBytes)
+    {
+        if(m_bins.tempStorage) checkCudaErrors(cudaFree(m_bins.tempStorage));
+        m_bins.tempBytes = tempBytes;
+        checkCudaErrors(cudaMalloc(&m_bins.tempStorage,m_bins.tempBytes));
+    }
+
+    // Count our tiles and read back where they start, our last start is how many entries we have to sort
+    countStippleTiles(m_stream,256,n,xy,_radius,m_dotScale,_dotRadius,_image,_tiles,m_bins);
+    m_tileStart.resize(numTiles+1);
+    checkCudaErrors(cudaMemcpyAsync(&m_tileStart[0],m_bins.tileStart,(numTiles+1)*sizeof(int),cudaMemcpyDeviceToHost,m_stream));
+    checkCudaErrors(cudaStreamSynchronize(m_stream));
+    int numEntries = m_tileStart[numTiles];
+
+    if(numEntries>m_binEntries)
+    {
+        if(m_bins.tileKeys) checkCudaErrors(cudaFree(m_bins.tileKeys));
+        if(m_bins.stippleIdx) checkCudaErrors(cudaFree(m_bins.stippleIdx));
+        if(m_bins.sortedKeys) checkCudaErrors(cudaFree(m_bins.sortedKeys));
+        if(m_bins.sortedIdx) checkCudaErrors(cudaFree(m_bins.sortedIdx));
+        m_binEntries = numEntries+numEntries/4;
+        checkCudaErrors(cudaMalloc(&m_bins.tileKeys,m_binEntries*sizeof(int)));
+        checkCudaErrors(cudaMalloc(&m_bins.stippleIdx,m_binEntries*sizeof(int)));
+        checkCudaErrors(cudaMalloc(&m_bins.sortedKeys,m_binEntries*sizeof(int)));
+        checkCudaErrors(cudaMalloc(&m_bins.sortedIdx,m_binEntries*sizeof(int)));
+    }
+    tempBytes = binTempStorageBytes(n,numTiles,numEntries);
+    if(tempBytes>m_bins.tempBytes)
+    {
+        checkCudaErrors(cudaFree(m_bins.tempStorage));
+        m_bins.tempBytes = tempBytes;
+        checkCudaErrors(cudaMalloc(&m_bins.tempStorage,m_bins.tempBytes));
+    }
+    sortStippleTiles(m_stream,256,n,numEntries,xy,_radius,m_dotScale,_dotRadius,_image,_tiles,m_bins);
+}
+//----------------------------------------------------------------------------------------------------------------------
+void StippleRaster::setStipples(SPHSolverCUDA &_solver)
+{
+    unsigned int columns = STP_HAS_RADIUS;
+    if(_solver.isColorStippling()) columns |= STP_HAS_CLASS;
+    m_stipples.download(_solver,columns);
+}
+//----------------------------------------------------------------------------------------------------------------------
+void StippleRaster::setStipples(const std::vector<float3> &_positions, float _width, float _height)
+{
+    m_stipples.setPositions(_positions,_width,_height);
+}
+//----------------------------------------------------------------------------------------------------------------------
+float StippleRaster::dotRadius()
+{
+    if(m_dotRadius>0.f) return m_dotRadius;
+    // A third of the spacing our stipples would have if they were spread evenly
+    float2 b = m_stipples.getBounds();
+    int n = m_stipples.getCount();
+    if(!n) return 0.f;
+    return 0.3f*sqrtf(b.x*b.y/(float)n);
+}
+//----------------------------------------------------------------------------------------------------------------------
+bool StippleRaster::isRasterFile(const std::string &_file)
+{
+    if(_file.size()<4) return false;
+    std::string ext = _file.substr(_file.size()-4);
+    return ext==".png" || ext==".svg" || ext==".pdf";
+}
+//----------------------------------------------------------------------------------------------------------------------
+bool StippleRaster::write(const std::string &_file, int _width)
+{
+    if(_width<=0 || !isRasterFile(_file))
+    {
+        std::cerr<<"Cannot write "<<_file<<", we can write .png, .svg or .pdf files at a positive width"<<std::endl;
+        return false;
+    }
+    std::string ext = _file.substr(_file.size()-4);
+    if(ext==".png") return writePNG(_file,_width);
+    if(ext==".svg") return writeSVG(_file,_width);
+    return writePDF(_file,_width);
+}
+//----------------------------------------------------------------------------------------------------------------------
+bool StippleRaster::writePNG(const std::string &_file, int _width)
+{
+    float2 b = m_stipples.getBounds();
+    if(b.x<=0.f || b.y<=0.f) return false;
+    int width = _width;
+    int height = (int)ceilf(_width*b.y/b.x);
+    bool color = m_stipples.getDeviceClass()!=0;
+    int bpp = (color) ? 3 : 1;
+
+    // Our whole image lives on our host until we save it, QImageWriter cannot take our rows a tile at a time.
+    // Indexed grey rather than Format_Grayscale8 so we still build against Qt 4.8
+    QImage image(width,height,(color) ? QImage::Format_RGB888 : QImage::Format_Indexed8);
+    if(image.isNull())
+    {
+        std::cerr<<"Cannot allocate a "<<width<<"x"<<height<<" image for "<<_file<<std::endl;
+        return false;
+    }
+    if(!color)
+    {
+        QVector<QRgb> grey(256);
+        for(int i=0;i<256;i++) grey[i] = qRgb(i,i,i);
+        image.setColorTable(grey);
+    }
+
+    int n = m_stipples.getCount();
+    if(n)
+    {
+        allocTiles();
+        // Our stipples were downloaded on our solvers stream
+        if(m_stipples.getEvent()) checkCudaErrors(cudaStreamWaitEvent(m_stream,m_stipples.getEvent(),0));
+
+        const float *radius = (m_dotRadius>0.f) ? 0 : m_stipples.getDeviceRadius();
+        float r = dotRadius();
+        int tilesX = (width+STP_RASTER_TILE-1)/STP_RASTER_TILE;
+        int tilesY = (height+STP_RASTER_TILE-1)/STP_RASTER_TILE;
+        int numTiles = tilesX*tilesY;
+
+        // Bin our stipples once so each tile only splats the stipples that touch it
+        RasterTile image;
+        image.origin = make_int2(0,0);
+        image.size = make_int2(width,height);
+        image.pixelsPerUnit = width/b.x;
+        image.simHeight = b.y;
+        binStipples(image,make_int2(tilesX,tilesY),radius,r);
+
+        RasterTile tiles[2];
+        for(int t=0;t<=numTiles;t++)
+        {
+            if(t<numTiles)
+            {
+                // Queue our next tile before we copy out our last one so our GPU keeps drawing
+                RasterTile &tile = tiles[t%2];
+                tile.origin = make_int2((t%tilesX)*STP_RASTER_TILE,(t/tilesX)*STP_RASTER_TILE);
+                tile.size = make_int2(std::min(STP_RASTER_TILE,width-tile.origin.x),std::min(STP_RASTER_TILE,height-tile.origin.y));
+                tile.pixelsPerUnit = width/b.x;
+                tile.simHeight = b.y;
+                size_t tilePixels = (size_t)tile.size.x*tile.size.y;
+
+                // Our pinned tile may still be waiting to be copied from two tiles ago
+                checkCudaErrors(cudaEventSynchronize(m_tileEvent[t%2]));
+                checkCudaErrors(cudaMemsetAsync(m_ink,0,tilePixels*((color) ? 4 : 1)*sizeof(float),m_stream));
+                int first = m_tileStart[t];
+                splatStipples(m_stream,256,m_tileStart[t+1]-first,m_bins.sortedIdx+first,m_stipples.getDeviceXY(),radius,m_stipples.getDeviceClass(),m_dotScale,r,tile,m_ink);
+                resolveInk(m_stream,256,tile,m_ink,color,m_pixels);
+                checkCudaErrors(cudaMemcpyAsync(m_hostPixels[t%2],m_pixels,tilePixels*bpp,cudaMemcpyDeviceToHost,m_stream));
+                checkCudaErrors(cudaEventRecord(m_tileEvent[t%2],m_stream));
+            }
+            if(t>0)
+            {
+                int last = (t-1)%2;
+                RasterTile &tile = tiles[last];
+                checkCudaErrors(cudaEventSynchronize(m_tileEvent[last]));
+                for(int y=0;y<tile.size.y;y++)
+                {
+                    memcpy(image.scanLine(tile.origin.y+y)+tile.origin.x*bpp,m_hostPixels[last]+(size_t)y*tile.size.x*bpp,tile.size.x*bpp);
+                }
+            }
+        }
+    }
+    else
+    {
+        if(color) image.fill(Qt::white);
+        else image.fill(255);
+    }
+
+    if(!image.save(QString::fromStdString(_file),"PNG"))
+    {
+        std::cerr<<"Failed writing "<<_file<<std::endl;
+        return false;
+    }
+    return true;
+}
+//----------------------------------------------------------------------------------------------------------------------
+bool StippleRaster::writeSVG(const std::string &_file, int _width)
+{
+    float2 b = m_stipples.getBounds();
+    if(b.x<=0.f || b.y<=0.f) return false;
+    if(m_stipples.getEvent()) checkCudaErrors(cudaEventSynchronize(m_stipples.getEvent()));
+
+    FILE *f = fopen(_file.c_str(),"w");
+    if(!f)
+    {
+        std::cerr<<"Cannot open file "<<_file<<std::endl;
+        return false;
+    }
+    std::vector<char> buffer(STP_VECTOR_BUFFER);
+    setvbuf(f,&buffer[0],_IOFBF,buffer.size());
+
+    // Our viewbox is in simulation units, flipped so our y goes up like our simulation
+    int height = (int)ceilf(_width*b.y/b.x);
+    fprintf(f,"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    fprintf(f,"<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\" viewBox=\"0 0 %g %g\">\n",_width,height,b.x,b.y);
+    fprintf(f,"<rect width=\"%g\" height=\"%g\" fill=\"white\"/>\n",b.x,b.y);
+    fprintf(f,"<g transform=\"matrix(1 0 0 -1 0 %g)\">\n",b.y);
+
+    int n = m_stipples.getCount();
+    const float2 *xy = m_stipples.getHostXY();
+    const float *radius = (m_dotRadius>0.f) ? 0 : m_stipples.getHostRadius();
+    const unsigned char *cls = m_stipples.getHostClass();
+    float r = dotRadius()*m_dotScale;
+    int numInks = (cls) ? 4 : 1;
+    for(int ink=0;ink<numInks;ink++)
+    {
+        // One group per ink, multiplied together like our printed inks
+        if(cls) fprintf(f,"<g fill=\"%s\" style=\"mix-blend-mode:multiply\">\n",s_svgInk[ink]);
+        else fprintf(f,"<g fill=\"black\">\n");
+        for(int i=0;i<n;i++)
+        {
+            if(cls && std::min((int)cls[i],3)!=ink) continue;
+            fprintf(f,"<circle cx=\"%.5g\" cy=\"%.5g\" r=\"%.4g\"/>\n",xy[i].x,xy[i].y,(radius) ? radius[i]*m_dotScale : r);
+        }
+        fprintf(f,"</g>\n");
+    }
+    fprintf(f,"</g>\n</svg>\n");
+
+    bool ok = !ferror(f);
+    if(fclose(f)!=0) ok = false;
+    if(!ok) std::cerr<<"Failed writing "<<_file<<std::endl;
+    return ok;
+}
+//----------------------------------------------------------------------------------------------------------------------
+bool StippleRaster::writePDF(const std::string &_file, int _width)
+{
+    float2 b = m_stipples.getBounds();
+    if(b.x<=0.f || b.y<=0.f) return false;
+    if(m_stipples.getEvent()) checkCudaErrors(cudaEventSynchronize(m_stipples.getEvent()));
+
+    FILE *f = fopen(_file.c_str(),"wb");
+    if(!f)
+    {
+        std::cerr<<"Cannot open file "<<_file<<std::endl;
+        return false;
+    }
+    std::vector<char> buffer(STP_VECTOR_BUFFER);
+    setvbuf(f,&buffer[0],_IOFBF,buffer.size());
+
+    // Our page is _width pixels at our print resolution, in points
+    float pageWidth = _width*72.f/m_dpi;
+    float pageHeight = pageWidth*b.y/b.x;
+    long offsets[7];
+
+    fprintf(f,"%%PDF-1.4\n");
+    offsets[1] = ftell(f);
+    fprintf(f,"1 0 obj\n<< /Type /Catalog /Pages 2 0 R >>\nendobj\n");
+    offsets[2] = ftell(f);
+    fprintf(f,"2 0 obj\n<< /Type /Pages /Kids [3 0 R] /Count 1 >>\nendobj\n");
+    offsets[3] = ftell(f);
+    fprintf(f,"3 0 obj\n<< /Type /Page /Parent 2 0 R /MediaBox [0 0 %g %g] /Contents 4 0 R /Resources << /ExtGState << /GS0 6 0 R >> >> >>\nendobj\n",pageWidth,pageHeight);
+    offsets[4] = ftell(f);
+    fprintf(f,"4 0 obj\n<< /Length 5 0 R >>\nstream\n");
+    long streamStart = ftell(f);
+
+    // Each stipple is a zero length line with round caps as wide as our dot, the smallest way to draw a disc.
+    // We draw in simulation units which already have y going up like our page.
+    fprintf(f,"%g 0 0 %g 0 0 cm 1 J\n",pageWidth/b.x,pageWidth/b.x);
+    int n = m_stipples.getCount();
+    const float2 *xy = m_stipples.getHostXY();
+    const float *radius = (m_dotRadius>0.f) ? 0 : m_stipples.getHostRadius();
+    const unsigned char *cls = m_stipples.getHostClass();
+    float r = dotRadius()*m_dotScale;
+    if(cls) fprintf(f,"/GS0 gs\n");
+    int numInks = (cls) ? 4 : 1;
+    for(int ink=0;ink<numInks;ink++)
+    {
+        fprintf(f,"%s K\n",s_pdfInk[(cls) ? ink : 3]);
+        if(!radius) fprintf(f,"%.4g w\n",2.f*r);
+        for(int i=0;i<n;i++)
+        {
+            if(cls && std::min((int)cls[i],3)!=ink) continue;
+            if(radius) fprintf(f,"%.4g w ",2.f*radius[i]*m_dotScale);
+            fprintf(f,"%.5g %.5g m %.5g %.5g l S\n",xy[i].x,xy[i].y,xy[i].x,xy[i].y);
+        }
+    }
+
+    long streamLength = ftell(f)-streamStart;
+    fprintf(f,"endstream\nendobj\n");
+    offsets[5] = ftell(f);
+    fprintf(f,"5 0 obj\n%ld\nendobj\n",streamLength);
+    offsets[6] = ftell(f);
+    // Our inks multiply together like they would when printed
+    fprintf(f,"6 0 obj\n<< /Type /ExtGState /BM /Multiply >>\nendobj\n");
+    long xref = ftell(f);
+    fprintf(f,"xref\n0 7\n0000000000 65535 f \n");
+    for(int i=1;i<7;i++)
+    {
+        fprintf(f,"%010ld 00000 n \n",offsets[i]);
+    }
+    fprintf(f,"trailer\n<< /Size 7 /Root 1 0 R >>\nstartxref\n%ld\n%%%%EOF\n",xref);
+
+    bool ok = !ferror(f);
+    if(fclose(f)!=0) ok = false;
+    if(!ok) std::cerr<<"Failed writing "<<_file<<std::endl;
+    return ok;
+}
+//----------------------------------------------------------------------------------------------------------------------
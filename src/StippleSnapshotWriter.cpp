@@ -0,0 +1,113 @@
+#include "StippleSnapshotWriter.h"
+#include "SPHSolverCUDA.h"
+#include <QMutexLocker>
+#include <cstdio>
+
+//----------------------------------------------------------------------------------------------------------------------
+StippleSnapshotWriter::StippleSnapshotWriter(const std::string &_prefix, int _ringSize, bool _compress, bool _dropWhenFull)
+{
+    m_prefix = _prefix;
+    m_compress = _compress;
+    m_dropWhenFull = _dropWhenFull;
+    m_columns = 0;
+    m_numWritten = 0;
+    m_numDropped = 0;
+    m_stop = false;
+    if(_ringSize<1) _ringSize = 1;
+    for(int i=0;i<_ringSize;i++)
+    {
+        m_slots.push_back(new Slot());
+        m_free.push_back(m_slots.back());
+    }
+    start();
+}
+//----------------------------------------------------------------------------------------------------------------------
+StippleSnapshotWriter::~StippleSnapshotWriter()
+{
+    m_mutex.lock();
+    m_stop = true;
+    m_hasWork.wakeAll();
+    m_mutex.unlock();
+    wait();
+
+    for(unsigned int i=0;i<m_slots.size();i++)
+    {
+        delete m_slots[i];
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+bool StippleSnapshotWriter::capture(SPHSolverCUDA &_solver, int _step)
+{
+    QMutexLocker lock(&m_mutex);
+    while(m_free.empty())
+    {
+        if(m_dropWhenFull)
+        {
+            m_numDropped++;
+            return false;
+        }
+        // Our disk has fallen behind, hold back our host until it catches up. Our stream keeps running.
+        m_slotFree.wait(&m_mutex);
+    }
+    Slot *s = m_free.back();
+    m_free.pop_back();
+    lock.unlock();
+
+    // Nothing else touches a slot until we hand it over so this can run without our lock
+    char name[32];
+    snprintf(name,sizeof(name),"_%06d%s",_step,(m_compress) ? ".stpz" : ".stp");
+    s->file = m_prefix + name;
+    s->exporter.download(_solver,m_columns);
+
+    lock.relock();
+    m_pending.push_back(s);
+    m_hasWork.wakeOne();
+    return true;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void StippleSnapshotWriter::flush()
+{
+    QMutexLocker lock(&m_mutex);
+    while(m_free.size()<m_slots.size())
+    {
+        m_slotFree.wait(&m_mutex);
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
+int StippleSnapshotWriter::getNumWritten()
+{
+    QMutexLocker lock(&m_mutex);
+    return m_numWritten;
+}
+//----------------------------------------------------------------------------------------------------------------------
+int StippleSnapshotWriter::getNumDropped()
+{
+    QMutexLocker lock(&m_mutex);
+    return m_numDropped;
+}
+//----------------------------------------------------------------------------------------------------------------------
+void StippleSnapshotWriter::run()
+{
+    QMutexLocker lock(&m_mutex);
+    for(;;)
+    {
+        while(m_pending.empty() && !m_stop)
+        {
+            m_hasWork.wait(&m_mutex);
+        }
+        if(m_pending.empty()) return;
+
+        Slot *s = m_pending.front();
+        m_pending.pop_front();
+        lock.unlock();
+
+        // Waits on our download event, never on our solvers stream
+        bool written = s->exporter.write(s->file);
+
+        lock.relock();
+        if(written) m_numWritten++;
+        m_free.push_back(s);
+        m_slotFree.wakeAll();
+    }
+}
+//----------------------------------------------------------------------------------------------------------------------
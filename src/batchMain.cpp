@@ -0,0 +1,210 @@
+//----------------------------------------------------------------------------------------------------------------------
+/// @file batchMain.cpp
+/// @brief Headless entry point for running our stippler without a window or OpenGL context.
+/// @brief Usage: StipplingBatch <image> <numParticles> <epsilon> <outputFile> [maxIterations] [numDevices]
+/// @brief Output files ending in .stp are written in our binary StippleExport format.
+/// @brief Output files ending in .png, .svg or .pdf are drawn by StippleRaster at STP_BATCH_RASTER_WIDTH pixels wide.
+/// @brief Usage: StipplingBatch --render <stipples.txt> <output> [widthPixels] [simWidth simHeight]
+/// @brief draws a text dump of one of our old exports with StippleRaster. Our text dumps dont store the bounds of
+/// @brief the simulation they came from so pass them if it wasnt STP_BATCH_BOUNDS square.
+/// @brief Adding --snapshots <prefix> <interval> to a single GPU run also saves every interval'th step as
+/// @brief <prefix>_<step>.stpz while it runs.
+/// @brief Passing more than one device splits our simulation across them with SPHSolverMultiGPU.
+/// @brief Usage: StipplingBatch --jobs <jobFile> [maxConcurrent] [threadsPerBlock]
+/// @brief runs every job in a job file, several at a time on one GPU, with StippleJobScheduler.
+//----------------------------------------------------------------------------------------------------------------------
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <vector>
+#include <QString>
+#include <QTime>
+#include "SPHSolverCUDA.h"
+#include "SPHSolverMultiGPU.h"
+#include "StippleJobScheduler.h"
+#include "StippleExport.h"
+#include "StippleSnapshotWriter.h"
+#include "StippleRaster.h"
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief the width in pixels we draw our .png, .svg and .pdf outputs at, A4 at 300dpi
+//----------------------------------------------------------------------------------------------------------------------
+#define STP_BATCH_RASTER_WIDTH 2480
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief the bounds of the simulations our batch runs create
+//----------------------------------------------------------------------------------------------------------------------
+#define STP_BATCH_BOUNDS 15.f
+
+//----------------------------------------------------------------------------------------------------------------------
+void printUsage(const char *_exe)
+{
+    std::cerr<<"Usage: "<<_exe<<" <image> <numParticles> <epsilon> <outputFile> [maxIterations] [numDevices]"<<std::endl;
+    std::cerr<<"       "<<_exe<<" --jobs <jobFile> [maxConcurrent] [threadsPerBlock]"<<std::endl;
+    std::cerr<<"       "<<_exe<<" --render <stipples.txt> <output.png|svg|pdf> [widthPixels] [simWidth simHeight]"<<std::endl;
+    std::cerr<<"       add --snapshots <prefix> <interval> to a single GPU run to save every interval'th step"<<std::endl;
+}
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief writes out our stipples. Our single GPU solver is downloaded straight into our pinned export buffers,
+/// @brief with our stipple radii as well when writing our binary format.
+//----------------------------------------------------------------------------------------------------------------------
+bool exportStipples(SPHSolverCUDA &solver, const std::string &_output)
+{
+    if(StippleRaster::isRasterFile(_output))
+    {
+        StippleRaster raster;
+        raster.setStipples(solver);
+        return raster.write(_output,STP_BATCH_RASTER_WIDTH);
+    }
+    StippleExport e;
+    e.download(solver,StippleExport::isBinaryFile(_output) ? STP_HAS_RADIUS : 0);
+    return e.write(_output);
+}
+//----------------------------------------------------------------------------------------------------------------------
+template<class Solver>
+bool exportStipples(Solver &solver, const std::string &_output)
+{
+    float2 bounds = solver.getSimBounds();
+    if(StippleRaster::isRasterFile(_output))
+    {
+        StippleRaster raster;
+        raster.setStipples(solver.getParticlePositions(),bounds.x,bounds.y);
+        return raster.write(_output,STP_BATCH_RASTER_WIDTH);
+    }
+    StippleExport e;
+    e.setPositions(solver.getParticlePositions(),bounds.x,bounds.y);
+    return e.write(_output);
+}
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief runs our solver until it converges and writes out our stipples. Both our single and multi GPU
+/// @brief solvers have the same interface for this.
+//----------------------------------------------------------------------------------------------------------------------
+template<class Solver>
+int runSolver(Solver &solver, QString _image, int _numParticles, float _epsilon, const std::string &_output, int _maxIterations)
+{
+    solver.setSampleImage(_image);
+    solver.setConvergeValue(_epsilon);
+    solver.genRandomSamples((float)_numParticles);
+
+    QTime startTime = QTime::currentTime();
+    int iterations = 0;
+    bool converged = false;
+    while(iterations<_maxIterations && !converged)
+    {
+        solver.update();
+        iterations++;
+        converged = solver.convergedState();
+    }
+    float timeTaken = startTime.msecsTo(QTime::currentTime()) / 1000.f;
+
+    if(converged)
+    {
+        std::cout<<"Converged after "<<iterations<<" iterations in "<<timeTaken<<"s"<<std::endl;
+    }
+    else
+    {
+        std::cout<<"Did not converge after "<<iterations<<" iterations ("<<timeTaken<<"s), writing current samples"<<std::endl;
+    }
+
+    // Write our stipples out in the same formats as the GUI export
+    if(!exportStipples(solver,_output)) return EXIT_FAILURE;
+
+    return converged ? EXIT_SUCCESS : 2;
+}
+//----------------------------------------------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+    // Pull out our snapshot option before we read our positional arguments
+    std::string snapshotPrefix;
+    int snapshotInterval = 0;
+    for(int i=1;i<argc-2;i++)
+    {
+        if(std::string(argv[i])=="--snapshots")
+        {
+            snapshotPrefix = argv[i+1];
+            snapshotInterval = atoi(argv[i+2]);
+            for(int j=i;j+3<argc;j++) argv[j] = argv[j+3];
+            argc-=3;
+            break;
+        }
+    }
+
+    if(argc>2 && std::string(argv[1])=="--jobs")
+    {
+        int maxConcurrent = (argc>3) ? atoi(argv[3]) : 8;
+        int threadsPerBlock = (argc>4) ? atoi(argv[4]) : 256;
+        StippleJobScheduler scheduler(maxConcurrent,threadsPerBlock);
+        if(scheduler.loadJobFile(argv[2])<=0)
+        {
+            std::cerr<<"No jobs to run"<<std::endl;
+            return EXIT_FAILURE;
+        }
+        scheduler.run();
+        return (scheduler.getNumFailed()==0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if(argc>3 && std::string(argv[1])=="--render")
+    {
+        // Our text dumps dont store our bounds so unless we are told otherwise assume the same bounds as our batch runs
+        std::ifstream f(argv[2]);
+        if(!f.is_open())
+        {
+            std::cerr<<"Cannot open file "<<argv[2]<<std::endl;
+            return EXIT_FAILURE;
+        }
+        std::vector<float3> positions;
+        float x,y;
+        while(f>>x>>y) positions.push_back(make_float3(x,y,0.f));
+        f.close();
+
+        StippleRaster raster;
+        float simWidth = (argc>6) ? (float)atof(argv[5]) : STP_BATCH_BOUNDS;
+        float simHeight = (argc>6) ? (float)atof(argv[6]) : STP_BATCH_BOUNDS;
+        if(simWidth<=0.f || simHeight<=0.f)
+        {
+            printUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        raster.setStipples(positions,simWidth,simHeight);
+        int width = (argc>4) ? atoi(argv[4]) : STP_BATCH_RASTER_WIDTH;
+        return raster.write(argv[3],width) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if(argc<5)
+    {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    QString image(argv[1]);
+    int numParticles = atoi(argv[2]);
+    float epsilon = (float)atof(argv[3]);
+    std::string output(argv[4]);
+    int maxIterations = (argc>5) ? atoi(argv[5]) : 100000;
+    int numDevices = (argc>6) ? atoi(argv[6]) : 1;
+
+    if(numParticles<=0 || epsilon<=0.f)
+    {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if(numDevices==1)
+    {
+        // Create our solver without any OpenGL buffers
+        SPHSolverCUDA solver(STP_BATCH_BOUNDS,STP_BATCH_BOUNDS,0.05f,3.f,true);
+        if(snapshotInterval<=0) return runSolver(solver,image,numParticles,epsilon,output,maxIterations);
+
+        // Compressed and dropping when the disk falls behind so our snapshots never slow down our run
+        StippleSnapshotWriter snapshots(snapshotPrefix,4,true,true);
+        solver.setSnapshotWriter(&snapshots,snapshotInterval);
+        int result = runSolver(solver,image,numParticles,epsilon,output,maxIterations);
+        solver.setSnapshotWriter(0);
+        snapshots.flush();
+        std::cout<<"Wrote "<<snapshots.getNumWritten()<<" snapshots, dropped "<<snapshots.getNumDropped()<<std::endl;
+        return result;
+    }
+
+    // Split our simulation across our devices, 0 or less uses all of them
+    SPHSolverMultiGPU solver(STP_BATCH_BOUNDS,STP_BATCH_BOUNDS,0.05f,3.f,numDevices);
+    return runSolver(solver,image,numParticles,epsilon,output,maxIterations);
+}
@@ -0,0 +1,248 @@
+//----------------------------------------------------------------------------------------------------------------------
+/// @file benchMain.cpp
+/// @brief Headless benchmark of our solver so changes can be compared objectively. Runs every image against every
+/// @brief particle count from the same seed until it converges, timing each stage of every step with CUDA events,
+/// @brief and writes everything out as JSON.
+/// @brief Usage: StipplingBench [--output <file.json>] [--images <a.png,b.png>] [--counts <10000,80000>]
+/// @brief                       [--epsilon <e>] [--maxIterations <n>] [--seed <s>] [--device <d>]
+//----------------------------------------------------------------------------------------------------------------------
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <QString>
+#include <QTime>
+#include "SPHSolverCUDA.h"
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief The results of one of our scenarios
+//----------------------------------------------------------------------------------------------------------------------
+struct BenchResult
+{
+    std::string image;
+    int numParticles;
+    int iterations;
+    bool converged;
+    float setupSeconds;
+    float solveSeconds;
+    double stageTimes[SOLVER_NUM_STAGES];
+    int timedSteps;
+    size_t peakDeviceBytes;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+void printUsage(const char *_exe)
+{
+    std::cerr<<"Usage: "<<_exe<<" [--output <file.json>] [--images <a.png,b.png>] [--counts <10000,80000>]"<<std::endl;
+    std::cerr<<"       [--epsilon <e>] [--maxIterations <n>] [--seed <s>] [--device <d>]"<<std::endl;
+}
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief splits a comma separated list
+//----------------------------------------------------------------------------------------------------------------------
+std::vector<std::string> splitList(const std::string &_list)
+{
+    std::vector<std::string> items;
+    size_t start = 0;
+    while(start<=_list.size())
+    {
+        size_t end = _list.find(',',start);
+        if(end==std::string::npos) end = _list.size();
+        if(end>start) items.push_back(_list.substr(start,end-start));
+        start = end+1;
+    }
+    return items;
+}
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief writes _s as a JSON string
+//----------------------------------------------------------------------------------------------------------------------
+void writeJSONString(FILE *_f, const std::string &_s)
+{
+    fputc('"',_f);
+    for(unsigned int i=0;i<_s.size();i++)
+    {
+        if(_s[i]=='"' || _s[i]=='\\') fputc('\\',_f);
+        fputc(_s[i],_f);
+    }
+    fputc('"',_f);
+}
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief writes _v as a JSON number, JSON has no nan or inf so those are written as null
+//----------------------------------------------------------------------------------------------------------------------
+void writeJSONNumber(FILE *_f, double _v)
+{
+    if(_v==_v && _v-_v==0.0) fprintf(_f,"%g",_v);
+    else fputs("null",_f);
+}
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief how much of our device is in use right now
+//----------------------------------------------------------------------------------------------------------------------
+size_t deviceBytesUsed()
+{
+    size_t freeBytes, totalBytes;
+    checkCudaErrors(cudaMemGetInfo(&freeBytes,&totalBytes));
+    return totalBytes-freeBytes;
+}
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief runs one of our scenarios in a fresh solver so nothing cached from an earlier scenario helps it along
+//----------------------------------------------------------------------------------------------------------------------
+BenchResult runScenario(const std::string &_image, int _numParticles, float _epsilon, int _maxIterations, unsigned long long _seed, int _device)
+{
+    BenchResult r;
+    r.image = _image;
+    r.numParticles = _numParticles;
+    r.iterations = 0;
+    r.converged = false;
+
+    // Everything our solver allocates counts towards our peak, not whatever was in use before us
+    checkCudaErrors(cudaSetDevice(_device));
+    size_t baseline = deviceBytesUsed();
+
+    QTime setupTime = QTime::currentTime();
+    SPHSolverCUDA solver(15.f,15.f,0.05f,3.f,true,_device);
+    solver.setSampleSeed(_seed);
+    solver.setSampleImage(QString(_image.c_str()));
+    solver.setConvergeValue(_epsilon);
+    // Check every step so our iteration counts are exact
+    solver.setConvergeCheckInterval(1);
+    solver.genRandomSamples((float)_numParticles);
+    checkCudaErrors(cudaStreamSynchronize(solver.getStream()));
+    r.setupSeconds = setupTime.msecsTo(QTime::currentTime()) / 1000.f;
+
+    solver.setStageTiming(true);
+    solver.resetStageTimes();
+    size_t peak = deviceBytesUsed();
+    QTime solveTime = QTime::currentTime();
+    while(r.iterations<_maxIterations && !r.converged)
+    {
+        solver.update();
+        r.iterations++;
+        // Our converged count is read back after our stage timings so wait for it to land
+        r.converged = solver.waitConvergedState();
+        peak = std::max(peak,deviceBytesUsed());
+    }
+    r.solveSeconds = solveTime.msecsTo(QTime::currentTime()) / 1000.f;
+
+    for(int i=0;i<SOLVER_NUM_STAGES;i++) r.stageTimes[i] = solver.getStageTime(i);
+    r.timedSteps = solver.getNumTimedSteps();
+    r.peakDeviceBytes = (peak>baseline) ? peak-baseline : 0;
+    return r;
+}
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief writes all of our results to _file as JSON
+//----------------------------------------------------------------------------------------------------------------------
+bool writeResults(const std::string &_file, const std::vector<BenchResult> &_results, float _epsilon, int _maxIterations, unsigned long long _seed, int _device)
+{
+    FILE *f = fopen(_file.c_str(),"w");
+    if(!f)
+    {
+        std::cerr<<"Cannot open file "<<_file<<std::endl;
+        return false;
+    }
+
+    cudaDeviceProp prop;
+    checkCudaErrors(cudaGetDeviceProperties(&prop,_device));
+    fprintf(f,"{\n  \"device\": ");
+    writeJSONString(f,prop.name);
+    fprintf(f,",\n  \"epsilon\": ");
+    writeJSONNumber(f,_epsilon);
+    fprintf(f,",\n  \"maxIterations\": %d,\n  \"seed\": %llu,\n  \"scenarios\": [\n",_maxIterations,_seed);
+    for(unsigned int i=0;i<_results.size();i++)
+    {
+        const BenchResult &r = _results[i];
+        double totalStageMs = 0.0;
+        for(int s=0;s<SOLVER_NUM_STAGES;s++) totalStageMs+=r.stageTimes[s];
+        int steps = std::max(r.timedSteps,1);
+
+        fprintf(f,"    {\n      \"image\": ");
+        writeJSONString(f,r.image);
+        fprintf(f,",\n      \"particles\": %d,\n      \"iterations\": %d,\n      \"converged\": %s,\n",r.numParticles,r.iterations,(r.converged) ? "true" : "false");
+        fprintf(f,"      \"setupSeconds\": ");
+        writeJSONNumber(f,r.setupSeconds);
+        fprintf(f,",\n      \"solveSeconds\": ");
+        writeJSONNumber(f,r.solveSeconds);
+        fprintf(f,",\n      \"msPerStep\": ");
+        writeJSONNumber(f,totalStageMs/steps);
+        fprintf(f,",\n      \"peakDeviceBytes\": %llu,\n",(unsigned long long)r.peakDeviceBytes);
+        fprintf(f,"      \"stages\": {\n");
+        for(int s=0;s<SOLVER_NUM_STAGES;s++)
+        {
+            fprintf(f,"        \"%s\": {\"totalMs\": ",SPHSolverCUDA::getStageName(s));
+            writeJSONNumber(f,r.stageTimes[s]);
+            fprintf(f,", \"msPerStep\": ");
+            writeJSONNumber(f,r.stageTimes[s]/steps);
+            fprintf(f,"}%s\n",(s<SOLVER_NUM_STAGES-1) ? "," : "");
+        }
+        fprintf(f,"      }\n    }%s\n",(i<_results.size()-1) ? "," : "");
+    }
+    fprintf(f,"  ]\n}\n");
+    fclose(f);
+    return true;
+}
+//----------------------------------------------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+    std::string output = "benchmark.json";
+    std::vector<std::string> images;
+    images.push_back("images/appleSquare200.png");
+    images.push_back("images/GroundTruth.png");
+    std::vector<int> counts;
+    counts.push_back(10000);
+    counts.push_back(80000);
+    counts.push_back(160000);
+    counts.push_back(1000000);
+    float epsilon = 0.001f;
+    int maxIterations = 20000;
+    unsigned long long seed = 1234ULL;
+    int device = 0;
+
+    for(int i=1;i<argc;i++)
+    {
+        std::string arg(argv[i]);
+        if(i+1>=argc)
+        {
+            printUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        std::string value(argv[++i]);
+        if(arg=="--output") output = value;
+        else if(arg=="--images") images = splitList(value);
+        else if(arg=="--counts")
+        {
+            std::vector<std::string> items = splitList(value);
+            counts.clear();
+            for(unsigned int c=0;c<items.size();c++) counts.push_back(atoi(items[c].c_str()));
+        }
+        else if(arg=="--epsilon") epsilon = (float)atof(value.c_str());
+        else if(arg=="--maxIterations") maxIterations = atoi(value.c_str());
+        else if(arg=="--seed") seed = strtoull(value.c_str(),0,10);
+        else if(arg=="--device") device = atoi(value.c_str());
+        else
+        {
+            printUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::vector<BenchResult> results;
+    for(unsigned int i=0;i<images.size();i++)
+    {
+        for(unsigned int c=0;c<counts.size();c++)
+        {
+            if(counts[c]<=0) continue;
+            BenchResult r = runScenario(images[i],counts[c],epsilon,maxIterations,seed,device);
+            double totalStageMs = 0.0;
+            for(int s=0;s<SOLVER_NUM_STAGES;s++) totalStageMs+=r.stageTimes[s];
+            std::cout<<r.image<<" "<<r.numParticles<<" particles: "<<((r.converged) ? "converged" : "did not converge")
+                     <<" after "<<r.iterations<<" iterations, "<<totalStageMs/std::max(r.timedSteps,1)<<"ms per step, "
+                     <<r.peakDeviceBytes/(1024*1024)<<"MB peak"<<std::endl;
+            results.push_back(r);
+        }
+    }
+
+    if(!writeResults(output,results,epsilon,maxIterations,seed,device)) return EXIT_FAILURE;
+    std::cout<<"Wrote "<<output<<std::endl;
+    return EXIT_SUCCESS;
+}
+//----------------------------------------------------------------------------------------------------------------------